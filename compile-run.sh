@@ -7,7 +7,8 @@
 #
 
 # Compile main:
-clang++ -o eva-llvm `llvm-config --cxxflags --ldflags --system-libs --libs core` eva-llvm.cpp -fexceptions
+# (the runtime is linked in, and exported for the JIT)
+clang++ -o eva-llvm `llvm-config --cxxflags --ldflags --system-libs --libs core orcjit native passes perfjitevents` eva-llvm.cpp src/runtime/*.cpp -rdynamic -fexceptions
 
 # Run main:
 ./eva-llvm
@@ -24,11 +25,43 @@ opt ./out.ll -O3 -S -o ./out-opt.ll
 #
 #   brew install libgc
 #
-clang++ -O3 -I/usr/local/include/gc/ ./out-opt.ll /usr/local/lib/libgc.a -o ./out
+clang++ -O3 -I/usr/local/include/gc/ ./out-opt.ll src/runtime/*.cpp /usr/local/lib/libgc.a -pthread -o ./out
 
 # Run the compiled program:
 ./out
 
+# Profile-guided optimization, at the same -O level (1 and above) for
+# both builds (the profile matches the CFG instrumented at the level).
+# out.ll is instrumented already, -fprofile-generate only links the
+# profile runtime in:
+#
+#   ./eva-llvm -O2 --profile-generate -f app.eva
+#   clang++ -O2 -c ./out.ll -o ./out.o
+#   clang++ -O2 -c src/runtime/*.cpp
+#   clang++ -fprofile-generate ./out.o ./Eva*.o ... -o ./out
+#   ./out                      # writes default.profraw
+#   llvm-profdata merge -o eva.profdata default.profraw
+#   ./eva-llvm -O2 --profile-use=eva.profdata -f app.eva
+
+# Runtime prelude: the runtime as bitcode, its functions are inlined
+# into the program at -O1 and above (the runtime is still linked):
+#
+#   for f in src/runtime/*.cpp; do
+#     clang++ -O2 -c -emit-llvm $f -o /tmp/$(basename $f .cpp).bc
+#   done
+#   llvm-link /tmp/Eva*.bc -o eva-runtime.bc
+#   ./eva-llvm -O2 --prelude eva-runtime.bc -f app.eva
+
+# Separate compilation of modules, (import "geometry"):
+#
+#   ./eva-llvm --build app/main.eva -O2 -j 4 > app/link.txt
+#   clang++ -flto=thin -fuse-ld=lld -O2 $(cat app/link.txt) \
+#     -Wl,--thinlto-cache-dir=app/.thinlto-cache \
+#     src/runtime/*.cpp -pthread -o ./app/main
+#
+# Only the changed modules (and the importers of changed interfaces)
+# are recompiled; the ThinLTO cache skips the unchanged backends.
+
 # Print result:
 echo $?
 
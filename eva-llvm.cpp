@@ -11,29 +11,152 @@
  * Eva LLVM executable.
  */
 
+#include <atomic>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <vector>
 
+#include "./src/CompileStats.h"
+#include "./src/EvaInterpreter.h"
 #include "./src/EvaLLVM.h"
+#include "./src/EvaServer.h"
+#include "./src/ModuleBuilder.h"
 
 void printHelp() {
-  std::cout << "\nUsage: eva-llvm [options]\n\n"
+  std::cout << "\nUsage: eva-llvm [options] [files.eva]\n\n"
             << "Options:\n"
             << "    -e, --expression  Expression to parse\n"
-            << "    -f, --file        File to parse\n\n";
+            << "    -f, --file        File to parse\n"
+            << "    files.eva         Compile each file to an object file\n"
+            << "                      (a.eva -> a.o)\n"
+            << "    -j N              Compile the files in N threads\n"
+            << "    --build main.eva  Compile the program modules (imports)\n"
+            << "                      to ThinLTO bitcode, only the changed\n"
+            << "                      ones, and print the files to link\n"
+            << "    --serve sock      Run the compile server on the Unix\n"
+            << "                      socket (-j N warm compilers)\n"
+            << "    --connect sock    Send -e/-f to the compile server\n"
+            << "    --emit ir|object|run\n"
+            << "                      What the server returns: the IR, the\n"
+            << "                      object file (out.o), or the program\n"
+            << "                      output and exit code (ir)\n"
+            << "    -r, --run         Run: interpret, compile hot functions\n"
+            << "    --hot-threshold N Calls + loop iterations to compile a\n"
+            << "                      function in the run mode (1000)\n"
+            << "    --jit-profiling   Name JIT-compiled functions for perf\n"
+            << "                      (/tmp/perf-<pid>.map, jitdump) and gdb\n"
+            << "    --fast-math       Reassociate floating point math\n"
+            << "    --native          Compile for the host CPU (e.g. AVX)\n"
+            << "    -O0 .. -O3        Optimize the emitted IR\n"
+            << "    --prelude <eva-runtime.bc>\n"
+            << "                      Link the called runtime functions\n"
+            << "                      from the bitcode, to inline them\n"
+            << "    -g                Emit DWARF debug info\n"
+            << "    --profile-generate\n"
+            << "                      Instrument for PGO (writes a raw\n"
+            << "                      profile when the program exits)\n"
+            << "    --profile-use=<file.profdata>\n"
+            << "                      Optimize with the merged profile\n"
+            << "                      (at the -O1..3 level it was made at)\n"
+            << "    --instrument-functions\n"
+            << "                      Profile calls and time per function\n"
+            << "    --alloc-profile   Profile instances per class and site\n"
+            << "    --time-report     Print compile phase timing and stats\n"
+            << "    --stats-json      Same as --time-report, as JSON\n\n";
 }
 
-int main(int argc, char const *argv[]) {
-  if (argc != 3) {
-    printHelp();
-    return 0;
+/**
+ * Reads a source file.
+ */
+std::string readFile(const std::string& fileName) {
+  std::ifstream file(fileName);
+
+  if (!file) {
+    DIE << "Cannot read " << fileName;
+  }
+
+  std::stringstream buffer;
+  buffer << file.rdbuf() << "\n";
+  return buffer.str();
+}
+
+/**
+ * Numeric option value: -j 4
+ */
+size_t parseCount(const std::string& option, const std::string& value) {
+  if (value.empty() ||
+      value.find_first_not_of("0123456789") != std::string::npos) {
+    DIE << option << " expects a number, given \"" << value << "\"\n";
   }
 
+  try {
+    return std::stoul(value);
+  } catch (const std::out_of_range&) {
+    DIE << option << " is out of range: " << value << "\n";
+  }
+
+  return 0;
+}
+
+/**
+ * Object file of a source file: a.eva -> a.o
+ */
+std::string getObjectFileName(const std::string& fileName) {
+  auto dot = fileName.rfind('.');
+  auto slash = fileName.rfind('/');
+
+  if (dot == std::string::npos ||
+      (slash != std::string::npos && dot < slash)) {
+    return fileName + ".o";
+  }
+
+  return fileName.substr(0, dot) + ".o";
+}
+
+/**
+ * Compiles the files to object files in `jobs` threads.
+ *
+ * Each compilation has its own compiler instance (and LLVM context),
+ * the threads only share the index of the next file.
+ */
+void compileFiles(
+    const std::vector<std::string>& files, unsigned jobs,
+    const std::function<void(EvaLLVM&, const std::string&)>& configure) {
+  EvaLLVM::initializeNativeTarget();
+
+  std::atomic<size_t> next{0};
+
+  auto worker = [&]() {
+    size_t i;
+    while ((i = next.fetch_add(1)) < files.size()) {
+      EvaLLVM vm;
+      configure(vm, files[i]);
+      vm.compileToObject(readFile(files[i]), getObjectFileName(files[i]));
+    }
+  };
+
+  std::vector<std::thread> threads;
+
+  for (auto i = 1; i < std::min<size_t>(jobs, files.size()); i++) {
+    threads.emplace_back(worker);
+  }
+
+  worker();
+
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
+int main(int argc, char const *argv[]) {
   /**
    * Expression mode.
    */
-  std::string mode = argv[1];
+  std::string mode;
 
   /**
    * Program to execute.
@@ -41,23 +164,233 @@ int main(int argc, char const *argv[]) {
   std::string program;
 
   /**
-   * Simple expression.
+   * Tiered execution instead of emitting IR.
+   */
+  bool run = false;
+
+  /**
+   * Tier-up threshold.
+   */
+  size_t hotThreshold = 1000;
+
+  /**
+   * JIT event listeners (perf, gdb) in the run mode.
+   */
+  bool jitProfiling = false;
+
+  /**
+   * Fast-math floating point.
+   */
+  bool fastMath = false;
+
+  /**
+   * Host CPU features.
+   */
+  bool native = false;
+
+  /**
+   * Optimization level.
+   */
+  unsigned optLevel = 0;
+
+  /**
+   * Debug info.
+   */
+  bool debugInfo = false;
+
+  /**
+   * Profile-guided optimization.
+   */
+  bool profileGenerate = false;
+  std::string profileUse;
+
+  /**
+   * Runtime bitcode for the inlining.
+   */
+  std::string prelude;
+
+  /**
+   * Function profiler hooks.
+   */
+  bool instrumentFunctions = false;
+
+  /**
+   * Allocation profiler.
+   */
+  bool allocProfile = false;
+
+  /**
+   * Compile phase timing and stats (to stderr).
+   */
+  bool timeReport = false;
+  bool statsJSON = false;
+
+  /**
+   * Batch compilation: files to object files, and the threads count.
+   */
+  std::vector<std::string> files;
+  unsigned jobs = 1;
+
+  /**
+   * Main module of the incremental build.
    */
-  if (mode == "-e") {
-    program = argv[2];
+  std::string buildFile;
+
+  /**
+   * Compile server socket, and the client request.
+   */
+  std::string serveSocket;
+  std::string connectSocket;
+  std::string emit = "ir";
+
+  CompileStats stats;
+
+  for (auto i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+
+    if (arg == "-r" || arg == "--run") {
+      run = true;
+    } else if (arg == "--fast-math") {
+      fastMath = true;
+    } else if (arg == "--native") {
+      native = true;
+    } else if (arg.size() == 3 && arg[0] == '-' && arg[1] == 'O' &&
+               arg[2] >= '0' && arg[2] <= '3') {
+      optLevel = arg[2] - '0';
+    } else if (arg == "--instrument-functions") {
+      instrumentFunctions = true;
+    } else if (arg == "--alloc-profile") {
+      allocProfile = true;
+    } else if (arg == "--time-report") {
+      timeReport = true;
+    } else if (arg == "--stats-json") {
+      statsJSON = true;
+    } else if (arg == "-g") {
+      debugInfo = true;
+    } else if (arg == "--profile-generate") {
+      profileGenerate = true;
+    } else if (arg == "--prelude" && i + 1 < argc) {
+      prelude = argv[++i];
+    } else if (arg.rfind("--profile-use=", 0) == 0) {
+      profileUse = arg.substr(std::string("--profile-use=").size());
+    } else if (arg == "--jit-profiling") {
+      jitProfiling = true;
+    } else if (arg == "--build" && i + 1 < argc) {
+      buildFile = argv[++i];
+    } else if (arg == "--serve" && i + 1 < argc) {
+      serveSocket = argv[++i];
+    } else if (arg == "--connect" && i + 1 < argc) {
+      connectSocket = argv[++i];
+    } else if (arg == "--emit" && i + 1 < argc) {
+      emit = argv[++i];
+    } else if (arg == "-j" && i + 1 < argc) {
+      jobs = std::max<size_t>(1, parseCount(arg, argv[++i]));
+    } else if (arg == "--hot-threshold" && i + 1 < argc) {
+      hotThreshold = parseCount(arg, argv[++i]);
+    } else if ((arg == "-e" || arg == "--expression" || arg == "-f" ||
+                arg == "--file") &&
+               i + 1 < argc) {
+      mode = arg;
+      program = argv[++i];
+    } else if (!arg.empty() && arg[0] != '-') {
+      files.push_back(arg);
+    } else {
+      printHelp();
+      return 0;
+    }
+  }
+
+  /**
+   * Compiler options.
+   */
+  auto configure = [&](EvaLLVM& vm, const std::string& sourceFile) {
+    vm.setFastMath(fastMath);
+    vm.setNativeTarget(native);
+    vm.setOptLevel(optLevel);
+    vm.setDebugInfo(debugInfo, sourceFile.empty() ? "main.eva" : sourceFile);
+    vm.setProfileGenerate(profileGenerate);
+    vm.setProfileUse(profileUse);
+    vm.setInstrumentFunctions(instrumentFunctions);
+    vm.setAllocProfile(allocProfile);
+    vm.setPrelude(prelude);
+  };
+
+  if (!buildFile.empty()) {
+    EvaLLVM::initializeNativeTarget();
+
+    for (auto& bitcodeFile : ModuleBuilder(jobs, configure).build(buildFile)) {
+      std::cout << bitcodeFile << "\n";
+    }
+
+    return 0;
+  }
+
+  if (!serveSocket.empty()) {
+    return EvaServer(serveSocket, jobs, [&](EvaLLVM& vm) {
+             configure(vm, "");
+           }).serve();
+  }
+
+  if (!files.empty()) {
+    compileFiles(files, jobs, configure);
+    return 0;
+  }
+
+  if (mode.empty()) {
+    printHelp();
+    return 0;
   }
 
   /**
    * Eva file.
    */
-  else if (mode == "-f") {
-    // Read the file:
-    std::ifstream programFile(argv[2]);
-    std::stringstream buffer;
-    buffer << programFile.rdbuf() << "\n";
+  std::string sourceFile;
+
+  if (mode == "-f" || mode == "--file") {
+    stats.startPhase("read");
+
+    sourceFile = program;
 
     // Program:
-    program = buffer.str();
+    program = readFile(sourceFile);
+
+    stats.endPhase();
+  }
+
+  /**
+   * Compile server client.
+   */
+  if (!connectSocket.empty()) {
+    auto response = EvaClient::request(connectSocket, emit, program);
+
+    if (!response.ok) {
+      std::cerr << "Fatal error: " << response.payload;
+
+      if (!response.payload.empty() && response.payload.back() != '\n') {
+        std::cerr << "\n";
+      }
+
+      return response.exitCode;
+    }
+
+    if (emit == "object") {
+      std::ofstream out("./out.o", std::ios::binary);
+      out << response.payload;
+    } else {
+      std::cout << response.payload;
+    }
+
+    return response.exitCode;
+  }
+
+  /**
+   * Tiered execution: interpreter + JIT.
+   */
+  if (run) {
+    EvaInterpreter interpreter(hotThreshold, jitProfiling, [&](EvaLLVM& vm) {
+      configure(vm, sourceFile);
+    });
+    return interpreter.exec(program);
   }
 
   /**
@@ -65,10 +398,22 @@ int main(int argc, char const *argv[]) {
    */
   EvaLLVM vm;
 
+  configure(vm, sourceFile);
+
+  if (timeReport || statsJSON) {
+    vm.setStats(&stats);
+  }
+
   /**
    * Generate LLVM IR.
    */
   vm.exec(program);
 
+  if (statsJSON) {
+    stats.printJSON(std::cerr);
+  } else if (timeReport) {
+    stats.print(std::cerr);
+  }
+
   return 0;
-}
\ No newline at end of file
+}
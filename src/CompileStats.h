@@ -0,0 +1,169 @@
+/**
+ * Programming Language with LLVM
+ *
+ * Course info:
+ * http://dmitrysoshnikov.com/courses/programming-language-with-llvm/
+ *
+ * (C) 2023-present Dmitry Soshnikov <dmitry.soshnikov@gmail.com>
+ */
+
+/**
+ * Compiler statistics: phase timing, counters, peak memory.
+ */
+
+#ifndef CompileStats_h
+#define CompileStats_h
+
+#include <sys/resource.h>
+#include <time.h>
+
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * Wall and CPU time of a compiler phase.
+ */
+struct PhaseTime {
+  std::string name;
+  double wallMs;
+  double cpuMs;
+};
+
+/**
+ * Collects timing of compiler phases (read, parse, locations, gen,
+ * verify, optimize, emit) and counters (tokens, AST nodes, etc).
+ */
+class CompileStats {
+ public:
+  /**
+   * Starts timing of a phase.
+   */
+  void startPhase(const std::string& name) {
+    phaseName_ = name;
+    wallStart_ = std::chrono::steady_clock::now();
+    cpuStart_ = getThreadCpuMs();
+  }
+
+  /**
+   * Ends timing of the current phase.
+   */
+  void endPhase() {
+    std::chrono::duration<double, std::milli> wall =
+        std::chrono::steady_clock::now() - wallStart_;
+    auto cpu = getThreadCpuMs() - cpuStart_;
+
+    phases_.push_back(PhaseTime{phaseName_, wall.count(), cpu});
+  }
+
+  /**
+   * CPU time of the current thread, in ms (the process CPU time would
+   * include other compiling threads, e.g. with -j).
+   */
+  static double getThreadCpuMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+  }
+
+  /**
+   * Sets a counter.
+   */
+  void count(const std::string& name, uint64_t value) {
+    counters_.push_back(std::make_pair(name, value));
+  }
+
+  /**
+   * Peak resident set size of the process, in KB.
+   */
+  static uint64_t getPeakRSS() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+  }
+
+  /**
+   * Prints the human-readable report.
+   */
+  void print(std::ostream& out) const {
+    double totalWall = 0, totalCpu = 0;
+
+    out << "===" << std::string(50, '-') << "===\n"
+        << "                   Eva compile report\n"
+        << "===" << std::string(50, '-') << "===\n\n"
+        << "  " << std::left << std::setw(16) << "Phase" << std::right
+        << std::setw(14) << "Wall (ms)" << std::setw(14) << "CPU (ms)"
+        << "\n";
+
+    out << std::fixed << std::setprecision(3);
+
+    for (auto& phase : phases_) {
+      out << "  " << std::left << std::setw(16) << phase.name << std::right
+          << std::setw(14) << phase.wallMs << std::setw(14) << phase.cpuMs
+          << "\n";
+
+      totalWall += phase.wallMs;
+      totalCpu += phase.cpuMs;
+    }
+
+    out << "  " << std::left << std::setw(16) << "total" << std::right
+        << std::setw(14) << totalWall << std::setw(14) << totalCpu << "\n\n";
+
+    for (auto& counter : counters_) {
+      out << "  " << std::left << std::setw(16) << counter.first << std::right
+          << std::setw(14) << counter.second << "\n";
+    }
+
+    out << "  " << std::left << std::setw(16) << "peak RSS (KB)"
+        << std::right << std::setw(14) << getPeakRSS() << "\n\n";
+  }
+
+  /**
+   * Prints the report as JSON:
+   *
+   * {"phases": [{"name": "parse", "wall_ms": 1.5, "cpu_ms": 1.4}, ...],
+   *  "counters": {"tokens": 120, ...}, "peak_rss_kb": 20480}
+   */
+  void printJSON(std::ostream& out) const {
+    out << "{\"phases\": [";
+
+    for (auto i = 0; i < phases_.size(); i++) {
+      out << (i > 0 ? ", " : "") << "{\"name\": \"" << phases_[i].name
+          << "\", \"wall_ms\": " << phases_[i].wallMs
+          << ", \"cpu_ms\": " << phases_[i].cpuMs << "}";
+    }
+
+    out << "], \"counters\": {";
+
+    for (auto i = 0; i < counters_.size(); i++) {
+      out << (i > 0 ? ", " : "") << "\"" << counters_[i].first
+          << "\": " << counters_[i].second;
+    }
+
+    out << "}, \"peak_rss_kb\": " << getPeakRSS() << "}\n";
+  }
+
+ private:
+  /**
+   * Finished phases, in order.
+   */
+  std::vector<PhaseTime> phases_;
+
+  /**
+   * Counters, in order.
+   */
+  std::vector<std::pair<std::string, uint64_t>> counters_;
+
+  /**
+   * Current phase.
+   */
+  std::string phaseName_;
+  std::chrono::steady_clock::time_point wallStart_;
+  double cpuStart_ = 0;
+};
+
+#endif
@@ -0,0 +1,829 @@
+/**
+ * Programming Language with LLVM
+ *
+ * Course info:
+ * http://dmitrysoshnikov.com/courses/programming-language-with-llvm/
+ *
+ * (C) 2023-present Dmitry Soshnikov <dmitry.soshnikov@gmail.com>
+ */
+
+/**
+ * Constant folder: partial evaluation of the AST before codegen.
+ *
+ * (* 60 60 24) -> 86400
+ * (+ VERSION 1) -> 43
+ * (if true <then> <else>) -> <then>
+ * (const (fib 20)) -> 6765
+ */
+
+#ifndef ConstantFolder_h
+#define ConstantFolder_h
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "./Logger.h"
+#include "./parser/EvaParser.h"
+
+/**
+ * Max number of evaluation steps of a compile-time call.
+ */
+static const size_t COMPTIME_STEPS_BUDGET = 1000000;
+
+/**
+ * Folding scope: constant bindings, and names shadowing outer constants.
+ */
+struct FoldScope {
+  std::map<std::string, Exp> constants;
+  std::set<std::string> unknown;
+  std::map<std::string, Exp> functions;
+  std::shared_ptr<FoldScope> parent;
+};
+
+using FoldEnv = std::shared_ptr<FoldScope>;
+
+class ConstantFolder {
+ public:
+  /**
+   * Functions annotated ^comptime or ^pure can be evaluated
+   * at compile time.
+   */
+  ConstantFolder(const std::map<int, std::set<std::string>>& annotations)
+      : annotations_(annotations) {}
+
+  /**
+   * Folds a program.
+   */
+  Exp fold(const Exp& program) {
+    assigned_.clear();
+    collectAssigned(program);
+
+    auto globalScope = std::make_shared<FoldScope>();
+
+    // Built-in constant, unless reassigned:
+    if (assigned_.count("VERSION") == 0) {
+      globalScope->constants.emplace("VERSION", Exp((int64_t)42));
+    }
+
+    return fold(program, globalScope);
+  }
+
+ private:
+  /**
+   * Folds an expression in the scope.
+   */
+  Exp fold(const Exp& exp, FoldEnv scope, bool isClassBody = false) {
+    if (exp.type == ExpType::SYMBOL) {
+      auto constant = lookupConstant(exp.string, scope);
+      return constant != nullptr ? *constant : exp;
+    }
+
+    if (exp.type != ExpType::LIST || exp.list.empty()) {
+      return exp;
+    }
+
+    auto result = exp;
+
+    // Method calls: ((method p calc) p)
+    if (exp.list[0].type != ExpType::SYMBOL) {
+      foldItems(result, 0, scope);
+      return result;
+    }
+
+    auto op = exp.list[0].string;
+
+    // --------------------------------------------
+    // Math: n-ary forms are nested (* a b c) -> (* (* a b) c)
+
+    if (isMathOp(op)) {
+      if (exp.list.size() > 3) {
+        auto nested = Exp(std::vector<Exp>{exp.list[0], exp.list[1],
+                                           exp.list[2]});
+        for (auto i = 3; i < exp.list.size(); i++) {
+          nested = Exp(std::vector<Exp>{exp.list[0], nested, exp.list[i]});
+        }
+        return fold(nested, scope);
+      }
+
+      foldItems(result, 1, scope);
+
+      Exp folded = result;
+      return foldBinary(op, result.list[1], result.list[2], folded) ? folded
+                                                                    : result;
+    }
+
+    if (isCompareOp(op)) {
+      foldItems(result, 1, scope);
+
+      Exp folded = result;
+      return foldBinary(op, result.list[1], result.list[2], folded) ? folded
+                                                                    : result;
+    }
+
+    // --------------------------------------------
+    // Branches: dead branch is removed.
+
+    if (op == "if") {
+      auto cond = fold(exp.list[1], scope);
+
+      bool truthy = false;
+      if (exp.list.size() == 4 && isTruthy(cond, truthy)) {
+        return fold(exp.list[truthy ? 2 : 3], scope);
+      }
+
+      result.list[1] = cond;
+      foldItems(result, 2, scope);
+      return result;
+    }
+
+    // --------------------------------------------
+    // Loops: (while false ...) is removed.
+
+    if (op == "while") {
+      auto cond = fold(exp.list[1], scope);
+
+      bool truthy = false;
+      if (isTruthy(cond, truthy) && !truthy) {
+        return Exp((int64_t)0);
+      }
+
+      result.list[1] = cond;
+      result.list[2] = fold(exp.list[2], newScope(scope));
+      return result;
+    }
+
+    // (for (i <start> [<op>] <end> [<step>]) <hints> <body>)
+    // (parallel-for (i <start> <end>) <body>)
+    if (op == "for" || op == "parallel-for") {
+      auto& header = result.list[1];
+
+      for (auto i = 1; i < header.list.size(); i++) {
+        if (!isCompareOp(header.list[i].string)) {
+          header.list[i] = fold(header.list[i], scope);
+        }
+      }
+
+      auto loopScope = newScope(scope);
+      loopScope->unknown.insert(header.list[0].string);
+
+      result.list.back() = fold(exp.list.back(), loopScope);
+      return result;
+    }
+
+    // --------------------------------------------
+    // Blocks: literals which are not the result are dropped.
+
+    if (op == "begin") {
+      auto blockScope = newScope(scope);
+      std::vector<Exp> items{exp.list[0]};
+
+      for (auto i = 1; i < exp.list.size(); i++) {
+        auto item = fold(exp.list[i], blockScope, isClassBody);
+        if (i == exp.list.size() - 1 || !isLiteral(item)) {
+          items.push_back(item);
+        }
+      }
+
+      return Exp(items);
+    }
+
+    // --------------------------------------------
+    // Variables: (var x 10), (var (x number) 10)
+
+    if (op == "var") {
+      result.list[2] = fold(exp.list[2], scope);
+
+      // Class fields are not variables:
+      if (!isClassBody) {
+        defineVar(exp.list[1], result.list[2], scope);
+      }
+
+      return result;
+    }
+
+    if (op == "set") {
+      if (exp.list[1].type == ExpType::LIST) {
+        result.list[1] = fold(exp.list[1], scope);
+      }
+      result.list[2] = fold(exp.list[2], scope);
+      return result;
+    }
+
+    // --------------------------------------------
+    // Interfaces: method signatures, nothing to fold.
+
+    if (op == "interface") {
+      return exp;
+    }
+
+    // --------------------------------------------
+    // Functions: params shadow outer constants.
+
+    if (op == "def") {
+      auto fnName = exp.list[1].string;
+      auto bodyIndex = hasReturnType(exp) ? 5 : 3;
+
+      auto fnScope = newScope(scope);
+
+      for (auto& param : exp.list[2].list) {
+        fnScope->unknown.insert(param.type == ExpType::LIST
+                                    ? param.list[0].string
+                                    : param.string);
+      }
+
+      // Compile-time functions (registered before the body, for recursion):
+      if (!isClassBody && isComptime(exp.list[1])) {
+        scope->unknown.erase(fnName);
+        scope->functions.erase(fnName);
+        scope->functions.emplace(fnName, exp);
+      } else {
+        scope->unknown.insert(fnName);
+      }
+
+      result.list[bodyIndex] = fold(exp.list[bodyIndex], fnScope);
+
+      if (!isClassBody && isComptime(exp.list[1])) {
+        scope->functions.erase(fnName);
+        scope->functions.emplace(fnName, result);
+      }
+
+      return result;
+    }
+
+    // (async def <name> <params> <body>)
+    if (op == "async") {
+      result.list[1] = fold(exp.list[1], scope, isClassBody);
+      return result;
+    }
+
+    // (class <name> <parent> <body>)
+    if (op == "class") {
+      result.list[3] =
+          fold(exp.list[3], newScope(scope), /* isClassBody */ true);
+      return result;
+    }
+
+    // --------------------------------------------
+    // Forms with names and types which are not folded:
+
+    if (op == "prop" || op == "method") {
+      result.list[1] = fold(exp.list[1], scope);
+      return result;
+    }
+
+    if (op == "new" || op == "printf" || op == "array" || op == "splat") {
+      foldItems(result, 2, scope);
+      return result;
+    }
+
+    // --------------------------------------------
+    // Atomics: places and memory orders are not folded.
+
+    if (isAtomicOp(op) || op == "fence") {
+      for (auto i = 1; i < exp.list.size(); i++) {
+        if (exp.list[i].type == ExpType::LIST ||
+            (i > 1 && !isMemoryOrder(exp.list[i].string))) {
+          result.list[i] = fold(exp.list[i], scope);
+        }
+      }
+      return result;
+    }
+
+    // --------------------------------------------
+    // Compile-time evaluation: (const <exp>)
+
+    if (op == "const") {
+      auto constExp = fold(exp.list[1], scope);
+      size_t steps = COMPTIME_STEPS_BUDGET;
+      Exp value = constExp;
+
+      if (!evaluate(constExp, scope, std::make_shared<FoldScope>(), value,
+                    steps)) {
+        DIE << "Expression is not a compile-time constant.\n";
+      }
+
+      return value;
+    }
+
+    // --------------------------------------------
+    // Calls: compile-time functions with literal args are evaluated.
+
+    foldItems(result, 1, scope);
+
+    if (lookupFunction(op, scope) != nullptr) {
+      size_t steps = COMPTIME_STEPS_BUDGET;
+      Exp value = result;
+
+      if (allLiterals(result, 1) &&
+          evaluate(result, scope, std::make_shared<FoldScope>(), value,
+                   steps)) {
+        return value;
+      }
+    }
+
+    return result;
+  }
+
+  /**
+   * Folds list items starting from the index.
+   */
+  void foldItems(Exp& exp, size_t start, FoldEnv scope) {
+    for (auto i = start; i < exp.list.size(); i++) {
+      exp.list[i] = fold(exp.list[i], scope);
+    }
+  }
+
+  /**
+   * Defines a variable: constant if initialized with a literal
+   * of the declared type, and never reassigned.
+   */
+  void defineVar(const Exp& decl, const Exp& init, FoldEnv scope) {
+    auto varName =
+        decl.type == ExpType::LIST ? decl.list[0].string : decl.string;
+    auto typeName = decl.type == ExpType::LIST &&
+                            decl.list[1].type == ExpType::SYMBOL
+                        ? decl.list[1].string
+                        : decl.type == ExpType::LIST ? "" : "number";
+
+    scope->constants.erase(varName);
+    scope->unknown.erase(varName);
+
+    if (assigned_.count(varName) == 0 && isLiteralOfType(init, typeName)) {
+      scope->constants.emplace(varName, init);
+    } else {
+      scope->unknown.insert(varName);
+    }
+  }
+
+  /**
+   * Evaluates an expression at compile time. Returns false if the
+   * expression is not constant, or the steps budget is exhausted.
+   *
+   * `scope` resolves constants and functions of the program,
+   * `locals` holds variables of the evaluation.
+   */
+  bool evaluate(const Exp& exp, FoldEnv scope, FoldEnv locals, Exp& result,
+                size_t& steps) {
+    if (steps-- == 0) {
+      return false;
+    }
+
+    if (isLiteral(exp)) {
+      result = exp;
+      return true;
+    }
+
+    if (exp.type == ExpType::SYMBOL) {
+      for (auto env = locals; env != nullptr; env = env->parent) {
+        auto it = env->constants.find(exp.string);
+        if (it != env->constants.end()) {
+          result = it->second;
+          return true;
+        }
+      }
+
+      auto constant = lookupConstant(exp.string, scope);
+      if (constant != nullptr) {
+        result = *constant;
+        return true;
+      }
+
+      return false;
+    }
+
+    if (exp.type != ExpType::LIST || exp.list.empty() ||
+        exp.list[0].type != ExpType::SYMBOL) {
+      return false;
+    }
+
+    auto op = exp.list[0].string;
+
+    if (isMathOp(op) || isCompareOp(op)) {
+      if (exp.list.size() != 3) {
+        return evaluate(fold(exp, scope), scope, locals, result, steps);
+      }
+
+      Exp op1((int64_t)0), op2((int64_t)0);
+      return evaluate(exp.list[1], scope, locals, op1, steps) &&
+             evaluate(exp.list[2], scope, locals, op2, steps) &&
+             foldBinary(op, op1, op2, result);
+    }
+
+    if (op == "if") {
+      Exp cond((int64_t)0);
+      bool truthy = false;
+
+      return exp.list.size() == 4 &&
+             evaluate(exp.list[1], scope, locals, cond, steps) &&
+             isTruthy(cond, truthy) &&
+             evaluate(exp.list[truthy ? 2 : 3], scope, locals, result, steps);
+    }
+
+    if (op == "begin") {
+      auto blockLocals = newScope(locals);
+      result = Exp((int64_t)0);
+
+      for (auto i = 1; i < exp.list.size(); i++) {
+        if (!evaluate(exp.list[i], scope, blockLocals, result, steps)) {
+          return false;
+        }
+      }
+
+      return true;
+    }
+
+    if (op == "var") {
+      auto& decl = exp.list[1];
+      auto varName =
+          decl.type == ExpType::LIST ? decl.list[0].string : decl.string;
+
+      if (!evaluate(exp.list[2], scope, locals, result, steps) ||
+          (decl.type == ExpType::LIST &&
+           !castLiteral(result, decl.list[1], result))) {
+        return false;
+      }
+
+      locals->constants.erase(varName);
+      locals->constants.emplace(varName, result);
+      return true;
+    }
+
+    if (op == "set") {
+      if (exp.list[1].type != ExpType::SYMBOL ||
+          !evaluate(exp.list[2], scope, locals, result, steps)) {
+        return false;
+      }
+
+      for (auto env = locals; env != nullptr; env = env->parent) {
+        auto it = env->constants.find(exp.list[1].string);
+        if (it != env->constants.end()) {
+          it->second = result;
+          return true;
+        }
+      }
+
+      return false;
+    }
+
+    if (op == "while") {
+      Exp cond((int64_t)0);
+      bool truthy = false;
+
+      for (;;) {
+        if (!evaluate(exp.list[1], scope, locals, cond, steps) ||
+            !isTruthy(cond, truthy)) {
+          return false;
+        }
+
+        if (!truthy) {
+          result = Exp((int64_t)0);
+          return true;
+        }
+
+        if (!evaluate(exp.list[2], scope, newScope(locals), result, steps)) {
+          return false;
+        }
+      }
+    }
+
+    // Calls of compile-time functions:
+    auto fnExp = lookupFunction(op, scope);
+
+    if (fnExp == nullptr) {
+      return false;
+    }
+
+    auto& params = fnExp->list[2].list;
+
+    if (params.size() != exp.list.size() - 1) {
+      return false;
+    }
+
+    auto fnLocals = std::make_shared<FoldScope>();
+
+    for (auto i = 0; i < params.size(); i++) {
+      Exp arg((int64_t)0);
+
+      if (!evaluate(exp.list[i + 1], scope, locals, arg, steps)) {
+        return false;
+      }
+
+      if (params[i].type == ExpType::LIST) {
+        if (!castLiteral(arg, params[i].list[1], arg)) {
+          return false;
+        }
+        fnLocals->constants.emplace(params[i].list[0].string, arg);
+      } else {
+        fnLocals->constants.emplace(params[i].string, arg);
+      }
+    }
+
+    auto bodyIndex = hasReturnType(*fnExp) ? 5 : 3;
+
+    if (!evaluate(fnExp->list[bodyIndex], scope, fnLocals, result, steps)) {
+      return false;
+    }
+
+    return !hasReturnType(*fnExp) ||
+           castLiteral(result, fnExp->list[4], result);
+  }
+
+  /**
+   * Folds binary operation on literals, with the codegen semantics:
+   * i32 arithmetic wraps around, numbers out of the i32 range are i64,
+   * integer compares are signed (booleans unsigned), floating point
+   * compares are ordered.
+   */
+  bool foldBinary(const std::string& op, const Exp& op1, const Exp& op2,
+                  Exp& result) {
+    if (!isLiteral(op1) || !isLiteral(op2)) {
+      return false;
+    }
+
+    // Floating point:
+    if (op1.type == ExpType::FLOAT || op2.type == ExpType::FLOAT) {
+      if (isBoolean(op1) || isBoolean(op2)) {
+        return false;
+      }
+
+      auto a = op1.type == ExpType::FLOAT ? op1.floatNumber : op1.number;
+      auto b = op2.type == ExpType::FLOAT ? op2.floatNumber : op2.number;
+
+      if (op == "+") result = Exp(a + b);
+      else if (op == "-") result = Exp(a - b);
+      else if (op == "*") result = Exp(a * b);
+      else if (op == "/") result = Exp(a / b);
+      else result = boolean(compare(op, a, b));
+
+      return true;
+    }
+
+    auto a = toInteger(op1);
+    auto b = toInteger(op2);
+
+    // Booleans are only compared with booleans (mixed with numbers,
+    // true is sign-extended to -1 by the codegen):
+    if (isBoolean(op1) || isBoolean(op2)) {
+      if (isMathOp(op) || !isBoolean(op1) || !isBoolean(op2)) {
+        return false;
+      }
+      result = boolean(compare(op, (uint64_t)a, (uint64_t)b));
+      return true;
+    }
+
+    auto isI32 = isI32Number(a) && isI32Number(b);
+
+    if (isCompareOp(op)) {
+      result = isI32 ? boolean(compare(op, (int32_t)a, (int32_t)b))
+                     : boolean(compare(op, a, b));
+      return true;
+    }
+
+    // Division by zero and overflowing division are left for runtime:
+    if (op == "/" && (b == 0 || (b == -1 && (isI32 ? a == INT32_MIN
+                                                    : a == INT64_MIN)))) {
+      return false;
+    }
+
+    uint64_t value = 0;
+
+    if (op == "+") value = (uint64_t)a + (uint64_t)b;
+    else if (op == "-") value = (uint64_t)a - (uint64_t)b;
+    else if (op == "*") value = (uint64_t)a * (uint64_t)b;
+    else value = a / b;
+
+    result = Exp(isI32 ? (int64_t)(int32_t)(uint32_t)value : (int64_t)value);
+
+    // Wrapped i64 result in the i32 range would change its type:
+    return isI32 || !isI32Number(result.number);
+  }
+
+  /**
+   * Compares two numbers. Float compares are ordered, as the generated
+   * ones (`!=` is `fcmp one`): false if either is NaN.
+   */
+  template <typename T>
+  bool compare(const std::string& op, T a, T b) {
+    if (op == ">") return a > b;
+    if (op == "<") return a < b;
+    if (op == "==") return a == b;
+    if (op == "!=") return a < b || a > b;
+    if (op == ">=") return a >= b;
+    return a <= b;
+  }
+
+  /**
+   * Converts a literal to the declared type. Only types which
+   * keep the folding semantics are supported.
+   */
+  bool castLiteral(const Exp& value, const Exp& typeExp, Exp& result) {
+    if (typeExp.type != ExpType::SYMBOL) {
+      return false;
+    }
+
+    auto& typeName = typeExp.string;
+
+    if (typeName == "number" || typeName == "i32") {
+      if (value.type != ExpType::NUMBER || !isI32Number(value.number)) {
+        return false;
+      }
+      result = value;
+      return true;
+    }
+
+    if (typeName == "f64") {
+      if (value.type == ExpType::FLOAT) {
+        result = value;
+        return true;
+      }
+      if (value.type == ExpType::NUMBER) {
+        result = Exp((double)value.number);
+        return true;
+      }
+      return false;
+    }
+
+    if (typeName == "boolean") {
+      if (!isBoolean(value)) {
+        return false;
+      }
+      result = value;
+      return true;
+    }
+
+    return false;
+  }
+
+  /**
+   * Whether a literal can be a constant of the declared type.
+   */
+  bool isLiteralOfType(const Exp& value, const std::string& typeName) {
+    return ((typeName == "number" || typeName == "i32") &&
+            value.type == ExpType::NUMBER && isI32Number(value.number)) ||
+           (typeName == "f64" && value.type == ExpType::FLOAT) ||
+           (typeName == "boolean" && isBoolean(value));
+  }
+
+  /**
+   * Truthiness of a literal condition.
+   */
+  bool isTruthy(const Exp& cond, bool& truthy) {
+    if (isBoolean(cond)) {
+      truthy = cond.string == "true";
+      return true;
+    }
+
+    if (cond.type == ExpType::NUMBER) {
+      truthy = cond.number != 0;
+      return true;
+    }
+
+    return false;
+  }
+
+  /**
+   * Returns the constant bound to a name, or nullptr.
+   */
+  const Exp* lookupConstant(const std::string& name, FoldEnv scope) {
+    for (auto env = scope; env != nullptr; env = env->parent) {
+      if (env->unknown.count(name) != 0 || env->functions.count(name) != 0) {
+        return nullptr;
+      }
+
+      auto it = env->constants.find(name);
+      if (it != env->constants.end()) {
+        return &it->second;
+      }
+    }
+
+    return nullptr;
+  }
+
+  /**
+   * Returns a compile-time function bound to a name, or nullptr.
+   */
+  const Exp* lookupFunction(const std::string& name, FoldEnv scope) {
+    for (auto env = scope; env != nullptr; env = env->parent) {
+      if (env->unknown.count(name) != 0 || env->constants.count(name) != 0) {
+        return nullptr;
+      }
+
+      auto it = env->functions.find(name);
+      if (it != env->functions.end()) {
+        return &it->second;
+      }
+    }
+
+    return nullptr;
+  }
+
+  /**
+   * Whether the def (by its name) is annotated ^comptime or ^pure.
+   */
+  bool isComptime(const Exp& fnName) {
+    auto it = annotations_.find(fnName.annotationsId);
+    return it != annotations_.end() && (it->second.count("comptime") != 0 ||
+                                        it->second.count("pure") != 0);
+  }
+
+  /**
+   * Collects names of all reassigned variables: (set x ...), and
+   * variables of atomic operations (shared between threads).
+   */
+  void collectAssigned(const Exp& exp) {
+    if (exp.type != ExpType::LIST || exp.list.empty()) {
+      return;
+    }
+
+    if (exp.list[0].type == ExpType::SYMBOL &&
+        (exp.list[0].string == "set" || isAtomicOp(exp.list[0].string)) &&
+        exp.list.size() > 1 && exp.list[1].type == ExpType::SYMBOL) {
+      assigned_.insert(exp.list[1].string);
+    }
+
+    for (auto& e : exp.list) {
+      collectAssigned(e);
+    }
+  }
+
+  /**
+   * Whether all list items from the index are literals.
+   */
+  bool allLiterals(const Exp& exp, size_t start) {
+    for (auto i = start; i < exp.list.size(); i++) {
+      if (!isLiteral(exp.list[i])) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /**
+   * Number, floating point number, or boolean.
+   */
+  bool isLiteral(const Exp& exp) {
+    return exp.type == ExpType::NUMBER || exp.type == ExpType::FLOAT ||
+           isBoolean(exp);
+  }
+
+  bool isBoolean(const Exp& exp) {
+    return exp.type == ExpType::SYMBOL &&
+           (exp.string == "true" || exp.string == "false");
+  }
+
+  bool isI32Number(int64_t number) {
+    return number >= INT32_MIN && number <= INT32_MAX;
+  }
+
+  int64_t toInteger(const Exp& exp) {
+    return isBoolean(exp) ? exp.string == "true" : exp.number;
+  }
+
+  Exp boolean(bool value) {
+    std::string name = value ? "true" : "false";
+    return Exp(name);
+  }
+
+  bool isMathOp(const std::string& op) {
+    return op == "+" || op == "-" || op == "*" || op == "/";
+  }
+
+  bool isCompareOp(const std::string& op) {
+    return op == ">" || op == "<" || op == "==" || op == "!=" || op == ">=" ||
+           op == "<=";
+  }
+
+  bool isAtomicOp(const std::string& op) { return op.rfind("atomic-", 0) == 0; }
+
+  bool isMemoryOrder(const std::string& name) {
+    return name == "relaxed" || name == "acquire" || name == "release" ||
+           name == "acq-rel" || name == "seq-cst";
+  }
+
+  bool hasReturnType(const Exp& fnExp) {
+    return fnExp.list[3].type == ExpType::SYMBOL &&
+           fnExp.list[3].string == "->";
+  }
+
+  FoldEnv newScope(FoldEnv parent) {
+    auto scope = std::make_shared<FoldScope>();
+    scope->parent = parent;
+    return scope;
+  }
+
+  /**
+   * Function annotations.
+   */
+  const std::map<int, std::set<std::string>>& annotations_;
+
+  /**
+   * Names of reassigned variables (never constant).
+   */
+  std::set<std::string> assigned_;
+};
+
+#endif
@@ -37,7 +37,8 @@ class Environment : public std::enable_shared_from_this<Environment> {
    * Creates a variable with the given name and value.
    */
   llvm::Value* define(const std::string& name, llvm::Value* value) {
-    // Implement here...
+    record_[name] = value;
+    return value;
   }
 
   /**
@@ -48,13 +49,29 @@ class Environment : public std::enable_shared_from_this<Environment> {
     return resolve(name)->record_[name];
   }
 
+  /**
+   * Whether the variable is defined in this or a parent environment.
+   */
+  bool has(const std::string& name) {
+    return record_.count(name) != 0 ||
+           (parent_ != nullptr && parent_->has(name));
+  }
+
  private:
   /**
    * Returns specific environment in which a variable is defined, or
    * throws if a variable is not defined.
    */
   std::shared_ptr<Environment> resolve(const std::string& name) {
-    // Implement here...
+    if (record_.count(name) != 0) {
+      return shared_from_this();
+    }
+
+    if (parent_ == nullptr) {
+      DIE << "Variable \"" << name << "\" is not defined.\n";
+    }
+
+    return parent_->resolve(name);
   }
 
   /**
@@ -0,0 +1,944 @@
+/**
+ * Programming Language with LLVM
+ *
+ * Course info:
+ * http://dmitrysoshnikov.com/courses/programming-language-with-llvm/
+ *
+ * (C) 2023-present Dmitry Soshnikov <dmitry.soshnikov@gmail.com>
+ */
+
+/**
+ * Eva AST interpreter: the first execution tier.
+ *
+ * Short programs are evaluated directly over the AST, avoiding the
+ * cost of codegen and native compilation. Each function counts its calls
+ * and loop iterations, and once it gets hot, it is compiled by EvaLLVM,
+ * JIT-ed, and further calls go to the native code.
+ */
+
+#ifndef EvaInterpreter_h
+#define EvaInterpreter_h
+
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "./EvaJIT.h"
+#include "./EvaLLVM.h"
+#include "./Logger.h"
+#include "./parser/EvaParser.h"
+
+using syntax::EvaParser;
+
+struct FunctionObject;
+
+/**
+ * Runtime value type.
+ */
+enum class EvaValueType {
+  NUMBER,
+  BOOLEAN,
+  STRING,
+  FUNCTION,
+};
+
+/**
+ * Runtime value.
+ */
+struct EvaValue {
+  EvaValueType type;
+
+  int number;
+  std::string string;
+  std::shared_ptr<FunctionObject> fn;
+
+  static EvaValue Number(int number) {
+    return EvaValue{EvaValueType::NUMBER, number};
+  }
+
+  static EvaValue Boolean(bool value) {
+    return EvaValue{EvaValueType::BOOLEAN, value};
+  }
+
+  static EvaValue String(const std::string& string) {
+    return EvaValue{EvaValueType::STRING, 0, string};
+  }
+
+  static EvaValue Function(std::shared_ptr<FunctionObject> fn) {
+    return EvaValue{EvaValueType::FUNCTION, 0, "", fn};
+  }
+
+  /**
+   * Booleans and numbers are truthy when non-zero.
+   */
+  bool isTruthy() const { return number != 0; }
+};
+
+/**
+ * Interpreter environment: same scoping semantics as
+ * the compiler Environment, but storing runtime values.
+ */
+class InterpreterEnvironment
+    : public std::enable_shared_from_this<InterpreterEnvironment> {
+ public:
+  InterpreterEnvironment(std::shared_ptr<InterpreterEnvironment> parent)
+      : parent_(parent) {}
+
+  /**
+   * Creates a variable with the given name and value.
+   */
+  EvaValue define(const std::string& name, const EvaValue& value) {
+    record_[name] = value;
+    return value;
+  }
+
+  /**
+   * Updates an existing variable.
+   */
+  EvaValue assign(const std::string& name, const EvaValue& value) {
+    resolve(name)->record_[name] = value;
+    return value;
+  }
+
+  /**
+   * Returns the value of a defined variable.
+   */
+  EvaValue lookup(const std::string& name) {
+    return resolve(name)->record_[name];
+  }
+
+  /**
+   * Whether the variable is defined in this or parent environments.
+   */
+  bool has(const std::string& name) {
+    if (record_.count(name) != 0) {
+      return true;
+    }
+    return parent_ != nullptr && parent_->has(name);
+  }
+
+ private:
+  /**
+   * Returns specific environment in which a variable is defined, or
+   * dies if a variable is not defined.
+   */
+  std::shared_ptr<InterpreterEnvironment> resolve(const std::string& name) {
+    if (record_.count(name) != 0) {
+      return shared_from_this();
+    }
+
+    if (parent_ == nullptr) {
+      DIE << "Variable \"" << name << "\" is not defined.\n";
+    }
+
+    return parent_->resolve(name);
+  }
+
+  /**
+   * Bindings storage
+   */
+  std::map<std::string, EvaValue> record_;
+
+  /**
+   * Parent link
+   */
+  std::shared_ptr<InterpreterEnvironment> parent_;
+};
+
+using InterpEnv = std::shared_ptr<InterpreterEnvironment>;
+
+/**
+ * Native (JIT-compiled) function.
+ */
+using NativeFunction = void*;
+
+/**
+ * Functions with more params are always interpreted.
+ */
+static const size_t MAX_NATIVE_PARAMS = 4;
+
+/**
+ * Function object: AST, closure, and the tier-up state.
+ */
+struct FunctionObject {
+  std::string name;
+  Exp fnExp;
+  std::vector<std::string> params;
+  Exp body;
+  InterpEnv env;
+
+  /**
+   * Profile counters: calls and loop iterations.
+   */
+  size_t callsCount;
+  size_t loopsCount;
+
+  /**
+   * Compiled version, once the function gets hot.
+   */
+  NativeFunction native;
+
+  /**
+   * Whether the function can be compiled (checked once it's hot).
+   */
+  bool compilable;
+};
+
+/**
+ * Special forms which are not function calls.
+ */
+static const std::set<std::string> SPECIAL_FORMS = {
+    "+",  "-",   "*",     "/",   ">",   "<",   "==",    "!=",     ">=",
+    "<=", "if",  "while", "for", "def", "var", "set",   "begin",  "printf",
+};
+
+/**
+ * Forms supported only by the compiler.
+ */
+static const std::set<std::string> COMPILED_ONLY_FORMS = {
+    "class",        "new",          "prop",         "method",
+    "super",        "array",        "aref",         "aset",
+    "alen",         "splat",        "vload",        "vstore",
+    "lane",         "set-lane",     "shuffle",      "reduce-add",
+    "reduce-mul",   "reduce-min",   "reduce-max",   "str-len",
+    "str-concat",   "str-cmp",      "str-eq",       "str-hash",
+    "async",        "await",        "async-run",    "spawn",
+    "sync",         "parallel-for", "atomic-load",  "atomic-store",
+    "atomic-add",   "atomic-sub",   "atomic-xchg",  "atomic-cas",
+    "fence",        "import",       "interface",
+};
+
+class EvaInterpreter {
+ public:
+  /**
+   * Sets the compiler options (-O, --fast-math, etc) of the JIT.
+   */
+  using Configure = std::function<void(EvaLLVM&)>;
+
+  /**
+   * `hotThreshold` is the number of calls plus loop
+   * iterations after which a function is compiled. `jitListeners`
+   * makes compiled functions visible to perf and debuggers.
+   */
+  EvaInterpreter(size_t hotThreshold = 1000, bool jitListeners = false,
+                 Configure configure = [](EvaLLVM&) {})
+      : parser(std::make_unique<EvaParser>()),
+        globalEnv_(std::make_shared<InterpreterEnvironment>(nullptr)),
+        hotThreshold_(hotThreshold),
+        jitListeners_(jitListeners),
+        configure_(configure) {
+    globalEnv_->define("VERSION", EvaValue::Number(42));
+  }
+
+  /**
+   * Whether the program can run in the interpreter.
+   *
+   * Classes, arrays, vectors, and floating point numbers are only supported
+   * by the compiler, such programs are compiled and JIT-ed as a whole.
+   */
+  static bool canInterpret(const Exp& exp) {
+    // Floating point is compiled only:
+    if (exp.type == ExpType::FLOAT) {
+      return false;
+    }
+
+    if (exp.type != ExpType::LIST) {
+      return true;
+    }
+
+    if (!exp.list.empty() && exp.list[0].type == ExpType::SYMBOL) {
+      if (COMPILED_ONLY_FORMS.count(exp.list[0].string) != 0) {
+        return false;
+      }
+    }
+
+    for (auto& e : exp.list) {
+      if (!canInterpret(e)) {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  /**
+   * Executes a program, returns the exit code.
+   */
+  int exec(const std::string& program) {
+    // Annotations are for the compiler only:
+    Annotations annotations{};
+    auto ast = EvaLLVM::stripAnnotations(
+        parser->parse("(begin " + program + ")"), annotations);
+
+    // Whole program goes directly to the JIT:
+    if (!canInterpret(ast)) {
+      auto vm = createCompiler();
+      vm->compileProgram(program);
+      auto compiled = vm->takeModule();
+      auto main = (int (*)())jit().addModule(
+          std::move(compiled.first), std::move(compiled.second), "main");
+      return main();
+    }
+
+    // The program block is the global scope (top-level functions
+    // can be compiled, see collectCompilableDefs):
+    for (auto i = 1; i < ast.list.size(); i++) {
+      eval(ast.list[i], globalEnv_);
+    }
+
+    return 0;
+  }
+
+ private:
+  /**
+   * Main eval loop.
+   */
+  EvaValue eval(const Exp& exp, InterpEnv env) {
+    switch (exp.type) {
+      /**
+       * ----------------------------------------------
+       * Numbers.
+       */
+      case ExpType::NUMBER:
+        return EvaValue::Number(exp.number);
+
+      case ExpType::FLOAT:
+        DIE << "Floating point numbers are not interpreted.\n";
+
+      /**
+       * ----------------------------------------------
+       * Strings.
+       */
+      case ExpType::STRING:
+        return EvaValue::String(EvaLLVM::unescape(exp.string));
+
+      /**
+       * ----------------------------------------------
+       * Symbols (variables, booleans).
+       */
+      case ExpType::SYMBOL:
+        if (exp.string == "true" || exp.string == "false") {
+          return EvaValue::Boolean(exp.string == "true");
+        }
+        return env->lookup(exp.string);
+
+      /**
+       * ----------------------------------------------
+       * Lists.
+       */
+      case ExpType::LIST:
+        break;
+    }
+
+    auto tag = exp.list[0];
+
+    if (tag.type == ExpType::SYMBOL) {
+      auto op = tag.string;
+
+      // --------------------------------------------
+      // Binary math operations:
+
+      if (op == "+") {
+        return EvaValue::Number(number(exp.list[1], env) +
+                                number(exp.list[2], env));
+      }
+
+      else if (op == "-") {
+        return EvaValue::Number(number(exp.list[1], env) -
+                                number(exp.list[2], env));
+      }
+
+      else if (op == "*") {
+        return EvaValue::Number(number(exp.list[1], env) *
+                                number(exp.list[2], env));
+      }
+
+      else if (op == "/") {
+        return EvaValue::Number(number(exp.list[1], env) /
+                                number(exp.list[2], env));
+      }
+
+      // --------------------------------------------
+      // Compare operations: signed, as in the compiler.
+
+      else if (op == ">") {
+        return EvaValue::Boolean(number(exp.list[1], env) >
+                                 number(exp.list[2], env));
+      }
+
+      else if (op == "<") {
+        return EvaValue::Boolean(number(exp.list[1], env) <
+                                 number(exp.list[2], env));
+      }
+
+      else if (op == "==") {
+        return EvaValue::Boolean(number(exp.list[1], env) ==
+                                 number(exp.list[2], env));
+      }
+
+      else if (op == "!=") {
+        return EvaValue::Boolean(number(exp.list[1], env) !=
+                                 number(exp.list[2], env));
+      }
+
+      else if (op == ">=") {
+        return EvaValue::Boolean(number(exp.list[1], env) >=
+                                 number(exp.list[2], env));
+      }
+
+      else if (op == "<=") {
+        return EvaValue::Boolean(number(exp.list[1], env) <=
+                                 number(exp.list[2], env));
+      }
+
+      // --------------------------------------------
+      // Branch: (if <cond> <then> <else>)
+
+      else if (op == "if") {
+        if (eval(exp.list[1], env).isTruthy()) {
+          return eval(exp.list[2], env);
+        }
+        return eval(exp.list[3], env);
+      }
+
+      // --------------------------------------------
+      // While loop: (while <cond> <body>)
+      //
+      // Iterations are counted towards the enclosing function.
+
+      else if (op == "while") {
+        auto result = EvaValue::Number(0);
+
+        while (eval(exp.list[1], env).isTruthy()) {
+          result = eval(exp.list[2], env);
+
+          if (currentFn_ != nullptr) {
+            currentFn_->loopsCount++;
+          }
+        }
+
+        return result;
+      }
+
+      // --------------------------------------------
+      // Counted loop: (for (<var> <start> [<op>] <end> [<step>]) <body>)
+      //
+      // Loop hints are for the compiler only. Compares are signed.
+      // The default step is -1 for `>` and `>=`, and the step should
+      // move towards the end (as in compileForLoop).
+
+      else if (op == "for") {
+        auto& header = exp.list[1];
+
+        auto hasOp = header.list[2].type == ExpType::SYMBOL &&
+                     (header.list[2].string == "<" ||
+                      header.list[2].string == "<=" ||
+                      header.list[2].string == ">" ||
+                      header.list[2].string == ">=");
+
+        auto cmpOp = hasOp ? header.list[2].string : "<";
+        auto stepIndex = hasOp ? 4 : 3;
+        auto isDescending = cmpOp == ">" || cmpOp == ">=";
+
+        auto index = number(header.list[1], env);
+        auto end = number(header.list[hasOp ? 3 : 2], env);
+        auto step = stepIndex < header.list.size()
+                        ? number(header.list[stepIndex], env)
+                        : (isDescending ? -1 : 1);
+
+        if (step == 0 || (step < 0) != isDescending) {
+          DIE << "Counted loop \"" << header.list[0].string << "\" with "
+              << cmpOp << " should have a "
+              << (isDescending ? "negative" : "positive") << " step.\n";
+        }
+
+        auto& body = exp.list[exp.list.size() - 1];
+
+        for (;;) {
+          auto inRange = cmpOp == "<"    ? index < end
+                         : cmpOp == "<=" ? index <= end
+                         : cmpOp == ">"  ? index > end
+                                         : index >= end;
+          if (!inRange) {
+            break;
+          }
+
+          auto loopEnv = std::make_shared<InterpreterEnvironment>(env);
+          loopEnv->define(header.list[0].string, EvaValue::Number(index));
+
+          eval(body, loopEnv);
+
+          if (currentFn_ != nullptr) {
+            currentFn_->loopsCount++;
+          }
+
+          index += step;
+        }
+
+        return EvaValue::Number(0);
+      }
+
+      // --------------------------------------------
+      // Function declaration: (def <name> <params> <body>)
+
+      else if (op == "def") {
+        auto fnName = exp.list[1].string;
+
+        std::vector<std::string> params;
+        for (auto& param : exp.list[2].list) {
+          params.push_back(param.type == ExpType::LIST ? param.list[0].string
+                                                       : param.string);
+        }
+
+        auto body = hasReturnType(exp) ? exp.list[5] : exp.list[3];
+
+        auto fn = std::make_shared<FunctionObject>(FunctionObject{
+            fnName, exp, params, body, env,
+            /* callsCount */ 0, /* loopsCount */ 0,
+            /* native */ nullptr, /* compilable */ true});
+
+        return env->define(fnName, EvaValue::Function(fn));
+      }
+
+      // --------------------------------------------
+      // Variable declaration: (var x (+ y 10))
+
+      else if (op == "var") {
+        auto varNameDecl = exp.list[1];
+        auto varName = varNameDecl.type == ExpType::LIST
+                           ? varNameDecl.list[0].string
+                           : varNameDecl.string;
+        return env->define(varName, eval(exp.list[2], env));
+      }
+
+      // --------------------------------------------
+      // Variable update: (set x 100)
+
+      else if (op == "set") {
+        return env->assign(exp.list[1].string, eval(exp.list[2], env));
+      }
+
+      // --------------------------------------------
+      // Blocks: (begin <expressions>)
+
+      else if (op == "begin") {
+        auto blockEnv = std::make_shared<InterpreterEnvironment>(env);
+        auto blockRes = EvaValue::Number(0);
+
+        for (auto i = 1; i < exp.list.size(); i++) {
+          blockRes = eval(exp.list[i], blockEnv);
+        }
+
+        return blockRes;
+      }
+
+      // --------------------------------------------
+      // printf: (printf "Value: %d" 42)
+
+      else if (op == "printf") {
+        return EvaValue::Number(printf(exp, env));
+      }
+    }
+
+    // --------------------------------------------
+    // Function calls: (square 2)
+
+    auto callee = eval(exp.list[0], env);
+
+    if (callee.type != EvaValueType::FUNCTION) {
+      DIE << "Not a function.\n";
+    }
+
+    std::vector<EvaValue> args;
+    for (auto i = 1; i < exp.list.size(); i++) {
+      args.push_back(eval(exp.list[i], env));
+    }
+
+    return call(callee.fn, args);
+  }
+
+  /**
+   * Calls a function: native if compiled, interpreted otherwise.
+   */
+  EvaValue call(std::shared_ptr<FunctionObject> fn,
+                const std::vector<EvaValue>& args) {
+    fn->callsCount++;
+
+    if (fn->native == nullptr && fn->compilable &&
+        fn->callsCount + fn->loopsCount >= hotThreshold_) {
+      tierUp(fn);
+    }
+
+    if (fn->native != nullptr && allNumbers(args)) {
+      return EvaValue::Number(callNative(fn->native, args));
+    }
+
+    auto activationEnv = std::make_shared<InterpreterEnvironment>(fn->env);
+
+    for (auto i = 0; i < fn->params.size(); i++) {
+      activationEnv->define(fn->params[i], args[i]);
+    }
+
+    auto prevFn = currentFn_;
+    currentFn_ = fn.get();
+
+    auto result = eval(fn->body, activationEnv);
+
+    currentFn_ = prevFn;
+
+    return result;
+  }
+
+  /**
+   * Compiles a hot function (with all functions it calls),
+   * and patches it to the native version.
+   */
+  void tierUp(std::shared_ptr<FunctionObject> fn) {
+    std::vector<Exp> defs;
+    std::set<std::string> visited;
+
+    if (!collectCompilableDefs(fn, defs, visited)) {
+      fn->compilable = false;
+      return;
+    }
+
+    auto vm = createCompiler();
+    vm->compileDefs(defs);
+    auto compiled = vm->takeModule();
+
+    fn->native = jit().addModule(std::move(compiled.first),
+                                 std::move(compiled.second), fn->name);
+  }
+
+  /**
+   * Collects the function with its (transitive) callees. Only
+   * top-level functions over numbers, which don't refer to global
+   * variables, can be compiled separately from the program.
+   */
+  bool collectCompilableDefs(std::shared_ptr<FunctionObject> fn,
+                             std::vector<Exp>& defs,
+                             std::set<std::string>& visited) {
+    if (visited.count(fn->name) != 0) {
+      return true;
+    }
+    visited.insert(fn->name);
+
+    if (!fn->compilable || fn->env != globalEnv_ ||
+        fn->params.size() > MAX_NATIVE_PARAMS) {
+      return false;
+    }
+
+    // Only numbers in the signature:
+    for (auto& param : fn->fnExp.list[2].list) {
+      if (param.type == ExpType::LIST && param.list[1].string != "number") {
+        return false;
+      }
+    }
+
+    if (hasReturnType(fn->fnExp) && fn->fnExp.list[4].string != "number") {
+      return false;
+    }
+
+    std::set<std::string> locals(fn->params.begin(), fn->params.end());
+    std::set<std::string> freeNames;
+
+    collectNames(fn->body, locals, freeNames);
+
+    defs.push_back(fn->fnExp);
+
+    for (auto& name : freeNames) {
+      if (locals.count(name) != 0) {
+        continue;
+      }
+
+      if (!globalEnv_->has(name)) {
+        return false;
+      }
+
+      auto value = globalEnv_->lookup(name);
+
+      if (value.type != EvaValueType::FUNCTION ||
+          !collectCompilableDefs(value.fn, defs, visited)) {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  /**
+   * Collects local declarations and all referenced names of a body.
+   */
+  void collectNames(const Exp& exp, std::set<std::string>& locals,
+                    std::set<std::string>& names) {
+    if (exp.type == ExpType::SYMBOL) {
+      if (exp.string != "true" && exp.string != "false") {
+        names.insert(exp.string);
+      }
+      return;
+    }
+
+    if (exp.type != ExpType::LIST || exp.list.empty()) {
+      return;
+    }
+
+    auto start = 0;
+
+    if (exp.list[0].type == ExpType::SYMBOL &&
+        SPECIAL_FORMS.count(exp.list[0].string) != 0) {
+      auto& op = exp.list[0].string;
+
+      // Nested functions are not compiled separately:
+      if (op == "def") {
+        names.insert("def");
+        return;
+      }
+
+      if (op == "var") {
+        auto& varNameDecl = exp.list[1];
+        locals.insert(varNameDecl.type == ExpType::LIST
+                          ? varNameDecl.list[0].string
+                          : varNameDecl.string);
+        start = 2;
+      } else if (op == "for") {
+        // Loop variable, range, and the body (hints are skipped):
+        auto& header = exp.list[1];
+        locals.insert(header.list[0].string);
+
+        for (auto i = 1; i < header.list.size(); i++) {
+          if (header.list[i].type != ExpType::SYMBOL ||
+              SPECIAL_FORMS.count(header.list[i].string) == 0) {
+            collectNames(header.list[i], locals, names);
+          }
+        }
+
+        collectNames(exp.list[exp.list.size() - 1], locals, names);
+        return;
+      } else {
+        start = 1;
+      }
+    }
+
+    for (auto i = start; i < exp.list.size(); i++) {
+      collectNames(exp.list[i], locals, names);
+    }
+  }
+
+  /**
+   * Calls native code with i32 arguments.
+   */
+  int callNative(NativeFunction native, const std::vector<EvaValue>& args) {
+    switch (args.size()) {
+      case 0:
+        return ((int (*)())native)();
+      case 1:
+        return ((int (*)(int))native)(args[0].number);
+      case 2:
+        return ((int (*)(int, int))native)(args[0].number, args[1].number);
+      case 3:
+        return ((int (*)(int, int, int))native)(args[0].number, args[1].number,
+                                                args[2].number);
+      case 4:
+        return ((int (*)(int, int, int, int))native)(
+            args[0].number, args[1].number, args[2].number, args[3].number);
+    }
+
+    DIE << "Too many arguments for a native call.\n";
+    return 0;
+  }
+
+  /**
+   * Whether all values are numbers.
+   */
+  bool allNumbers(const std::vector<EvaValue>& values) {
+    for (auto& value : values) {
+      if (value.type != EvaValueType::NUMBER) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /**
+   * Evaluates a number operand.
+   */
+  int number(const Exp& exp, InterpEnv env) { return eval(exp, env).number; }
+
+  /**
+   * Formats arguments one conversion at a time, returns printed count.
+   * The arguments are evaluated first, and checked as in the compiler
+   * (checkPrintfArgs): numbers are i32, strings only go to %s.
+   */
+  int printf(const Exp& exp, InterpEnv env) {
+    auto format = EvaLLVM::unescape(exp.list[1].string);
+
+    std::vector<EvaValue> args{};
+    for (auto i = 2; i < exp.list.size(); i++) {
+      args.push_back(eval(exp.list[i], env));
+    }
+
+    // Chunks up to (and including) the conversion char, with the number
+    // of `*` args, the text after the last one is written as is:
+    std::vector<std::pair<std::string, size_t>> chunks{};
+    std::string::size_type pos = 0;
+    size_t argIndex = 0;
+
+    for (auto spec = format.find('%'); spec != std::string::npos;
+         spec = format.find('%', pos)) {
+      // %% escape:
+      if (spec + 1 < format.size() && format[spec + 1] == '%') {
+        chunks.push_back({format.substr(pos, spec - pos + 2), 0});
+        pos = spec + 2;
+        continue;
+      }
+
+      auto end = format.find_first_not_of("-+ #0123456789.*hljztL", spec + 1);
+      auto conversion = end != std::string::npos ? format[end] : '\0';
+      auto specText = format.substr(
+          spec, end != std::string::npos ? end - spec + 1 : end);
+      auto stars = std::count(specText.begin(), specText.end(), '*');
+
+      if (conversion == '\0' || stars > 2 ||
+          std::string("diouxXeEfFgGaAcsp").find(conversion) ==
+              std::string::npos) {
+        DIE << "Unsupported printf conversion \"" << specText << "\".\n";
+      }
+
+      if (argIndex + stars >= args.size()) {
+        DIE << "Not enough arguments for \"" << specText
+            << "\" in printf.\n";
+      }
+
+      for (auto i = 0; i < stars; i++) {
+        if (args[argIndex++].type == EvaValueType::STRING) {
+          DIE << "Width and precision of \"" << specText
+              << "\" should be numbers.\n";
+        }
+      }
+
+      auto isString = args[argIndex++].type == EvaValueType::STRING;
+      auto isLong = specText.find_first_of("ljzt") != std::string::npos;
+      auto isFloat =
+          std::string("eEfFgGaA").find(conversion) != std::string::npos;
+
+      if (isString != (conversion == 's') ||
+          (!isString && (isLong || isFloat || conversion == 'p'))) {
+        DIE << "Argument " << argIndex << " of printf ("
+            << (isString ? "string" : "i32") << ") does not match \""
+            << specText << "\".\n";
+      }
+
+      chunks.push_back({format.substr(pos, end + 1 - pos), stars + 1});
+      pos = end + 1;
+    }
+
+    if (argIndex != args.size()) {
+      DIE << "Too many arguments for printf: the format takes " << argIndex
+          << ", given " << args.size() << ".\n";
+    }
+
+    auto printed = 0;
+    auto arg = args.begin();
+
+    for (auto& chunk : chunks) {
+      auto text = chunk.first.c_str();
+
+      if (chunk.second == 0) {
+        printed += eva_write_format(text);
+        continue;
+      }
+
+      // Width and precision (`*`) go before the value:
+      std::vector<int> widths{};
+      for (auto i = 1; i < chunk.second; i++) {
+        widths.push_back((arg++)->number);
+      }
+
+      auto write = [&](auto value) {
+        return widths.empty() ? eva_write_format(text, value)
+               : widths.size() == 1
+                   ? eva_write_format(text, widths[0], value)
+                   : eva_write_format(text, widths[0], widths[1], value);
+      };
+
+      printed += arg->type == EvaValueType::STRING
+                     ? write(arg->string.c_str())
+                     : write(arg->number);
+      arg++;
+    }
+
+    if (pos < format.size()) {
+      printed += eva_write_str(format.data() + pos, format.size() - pos);
+    }
+
+    return printed;
+  }
+
+  /**
+   * Whether function has return type defined.
+   */
+  static bool hasReturnType(const Exp& fnExp) {
+    return fnExp.list[3].type == ExpType::SYMBOL &&
+           fnExp.list[3].string == "->";
+  }
+
+  /**
+   * Compiler instance with the options of the run.
+   */
+  std::unique_ptr<EvaLLVM> createCompiler() {
+    auto vm = std::make_unique<EvaLLVM>();
+    configure_(*vm);
+    return vm;
+  }
+
+  /**
+   * JIT is created lazily: short programs never pay for it.
+   */
+  EvaJIT& jit() {
+    if (jit_ == nullptr) {
+      jit_ = std::make_unique<EvaJIT>(jitListeners_);
+    }
+    return *jit_;
+  }
+
+  /**
+   * Parser.
+   */
+  std::unique_ptr<EvaParser> parser;
+
+  /**
+   * Global Environment.
+   */
+  InterpEnv globalEnv_;
+
+  /**
+   * Calls + loop iterations after which a function is compiled.
+   */
+  size_t hotThreshold_;
+
+  /**
+   * Register perf and GDB JIT event listeners.
+   */
+  bool jitListeners_;
+
+  /**
+   * Compiler options.
+   */
+  Configure configure_;
+
+  /**
+   * Currently executing function (receives loop counts).
+   */
+  FunctionObject* currentFn_ = nullptr;
+
+  /**
+   * JIT compiler.
+   */
+  std::unique_ptr<EvaJIT> jit_;
+};
+
+#endif
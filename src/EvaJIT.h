@@ -0,0 +1,265 @@
+/**
+ * Programming Language with LLVM
+ *
+ * Course info:
+ * http://dmitrysoshnikov.com/courses/programming-language-with-llvm/
+ *
+ * (C) 2023-present Dmitry Soshnikov <dmitry.soshnikov@gmail.com>
+ */
+
+/**
+ * JIT compiler for generated Eva modules (ORC LLJIT).
+ */
+
+#ifndef EvaJIT_h
+#define EvaJIT_h
+
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/TargetSelect.h"
+
+#include "./Logger.h"
+
+/**
+ * Writes `/tmp/perf-<pid>.map`: one "<addr> <size> <name>" line per
+ * JIT-compiled function, which `perf report` reads as is (the jitdump
+ * of the LLVM perf listener needs `perf inject --jit` first).
+ */
+class PerfMapListener : public llvm::JITEventListener {
+ public:
+  PerfMapListener() {
+    auto path = "/tmp/perf-" + std::to_string(getpid()) + ".map";
+    file_ = std::fopen(path.c_str(), "w");
+  }
+
+  ~PerfMapListener() {
+    if (file_ != nullptr) {
+      std::fclose(file_);
+    }
+  }
+
+  void notifyObjectLoaded(
+      ObjectKey key, const llvm::object::ObjectFile& obj,
+      const llvm::RuntimeDyld::LoadedObjectInfo& info) override {
+    if (file_ == nullptr) {
+      return;
+    }
+
+    // Debug object has symbol addresses relocated to the loaded ones:
+    auto debugObj = info.getObjectForDebug(obj);
+    auto& loaded = debugObj.getBinary() ? *debugObj.getBinary() : obj;
+
+    for (auto& entry : llvm::object::computeSymbolSizes(loaded)) {
+      auto& sym = entry.first;
+      auto type = sym.getType();
+
+      if (!type || *type != llvm::object::SymbolRef::ST_Function) {
+        llvm::consumeError(type.takeError());
+        continue;
+      }
+
+      auto name = sym.getName();
+      auto addr = sym.getAddress();
+
+      if (!name || !addr) {
+        llvm::consumeError(name.takeError());
+        llvm::consumeError(addr.takeError());
+        continue;
+      }
+
+      std::fprintf(file_, "%llx %llx %s\n", (unsigned long long)*addr,
+                   (unsigned long long)entry.second, name->str().c_str());
+    }
+
+    std::fflush(file_);
+  }
+
+ private:
+  /**
+   * Perf map file.
+   */
+  FILE* file_;
+};
+
+/**
+ * JIT: compiles LLVM modules to native code in-process.
+ */
+class EvaJIT {
+ public:
+  /**
+   * `eventListeners` registers the GDB and perf JIT event listeners,
+   * so compiled functions are named in debuggers and `perf report`.
+   */
+  EvaJIT(bool eventListeners = false) {
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+
+    llvm::orc::LLJITBuilder builder;
+
+    if (eventListeners) {
+      builder.setObjectLinkingLayerCreator(
+          [this](llvm::orc::ExecutionSession& session, const llvm::Triple&) {
+            return createListenedLinkingLayer(session);
+          });
+    }
+
+    auto jit = builder.create();
+
+    if (!jit) {
+      DIE << "[EvaJIT]: " << llvm::toString(jit.takeError()) << "\n";
+    }
+
+    jit_ = std::move(*jit);
+  }
+
+  /**
+   * Adds a module to a fresh dylib and returns the native address
+   * of the given symbol.
+   *
+   * Each module gets its own dylib, so repeatedly compiled functions
+   * (and the callees they bring along) don't clash by name.
+   */
+  void* addModule(std::unique_ptr<llvm::LLVMContext> ctx,
+                  std::unique_ptr<llvm::Module> module,
+                  const std::string& symbol) {
+    auto& dylib = createDylib();
+
+    module->setDataLayout(jit_->getDataLayout());
+
+    check(jit_->addIRModule(
+        dylib, llvm::orc::ThreadSafeModule(std::move(module), std::move(ctx))));
+
+    // Global constructors (e.g. registration of allocation sites):
+    check(jit_->initialize(dylib));
+
+    auto sym = jit_->lookup(dylib, symbol);
+
+    if (!sym) {
+      DIE << "[EvaJIT]: " << llvm::toString(sym.takeError()) << "\n";
+    }
+
+    return (void*)sym->getAddress();
+  }
+
+  /**
+   * Removes the added modules (frees their code and data).
+   */
+  void removeModules() {
+    for (auto dylib : dylibs_) {
+      check(jit_->getExecutionSession().removeJITDylib(*dylib));
+    }
+
+    dylibs_.clear();
+  }
+
+ private:
+  /**
+   * Object linking layer (the default one on ELF) with the GDB, perf
+   * jitdump, and perf map listeners.
+   */
+  llvm::Expected<std::unique_ptr<llvm::orc::ObjectLayer>>
+  createListenedLinkingLayer(llvm::orc::ExecutionSession& session) {
+    auto layer = std::make_unique<llvm::orc::RTDyldObjectLinkingLayer>(
+        session,
+        []() { return std::make_unique<llvm::SectionMemoryManager>(); });
+
+    // GDB JIT interface (__jit_debug_register_code):
+    layer->registerJITEventListener(
+        *llvm::JITEventListener::createGDBRegistrationListener());
+
+    // jitdump file for `perf inject --jit` (nullptr without LLVM_USE_PERF):
+    if (auto perf = llvm::JITEventListener::createPerfJITEventListener()) {
+      layer->registerJITEventListener(*perf);
+    }
+
+    perfMap_ = std::make_unique<PerfMapListener>();
+    layer->registerJITEventListener(*perfMap_);
+
+    return std::move(layer);
+  }
+
+  /**
+   * Creates a new dylib which resolves externs (printf, GC_malloc, etc)
+   * from the current process.
+   */
+  llvm::orc::JITDylib& createDylib() {
+    auto dylib =
+        jit_->createJITDylib("eva." + std::to_string(dylibsCount_++));
+
+    if (!dylib) {
+      DIE << "[EvaJIT]: " << llvm::toString(dylib.takeError()) << "\n";
+    }
+
+    auto generator =
+        llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+            jit_->getDataLayout().getGlobalPrefix());
+
+    if (!generator) {
+      DIE << "[EvaJIT]: " << llvm::toString(generator.takeError()) << "\n";
+    }
+
+    dylib->addGenerator(std::move(*generator));
+
+    // Without the GC linked in, instances are allocated with malloc
+    // (as strings of the runtime are):
+    if (llvm::sys::DynamicLibrary::SearchForAddressOfSymbol("GC_malloc") ==
+        nullptr) {
+      check(dylib->define(llvm::orc::absoluteSymbols(
+          {{jit_->mangleAndIntern("GC_malloc"),
+            llvm::JITEvaluatedSymbol(llvm::pointerToJITTargetAddress(&malloc),
+                                     llvm::JITSymbolFlags::Exported)}})));
+    }
+
+    dylibs_.push_back(&*dylib);
+
+    return *dylib;
+  }
+
+  /**
+   * Dies on a JIT error.
+   */
+  void check(llvm::Error err) {
+    if (err) {
+      DIE << "[EvaJIT]: " << llvm::toString(std::move(err)) << "\n";
+    }
+  }
+
+  /**
+   * Perf map listener (with event listeners on), outlives the JIT
+   * which notifies it when objects are freed.
+   */
+  std::unique_ptr<PerfMapListener> perfMap_;
+
+  /**
+   * ORC JIT instance.
+   */
+  std::unique_ptr<llvm::orc::LLJIT> jit_;
+
+  /**
+   * Number of created dylibs (used for unique names).
+   */
+  size_t dylibsCount_ = 0;
+
+  /**
+   * Dylibs of the added modules.
+   */
+  std::vector<llvm::orc::JITDylib*> dylibs_;
+};
+
+#endif
@@ -14,19 +14,47 @@
 #ifndef EvaLLVM_h
 #define EvaLLVM_h
 
+#include <algorithm>
+#include <functional>
 #include <iostream>
 #include <map>
-#include <regex>
+#include <mutex>
+#include <set>
 #include <string>
 
+#include "llvm/Analysis/ModuleSummaryAnalysis.h"
+#include "llvm/Analysis/ProfileSummaryInfo.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/DIBuilder.h"
+#include "llvm/IR/InstIterator.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
+#include "llvm/IR/ValueMap.h"
 #include "llvm/IR/Verifier.h"
-
+#include "llvm/Linker/Linker.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/PGOOptions.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+
+#include "./CompileStats.h"
+#include "./ConstantFolder.h"
 #include "./Environment.h"
 #include "./Logger.h"
+#include "./ModuleInterface.h"
 #include "./parser/EvaParser.h"
+#include "./runtime/EvaRuntime.h"
 
 using syntax::EvaParser;
 
@@ -37,14 +65,94 @@ using Env = std::shared_ptr<Environment>;
 
 /**
  * Class info. Contains struct type and field names.
+ *
+ * Fields and vtable slots are in the declaration order, inherited
+ * ones first: an instance of a subclass is used as the parent.
  */
 struct ClassInfo {
   llvm::StructType* cls;
   llvm::StructType* parent;
   std::map<std::string, llvm::Type*> fieldsMap;
   std::map<std::string, llvm::Function*> methodsMap;
+  std::vector<std::string> fieldNames;
+  std::vector<std::string> methodNames;
+};
+
+/**
+ * Interface info: the value type (instance + itable), the itable
+ * type, and the method names in the itable order (the selectors).
+ */
+struct InterfaceInfo {
+  llvm::StructType* type;
+  llvm::StructType* iTable;
+  std::vector<std::string> methods;
+};
+
+/**
+ * Untyped function, compiled per distinct call-site signature.
+ */
+struct GenericFunction {
+  Exp fnExp;
+  Env env;
+};
+
+/**
+ * Range of a counted loop induction variable, used to prove
+ * array accesses in-bounds:
+ *
+ * (for (i 0 (alen a)) ...) -> i in [0, length of `a`)
+ * (for (i 0 100) ...) -> i in [0, 100)
+ */
+struct LoopRange {
+  llvm::Value* index;
+  llvm::Value* arrayVar;
+  uint64_t end;
+};
+
+/**
+ * Piece of a printf format: literal text, or a conversion spec ("%5d").
+ */
+struct PrintfChunk {
+  bool isSpec;
+  std::string text;
+};
+
+/**
+ * Async function being compiled: coroutine id and handle, and the blocks
+ * suspensions branch to (destroy the frame, return to the caller).
+ */
+struct Coroutine {
+  llvm::Value* id = nullptr;
+  llvm::Value* handle = nullptr;
+  llvm::BasicBlock* cleanupBlock = nullptr;
+  llvm::BasicBlock* suspendBlock = nullptr;
+};
+
+/**
+ * Alignment of the coroutine promise (llvm.coro.promise).
+ */
+#define PROMISE_ALIGN 8
+
+/**
+ * Function annotations by def (the id is on the name of the def):
+ * ^inline, ^noinline, ^pure, ^comptime.
+ */
+using Annotations = std::map<int, std::set<std::string>>;
+
+/**
+ * Memory effects of a function, from the attribute inference.
+ */
+enum class MemoryEffect {
+  NONE,
+  READ,
+  WRITE,
 };
 
+/**
+ * Local variable types used by the type inference.
+ */
+using TypeEnv = std::map<std::string, llvm::Type*>;
+
 /**
  * Index of the vTable in the class fields.
  */
@@ -57,6 +165,37 @@ static const size_t VTABLE_INDEX = 0;
  */
 static const size_t RESERVED_FIELDS_COUNT = 1;
 
+/**
+ * Interface value: { i8* instance, %<Interface>_iTable* iTable }
+ */
+static const size_t INTERFACE_INSTANCE_INDEX = 0;
+static const size_t INTERFACE_ITABLE_INDEX = 1;
+
+/**
+ * Array layout: { i64 length, i64 reserved, [0 x T] data }
+ *
+ * The reserved header word keeps the data 16-byte aligned.
+ */
+static const size_t ARRAY_LENGTH_INDEX = 0;
+static const size_t ARRAY_DATA_INDEX = 2;
+static const size_t ARRAY_ALIGNMENT = 16;
+
+/**
+ * Branch weight of the passing runtime check (vs. 1 for failing).
+ */
+static const uint32_t BOUNDS_CHECK_WEIGHT = 1 << 20;
+
+/**
+ * Priority of the allocation sites registration (before the module
+ * init functions, which have the default 65535).
+ */
+static const int ALLOC_SITES_CTOR_PRIORITY = 101;
+
+/**
+ * Max lanes of a vector type.
+ */
+static const int64_t MAX_VECTOR_LANES = 1024;
+
 // Generic binary operator:
 #define GEN_BINARY_OP(Op, varName)         \
   do {                                     \
@@ -65,6 +204,56 @@ static const size_t RESERVED_FIELDS_COUNT = 1;
     return builder->Op(op1, op2, varName); \
   } while (false)
 
+// Numeric binary operator: operands are promoted to the common
+// type (i32 -> i64 -> f32 -> f64, scalars are splatted to vectors),
+// and the floating point version is used for f32/f64 (and vectors):
+#define GEN_NUMERIC_OP(IntOp, FloatOp, varName)        \
+  do {                                                 \
+    auto op1 = gen(exp.list[1], env);                  \
+    auto op2 = gen(exp.list[2], env);                  \
+    promoteOperands(op1, op2);                         \
+    if (op1->getType()->isFPOrFPVectorTy()) {          \
+      return builder->FloatOp(op1, op2, varName);      \
+    }                                                  \
+    return builder->IntOp(op1, op2, varName);          \
+  } while (false)
+
+// Ordered compare: as the numeric operator, integers are signed,
+// and booleans are compared unsigned (false < true):
+#define GEN_COMPARE_OP(SignedOp, UnsignedOp, FloatOp, varName) \
+  do {                                                          \
+    auto op1 = gen(exp.list[1], env);                           \
+    auto op2 = gen(exp.list[2], env);                           \
+    promoteOperands(op1, op2);                                  \
+    if (op1->getType()->isFPOrFPVectorTy()) {                   \
+      return builder->FloatOp(op1, op2, varName);               \
+    }                                                           \
+    if (op1->getType()->getScalarType()->isIntegerTy(1)) {      \
+      return builder->UnsignedOp(op1, op2, varName);            \
+    }                                                           \
+    return builder->SignedOp(op1, op2, varName);                \
+  } while (false)
+
+/**
+ * Sets the debug location of an expression for the generated
+ * instructions, and restores the outer location on exit.
+ */
+class DebugLocScope {
+ public:
+  DebugLocScope(llvm::IRBuilder<>& builder, llvm::DebugLoc loc)
+      : builder_(builder), outerLoc_(builder.getCurrentDebugLocation()) {
+    if (loc) {
+      builder_.SetCurrentDebugLocation(loc);
+    }
+  }
+
+  ~DebugLocScope() { builder_.SetCurrentDebugLocation(outerLoc_); }
+
+ private:
+  llvm::IRBuilder<>& builder_;
+  llvm::DebugLoc outerLoc_;
+};
+
 class EvaLLVM {
  public:
   EvaLLVM() : parser(std::make_unique<EvaParser>()) {
@@ -78,625 +267,6909 @@ class EvaLLVM {
    * Executes a program.
    */
   void exec(const std::string& program) {
-    // 1. Parse the program
-    auto ast = parser->parse("(begin " + program + ")");
+    buildModule(program);
 
-    // 2. Compile to LLVM IR:
-    compile(ast);
+    startPhase("emit");
 
     // Print generated code.
     module->print(llvm::outs(), nullptr);
 
     std::cout << "\n";
 
-    // 3. Save module IR to file:
+    // 4. Save module IR to file:
     saveModuleToFile("./out.ll");
+
+    endPhase();
   }
 
- private:
   /**
-   * Compiles an expression.
+   * Compiles a program to a native object file.
+   *
+   * Used by the batch compilation (-j): each thread has its own
+   * EvaLLVM instance (and LLVM context), nothing else is shared.
    */
-  void compile(const Exp& ast) {
-    // 1. Create main function:
-    fn = createFunction(
-        "main",
-        llvm::FunctionType::get(/* return type */ builder->getInt32Ty(),
-                                /* vararg */ false),
-        GlobalEnv);
+  void compileToObject(const std::string& program,
+                       const std::string& objectFile) {
+    buildModule(program);
 
-    createGlobalVar("VERSION", builder->getInt32(42));
-
-    // 2. Compile main body:
-    gen(ast, GlobalEnv);
-
-    builder->CreateRet(builder->getInt32(0));
+    startPhase("emit");
+    emitObjectFile(objectFile);
+    endPhase();
   }
 
   /**
-   * Main compile loop.
+   * Compiles a program to LLVM IR, or to a native object, in memory.
+   * Used by the compile server.
    */
-  llvm::Value* gen(const Exp& exp, Env env) {
-    switch (exp.type) {
-      /**
-       * ----------------------------------------------
-       * Numbers.
-       */
-      case ExpType::NUMBER:
-        // Implement here...
+  std::string compileToIR(const std::string& program) {
+    buildModule(program);
 
-      /**
-       * ----------------------------------------------
-       * Strings.
-       */
-      case ExpType::STRING: {
-        // Implement here...
-      }
+    std::string ir{};
+    llvm::raw_string_ostream out(ir);
+    module->print(out, nullptr);
+    out.flush();
 
-      /**
-       * ----------------------------------------------
-       * Symbols (variables, operators).
-       */
-      case ExpType::SYMBOL:
-        /**
-         * Boolean.
-         */
-        if (exp.string == "true" || exp.string == "false") {
-          // Implement here...
-        } else {
-          // Variables and functions:
+    return ir;
+  }
 
-          // Implement here...
-        }
+  std::string compileToObjectCode(const std::string& program) {
+    buildModule(program);
 
-      /**
-       * ----------------------------------------------
-       * Lists.
-       */
-      case ExpType::LIST:
-        auto tag = exp.list[0];
+    llvm::SmallVector<char, 0> buffer;
+    llvm::raw_svector_ostream out(buffer);
+    emitObject(out);
 
-        /**
-         * ----------------------------------------------
-         * Special cases.
-         */
-        if (tag.type == ExpType::SYMBOL) {
-          auto op = tag.string;
+    return std::string(buffer.data(), buffer.size());
+  }
 
-          // --------------------------------------------
-          // Binary math operations:
+  /**
+   * Compiles a module of a separately compiled program: ThinLTO
+   * bitcode (with the summary, to import functions across modules
+   * at the link), and the interface for the importers.
+   */
+  void compileModule(const std::string& program,
+                     const std::string& bitcodeFile,
+                     const std::string& interfaceFile) {
+    separateCompilation_ = true;
 
-          if (op == "+") {
-            // Implement here...
-          }
+    buildModule(program);
 
-          else if (op == "-") {
-            // Implement here...
-          }
+    startPhase("emit");
+    ModuleInterface::write(interfaceFile, exports_);
+    emitBitcodeFile(bitcodeFile);
+    endPhase();
+  }
 
-          else if (op == "*") {
-            // Implement here...
-          }
+  /**
+   * Initializes the native target (once per process, the target
+   * registry is shared by all threads).
+   */
+  static void initializeNativeTarget() {
+    static std::once_flag initialized;
 
-          else if (op == "/") {
-            // Implement here...
-          }
+    std::call_once(initialized, []() {
+      llvm::InitializeNativeTarget();
+      llvm::InitializeNativeTargetAsmPrinter();
+    });
+  }
 
-          // --------------------------------------------
-          // Compare operations: (> 5 10)
+  /**
+   * Collects phase timing and counters of the compilation.
+   */
+  void setStats(CompileStats* stats) { stats_ = stats; }
 
-          // UGT - unsigned, greater than
-          else if (op == ">") {
-            // Implement here...
-          }
+  /**
+   * Compiles a whole program (with `main`) without printing
+   * or saving the module. Used by the JIT execution.
+   */
+  void compileProgram(const std::string& program) {
+    compile(parser->parse("(begin " + program + ")"));
+    optimize();
+  }
 
-          // ULT - unsigned, less than
-          else if (op == "<") {
-            // Implement here...
-          }
+  /**
+   * Compiles only the given function definitions (no `main`).
+   *
+   * Used by the tiered execution: hot functions of the interpreter
+   * are compiled together with the functions they call.
+   */
+  void compileDefs(const std::vector<Exp>& defs) {
+    // Functions are compiled from within an init function,
+    // which plays the role of `main` for the builder state:
+    fn = createFunction(
+        "__eva_defs_init",
+        llvm::FunctionType::get(builder->getVoidTy(), /* vararg */ false),
+        GlobalEnv);
 
-          // EQ - equal
-          else if (op == "==") {
-            // Implement here...
-          }
+    // Prototypes first, so the defs can call each other
+    // regardless of the order:
+    for (auto& def : defs) {
+      auto fnName = def.list[1].string;
+      createFunctionProto(fnName, extractFunctionType(def), GlobalEnv);
+      collectAssignedVars(def);
+    }
 
-          // NE - not equal
-          else if (op == "!=") {
-            // Implement here...
-          }
+    for (auto& def : defs) {
+      compileFunction(eliminateTailRecursion(def),
+                      /* name */ def.list[1].string, GlobalEnv);
+    }
 
-          // UGE - greater or equal
-          else if (op == ">=") {
-            // Implement here...
-          }
+    builder->CreateRetVoid();
 
-          // ULE - less or equal
-          else if (op == "<=") {
-            // Implement here...
-          }
+    markTailCalls();
+    inferFunctionAttributes();
+    optimize();
+  }
 
-          // --------------------------------------------
-          // Branch instruction:
+  /**
+   * Enables fast-math: floating point operations may be reassociated
+   * (e.g. to vectorize reductions), assuming no NaNs and infinities.
+   */
+  void setFastMath(bool enabled) {
+    fastMath_ = enabled;
 
-          /**
-           * (if <cond> <then> <else>)
-           */
-          else if (op == "if") {
-            // Compile <cond>:
-            auto cond = gen(exp.list[1], env);
+    llvm::FastMathFlags fmf;
+    if (enabled) {
+      fmf.setFast();
+    }
 
-            // Implement here...
-          }
+    builder->setFastMathFlags(fmf);
+  }
 
-          // --------------------------------------------
-          // While loop:
+  /**
+   * Compiles for the host CPU: functions get the host CPU name and
+   * features (e.g. AVX2), so vectors lower to the widest native SIMD.
+   */
+  void setNativeTarget(bool enabled) {
+    if (!enabled) {
+      hostCPUFeatures_.clear();
+      hostCPU_.clear();
+      return;
+    }
 
-          /**
-           * (while <cond> <body>)
-           *
-           */
-          else if (op == "while") {
-            // Implement here...
-          }
+    hostCPU_ = llvm::sys::getHostCPUName().str();
 
-          // --------------------------------------------
-          // Function declaration: (def <name> <params> <body>)
-          //
+    llvm::StringMap<bool> features;
+    llvm::sys::getHostCPUFeatures(features);
 
-          else if (op == "def") {
-            return compileFunction(exp, /* name */ exp.list[1].string, env);
-          }
+    for (auto& feature : features) {
+      hostCPUFeatures_ += (hostCPUFeatures_.empty() ? "" : ",");
+      hostCPUFeatures_ += (feature.getValue() ? "+" : "-");
+      hostCPUFeatures_ += feature.getKey().str();
+    }
+  }
 
-          // --------------------------------------------
-          // Variable declaration: (var x (+ y 10))
-          //
-          // Typed: (var (x number) 42)
-          //
-          // Note: locals are allocated on the stack.
+  /**
+   * Optimization level of the emitted module (0 - not optimized,
+   * the IR is optimized later with `opt`).
+   */
+  void setOptLevel(unsigned level) { optLevel_ = level; }
 
-          if (op == "var") {
-            // Implement here...
-          }
+  /**
+   * Instruments the module with profile counters (function entries,
+   * branches, loop back-edges). The compiled program writes the raw
+   * profile at exit (default.profraw, or $LLVM_PROFILE_FILE).
+   *
+   * The profile is used at the same optimization level (-O1 and up).
+   */
+  void setProfileGenerate(bool enabled) { profileGenerate_ = enabled; }
 
-          // --------------------------------------------
-          // Variable update: (set x 100)
-          // Property update (set (prop self x) 100)
+  /**
+   * Indexed profile (llvm-profdata merge) to annotate the module with
+   * branch weights and function entry counts before optimization.
+   */
+  void setProfileUse(const std::string& profileFile) {
+    profileUse_ = profileFile;
+  }
 
-          else if (op == "set") {
-            // Implement here...
-          }
+  /**
+   * Inserts profiler hooks on entry and exit of every function
+   * (see runtime/EvaProfiler.cpp).
+   */
+  void setInstrumentFunctions(bool enabled) { instrumentFunctions_ = enabled; }
 
-          // --------------------------------------------
-          // Blocks: (begin <expressions>)
+  /**
+   * Counts allocated instances per class and allocation site
+   * (see runtime/EvaAllocProfiler.cpp).
+   */
+  void setAllocProfile(bool enabled) { allocProfile_ = enabled; }
 
-          else if (op == "begin") {
-            // Block scope:
-            auto blockEnv = std::make_shared<Environment>(
-                std::map<std::string, llvm::Value*>{}, env);
+  /**
+   * Emits DWARF debug info: subprograms for functions and methods,
+   * local variables, and source locations of instructions.
+   */
+  void setDebugInfo(bool enabled, const std::string& sourceFile) {
+    debugInfo_ = enabled;
+    sourceFile_ = sourceFile;
+  }
 
-            // Compile each expression within the block.
-            // Result is the last evaluated expression.
-            llvm::Value* blockRes;
+  /**
+   * Compiles an imported module (not the main one): the top-level
+   * code is in the init function <name>.init, which runs before main.
+   */
+  void setModuleName(const std::string& name) { moduleName_ = name; }
 
-            for (auto i = 1; i < exp.list.size(); i++) {
-              // Generate expression code.
-              blockRes = gen(exp.list[i], blockEnv);
-            }
+  /**
+   * Runtime prelude: the runtime compiled to bitcode (see
+   * compile-run.sh). The runtime functions which the module calls
+   * are linked from it, so the optimizer can inline them.
+   */
+  void setPrelude(const std::string& preludeFile) {
+    preludeFile_ = preludeFile;
+  }
 
-            return blockRes;
-          }
+  /**
+   * Options which the emitted code depends on (the modification time
+   * of the profile and prelude files included): the incremental build
+   * recompiles the modules built with other options.
+   */
+  std::string getOptions() {
+    auto modified = [](const std::string& fileName) -> long long {
+      llvm::sys::fs::file_status status;
 
-          // --------------------------------------------
-          // printf extern function:
-          //
-          // (printf "Value: %d" 42)
-          //
+      if (fileName.empty() || llvm::sys::fs::status(fileName, status)) {
+        return 0;
+      }
 
-          else if (op == "printf") {
-            // Implement here...
-          }
+      return status.getLastModificationTime().time_since_epoch().count();
+    };
+
+    std::string options{};
+
+    options += "-O" + std::to_string(optLevel_) + "\n";
+    options += "-g " + std::to_string(debugInfo_) + "\n";
+    options += "--fast-math " + std::to_string(fastMath_) + "\n";
+    options += "--native " + hostCPU_ + " " + hostCPUFeatures_ + "\n";
+    options += "--profile-generate " + std::to_string(profileGenerate_) + "\n";
+    options += "--profile-use " + profileUse_ + " " +
+               std::to_string(modified(profileUse_)) + "\n";
+    options += "--prelude " + preludeFile_ + " " +
+               std::to_string(modified(preludeFile_)) + "\n";
+    options += "--instrument-functions " +
+               std::to_string(instrumentFunctions_) + "\n";
+    options += "--alloc-profile " + std::to_string(allocProfile_) + "\n";
+
+    return options;
+  }
 
-          // --------------------------------------------
-          // Class declaration:
-          //
-          // (class A <super> <body>)
-          //
+  /**
+   * Directory of the interface files of imports (searched first).
+   */
+  void addImportPath(const std::string& dir) {
+    importPaths_.insert(importPaths_.begin(), dir);
+  }
 
-          else if (op == "class") {
-            // Implement here...
+  /**
+   * Removes function annotations from defs, collecting them by def:
+   * the name of an annotated def gets the id of its annotations (so
+   * same-named defs in different scopes don't share them).
+   *
+   * (def ^inline ^pure square (x) (* x x))
+   *
+   * Annotations: ^inline, ^noinline, ^pure, ^comptime.
+   */
+  static Exp stripAnnotations(const Exp& exp, Annotations& annotations) {
+    if (exp.type != ExpType::LIST || exp.list.empty()) {
+      return exp;
+    }
+
+    auto result = exp;
+    auto& tag = exp.list[0];
+
+    if (tag.type == ExpType::SYMBOL && tag.string == "def") {
+      std::set<std::string> fnAnnotations{};
+
+      while (result.list.size() > 1 &&
+             result.list[1].type == ExpType::SYMBOL &&
+             result.list[1].string[0] == '^') {
+        fnAnnotations.insert(result.list[1].string.substr(1));
+        result.list.erase(result.list.begin() + 1);
+      }
+
+      for (auto& annotation : fnAnnotations) {
+        if (annotation != "inline" && annotation != "noinline" &&
+            annotation != "pure" && annotation != "comptime") {
+          DIE << "Unknown annotation ^" << annotation << "\n";
+        }
+      }
+
+      if (!fnAnnotations.empty() && result.list.size() > 1) {
+        auto id = (int)annotations.size() + 1;
+        result.list[1].annotationsId = id;
+        annotations[id] = fnAnnotations;
+      }
+    }
+
+    for (auto& e : result.list) {
+      e = stripAnnotations(e, annotations);
+    }
+
+    return result;
+  }
+
+  /**
+   * Unescapes a string literal: `\n`, `\t`, `\r` and `\\` (other
+   * backslashes are kept as is).
+   */
+  static std::string unescape(const std::string& str) {
+    std::string result;
+    result.reserve(str.size());
+
+    for (auto i = 0; i < str.size(); i++) {
+      if (str[i] != '\\' || i + 1 == str.size()) {
+        result.push_back(str[i]);
+        continue;
+      }
+
+      switch (str[i + 1]) {
+        case 'n':
+          result.push_back('\n');
+          break;
+        case 't':
+          result.push_back('\t');
+          break;
+        case 'r':
+          result.push_back('\r');
+          break;
+        case '\\':
+          result.push_back('\\');
+          break;
+        default:
+          result.push_back(str[i]);
+          continue;
+      }
+
+      i++;
+    }
+
+    return result;
+  }
+
+  /**
+   * Transfers ownership of the context and the module (e.g. to the JIT).
+   * The compiler instance cannot be used after this call.
+   */
+  std::pair<std::unique_ptr<llvm::LLVMContext>, std::unique_ptr<llvm::Module>>
+  takeModule() {
+    builder.reset();
+    varsBuilder.reset();
+    return {std::move(ctx), std::move(module)};
+  }
+
+ private:
+  /**
+   * Builds the module of a program: parse, gen, verify, optimize.
+   */
+  void buildModule(const std::string& program) {
+    auto source = "(begin " + program + ")";
+
+    // 1. Parse the program
+    startPhase("parse");
+    auto ast = parser->parse(source);
+    endPhase();
+
+    // The parser doesn't keep the locations, they are from the tokens:
+    if (debugInfo_) {
+      startPhase("locations");
+      syntax::Tokenizer tokenizer;
+      tokenizer.initString(source);
+      attachLocations(ast, tokenizer, /* "(begin " */ 7);
+      endPhase();
+    }
+
+    // 2. Compile to LLVM IR:
+    startPhase("gen");
+    compile(ast);
+    endPhase();
+
+    startPhase("verify");
+    std::string errors;
+    llvm::raw_string_ostream errorsStream(errors);
+    auto broken = llvm::verifyModule(*module, &errorsStream);
+    endPhase();
+
+    if (broken) {
+      DIE << "Invalid module generated:\n" << errorsStream.str() << "\n";
+    }
+
+    if (stats_ != nullptr) {
+      countModule(ast);
+    }
+
+    // 3. Optimize, apply or instrument for the profile:
+    startPhase("optimize");
+    optimize();
+    endPhase();
+  }
+
+  /**
+   * Compiles an expression.
+   */
+  void compile(const Exp& ast) {
+    auto program = stripAnnotations(ast, fnAnnotations_);
+
+    if (debugInfo_) {
+      createCompileUnit(program);
+    }
+
+    if (separateCompilation_) {
+      exports_ = ModuleInterface::extract(program);
+    }
+
+    program = declareInterfaces(program);
+
+    // 1. Create main function (or the init function of a module):
+    auto isMain = moduleName_.empty();
+
+    auto initFn = createFunction(
+        isMain ? "main" : moduleName_ + ".init",
+        llvm::FunctionType::get(
+            /* return type */ isMain ? builder->getInt32Ty()
+                                     : builder->getVoidTy(),
+            /* vararg */ false),
+        GlobalEnv);
+
+    fn = initFn;
+
+    if (isMain) {
+      GlobalEnv->define("VERSION",
+                        createGlobalVar("VERSION", builder->getInt32(42)));
+    }
+
+    // 2. Compile main body (folded), the top-level expressions
+    // are in the global scope:
+    auto body = ConstantFolder(fnAnnotations_).fold(program);
+    collectAssignedVars(body);
+
+    for (auto i = 1; i < body.list.size(); i++) {
+      gen(body.list[i], GlobalEnv);
+    }
+
+    if (isMain) {
+      builder->CreateRet(builder->getInt32(0));
+    } else {
+      builder->CreateRetVoid();
+      initFn->setLinkage(llvm::GlobalValue::InternalLinkage);
+      llvm::appendToGlobalCtors(*module, initFn, /* priority */ 65535);
+    }
+
+    // Itables of the classes implementing interfaces:
+    if (!classInterfaces_.empty()) {
+      buildInterfaceTables();
+    }
+
+    if (separateCompilation_) {
+      shareVTables();
+    }
+
+    // 3. Guaranteed tail calls:
+    markTailCalls();
+
+    // 4. Function attributes:
+    inferFunctionAttributes();
+
+    // 5. Profiler hooks:
+    if (instrumentFunctions_) {
+      instrumentFunctions();
+    }
+
+    if (allocProfile_) {
+      registerAllocationSites();
+    }
+
+    // 6. Debug info:
+    if (debugInfo_) {
+      finalizeDebugInfo();
+    }
+  }
+
+  /**
+   * Main compile loop.
+   */
+  llvm::Value* gen(const Exp& exp, Env env) {
+    DebugLocScope locScope(*builder, getDebugLoc(exp));
+
+    switch (exp.type) {
+      /**
+       * ----------------------------------------------
+       * Numbers.
+       */
+      case ExpType::NUMBER:
+        // Out of the i32 range literals are i64:
+        if (exp.number > INT32_MAX || exp.number < INT32_MIN) {
+          return builder->getInt64(exp.number);
+        }
+
+        return builder->getInt32(exp.number);
+
+      /**
+       * ----------------------------------------------
+       * Floating point numbers: f64 (double).
+       */
+      case ExpType::FLOAT:
+        return llvm::ConstantFP::get(builder->getDoubleTy(), exp.floatNumber);
+
+      /**
+       * ----------------------------------------------
+       * Strings.
+       */
+      case ExpType::STRING: {
+        return getStringLiteral(unescape(exp.string));
+      }
+
+      /**
+       * ----------------------------------------------
+       * Symbols (variables, operators).
+       */
+      case ExpType::SYMBOL:
+        /**
+         * Boolean.
+         */
+        if (exp.string == "true" || exp.string == "false") {
+          return builder->getInt1(exp.string == "true");
+        } else {
+          // Variables and functions:
+
+          // Untyped function as a value is its number specialization:
+          if (genericFns_.count(exp.string) != 0) {
+            auto& params = genericFns_.at(exp.string).fnExp.list[2].list;
+            return getSpecialization(
+                exp.string,
+                std::vector<llvm::Type*>(params.size(), builder->getInt32Ty()));
+          }
+
+          auto value = env->lookup(exp.string);
+
+          // Local variables:
+          if (auto localVar = llvm::dyn_cast<llvm::AllocaInst>(value)) {
+            return builder->CreateLoad(localVar->getAllocatedType(), localVar,
+                                       exp.string.c_str());
+          }
+
+          // Global variables:
+          if (auto globalVar = llvm::dyn_cast<llvm::GlobalVariable>(value)) {
+            return builder->CreateLoad(globalVar->getValueType(), globalVar,
+                                       exp.string.c_str());
           }
 
+          // Functions, loop variables:
+          return value;
+        }
+
+      /**
+       * ----------------------------------------------
+       * Lists.
+       */
+      case ExpType::LIST:
+        auto tag = exp.list[0];
+
+        /**
+         * ----------------------------------------------
+         * Special cases.
+         */
+        if (tag.type == ExpType::SYMBOL) {
+          auto op = tag.string;
+
           // --------------------------------------------
-          // New operator:
-          //
-          // (new <class> <args>)
-          //
+          // Binary math operations:
 
-          else if (op == "new") {
-            return createInstance(exp, env, "");
+          if (op == "+") {
+            GEN_NUMERIC_OP(CreateAdd, CreateFAdd, "tmpadd");
+          }
+
+          else if (op == "-") {
+            GEN_NUMERIC_OP(CreateSub, CreateFSub, "tmpsub");
+          }
+
+          else if (op == "*") {
+            GEN_NUMERIC_OP(CreateMul, CreateFMul, "tmpmul");
+          }
+
+          else if (op == "/") {
+            GEN_NUMERIC_OP(CreateSDiv, CreateFDiv, "tmpdiv");
           }
 
           // --------------------------------------------
-          // Prop access:
-          //
-          // (prop <instance> <name>)
+          // Compare operations: (> 5 10)
           //
+          // Integers are compared signed, floating
+          // point numbers with ordered compares (OGT, etc).
 
-          else if (op == "prop") {
-            // Implement here...
+          // SGT - signed, greater than
+          else if (op == ">") {
+            GEN_COMPARE_OP(CreateICmpSGT, CreateICmpUGT, CreateFCmpOGT,
+                           "tmpcmp");
+          }
+
+          // SLT - signed, less than
+          else if (op == "<") {
+            GEN_COMPARE_OP(CreateICmpSLT, CreateICmpULT, CreateFCmpOLT,
+                           "tmpcmp");
+          }
+
+          // EQ - equal
+          else if (op == "==") {
+            GEN_NUMERIC_OP(CreateICmpEQ, CreateFCmpOEQ, "tmpcmp");
+          }
+
+          // NE - not equal
+          else if (op == "!=") {
+            GEN_NUMERIC_OP(CreateICmpNE, CreateFCmpONE, "tmpcmp");
+          }
+
+          // SGE - signed, greater or equal
+          else if (op == ">=") {
+            GEN_COMPARE_OP(CreateICmpSGE, CreateICmpUGE, CreateFCmpOGE,
+                           "tmpcmp");
+          }
+
+          // SLE - signed, less or equal
+          else if (op == "<=") {
+            GEN_COMPARE_OP(CreateICmpSLE, CreateICmpULE, CreateFCmpOLE,
+                           "tmpcmp");
           }
 
           // --------------------------------------------
-          // Method access:
-          //
-          // (method <instance> <name>)
+          // Branch instruction:
+
+          /**
+           * (if <cond> <then> <else>)
+           */
+          else if (op == "if") {
+            // Compile <cond>:
+            auto cond = toBoolean(gen(exp.list[1], env));
+
+            auto thenBlock = createBB("then", fn);
+
+            // Else, if-end blocks are appended after the <then> code:
+            auto elseBlock = createBB("else");
+            auto ifEndBlock = createBB("ifend");
+
+            builder->CreateCondBr(cond, thenBlock, elseBlock);
+
+            // Then branch (nested ifs change the current block):
+            builder->SetInsertPoint(thenBlock);
+            auto thenRes = gen(exp.list[2], env);
+            thenBlock = builder->GetInsertBlock();
+
+            // Else branch, 0 of the <then> type if omitted:
+            fn->getBasicBlockList().push_back(elseBlock);
+            builder->SetInsertPoint(elseBlock);
+            auto elseRes =
+                exp.list.size() > 3
+                    ? gen(exp.list[3], env)
+                    : llvm::Constant::getNullValue(thenRes->getType());
+            elseBlock = builder->GetInsertBlock();
+
+            // Numeric branches are converted to the common type:
+            auto resultType = thenRes->getType();
+
+            if (isNumericType(resultType) &&
+                isNumericType(elseRes->getType())) {
+              resultType =
+                  getCommonNumericType(resultType, elseRes->getType());
+            }
+
+            builder->SetInsertPoint(thenBlock);
+            thenRes = castValue(thenRes, resultType);
+            builder->CreateBr(ifEndBlock);
+
+            builder->SetInsertPoint(elseBlock);
+            elseRes = castValue(elseRes, resultType);
+            builder->CreateBr(ifEndBlock);
+
+            // If-end block:
+            fn->getBasicBlockList().push_back(ifEndBlock);
+            builder->SetInsertPoint(ifEndBlock);
+
+            // Result of the if expression is phi:
+            auto phi = builder->CreatePHI(resultType, 2, "tmpif");
+
+            phi->addIncoming(thenRes, thenBlock);
+            phi->addIncoming(elseRes, elseBlock);
+
+            return phi;
+          }
+
+          // --------------------------------------------
+          // While loop:
+
+          /**
+           * (while <cond> <body>)
+           *
+           */
+          else if (op == "while") {
+            // Condition:
+            auto condBlock = createBB("cond", fn);
+            builder->CreateBr(condBlock);
+
+            // Body, while-end blocks:
+            auto bodyBlock = createBB("body");
+            auto loopEndBlock = createBB("loopend");
+
+            // Compile <cond>:
+            builder->SetInsertPoint(condBlock);
+            auto cond = toBoolean(gen(exp.list[1], env));
+
+            builder->CreateCondBr(cond, bodyBlock, loopEndBlock);
+
+            // Body:
+            fn->getBasicBlockList().push_back(bodyBlock);
+            builder->SetInsertPoint(bodyBlock);
+            gen(exp.list[2], env);
+            builder->CreateBr(condBlock);
+
+            fn->getBasicBlockList().push_back(loopEndBlock);
+            builder->SetInsertPoint(loopEndBlock);
+
+            return builder->getInt32(0);
+          }
+
+          // --------------------------------------------
+          // Counted loop:
+
+          /**
+           * (for (<var> <start> [< | <= | > | >=] <end> [<step>])
+           *   [(unroll <n | full | disable>)]
+           *   [(vectorize <width | disable>)]
+           *   [(interleave <n>)]
+           *   <body>)
+           *
+           * (for (i 0 n) body) - i from 0 to n - 1
+           * (for (i 1 <= n 2) body) - i = 1, 3, ..., up to n
+           * (for (i n > 0) body) - i from n down to 1 (step -1)
+           */
+          else if (op == "for") {
+            return compileForLoop(exp, env);
+          }
+
+          // --------------------------------------------
+          // Module import: (import "geometry")
           //
-          // (method (super <class>) <name>)
+          // Declares the exports of the separately compiled module,
+          // from its interface file (geometry.evi).
+
+          else if (op == "import") {
+            return compileImport(exp.list[1].string);
+          }
+
+          // --------------------------------------------
+          // Function declaration: (def <name> <params> <body>)
           //
 
-          else if (op == "method") {
-            // Implement here...
+          else if (op == "def") {
+            // Untyped functions are compiled per call-site types:
+            if (isGeneric(exp)) {
+              genericFns_.erase(exp.list[1].string);
+              genericFns_.emplace(exp.list[1].string,
+                                  GenericFunction{exp, env});
+              return builder->getInt32(0);
+            }
+
+            return compileFunction(cls == nullptr ? eliminateTailRecursion(exp)
+                                                  : exp,
+                                   /* name */ exp.list[1].string, env);
           }
 
           // --------------------------------------------
-          // Function calls:
+          // Async function: (async def <name> <params> [-> <type>] <body>)
           //
-          // (square 2)
+          // Compiled to a coroutine: the call runs the function up to
+          // the first suspension, and returns the task: (task <type>).
 
-          else {
-            auto callable = gen(exp.list[0], env);
+          else if (op == "async") {
+            return compileAsyncFunction(exp.list[1], env);
+          }
 
-            // Implement here...
+          // Coroutine of an async function (internal form).
+          else if (op == "async-body") {
+            return compileAsyncBody(exp.list[1], env);
           }
-        }
 
-        // --------------------------------------------
-        // Method calls:
-        //
-        // ((method p getX) p 2)
+          // --------------------------------------------
+          // Variable declaration: (var x (+ y 10))
+          //
+          // Typed: (var (x number) 42)
+          //
+          // Note: locals are allocated on the stack. Numeric init
+          // values are converted to the declared type (castNumeric).
+
+          if (op == "var") {
+            auto varNameDecl = exp.list[1];
+            auto varName = extractVarName(varNameDecl);
+
+            auto init = gen(exp.list[2], env);
+
+            // Untyped variables have the type of the init value:
+            auto varTy = varNameDecl.type == ExpType::LIST
+                             ? extractVarType(varNameDecl)
+                             : init->getType();
+
+            init = castValue(init, varTy);
+
+            // Top-level variables are globals (used by the functions),
+            // constant init values are the initializers:
+            if (env == GlobalEnv) {
+              auto constInit = llvm::dyn_cast<llvm::Constant>(init);
+              auto globalVar = createGlobalVar(
+                  varName, constInit != nullptr
+                               ? constInit
+                               : llvm::Constant::getNullValue(varTy));
+
+              env->define(varName, globalVar);
+
+              if (constInit == nullptr) {
+                builder->CreateStore(init, globalVar);
+              }
+
+              addStaticArrayVar(varName, globalVar, init);
+
+              if (separateCompilation_) {
+                exportGlobalVar(varName, varTy);
+              }
+
+              return init;
+            }
+
+            auto varBinding = allocVar(varName, varTy, env);
+            builder->CreateStore(init, varBinding);
+
+            addStaticArrayVar(varName, varBinding, init);
+
+            return init;
+          }
+
+          // --------------------------------------------
+          // Variable update: (set x 100)
+          // Property update (set (prop self x) 100)
+
+          else if (op == "set") {
+            auto value = gen(exp.list[2], env);
+
+            // Properties:
+            if (isProp(exp.list[1])) {
+              auto instance = gen(exp.list[1].list[1], env);
+              auto fieldName = exp.list[1].list[2].string;
+              auto instanceCls = getInstanceClass(instance);
+
+              auto fieldIdx = getFieldIndex(instanceCls, fieldName);
+              auto address = builder->CreateStructGEP(
+                  instanceCls, instance, fieldIdx, "p" + fieldName);
+
+              builder->CreateStore(
+                  castValue(value, instanceCls->getElementType(fieldIdx)),
+                  address);
+
+              return value;
+            }
+
+            // Variables:
+            auto varName = exp.list[1].string;
+            auto varBinding = env->lookup(varName);
+
+            checkAssignable(varName, varBinding);
+
+            llvm::Type* varTy = nullptr;
+
+            if (auto localVar = llvm::dyn_cast<llvm::AllocaInst>(varBinding)) {
+              varTy = localVar->getAllocatedType();
+            } else if (auto globalVar =
+                           llvm::dyn_cast<llvm::GlobalVariable>(varBinding)) {
+              varTy = globalVar->getValueType();
+            } else {
+              DIE << "Cannot assign \"" << varName << "\".\n";
+            }
+
+            builder->CreateStore(castValue(value, varTy), varBinding);
+
+            return value;
+          }
+
+          // --------------------------------------------
+          // Blocks: (begin <expressions>)
+
+          else if (op == "begin") {
+            // Block scope:
+            auto blockEnv = std::make_shared<Environment>(
+                std::map<std::string, llvm::Value*>{}, env);
+
+            // Compile each expression within the block.
+            // Result is the last evaluated expression.
+            llvm::Value* blockRes;
+
+            for (auto i = 1; i < exp.list.size(); i++) {
+              // Generate expression code.
+              blockRes = gen(exp.list[i], blockEnv);
+            }
+
+            return blockRes;
+          }
+
+          // --------------------------------------------
+          // printf extern function:
+          //
+          // (printf "Value: %d" 42)
+          //
+
+          else if (op == "printf") {
+            return createPrintf(exp, env);
+          }
+
+          // --------------------------------------------
+          // Class declaration:
+          //
+          // (class A <super> <body>)
+          //
+
+          else if (op == "class") {
+            auto name = exp.list[1].string;
+            auto parentName = exp.list[2].string;
+
+            auto parent =
+                parentName == "null" ? nullptr : getClassByName(parentName);
+
+            if (parentName != "null" && parent == nullptr) {
+              DIE << "Unknown parent class " << parentName << " of " << name
+                  << "\n";
+            }
+
+            cls = llvm::StructType::create(*ctx, name);
+            classMap_[name] = ClassInfo{cls, parent, {}, {}};
+
+            if (parent != nullptr) {
+              inheritClass(cls, parent);
+            }
+
+            // Fields, method prototypes, and the vtable:
+            buildClassInfo(cls, exp, env);
+
+            // Methods (fields are set by the constructor):
+            auto& body = exp.list[3];
+
+            for (auto i = 1; i < body.list.size(); i++) {
+              if (isDef(body.list[i])) {
+                gen(body.list[i], env);
+              }
+            }
+
+            cls = nullptr;
+
+            return builder->getInt32(0);
+          }
+
+          // --------------------------------------------
+          // Interface declaration:
+          //
+          // (interface Callable
+          //   (begin
+          //     (def __call__ (self (x number)) -> number)))
+          //
+          // (class Transformer Callable <body>)
+          // (class Transformer (Base Callable Printable) <body>)
+          //
+          // Declared before the code (see declareInterfaces).
+
+          else if (op == "interface") {
+            return builder->getInt32(0);
+          }
+
+          // --------------------------------------------
+          // New operator:
+          //
+          // (new <class> <args>)
+          //
+
+          else if (op == "new") {
+            return createInstance(exp, env, "");
+          }
+
+          // --------------------------------------------
+          // Typed arrays:
+          //
+          // (array <type> <length>)
+          //
+          // Contiguous heap memory with the length header.
+
+          else if (op == "array") {
+            return createArray(exp, env);
+          }
+
+          // --------------------------------------------
+          // Array length:
+          //
+          // (alen <array>)
+          //
+
+          else if (op == "alen") {
+            return loadArrayLength(gen(exp.list[1], env));
+          }
+
+          // --------------------------------------------
+          // Array element access:
+          //
+          // (aref <array> <index>)
+          //
+
+          else if (op == "aref") {
+            auto array = gen(exp.list[1], env);
+            auto index = gen(exp.list[2], env);
+            return builder->CreateLoad(getArrayElementType(array->getType()),
+                                       getArrayElementPtr(array, index),
+                                       "aref");
+          }
+
+          // --------------------------------------------
+          // Array element update:
+          //
+          // (aset <array> <index> <value>)
+          //
+
+          else if (op == "aset") {
+            auto array = gen(exp.list[1], env);
+            auto index = gen(exp.list[2], env);
+            auto value = castValue(gen(exp.list[3], env),
+                                   getArrayElementType(array->getType()));
+            builder->CreateStore(value, getArrayElementPtr(array, index));
+            return value;
+          }
+
+          // --------------------------------------------
+          // SIMD vectors:
+          //
+          // (splat (vec f32 8) 1.5)
+          //
+          // Element-wise math and compares are the binary ops above.
+
+          else if (op == "splat") {
+            auto vecType = getTypeFromExp(exp.list[1]);
+
+            if (!vecType->isVectorTy()) {
+              DIE << "splat: vector type is expected.\n";
+            }
+
+            return castNumeric(gen(exp.list[2], env), vecType);
+          }
+
+          // --------------------------------------------
+          // Vector load/store from array:
+          //
+          // (vload <array> <index> <lanes>)
+          // (vstore <array> <index> <vector>)
+          //
+
+          else if (op == "vload") {
+            auto array = gen(exp.list[1], env);
+            auto index = gen(exp.list[2], env);
+            auto elemType = getArrayElementType(array->getType());
+            auto lanes = getLanesCount(exp.list[3]);
+            auto vecType = llvm::FixedVectorType::get(elemType, lanes);
+
+            auto ptr = getArrayElementPtr(array, index, lanes);
+            auto vecPtr =
+                builder->CreatePointerCast(ptr, vecType->getPointerTo());
+
+            return builder->CreateAlignedLoad(
+                vecType, vecPtr,
+                module->getDataLayout().getABITypeAlign(elemType), "vload");
+          }
+
+          else if (op == "vstore") {
+            auto array = gen(exp.list[1], env);
+            auto index = gen(exp.list[2], env);
+            auto elemType = getArrayElementType(array->getType());
+            auto value = gen(exp.list[3], env);
+            auto vecType = getVectorType(value, "vstore");
+
+            if (vecType->getElementType() != elemType) {
+              DIE << "vstore: vector and array element types differ.\n";
+            }
+
+            auto ptr =
+                getArrayElementPtr(array, index, vecType->getNumElements());
+            auto vecPtr =
+                builder->CreatePointerCast(ptr, vecType->getPointerTo());
+
+            builder->CreateAlignedStore(
+                value, vecPtr,
+                module->getDataLayout().getABITypeAlign(elemType));
+            return value;
+          }
+
+          // --------------------------------------------
+          // Lanes:
+          //
+          // (lane <vector> <index>)
+          // (set-lane <vector> <index> <value>)
+          //
+
+          else if (op == "lane") {
+            auto vec = gen(exp.list[1], env);
+            auto index = getLaneIndex(getVectorType(vec, "lane"),
+                                      gen(exp.list[2], env));
+            return builder->CreateExtractElement(vec, index, "lane");
+          }
+
+          else if (op == "set-lane") {
+            auto vec = gen(exp.list[1], env);
+            auto vecType = getVectorType(vec, "set-lane");
+            auto index = getLaneIndex(vecType, gen(exp.list[2], env));
+            auto elemType = vecType->getElementType();
+            auto value = castNumeric(gen(exp.list[3], env), elemType);
+            return builder->CreateInsertElement(vec, value, index, "vec");
+          }
+
+          // --------------------------------------------
+          // Shuffle:
+          //
+          // (shuffle <v1> <v2> (0 4 1 5))
+          //
+
+          else if (op == "shuffle") {
+            auto vec1 = gen(exp.list[1], env);
+            auto vec2 = gen(exp.list[2], env);
+
+            if (vec1->getType() != vec2->getType()) {
+              DIE << "shuffle: vectors of the same type are expected.\n";
+            }
+
+            // Lanes of v1, then of v2:
+            auto lanes = getVectorType(vec1, "shuffle")->getNumElements();
+
+            std::vector<int> mask{};
+            for (auto& lane : exp.list[3].list) {
+              if (lane.type != ExpType::NUMBER || lane.number < 0 ||
+                  lane.number >= 2 * lanes) {
+                DIE << "shuffle: mask lanes are numbers in [0, "
+                    << 2 * lanes << ").\n";
+              }
+              mask.push_back(lane.number);
+            }
+
+            return builder->CreateShuffleVector(vec1, vec2, mask, "shuffle");
+          }
+
+          // --------------------------------------------
+          // Horizontal reduce:
+          //
+          // (reduce-add <vector>), reduce-mul, reduce-min, reduce-max
+          //
+
+          else if (op == "reduce-add" || op == "reduce-mul" ||
+                   op == "reduce-min" || op == "reduce-max") {
+            return createReduce(op, gen(exp.list[1], env));
+          }
+
+          // --------------------------------------------
+          // Strings:
+          //
+          // (str-len <string>)
+          // (str-concat <string> <string>)
+          // (str-cmp <string> <string>), (str-eq <string> <string>)
+          // (str-hash <string>)
+          //
+
+          else if (op == "str-len") {
+            return loadStringLength(gen(exp.list[1], env));
+          }
+
+          else if (op == "str-concat" || op == "str-cmp" || op == "str-eq" ||
+                   op == "str-hash") {
+            std::vector<llvm::Value*> args{};
+
+            for (auto i = 1; i < exp.list.size(); i++) {
+              args.push_back(gen(exp.list[i], env));
+
+              if (!isStringType(args.back()->getType())) {
+                DIE << "String is expected in " << op << ".\n";
+              }
+            }
+
+            auto result = builder->CreateCall(getStringFn(op), args, "str");
+
+            // Runtime returns i32 0/1:
+            if (op == "str-eq") {
+              return builder->CreateICmpNE(result, builder->getInt32(0),
+                                           "streq");
+            }
+
+            return result;
+          }
+
+          // --------------------------------------------
+          // Suspends the async function until the task completes,
+          // the timer expires, or the fd is ready:
+          //
+          // (await <task>)
+          // (await (sleep <ms>))
+          // (await (readable <fd>)), (await (writable <fd>))
+          //
+
+          else if (op == "await") {
+            return compileAwait(exp.list[1], env);
+          }
+
+          // --------------------------------------------
+          // Runs the event loop until the task completes:
+          //
+          // (async-run <task>)
+          //
+
+          else if (op == "async-run") {
+            auto task = gen(exp.list[1], env);
+
+            if (!isTaskType(task->getType())) {
+              DIE << "Task is expected in async-run.\n";
+            }
+
+            auto handle = builder->CreateBitCast(task, builder->getInt8PtrTy());
+            builder->CreateCall(getEventLoopFn("eva_loop_run_until"), handle);
+
+            return takeTaskResult(handle, getTaskResultType(task->getType()));
+          }
+
+          // --------------------------------------------
+          // Atomics:
+          //
+          // (atomic-load <place> [<order>])
+          // (atomic-store <place> <value> [<order>])
+          // (atomic-add <place> <value> [<order>]) -> old value
+          // (atomic-sub ...), (atomic-xchg ...)
+          // (atomic-cas <place> <expected> <desired>
+          //   [<success order> [<failure order>]]) -> boolean
+          // (fence [<order>])
+          //
+          // Place: <var>, (prop <instance> <field>), (aref <array> <index>)
+          // Order: relaxed, acquire, release, acq-rel, seq-cst (default)
+          //
+
+          else if (op == "atomic-load" || op == "atomic-store" ||
+                   op == "atomic-add" || op == "atomic-sub" ||
+                   op == "atomic-xchg" || op == "atomic-cas" ||
+                   op == "fence") {
+            return compileAtomic(op, exp, env);
+          }
+
+          // --------------------------------------------
+          // Parallelism (work-stealing scheduler):
+          //
+          // (spawn (<fn> <args>)) -> future
+          // (sync <future>) -> result
+          // (parallel-for (<var> <start> <end>) <body>)
+          //
+
+          else if (op == "spawn") {
+            return compileSpawn(exp.list[1], env);
+          }
+
+          else if (op == "sync") {
+            return compileSync(exp.list[1], env);
+          }
+
+          else if (op == "parallel-for") {
+            return compileParallelFor(exp, env);
+          }
+
+          // --------------------------------------------
+          // Prop access:
+          //
+          // (prop <instance> <name>)
+          //
+
+          else if (op == "prop") {
+            auto instance = gen(exp.list[1], env);
+            auto fieldName = exp.list[2].string;
+            auto instanceCls = getInstanceClass(instance);
+
+            auto fieldIdx = getFieldIndex(instanceCls, fieldName);
+            auto address = builder->CreateStructGEP(instanceCls, instance,
+                                                    fieldIdx, "p" + fieldName);
+
+            return builder->CreateLoad(instanceCls->getElementType(fieldIdx),
+                                       address, fieldName);
+          }
+
+          // --------------------------------------------
+          // Method access:
+          //
+          // (method <instance> <name>)
+          //
+          // (method (super <class>) <name>)
+          //
+
+          else if (op == "method") {
+            auto methodName = exp.list[2].string;
+
+            // Super methods are called directly: (super <class>) is
+            // the current class, the method is of its parent.
+            if (isSuper(exp.list[1])) {
+              auto className = exp.list[1].list[1].string;
+              auto parent = classMap_[className].parent;
+
+              if (parent == nullptr) {
+                DIE << "Class " << className << " has no parent class\n";
+              }
+
+              auto& methods = classMap_[parent->getName().str()].methodsMap;
+              auto method = methods.find(methodName);
+
+              if (method == methods.end()) {
+                DIE << "Unknown method " << parent->getName().str() << "."
+                    << methodName << "\n";
+              }
+
+              return method->second;
+            }
+
+            auto instance = gen(exp.list[1], env);
+            auto instanceCls = getInstanceClass(instance);
+
+            // Virtual methods, through the vtable:
+            auto vTableAddr =
+                builder->CreateStructGEP(instanceCls, instance, VTABLE_INDEX);
+            auto vTable = builder->CreateLoad(
+                instanceCls->getElementType(VTABLE_INDEX), vTableAddr, "vt");
+
+            auto methodIdx = getMethodIndex(instanceCls, methodName);
+            auto vTableTy =
+                (llvm::StructType*)vTable->getType()->getPointerElementType();
+
+            auto methodAddr =
+                builder->CreateStructGEP(vTableTy, vTable, methodIdx);
+
+            return builder->CreateLoad(vTableTy->getElementType(methodIdx),
+                                       methodAddr, methodName);
+          }
+
+          // --------------------------------------------
+          // Untyped function calls, monomorphized:
+          //
+          // (square 2) -> square$i32
+
+          else if (genericFns_.count(op) != 0) {
+            std::vector<llvm::Value*> args{};
+            std::vector<llvm::Type*> argTypes{};
+
+            for (auto i = 1; i < exp.list.size(); i++) {
+              args.push_back(gen(exp.list[i], env));
+              argTypes.push_back(args.back()->getType());
+            }
+
+            auto specFn = getSpecialization(op, argTypes);
+            castArgs(args, specFn->getFunctionType());
+            return builder->CreateCall(specFn, args);
+          }
+
+          // --------------------------------------------
+          // Function calls:
+          //
+          // (square 2)
+
+          else {
+            auto callee = llvm::dyn_cast<llvm::Function>(gen(exp.list[0], env));
+
+            if (callee == nullptr) {
+              DIE << "\"" << op << "\" is not a function.\n";
+            }
+
+            return builder->CreateCall(
+                callee, genArgs(exp, 1, callee->getFunctionType(), env));
+          }
+        }
+
+        // --------------------------------------------
+        // Method calls:
+        //
+        // ((method p getX) p 2)
+
+        else {
+          // Interface calls, through the itable:
+          if (isInterfaceCall(exp, env)) {
+            return callInterfaceMethod(exp, env);
+          }
+
+          // Loaded from the vtable, or a super method:
+          auto method = gen(exp.list[0], env);
+          auto fnTy =
+              (llvm::FunctionType*)method->getType()->getPointerElementType();
+
+          // Instances of subclasses are passed as `self` of the parent:
+          return builder->CreateCall(fnTy, method, genArgs(exp, 1, fnTy, env));
+        }
+
+        break;
+    }
+
+    // Unreachable:
+    return builder->getInt32(0);
+  }
+
+  /**
+   * Returns field index.
+   */
+  size_t getFieldIndex(llvm::StructType* cls, const std::string& fieldName) {
+    auto& fields = classMap_[cls->getName().data()].fieldNames;
+    auto it = std::find(fields.begin(), fields.end(), fieldName);
+
+    if (it == fields.end()) {
+      DIE << "Unknown field " << cls->getName().str() << "." << fieldName
+          << "\n";
+    }
+
+    return std::distance(fields.begin(), it) + RESERVED_FIELDS_COUNT;
+  }
+
+  /**
+   * Returns method index.
+   */
+  size_t getMethodIndex(llvm::StructType* cls, const std::string& methodName) {
+    auto& methods = classMap_[cls->getName().data()].methodNames;
+    auto it = std::find(methods.begin(), methods.end(), methodName);
+
+    if (it == methods.end()) {
+      DIE << "Unknown method " << cls->getName().str() << "." << methodName
+          << "\n";
+    }
+
+    return std::distance(methods.begin(), it);
+  }
+
+  /**
+   * Class of the instance (pointer to the class struct).
+   */
+  llvm::StructType* getInstanceClass(llvm::Value* instance) {
+    auto type_ = instance->getType();
+    auto cls = type_->isPointerTy() ? llvm::dyn_cast<llvm::StructType>(
+                                          type_->getPointerElementType())
+                                    : nullptr;
+
+    if (cls == nullptr || !cls->hasName() ||
+        classMap_.count(cls->getName().str()) == 0) {
+      DIE << "Instance of a class is expected.\n";
+    }
+
+    return cls;
+  }
+
+  /**
+   * Creates an instance of a class.
+   */
+  llvm::Value* createInstance(const Exp& exp, Env env,
+                              const std::string& name) {
+    auto className = exp.list[1].string;
+    auto cls = getClassByName(className);
+
+    if (cls == nullptr || classMap_.count(className) == 0) {
+      DIE << "Unknown class " << className << "\n";
+    }
+
+    auto instance = mallocInstance(cls, name);
+
+    // Constructor (own or inherited), the instance is `self`:
+    auto& methods = classMap_[className].methodsMap;
+    auto ctor = methods.find("constructor");
+
+    if (ctor == methods.end()) {
+      if (exp.list.size() > 2) {
+        DIE << "Class " << className << " has no constructor\n";
+      }
+      return instance;
+    }
+
+    auto ctorType = ctor->second->getFunctionType();
+    auto args = genArgs(exp, 2, ctorType, env, /* firstParam */ 1);
+
+    args.insert(args.begin(),
+                builder->CreateBitCast(instance, ctorType->getParamType(0)));
+
+    builder->CreateCall(ctor->second, args);
+
+    return instance;
+  }
+
+  /**
+   * Allocates an object of a given class on the heap.
+   */
+  llvm::Value* mallocInstance(llvm::StructType* cls, const std::string& name) {
+    if (allocProfile_) {
+      recordAllocation(cls);
+    }
+
+    auto typeSize = builder->getInt64(getTypeSize(cls));
+
+    // Instances are garbage collected:
+    auto mallocPtr =
+        builder->CreateCall(module->getFunction("GC_malloc"), typeSize, name);
+
+    auto instance = builder->CreatePointerCast(mallocPtr, cls->getPointerTo());
+
+    // The vtable of the class:
+    std::string className{cls->getName().data()};
+    auto vTable = module->getNamedGlobal(className + "_vTable");
+
+    builder->CreateStore(
+        vTable, builder->CreateStructGEP(cls, instance, VTABLE_INDEX));
+
+    return instance;
+  }
+
+  /**
+   * Allocation profile: counts the allocation of the class instance
+   * at the site (class + current function). Site ids are per module,
+   * offset by the base id the module got at the registration:
+   *
+   * eva_alloc_record(eva.alloc.base + siteId)
+   */
+  void recordAllocation(llvm::StructType* cls) {
+    auto clsName = cls->getName().str();
+    auto callSite = getDisplayName(*fn);
+    auto key = std::make_pair(clsName, callSite);
+
+    auto it = allocSites_.find(key);
+
+    if (it == allocSites_.end()) {
+      auto siteId = allocSites_.size();
+
+      allocSitesTable_.push_back(llvm::ConstantStruct::get(
+          getAllocSiteType(),
+          {internString(clsName), internString(callSite),
+           builder->getInt64(getTypeSize(cls))}));
+
+      it = allocSites_.emplace(key, siteId).first;
+    }
+
+    auto callee = module->getOrInsertFunction(
+        "eva_alloc_record",
+        llvm::FunctionType::get(builder->getVoidTy(), builder->getInt32Ty(),
+                                false));
+
+    if (auto recordFn = llvm::dyn_cast<llvm::Function>(callee.getCallee())) {
+      recordFn->addFnAttr(llvm::Attribute::NoUnwind);
+      recordFn->addFnAttr(llvm::Attribute::InaccessibleMemOnly);
+    }
+
+    auto base = builder->CreateLoad(builder->getInt32Ty(),
+                                    getAllocSitesBase(), "alloc.base");
+
+    builder->CreateCall(
+        callee, builder->CreateAdd(base, builder->getInt32(it->second)));
+  }
+
+  /**
+   * Base id of the module allocation sites (UINT32_MAX until the
+   * registration, the runtime ignores such ids).
+   */
+  llvm::GlobalVariable* getAllocSitesBase() {
+    if (auto base = module->getNamedGlobal("eva.alloc.base")) {
+      return base;
+    }
+
+    return new llvm::GlobalVariable(
+        *module, builder->getInt32Ty(), /* isConstant */ false,
+        llvm::GlobalVariable::InternalLinkage, builder->getInt32(UINT32_MAX),
+        "eva.alloc.base");
+  }
+
+  /**
+   * Registers the allocation sites of the module from a constructor,
+   * which runs before the module init functions and main:
+   *
+   * eva.alloc.base = eva_alloc_register([N x { i8*, i8*, i64 }] sites, N)
+   */
+  void registerAllocationSites() {
+    if (allocSitesTable_.empty()) {
+      return;
+    }
+
+    auto sitesType =
+        llvm::ArrayType::get(getAllocSiteType(), allocSitesTable_.size());
+
+    auto sitesTable = new llvm::GlobalVariable(
+        *module, sitesType, /* isConstant */ true,
+        llvm::GlobalVariable::PrivateLinkage,
+        llvm::ConstantArray::get(sitesType, allocSitesTable_),
+        "eva.alloc.sites");
+
+    auto registerFn = module->getOrInsertFunction(
+        "eva_alloc_register",
+        llvm::FunctionType::get(
+            builder->getInt32Ty(),
+            {getAllocSiteType()->getPointerTo(), builder->getInt32Ty()},
+            false));
+
+    auto ctorFn = llvm::Function::Create(
+        llvm::FunctionType::get(builder->getVoidTy(), false),
+        llvm::Function::InternalLinkage, "eva.alloc.register", *module);
+
+    builder->SetInsertPoint(createBB("entry", ctorFn));
+    builder->CreateStore(
+        builder->CreateCall(
+            registerFn,
+            {builder->CreateConstInBoundsGEP2_32(sitesType, sitesTable, 0, 0),
+             builder->getInt32(allocSitesTable_.size())}),
+        getAllocSitesBase());
+    builder->CreateRetVoid();
+
+    llvm::appendToGlobalCtors(*module, ctorFn, ALLOC_SITES_CTOR_PRIORITY);
+  }
+
+  /**
+   * Allocation site (see runtime/EvaRuntime.h):
+   *
+   * { i8*, i8*, i64 }
+   */
+  llvm::StructType* getAllocSiteType() {
+    auto charPtrType = builder->getInt8Ty()->getPointerTo();
+    return llvm::StructType::get(
+        *ctx, {charPtrType, charPtrType, builder->getInt64Ty()});
+  }
+
+  /**
+   * Compiles a counted loop to the canonical form:
+   *
+   * preheader -> header (phi, compare) -> body -> latch (step) -> header
+   *                   \-> exit
+   *
+   * The induction variable is the phi (immutable in the body),
+   * the step is `add nsw`, so loop passes can reason about the
+   * trip count. Compares are signed. The default step is 1 for `<`
+   * and `<=`, and -1 for `>` and `>=`; constant steps should move
+   * towards the end (loops are `mustprogress`).
+   */
+  llvm::Value* compileForLoop(const Exp& exp, Env env) {
+    auto& header = exp.list[1];
+    auto varName = header.list[0].string;
+
+    // Range: (i start end), (i start <op> end), with optional step:
+    auto hasOp = header.list[2].type == ExpType::SYMBOL &&
+                 (header.list[2].string == "<" ||
+                  header.list[2].string == "<=" ||
+                  header.list[2].string == ">" ||
+                  header.list[2].string == ">=");
+
+    auto cmpOp = hasOp ? header.list[2].string : "<";
+    auto& endExp = header.list[hasOp ? 3 : 2];
+    auto stepIndex = hasOp ? 4 : 3;
+    auto isDescending = cmpOp == ">" || cmpOp == ">=";
+
+    // Preheader: start, end and step are evaluated once.
+    auto start = gen(header.list[1], env);
+    auto end = gen(endExp, env);
+    auto step = stepIndex < header.list.size()
+                    ? gen(header.list[stepIndex], env)
+                    : (llvm::Value*)builder->getInt32(isDescending ? -1 : 1);
+
+    if (auto constStep = llvm::dyn_cast<llvm::ConstantInt>(step)) {
+      if (constStep->isZero() || constStep->isNegative() != isDescending) {
+        DIE << "Counted loop \"" << varName << "\" with " << cmpOp
+            << " should have a " << (isDescending ? "negative" : "positive")
+            << " step.\n";
+      }
+    }
+
+    auto varType = getCommonNumericType(start->getType(), end->getType());
+
+    if (!varType->isIntegerTy()) {
+      DIE << "Counted loop \"" << varName << "\" should be an integer.\n";
+    }
+
+    start = castNumeric(start, varType);
+    end = castNumeric(end, varType);
+    step = castNumeric(step, varType);
+
+    auto preheaderBlock = builder->GetInsertBlock();
+
+    auto headerBlock = createBB("for.header", fn);
+    auto bodyBlock = createBB("for.body", fn);
+    auto latchBlock = createBB("for.latch", fn);
+    auto exitBlock = createBB("for.exit", fn);
+
+    builder->CreateBr(headerBlock);
+
+    // Header: induction variable and the condition.
+    builder->SetInsertPoint(headerBlock);
+
+    auto index = builder->CreatePHI(varType, 2, varName);
+    index->addIncoming(start, preheaderBlock);
+
+    llvm::Value* cond = nullptr;
+
+    if (cmpOp == "<") {
+      cond = builder->CreateICmpSLT(index, end, "for.cond");
+    } else if (cmpOp == "<=") {
+      cond = builder->CreateICmpSLE(index, end, "for.cond");
+    } else if (cmpOp == ">") {
+      cond = builder->CreateICmpSGT(index, end, "for.cond");
+    } else {
+      cond = builder->CreateICmpSGE(index, end, "for.cond");
+    }
+
+    builder->CreateCondBr(cond, bodyBlock, exitBlock);
+
+    // Body: the variable is bound directly to the phi.
+    builder->SetInsertPoint(bodyBlock);
+
+    auto loopEnv = std::make_shared<Environment>(
+        std::map<std::string, llvm::Value*>{{varName, index}}, env);
+
+    auto& body = exp.list[exp.list.size() - 1];
+
+    auto hasRange = addLoopRange(index, start, step, cmpOp, endExp, end, env);
+
+    gen(body, loopEnv);
+
+    if (hasRange) {
+      loopRanges_.pop_back();
+    }
+
+    builder->CreateBr(latchBlock);
+
+    // Latch: step and the back-edge with the loop hints.
+    builder->SetInsertPoint(latchBlock);
+
+    auto next = builder->CreateAdd(index, step, varName + ".next",
+                                   /* HasNUW */ false, /* HasNSW */ true);
+    index->addIncoming(next, latchBlock);
+
+    auto backEdge = builder->CreateBr(headerBlock);
+    backEdge->setMetadata(llvm::LLVMContext::MD_loop,
+                          createLoopMetadata(exp));
+
+    builder->SetInsertPoint(exitBlock);
+
+    return builder->getInt32(0);
+  }
+
+  /**
+   * Records the range of an ascending loop from a non-negative start
+   * with `<` to the array length (or a constant), so array accesses
+   * by the index need no bounds checks. Returns whether recorded.
+   */
+  bool addLoopRange(llvm::Value* index, llvm::Value* start, llvm::Value* step,
+                    const std::string& cmpOp, const Exp& endExp,
+                    llvm::Value* end, Env env) {
+    auto constStart = llvm::dyn_cast<llvm::ConstantInt>(start);
+    auto constStep = llvm::dyn_cast<llvm::ConstantInt>(step);
+
+    if (cmpOp != "<" || constStart == nullptr || constStep == nullptr ||
+        constStart->isNegative() ||
+        !constStep->getValue().isStrictlyPositive()) {
+      return false;
+    }
+
+    // (alen a): `a` should not be reassigned anywhere in the program
+    // (the body, called functions, atomics, see collectAssignedVars).
+    if (isTaggedList(endExp, "alen") &&
+        endExp.list[1].type == ExpType::SYMBOL &&
+        assignedVars_.count(endExp.list[1].string) == 0) {
+      loopRanges_.push_back(
+          LoopRange{index, env->lookup(endExp.list[1].string), 0});
+      return true;
+    }
+
+    if (auto constEnd = llvm::dyn_cast<llvm::ConstantInt>(end)) {
+      loopRanges_.push_back(
+          LoopRange{index, nullptr, constEnd->getZExtValue()});
+      return true;
+    }
+
+    return false;
+  }
+
+  /**
+   * Builds loop metadata from the loop hints:
+   *
+   * (unroll 4) -> llvm.loop.unroll.count 4
+   * (unroll full) -> llvm.loop.unroll.full
+   * (unroll disable) -> llvm.loop.unroll.disable
+   * (vectorize 8) -> llvm.loop.vectorize.width 8
+   * (vectorize disable) -> llvm.loop.vectorize.enable false
+   * (interleave 2) -> llvm.loop.interleave.count 2
+   */
+  llvm::MDNode* createLoopMetadata(const Exp& exp) {
+    // Self-reference placeholder:
+    std::vector<llvm::Metadata*> hints{nullptr};
+
+    // Counted loops always terminate:
+    hints.push_back(llvm::MDNode::get(
+        *ctx, llvm::MDString::get(*ctx, "llvm.loop.mustprogress")));
+
+    // Hints are between the header and the body:
+    for (auto i = 2; i < exp.list.size() - 1; i++) {
+      auto& hint = exp.list[i];
+
+      if (hint.type != ExpType::LIST || hint.list.size() != 2 ||
+          hint.list[0].type != ExpType::SYMBOL) {
+        DIE << "Loop hint should be (<name> <value>).\n";
+      }
+
+      auto name = hint.list[0].string;
+      auto& arg = hint.list[1];
+      auto disabled = arg.type == ExpType::SYMBOL && arg.string == "disable";
+
+      if (name == "unroll") {
+        if (disabled) {
+          hints.push_back(loopHint("llvm.loop.unroll.disable"));
+        } else if (arg.type == ExpType::SYMBOL && arg.string == "full") {
+          hints.push_back(loopHint("llvm.loop.unroll.full"));
+        } else {
+          hints.push_back(
+              loopHint("llvm.loop.unroll.count", getHintCount(hint)));
+        }
+      }
+
+      else if (name == "vectorize") {
+        if (disabled) {
+          hints.push_back(loopHint("llvm.loop.vectorize.enable", 0, true));
+        } else {
+          hints.push_back(loopHint("llvm.loop.vectorize.enable", 1, true));
+          hints.push_back(
+              loopHint("llvm.loop.vectorize.width", getHintCount(hint)));
+        }
+      }
+
+      else if (name == "interleave") {
+        hints.push_back(
+            loopHint("llvm.loop.interleave.count", getHintCount(hint)));
+      }
+
+      else {
+        DIE << "Unknown loop hint \"" << name << "\".\n";
+      }
+    }
+
+    auto loopID = llvm::MDNode::getDistinct(*ctx, hints);
+    loopID->replaceOperandWith(0, loopID);
+
+    return loopID;
+  }
+
+  /**
+   * Positive count of a loop hint: (unroll 4)
+   */
+  int64_t getHintCount(const Exp& hint) {
+    auto& arg = hint.list[1];
+
+    if (arg.type != ExpType::NUMBER || arg.number <= 0) {
+      DIE << "Loop hint \"" << hint.list[0].string
+          << "\" expects a positive number.\n";
+    }
+
+    return arg.number;
+  }
+
+  /**
+   * Loop hint: !{!"name"} or !{!"name", i32 value} (i1 for flags).
+   */
+  llvm::MDNode* loopHint(const std::string& name) {
+    return llvm::MDNode::get(*ctx, llvm::MDString::get(*ctx, name));
+  }
+
+  llvm::MDNode* loopHint(const std::string& name, int64_t value,
+                         bool isFlag = false) {
+    auto constValue =
+        isFlag ? builder->getInt1(value != 0) : builder->getInt32(value);
+
+    return llvm::MDNode::get(
+        *ctx, {llvm::MDString::get(*ctx, name),
+               llvm::ConstantAsMetadata::get(constValue)});
+  }
+
+  /**
+   * Vector type of the value, or dies if it's not a vector.
+   */
+  llvm::FixedVectorType* getVectorType(llvm::Value* value,
+                                       const std::string& op) {
+    auto vecType = llvm::dyn_cast<llvm::FixedVectorType>(value->getType());
+
+    if (vecType == nullptr) {
+      DIE << op << ": vector is expected.\n";
+    }
+
+    return vecType;
+  }
+
+  /**
+   * Lanes count of (vload ...) and (vec ...): a positive number literal.
+   */
+  unsigned getLanesCount(const Exp& exp) {
+    if (exp.type != ExpType::NUMBER || exp.number <= 0 ||
+        exp.number > MAX_VECTOR_LANES) {
+      DIE << "Vector lanes count must be a number in [1, " << MAX_VECTOR_LANES
+          << "].\n";
+    }
+
+    return exp.number;
+  }
+
+  /**
+   * Lane index: checked statically if constant, traps otherwise
+   * (out of range lanes are poison).
+   */
+  llvm::Value* getLaneIndex(llvm::FixedVectorType* vecType,
+                            llvm::Value* index) {
+    auto lanes = vecType->getNumElements();
+
+    if (auto constIndex = llvm::dyn_cast<llvm::ConstantInt>(index)) {
+      if (constIndex->isNegative() || constIndex->getZExtValue() >= lanes) {
+        DIE << "Lane index " << constIndex->getSExtValue()
+            << " is out of range [0, " << lanes << ").\n";
+      }
+      return index;
+    }
+
+    if (!index->getType()->isIntegerTy()) {
+      DIE << "Lane index must be integer.\n";
+    }
+
+    emitCheck(builder->CreateICmpULT(
+                  index, llvm::ConstantInt::get(index->getType(), lanes)),
+              "lane");
+
+    return index;
+  }
+
+  /**
+   * Horizontal vector reduction. Floating point lanes are summed
+   * in any order (as a tree), not sequentially.
+   */
+  llvm::Value* createReduce(const std::string& op, llvm::Value* vec) {
+    auto elemType = getVectorType(vec, op)->getElementType();
+    auto isFloat = elemType->isFloatingPointTy();
+
+    llvm::Value* result = nullptr;
+
+    if (op == "reduce-add") {
+      result = isFloat ? builder->CreateFAddReduce(
+                             llvm::ConstantFP::getNegativeZero(elemType), vec)
+                       : builder->CreateAddReduce(vec);
+    } else if (op == "reduce-mul") {
+      result = isFloat ? builder->CreateFMulReduce(
+                             llvm::ConstantFP::get(elemType, 1.0), vec)
+                       : builder->CreateMulReduce(vec);
+    } else if (op == "reduce-min") {
+      result = isFloat ? builder->CreateFPMinReduce(vec)
+                       : builder->CreateIntMinReduce(vec, /* signed */ true);
+    } else {
+      result = isFloat ? builder->CreateFPMaxReduce(vec)
+                       : builder->CreateIntMaxReduce(vec, /* signed */ true);
+    }
+
+    if (isFloat && (op == "reduce-add" || op == "reduce-mul")) {
+      auto call = (llvm::CallInst*)result;
+      auto fmf = call->getFastMathFlags();
+      fmf.setAllowReassoc();
+      call->setFastMathFlags(fmf);
+    }
+
+    return result;
+  }
+
+  /**
+   * Allocates a zero-initialized array on the heap.
+   */
+  llvm::Value* createArray(const Exp& exp, Env env) {
+    auto elemType = getTypeFromExp(exp.list[1]);
+    auto arrayType = getArrayType(elemType);
+
+    auto length = castNumeric(gen(exp.list[2], env), builder->getInt64Ty());
+
+    // Negative lengths (sign-extended) would wrap the size:
+    if (auto constLength = llvm::dyn_cast<llvm::ConstantInt>(length)) {
+      if (constLength->isNegative()) {
+        DIE << "Negative array length: " << constLength->getSExtValue()
+            << "\n";
+      }
+    } else {
+      emitCheck(builder->CreateICmpSGE(length, builder->getInt64(0)),
+                "alen");
+    }
+
+    // Header + length * sizeof(T):
+    auto headerSize = builder->getInt64(getArrayHeaderSize(arrayType));
+    auto dataSize = builder->CreateMul(
+        length, builder->getInt64(getTypeSize(elemType)), "asize");
+    auto size = builder->CreateAdd(headerSize, dataSize, "asize");
+
+    auto mem = builder->CreateCall(getArrayAllocFn(), size, "amem");
+
+    // Fresh memory, not aliased by anything else:
+    mem->addRetAttr(llvm::Attribute::NoAlias);
+    mem->addRetAttr(llvm::Attribute::getWithAlignment(
+        *ctx, llvm::Align(ARRAY_ALIGNMENT)));
+
+    auto array = builder->CreatePointerCast(mem, arrayType->getPointerTo(),
+                                            "array");
+
+    builder->CreateStore(
+        length, builder->CreateStructGEP(arrayType, array, ARRAY_LENGTH_INDEX));
+
+    // Statically known length, used to skip bounds checks:
+    if (auto constLength = llvm::dyn_cast<llvm::ConstantInt>(length)) {
+      staticArrayLengths_[array] = constLength->getZExtValue();
+    }
+
+    return array;
+  }
+
+  /**
+   * Returns array type for the element type:
+   *
+   * %Array.i32 = type { i64, i64, [0 x i32] }
+   */
+  llvm::StructType* getArrayType(llvm::Type* elemType) {
+    auto name = "Array." + mangleType(elemType);
+
+    if (auto arrayType = llvm::StructType::getTypeByName(*ctx, name)) {
+      return arrayType;
+    }
+
+    return llvm::StructType::create(
+        *ctx,
+        {builder->getInt64Ty(), builder->getInt64Ty(),
+         llvm::ArrayType::get(elemType, 0)},
+        name);
+  }
+
+  /**
+   * Whether the type is an array pointer.
+   */
+  bool isArrayType(llvm::Type* type_) {
+    if (!type_->isPointerTy() ||
+        !type_->getPointerElementType()->isStructTy()) {
+      return false;
+    }
+
+    auto structType = (llvm::StructType*)type_->getPointerElementType();
+
+    return structType->hasName() &&
+           structType->getName().startswith("Array.");
+  }
+
+  /**
+   * Element type of an array pointer type.
+   */
+  llvm::Type* getArrayElementType(llvm::Type* arrayPtrType) {
+    if (!isArrayType(arrayPtrType)) {
+      DIE << "Array is expected in aref/aset/alen.\n";
+    }
+
+    auto arrayType = (llvm::StructType*)arrayPtrType->getPointerElementType();
+    return arrayType->getElementType(ARRAY_DATA_INDEX)->getArrayElementType();
+  }
+
+  /**
+   * Size of the array header in bytes.
+   */
+  size_t getArrayHeaderSize(llvm::StructType* arrayType) {
+    return module->getDataLayout().getStructLayout(arrayType)->getElementOffset(
+        ARRAY_DATA_INDEX);
+  }
+
+  /**
+   * Loads array length. The length never changes after the allocation,
+   * so the load is invariant, and can be hoisted out of loops.
+   */
+  llvm::Value* loadArrayLength(llvm::Value* array) {
+    auto arrayType =
+        (llvm::StructType*)array->getType()->getPointerElementType();
+
+    auto length = builder->CreateLoad(
+        builder->getInt64Ty(),
+        builder->CreateStructGEP(arrayType, array, ARRAY_LENGTH_INDEX),
+        "alen");
+
+    length->setMetadata(llvm::LLVMContext::MD_invariant_load,
+                        llvm::MDNode::get(*ctx, {}));
+
+    return length;
+  }
+
+  /**
+   * Returns pointer to the array element, checking the bounds
+   * unless proven in-bounds statically. For vector accesses all
+   * `lanes` elements starting from the index are checked at once.
+   */
+  llvm::Value* getArrayElementPtr(llvm::Value* array, llvm::Value* index,
+                                  size_t lanes = 1) {
+    auto arrayType =
+        (llvm::StructType*)array->getType()->getPointerElementType();
+
+    // Loop ranges are known for the original index:
+    auto inBounds = isInBounds(array, index);
+
+    index = castNumeric(index, builder->getInt64Ty());
+
+    // Vectors: both the first and the last lanes (constant indices):
+    if (inBounds && lanes > 1) {
+      inBounds = isInBounds(
+          array, builder->CreateAdd(index, builder->getInt64(lanes - 1)));
+    }
+
+    if (!inBounds) {
+      emitBoundsCheck(array, index, lanes);
+    }
+
+    return builder->CreateInBoundsGEP(
+        arrayType, array,
+        {builder->getInt32(0), builder->getInt32(ARRAY_DATA_INDEX), index},
+        "aelem");
+  }
+
+  /**
+   * Whether the index is statically known to be within the array.
+   */
+  bool isInBounds(llvm::Value* array, llvm::Value* index) {
+    // Index of a counted loop over the array:
+    for (auto& range : loopRanges_) {
+      if (range.index != index) {
+        continue;
+      }
+
+      if (range.arrayVar != nullptr) {
+        auto load = llvm::dyn_cast<llvm::LoadInst>(array);
+        if (load != nullptr && load->getPointerOperand() == range.arrayVar) {
+          return true;
+        }
+      } else if (range.end <= getStaticArrayLength(array)) {
+        return true;
+      }
+    }
+
+    auto constIndex = llvm::dyn_cast<llvm::ConstantInt>(index);
+
+    if (constIndex == nullptr) {
+      return false;
+    }
+
+    auto length = getStaticArrayLength(array);
+
+    return length > 0 && constIndex->getZExtValue() < length;
+  }
+
+  /**
+   * Returns statically known array length, or 0 if unknown.
+   *
+   * Either the array allocation itself, or a load of a variable
+   * which is initialized with that allocation, and never assigned.
+   */
+  uint64_t getStaticArrayLength(llvm::Value* array) {
+    auto it = staticArrayLengths_.find(array);
+
+    if (it != staticArrayLengths_.end()) {
+      return it->second;
+    }
+
+    auto load = llvm::dyn_cast<llvm::LoadInst>(array);
+
+    if (load == nullptr) {
+      return 0;
+    }
+
+    auto var = staticArrayVars_.find(load->getPointerOperand());
+
+    return var != staticArrayVars_.end() ? var->second : 0;
+  }
+
+  /**
+   * Records the length of an array variable initialized with a
+   * constant length allocation. Variables assigned anywhere in the
+   * program are skipped: the assignment may not be compiled yet
+   * (e.g. later in a loop body), or be in another function.
+   */
+  void addStaticArrayVar(const std::string& name, llvm::Value* var,
+                         llvm::Value* init) {
+    auto it = staticArrayLengths_.find(init);
+
+    if (it != staticArrayLengths_.end() && assignedVars_.count(name) == 0) {
+      staticArrayVars_[var] = it->second;
+    }
+  }
+
+  /**
+   * Collects the names of the variables assigned in the expression:
+   *
+   * (set x ...), (atomic-store x ...), (atomic-xchg x ...), etc.
+   */
+  void collectAssignedVars(const Exp& exp) {
+    if (exp.type != ExpType::LIST) {
+      return;
+    }
+
+    if (exp.list.size() > 1 && exp.list[0].type == ExpType::SYMBOL &&
+        exp.list[1].type == ExpType::SYMBOL &&
+        (exp.list[0].string == "set" ||
+         exp.list[0].string.rfind("atomic-", 0) == 0)) {
+      assignedVars_.insert(exp.list[1].string);
+    }
+
+    for (auto& e : exp.list) {
+      collectAssignedVars(e);
+    }
+  }
+
+  /**
+   * Traps if the index is out of the array bounds. Negative indices
+   * become large unsigned, so a single unsigned compare is enough.
+   *
+   * For `lanes` elements: index <= length - lanes (and lanes <= length).
+   */
+  void emitBoundsCheck(llvm::Value* array, llvm::Value* index,
+                       size_t lanes = 1) {
+    auto length = loadArrayLength(array);
+
+    if (lanes == 1) {
+      emitCheck(builder->CreateICmpULT(index, length, "inbounds"), "aref");
+      return;
+    }
+
+    auto lanesCount = builder->getInt64(lanes);
+
+    emitCheck(builder->CreateAnd(
+                  builder->CreateICmpUGE(length, lanesCount),
+                  builder->CreateICmpULE(
+                      index, builder->CreateSub(length, lanesCount)),
+                  "inbounds"),
+              "aref");
+  }
+
+  /**
+   * Continues if the (likely) condition holds, traps otherwise.
+   */
+  void emitCheck(llvm::Value* condition, const std::string& name) {
+    auto okBlock = createBB(name + ".ok", fn);
+    auto failBlock = createBB(name + ".fail", fn);
+
+    builder->CreateCondBr(condition, okBlock, failBlock,
+                          llvm::MDBuilder(*ctx).createBranchWeights(
+                              BOUNDS_CHECK_WEIGHT, /* fail */ 1));
+
+    // The buffered output is written before the trap:
+    builder->SetInsertPoint(failBlock);
+    builder->CreateCall(getOutputFn("eva_flush"));
+    builder->CreateCall(
+        llvm::Intrinsic::getDeclaration(module.get(), llvm::Intrinsic::trap));
+    builder->CreateUnreachable();
+
+    builder->SetInsertPoint(okBlock);
+  }
+
+  /**
+   * Array allocator: GC_malloc(size) -> i8*
+   */
+  llvm::FunctionCallee getArrayAllocFn() {
+    return module->getOrInsertFunction(
+        "GC_malloc",
+        llvm::FunctionType::get(builder->getInt8Ty()->getPointerTo(),
+                                builder->getInt64Ty(), /* vararg */ false));
+  }
+
+  /**
+   * Returns native string type (see runtime/EvaRuntime.h):
+   *
+   * %EvaString = type { i64, i8*, [16 x i8] }
+   */
+  llvm::StructType* getStringType() {
+    if (auto stringType = llvm::StructType::getTypeByName(*ctx, "EvaString")) {
+      return stringType;
+    }
+
+    return llvm::StructType::create(
+        *ctx,
+        {builder->getInt64Ty(), builder->getInt8Ty()->getPointerTo(),
+         llvm::ArrayType::get(builder->getInt8Ty(), EVA_STRING_INLINE_SIZE)},
+        "EvaString");
+  }
+
+  /**
+   * Whether the type is a string pointer.
+   */
+  bool isStringType(llvm::Type* type_) {
+    return type_ == getStringType()->getPointerTo();
+  }
+
+  /**
+   * Interns a C string: identical strings (literals, printf formats)
+   * share one constant in the module.
+   */
+  llvm::Constant* internString(const std::string& str) {
+    auto it = stringPool_.find(str);
+
+    if (it == stringPool_.end()) {
+      auto init = llvm::ConstantDataArray::getString(*ctx, str);
+      auto global = new llvm::GlobalVariable(
+          *module, init->getType(), /* isConstant */ true,
+          llvm::GlobalVariable::PrivateLinkage, init, ".str");
+
+      global->setUnnamedAddr(llvm::GlobalValue::UnnamedAddr::Global);
+      global->setAlignment(llvm::MaybeAlign(1));
+
+      it = stringPool_.emplace(str, global).first;
+    }
+
+    return llvm::ConstantExpr::getInBoundsGetElementPtr(
+        it->second->getValueType(), it->second,
+        llvm::ArrayRef<llvm::Constant*>{builder->getInt32(0),
+                                        builder->getInt32(0)});
+  }
+
+  /**
+   * Returns string literal (interned), with bytes in the string pool.
+   */
+  llvm::Constant* getStringLiteral(const std::string& str) {
+    auto it = stringLiterals_.find(str);
+
+    if (it != stringLiterals_.end()) {
+      return it->second;
+    }
+
+    auto stringType = getStringType();
+    auto init = llvm::ConstantStruct::get(
+        stringType,
+        {builder->getInt64(str.size()), internString(str),
+         llvm::ConstantAggregateZero::get(stringType->getElementType(2))});
+
+    auto global = new llvm::GlobalVariable(
+        *module, stringType, /* isConstant */ true,
+        llvm::GlobalVariable::PrivateLinkage, init, ".strobj");
+
+    global->setUnnamedAddr(llvm::GlobalValue::UnnamedAddr::Global);
+    global->setAlignment(llvm::MaybeAlign(8));
+
+    stringLiterals_.emplace(str, global);
+
+    return global;
+  }
+
+  /**
+   * Loads the string length (strings are immutable).
+   */
+  llvm::Value* loadStringLength(llvm::Value* str) {
+    if (!isStringType(str->getType())) {
+      DIE << "String is expected in str-len.\n";
+    }
+
+    auto length = builder->CreateLoad(
+        builder->getInt64Ty(),
+        builder->CreateStructGEP(getStringType(), str, 0), "strlen");
+
+    length->setMetadata(llvm::LLVMContext::MD_invariant_load,
+                        llvm::MDNode::get(*ctx, {}));
+
+    return length;
+  }
+
+  /**
+   * Loads pointer to the string bytes ('\0'-terminated).
+   */
+  llvm::Value* loadStringData(llvm::Value* str) {
+    auto data = builder->CreateLoad(
+        builder->getInt8Ty()->getPointerTo(),
+        builder->CreateStructGEP(getStringType(), str, 1), "strdata");
+
+    data->setMetadata(llvm::LLVMContext::MD_invariant_load,
+                      llvm::MDNode::get(*ctx, {}));
+
+    return data;
+  }
+
+  /**
+   * Runtime function for the string operation.
+   */
+  llvm::FunctionCallee getStringFn(const std::string& op) {
+    auto stringPtrType = getStringType()->getPointerTo();
+
+    if (op == "str-concat") {
+      return module->getOrInsertFunction("eva_string_concat", stringPtrType,
+                                         stringPtrType, stringPtrType);
+    }
+
+    auto fnName = op == "str-cmp"  ? "eva_string_compare"
+                  : op == "str-eq" ? "eva_string_equals"
+                                   : "eva_string_hash";
+
+    auto fnType = op == "str-hash"
+                      ? llvm::FunctionType::get(builder->getInt64Ty(),
+                                                stringPtrType, false)
+                      : llvm::FunctionType::get(builder->getInt32Ty(),
+                                                {stringPtrType, stringPtrType},
+                                                false);
+
+    auto callee = module->getOrInsertFunction(fnName, fnType);
+
+    // Only reads the strings:
+    if (auto fn = llvm::dyn_cast<llvm::Function>(callee.getCallee())) {
+      fn->addFnAttr(llvm::Attribute::ReadOnly);
+      fn->addFnAttr(llvm::Attribute::ArgMemOnly);
+      fn->addFnAttr(llvm::Attribute::NoUnwind);
+    }
+
+    return callee;
+  }
+
+  /**
+   * Printf with a literal format is parsed at compile time, and lowered
+   * to the buffered output runtime:
+   *
+   * (printf "x = %d\n" x) ->
+   *
+   *   eva_write_str("x = ", 4)
+   *   eva_write_i32(x)
+   *   eva_write_str("\n", 1)
+   *
+   * Conversions with flags, width, or precision are formatted by
+   * eva_write_format one at a time. Returns the number of written chars.
+   */
+  llvm::Value* createPrintf(const Exp& exp, Env env) {
+    // Non-literal format is evaluated first (the evaluation order):
+    auto formatValue =
+        exp.list[1].type != ExpType::STRING ? gen(exp.list[1], env) : nullptr;
+
+    std::vector<llvm::Value*> args{};
+    for (auto i = 2; i < exp.list.size(); i++) {
+      args.push_back(gen(exp.list[i], env));
+    }
+
+    // Literal formats are checked against the arguments:
+    if (exp.list[1].type == ExpType::STRING) {
+      checkPrintfArgs(unescape(exp.list[1].string), args);
+    }
+
+    std::vector<PrintfChunk> chunks{};
+
+    // Non-literal, or unsupported format: formatted at runtime as a whole.
+    if (exp.list[1].type != ExpType::STRING ||
+        !parsePrintfFormat(exp.list[1].string, chunks)) {
+      auto format =
+          exp.list[1].type == ExpType::STRING
+              ? internString(unescape(exp.list[1].string))
+              : loadStringData(formatValue);
+
+      std::vector<llvm::Value*> formatArgs{format};
+
+      for (auto arg : args) {
+        formatArgs.push_back(toPrintfArg(arg));
+      }
+
+      return builder->CreateCall(getOutputFn("eva_write_format"), formatArgs,
+                                 "printed");
+    }
+
+    llvm::Value* printed = builder->getInt32(0);
+    auto argIndex = 0;
+
+    for (auto& chunk : chunks) {
+      auto written =
+          chunk.isSpec
+              ? createPrintfSpec(chunk.text, args[argIndex++])
+              : builder->CreateCall(getOutputFn("eva_write_str"),
+                                    {internString(chunk.text),
+                                     builder->getInt64(chunk.text.size())});
+
+      printed = builder->CreateAdd(printed, written, "printed");
+    }
+
+    return printed;
+  }
+
+  /**
+   * Splits unescaped printf format into literal text and conversion specs.
+   * Returns false for formats which are formatted as a whole at runtime:
+   * `*` width/precision (the arguments are checked by checkPrintfArgs).
+   */
+  bool parsePrintfFormat(const std::string& rawFormat,
+                         std::vector<PrintfChunk>& chunks) {
+    auto format = unescape(rawFormat);
+    std::string text{};
+
+    for (auto i = 0; i < format.size(); i++) {
+      if (format[i] != '%') {
+        text.push_back(format[i]);
+        continue;
+      }
+
+      // %% escape:
+      if (i + 1 < format.size() && format[i + 1] == '%') {
+        text.push_back('%');
+        i++;
+        continue;
+      }
+
+      auto end = format.find_first_of("diouxXeEfFgGaAcsp*", i + 1);
+
+      if (format[end] == '*') {
+        return false;
+      }
+
+      if (!text.empty()) {
+        chunks.push_back(PrintfChunk{false, text});
+        text.clear();
+      }
+
+      chunks.push_back(PrintfChunk{true, format.substr(i, end - i + 1)});
+      i = end;
+    }
+
+    if (!text.empty()) {
+      chunks.push_back(PrintfChunk{false, text});
+    }
+
+    return true;
+  }
+
+  /**
+   * Checks the arguments of a literal printf format: their number
+   * (a `*` width or precision takes an int), and types per conversion.
+   * Integer conversions take i64 with the l, ll, j, z, t modifiers.
+   */
+  void checkPrintfArgs(const std::string& format,
+                       const std::vector<llvm::Value*>& args) {
+    size_t argIndex = 0;
+
+    for (size_t i = 0; i < format.size(); i++) {
+      if (format[i] != '%') {
+        continue;
+      }
+
+      if (i + 1 < format.size() && format[i + 1] == '%') {
+        i++;
+        continue;
+      }
+
+      auto end = format.find_first_not_of("-+ #0123456789.*hljztL", i + 1);
+      auto conversion = end != std::string::npos ? format[end] : '\0';
+      auto spec =
+          format.substr(i, end != std::string::npos ? end - i + 1 : end);
+
+      auto modifiers = spec.substr(1, spec.size() - 2);
+      auto stars = std::count(modifiers.begin(), modifiers.end(), '*');
+
+      if (conversion == '\0' || stars > 2 ||
+          std::string("diouxXeEfFgGaAcsp").find(conversion) ==
+              std::string::npos) {
+        DIE << "Unsupported printf conversion \"" << spec << "\".\n";
+      }
+
+      if (argIndex + stars + 1 > args.size()) {
+        DIE << "Not enough arguments for \"" << spec << "\" in printf.\n";
+      }
+
+      for (auto j = 0; j < stars; j++) {
+        if (!args[argIndex++]->getType()->isIntegerTy(32)) {
+          DIE << "Width and precision of \"" << spec
+              << "\" should be numbers.\n";
+        }
+      }
+
+      auto argType = args[argIndex++]->getType();
+      auto isLong = modifiers.find_first_of("ljzt") != std::string::npos;
+      auto isFloat = std::string("eEfFgGaA").find(conversion) !=
+                     std::string::npos;
+
+      auto isValid = false;
+
+      if (conversion == 's') {
+        isValid = isStringType(argType) || argType == builder->getInt8PtrTy();
+      } else if (conversion == 'p') {
+        isValid = argType->isPointerTy();
+      } else if (isFloat) {
+        isValid = argType->isFloatingPointTy();
+      } else {
+        isValid = argType->isIntegerTy() &&
+                  (isLong ? argType->isIntegerTy(64)
+                          : argType->getIntegerBitWidth() <= 32);
+      }
+
+      if (!isValid) {
+        DIE << "Argument " << argIndex << " of printf ("
+            << (isStringType(argType) ? "string" : mangleType(argType))
+            << ") does not match \"" << spec << "\".\n";
+      }
+
+      i = end;
+    }
+
+    if (argIndex != args.size()) {
+      DIE << "Too many arguments for printf: the format takes " << argIndex
+          << ", given " << args.size() << ".\n";
+    }
+  }
+
+  /**
+   * Writes one printf conversion: simple specs of matching types are
+   * written directly, the others go through eva_write_format.
+   */
+  llvm::Value* createPrintfSpec(const std::string& spec, llvm::Value* arg) {
+    auto conversion = spec.back();
+    auto modifiers = spec.substr(1, spec.size() - 2);
+    auto argType = arg->getType();
+
+    if (modifiers.empty()) {
+      if ((conversion == 'd' || conversion == 'i') &&
+          (argType->isIntegerTy(32) || argType->isIntegerTy(1))) {
+        return builder->CreateCall(
+            getOutputFn("eva_write_i32"),
+            builder->CreateZExt(arg, builder->getInt32Ty()));
+      }
+
+      if (conversion == 'u' && argType->isIntegerTy(32)) {
+        return builder->CreateCall(getOutputFn("eva_write_u32"), arg);
+      }
+
+      if (conversion == 'c' && argType->isIntegerTy(32)) {
+        return builder->CreateCall(getOutputFn("eva_write_char"), arg);
+      }
+
+      if (conversion == 's' && isStringType(argType)) {
+        return builder->CreateCall(
+            getOutputFn("eva_write_str"),
+            {loadStringData(arg), loadStringLength(arg)});
+      }
+
+      if (conversion == 's' &&
+          argType == builder->getInt8Ty()->getPointerTo()) {
+        return builder->CreateCall(getOutputFn("eva_write_cstr"), arg);
+      }
+    }
+
+    if ((modifiers == "l" || modifiers == "ll") && argType->isIntegerTy(64)) {
+      if (conversion == 'd' || conversion == 'i') {
+        return builder->CreateCall(getOutputFn("eva_write_i64"), arg);
+      }
+
+      if (conversion == 'u') {
+        return builder->CreateCall(getOutputFn("eva_write_u64"), arg);
+      }
+    }
+
+    return builder->CreateCall(getOutputFn("eva_write_format"),
+                               {internString(spec), toPrintfArg(arg)});
+  }
+
+  /**
+   * Converts a value to a C vararg: strings to char*, default
+   * argument promotions for booleans and floats.
+   */
+  llvm::Value* toPrintfArg(llvm::Value* arg) {
+    if (isStringType(arg->getType())) {
+      return loadStringData(arg);
+    }
+
+    if (arg->getType()->isIntegerTy(1)) {
+      return builder->CreateZExt(arg, builder->getInt32Ty());
+    }
+
+    if (arg->getType()->isFloatTy()) {
+      return builder->CreateFPExt(arg, builder->getDoubleTy());
+    }
+
+    return arg;
+  }
+
+  /**
+   * Output runtime function (see runtime/EvaOutput.cpp).
+   */
+  llvm::FunctionCallee getOutputFn(const std::string& fnName) {
+    auto charPtrType = builder->getInt8Ty()->getPointerTo();
+    auto resultType = builder->getInt32Ty();
+
+    llvm::FunctionType* fnType = nullptr;
+
+    if (fnName == "eva_write_str") {
+      fnType = llvm::FunctionType::get(
+          resultType, {charPtrType, builder->getInt64Ty()}, false);
+    } else if (fnName == "eva_write_cstr" || fnName == "eva_write_format") {
+      auto isVarArg = fnName == "eva_write_format";
+      fnType = llvm::FunctionType::get(resultType, charPtrType, isVarArg);
+    } else if (fnName == "eva_write_i64" || fnName == "eva_write_u64") {
+      fnType =
+          llvm::FunctionType::get(resultType, builder->getInt64Ty(), false);
+    } else if (fnName == "eva_flush") {
+      fnType = llvm::FunctionType::get(builder->getVoidTy(), false);
+    } else {
+      fnType =
+          llvm::FunctionType::get(resultType, builder->getInt32Ty(), false);
+    }
+
+    auto callee = module->getOrInsertFunction(fnName, fnType);
+
+    if (auto fn = llvm::dyn_cast<llvm::Function>(callee.getCallee())) {
+      fn->addFnAttr(llvm::Attribute::NoUnwind);
+    }
+
+    return callee;
+  }
+
+  /**
+   * Compiles an async function as a function returning the task,
+   * with the coroutine in the body:
+   *
+   * (async def fetch ((fd number)) -> number <body>)
+   *
+   * (def fetch ((fd number)) -> (task number) (async-body <body>))
+   */
+  llvm::Value* compileAsyncFunction(const Exp& fnExp, Env env) {
+    auto fnName = fnExp.list[1].string;
+
+    if (isGeneric(fnExp)) {
+      DIE << "Async function \"" << fnName
+          << "\" must have typed parameters.\n";
+    }
+
+    std::string defTag = "def";
+    std::string arrow = "->";
+    std::string taskTag = "task";
+    std::string asyncBodyTag = "async-body";
+    std::string defaultType = "number";
+
+    auto resultTypeExp =
+        hasReturnType(fnExp) ? fnExp.list[4] : Exp(defaultType);
+    auto& body = hasReturnType(fnExp) ? fnExp.list[5] : fnExp.list[3];
+
+    return compileFunction(
+        Exp(std::vector<Exp>{
+            Exp(defTag),
+            fnExp.list[1],
+            fnExp.list[2],
+            Exp(arrow),
+            Exp(std::vector<Exp>{Exp(taskTag), resultTypeExp}),
+            Exp(std::vector<Exp>{Exp(asyncBodyTag), body}),
+        }),
+        fnName, env);
+  }
+
+  /**
+   * Coroutine of an async function (switch-resumed lowering):
+   *
+   * - the frame is allocated with malloc, unless the coroutine is
+   *   elided into the caller's frame (llvm.coro.alloc);
+   * - the promise { waiter, result } stores the result, and the
+   *   awaiting coroutine, which is scheduled at the completion;
+   * - the final suspension keeps the frame, which is destroyed when
+   *   the result is taken (see takeTaskResult).
+   *
+   * Returns the handle (task) to the caller at the first suspension.
+   */
+  llvm::Value* compileAsyncBody(const Exp& body, Env env) {
+    auto taskType = fn->getReturnType();
+    auto resultType = getTaskResultType(taskType);
+    auto promiseType = getPromiseType(resultType);
+    auto charPtrType = builder->getInt8PtrTy();
+    auto nullPtr = llvm::ConstantPointerNull::get(charPtrType);
+
+    hasCoroutines_ = true;
+    fn->addFnAttr("coroutine.presplit", "0");
+
+    auto promise = builder->CreateAlloca(promiseType, nullptr, "promise");
+    promise->setAlignment(llvm::Align(PROMISE_ALIGN));
+
+    auto outerCoroutine = coroutine_;
+
+    coroutine_.id = builder->CreateCall(
+        getCoroIntrinsic(llvm::Intrinsic::coro_id),
+        {builder->getInt32(0),
+         builder->CreateBitCast(promise, charPtrType), nullPtr, nullPtr},
+        "id");
+
+    // Frame allocation (removed if the frame is elided):
+    auto needAlloc = builder->CreateCall(
+        getCoroIntrinsic(llvm::Intrinsic::coro_alloc), coroutine_.id);
+
+    auto entryBlock = builder->GetInsertBlock();
+    auto allocBlock = createBB("coro.alloc", fn);
+    auto beginBlock = createBB("coro.begin", fn);
+
+    builder->CreateCondBr(needAlloc, allocBlock, beginBlock);
+
+    builder->SetInsertPoint(allocBlock);
+    auto size =
+        builder->CreateCall(getCoroIntrinsic(llvm::Intrinsic::coro_size));
+    auto allocated =
+        builder->CreateCall(getMemoryFn("malloc"), size, "frame");
+    builder->CreateBr(beginBlock);
+
+    builder->SetInsertPoint(beginBlock);
+    auto frame = builder->CreatePHI(charPtrType, 2);
+    frame->addIncoming(nullPtr, entryBlock);
+    frame->addIncoming(allocated, allocBlock);
+
+    coroutine_.handle = builder->CreateCall(
+        getCoroIntrinsic(llvm::Intrinsic::coro_begin),
+        {coroutine_.id, frame}, "handle");
+
+    // No awaiter yet. The promise is in the frame, so it's initialized
+    // after coro.begin (stores before it aren't moved to the frame):
+    builder->CreateStore(nullPtr,
+                         builder->CreateStructGEP(promiseType, promise, 0));
+
+    coroutine_.cleanupBlock = llvm::BasicBlock::Create(*ctx, "coro.cleanup");
+    coroutine_.suspendBlock = llvm::BasicBlock::Create(*ctx, "coro.suspend");
+
+    // Body, the result is stored in the promise:
+    auto result = gen(body, env);
+
+    result = castValue(result, resultType);
+
+    builder->CreateStore(result,
+                         builder->CreateStructGEP(promiseType, promise, 1));
+
+    // Schedule the awaiting coroutine:
+    auto waiter = builder->CreateLoad(
+        charPtrType, builder->CreateStructGEP(promiseType, promise, 0),
+        "waiter");
+
+    auto scheduleBlock = createBB("coro.schedule", fn);
+    auto finalBlock = createBB("coro.final", fn);
+
+    builder->CreateCondBr(builder->CreateIsNotNull(waiter), scheduleBlock,
+                          finalBlock);
+
+    builder->SetInsertPoint(scheduleBlock);
+    builder->CreateCall(getEventLoopFn("eva_loop_schedule"), waiter);
+    builder->CreateBr(finalBlock);
+
+    builder->SetInsertPoint(finalBlock);
+    suspendCoroutine(saveCoroutine(), /* isFinal */ true);
+
+    // Destroy: free the frame (if allocated).
+    fn->getBasicBlockList().push_back(coroutine_.cleanupBlock);
+    builder->SetInsertPoint(coroutine_.cleanupBlock);
+
+    auto freed = builder->CreateCall(
+        getCoroIntrinsic(llvm::Intrinsic::coro_free),
+        {coroutine_.id, coroutine_.handle});
+    builder->CreateCall(getMemoryFn("free"), freed);
+    builder->CreateBr(coroutine_.suspendBlock);
+
+    // Return to the caller (or resumer):
+    fn->getBasicBlockList().push_back(coroutine_.suspendBlock);
+    builder->SetInsertPoint(coroutine_.suspendBlock);
+
+    builder->CreateCall(getCoroIntrinsic(llvm::Intrinsic::coro_end),
+                        {coroutine_.handle, builder->getFalse()});
+
+    auto task = builder->CreateBitCast(coroutine_.handle, taskType);
+
+    coroutine_ = outerCoroutine;
+
+    return task;
+  }
+
+  /**
+   * (await <exp>): suspends the coroutine, it is resumed by the event
+   * loop (timers and fds), or by the awaited task at its completion.
+   */
+  llvm::Value* compileAwait(const Exp& exp, Env env) {
+    if (coroutine_.handle == nullptr) {
+      DIE << "await is only allowed in async functions.\n";
+    }
+
+    // (await (sleep <ms>))
+    if (isTaggedList(exp, "sleep")) {
+      auto ms = castNumeric(gen(exp.list[1], env), builder->getInt32Ty());
+
+      auto save = saveCoroutine();
+      builder->CreateCall(getEventLoopFn("eva_loop_sleep"),
+                          {coroutine_.handle, ms});
+      suspendCoroutine(save);
+
+      return builder->getInt32(0);
+    }
+
+    // (await (readable <fd>)), (await (writable <fd>))
+    if (isTaggedList(exp, "readable") || isTaggedList(exp, "writable")) {
+      auto fd = castNumeric(gen(exp.list[1], env), builder->getInt32Ty());
+      auto writable = builder->getInt32(isTaggedList(exp, "writable"));
+
+      auto save = saveCoroutine();
+      builder->CreateCall(getEventLoopFn("eva_loop_wait_fd"),
+                          {coroutine_.handle, fd, writable});
+      suspendCoroutine(save);
+
+      return builder->getInt32(0);
+    }
+
+    // (await <task>)
+    auto task = gen(exp, env);
+
+    if (!isTaskType(task->getType())) {
+      DIE << "await expects a task, (sleep <ms>), (readable <fd>), or "
+             "(writable <fd>).\n";
+    }
+
+    auto resultType = getTaskResultType(task->getType());
+    auto handle = builder->CreateBitCast(task, builder->getInt8PtrTy());
+
+    auto waitBlock = createBB("await.wait", fn);
+    auto readyBlock = createBB("await.ready", fn);
+
+    // Completed synchronously (no suspensions):
+    auto done = builder->CreateCall(
+        getCoroIntrinsic(llvm::Intrinsic::coro_done), handle, "done");
+    builder->CreateCondBr(done, readyBlock, waitBlock);
+
+    // Subscribe to the completion. A task has one awaiter: another
+    // one would replace it, and the first would never resume (traps).
+    builder->SetInsertPoint(waitBlock);
+
+    auto waiterPtr = builder->CreateStructGEP(
+        getPromiseType(resultType), getTaskPromise(handle, resultType), 0);
+    auto waiter =
+        builder->CreateLoad(builder->getInt8PtrTy(), waiterPtr, "waiter");
+    emitCheck(builder->CreateIsNull(waiter), "await");
+
+    auto save = saveCoroutine();
+    builder->CreateStore(coroutine_.handle, waiterPtr);
+    suspendCoroutine(save);
+    builder->CreateBr(readyBlock);
+
+    builder->SetInsertPoint(readyBlock);
+    return takeTaskResult(handle, resultType);
+  }
+
+  /**
+   * Saves the coroutine state before it's registered to be resumed.
+   */
+  llvm::Value* saveCoroutine() {
+    return builder->CreateCall(getCoroIntrinsic(llvm::Intrinsic::coro_save),
+                               coroutine_.handle, "save");
+  }
+
+  /**
+   * Suspension point: returns to the caller (or resumer), and
+   * continues in a new block when resumed. The final suspension
+   * is never resumed, only destroyed.
+   */
+  void suspendCoroutine(llvm::Value* save, bool isFinal = false) {
+    auto suspended = builder->CreateCall(
+        getCoroIntrinsic(llvm::Intrinsic::coro_suspend),
+        {save, builder->getInt1(isFinal)}, "suspended");
+
+    auto resumeBlock = createBB(isFinal ? "coro.unreachable" : "resume", fn);
+
+    auto switchInst =
+        builder->CreateSwitch(suspended, coroutine_.suspendBlock, 2);
+    switchInst->addCase(builder->getInt8(0), resumeBlock);
+    switchInst->addCase(builder->getInt8(1), coroutine_.cleanupBlock);
+
+    builder->SetInsertPoint(resumeBlock);
+
+    if (isFinal) {
+      builder->CreateUnreachable();
+    }
+  }
+
+  /**
+   * Result of the completed task, the task frame is destroyed.
+   */
+  llvm::Value* takeTaskResult(llvm::Value* handle, llvm::Type* resultType) {
+    auto result = builder->CreateLoad(
+        resultType,
+        builder->CreateStructGEP(getPromiseType(resultType),
+                                 getTaskPromise(handle, resultType), 1),
+        "result");
+
+    builder->CreateCall(getCoroIntrinsic(llvm::Intrinsic::coro_destroy),
+                        handle);
+
+    return result;
+  }
+
+  /**
+   * Promise of the task: { waiter, result }.
+   */
+  llvm::Value* getTaskPromise(llvm::Value* handle, llvm::Type* resultType) {
+    auto promise = builder->CreateCall(
+        getCoroIntrinsic(llvm::Intrinsic::coro_promise),
+        {handle, builder->getInt32(PROMISE_ALIGN), builder->getFalse()});
+
+    return builder->CreateBitCast(
+        promise, getPromiseType(resultType)->getPointerTo(), "promise");
+  }
+
+  /**
+   * Promise type: awaiting coroutine handle, and the result.
+   */
+  llvm::StructType* getPromiseType(llvm::Type* resultType) {
+    return llvm::StructType::get(*ctx,
+                                 {builder->getInt8PtrTy(), resultType});
+  }
+
+  /**
+   * Task of an async function: %EvaTask.i32* (the coroutine handle).
+   */
+  llvm::Type* getTaskType(llvm::Type* resultType) {
+    auto taskName = "EvaTask." + mangleType(resultType);
+    auto taskType = llvm::StructType::getTypeByName(*ctx, taskName);
+
+    if (taskType == nullptr) {
+      taskType = llvm::StructType::create(*ctx, taskName);
+      taskResultTypes_[taskType] = resultType;
+    }
+
+    return taskType->getPointerTo();
+  }
+
+  /**
+   * Whether the type is a task.
+   */
+  bool isTaskType(llvm::Type* type_) {
+    return type_->isPointerTy() &&
+           type_->getPointerElementType()->isStructTy() &&
+           taskResultTypes_.count(llvm::cast<llvm::StructType>(
+               type_->getPointerElementType())) != 0;
+  }
+
+  /**
+   * Result type of the task.
+   */
+  llvm::Type* getTaskResultType(llvm::Type* taskType) {
+    return taskResultTypes_.at(
+        llvm::cast<llvm::StructType>(taskType->getPointerElementType()));
+  }
+
+  /**
+   * Coroutine intrinsic (llvm.coro.*).
+   */
+  llvm::Function* getCoroIntrinsic(llvm::Intrinsic::ID id) {
+    if (id == llvm::Intrinsic::coro_size) {
+      return llvm::Intrinsic::getDeclaration(module.get(), id,
+                                             builder->getInt64Ty());
+    }
+
+    return llvm::Intrinsic::getDeclaration(module.get(), id);
+  }
+
+  /**
+   * Event loop runtime function (see runtime/EvaEventLoop.cpp).
+   */
+  llvm::FunctionCallee getEventLoopFn(const std::string& fnName) {
+    auto charPtrType = builder->getInt8PtrTy();
+    auto voidType = builder->getVoidTy();
+    auto i32Type = builder->getInt32Ty();
+
+    llvm::FunctionType* fnType = nullptr;
+
+    if (fnName == "eva_loop_sleep") {
+      fnType = llvm::FunctionType::get(voidType, {charPtrType, i32Type},
+                                       false);
+    } else if (fnName == "eva_loop_wait_fd") {
+      fnType = llvm::FunctionType::get(
+          voidType, {charPtrType, i32Type, i32Type}, false);
+    } else {
+      fnType = llvm::FunctionType::get(voidType, charPtrType, false);
+    }
+
+    auto callee = module->getOrInsertFunction(fnName, fnType);
+
+    if (auto fn = llvm::dyn_cast<llvm::Function>(callee.getCallee())) {
+      fn->addFnAttr(llvm::Attribute::NoUnwind);
+    }
+
+    return callee;
+  }
+
+  /**
+   * Atomic operations on a place (see gen), with the memory orders.
+   * Accesses are naturally aligned.
+   */
+  llvm::Value* compileAtomic(const std::string& op, const Exp& exp,
+                             Env env) {
+    if (op == "fence") {
+      auto order = getAtomicOrdering(exp, 1);
+
+      if (order == llvm::AtomicOrdering::Monotonic) {
+        DIE << "fence cannot be relaxed.\n";
+      }
+
+      builder->CreateFence(order);
+      return builder->getInt32(0);
+    }
+
+    auto ptr = getPlacePtr(exp.list[1], env);
+    auto type_ = ptr->getType()->getPointerElementType();
+
+    // Atomics are on byte-sized scalars: numbers and references (not
+    // booleans, which are i1, nor vectors and interface values):
+    if (!(type_->isIntegerTy() || type_->isFloatingPointTy() ||
+          type_->isPointerTy()) ||
+        (type_->isIntegerTy() && type_->getIntegerBitWidth() % 8 != 0)) {
+      DIE << op << " expects a number or a reference place, given "
+          << mangleType(type_) << ".\n";
+    }
+
+    auto align = llvm::Align(getTypeSize(type_));
+
+    if (op != "atomic-load" && exp.list[1].type == ExpType::SYMBOL) {
+      checkAssignable(exp.list[1].string, ptr);
+    }
+
+    if (op == "atomic-load") {
+      auto order = getAtomicOrdering(exp, 2);
+
+      if (order == llvm::AtomicOrdering::Release ||
+          order == llvm::AtomicOrdering::AcquireRelease) {
+        DIE << "atomic-load cannot be release or acq-rel.\n";
+      }
+
+      auto load = builder->CreateAlignedLoad(type_, ptr, align, "aload");
+      load->setAtomic(order);
+      return load;
+    }
+
+    auto value = castValue(gen(exp.list[2], env), type_);
+
+    if (op == "atomic-store") {
+      auto order = getAtomicOrdering(exp, 3);
+
+      if (order == llvm::AtomicOrdering::Acquire ||
+          order == llvm::AtomicOrdering::AcquireRelease) {
+        DIE << "atomic-store cannot be acquire or acq-rel.\n";
+      }
+
+      auto store = builder->CreateAlignedStore(value, ptr, align);
+      store->setAtomic(order);
+      return value;
+    }
+
+    if (op == "atomic-cas") {
+      if (!type_->isIntegerTy() && !type_->isPointerTy()) {
+        DIE << "atomic-cas expects an integer or a reference place.\n";
+      }
+
+      auto desired = castValue(gen(exp.list[3], env), type_);
+      auto successOrder = getAtomicOrdering(exp, 4);
+
+      // Failure order: explicit, or the success order without release.
+      auto failureOrder =
+          exp.list.size() > 5
+              ? getAtomicOrdering(exp, 5)
+              : llvm::AtomicCmpXchgInst::getStrongestFailureOrdering(
+                    successOrder);
+
+      if (failureOrder == llvm::AtomicOrdering::Release ||
+          failureOrder == llvm::AtomicOrdering::AcquireRelease) {
+        DIE << "atomic-cas failure order cannot be release or acq-rel.\n";
+      }
+
+      auto cas = builder->CreateAtomicCmpXchg(ptr, value, desired, align,
+                                              successOrder, failureOrder);
+
+      return builder->CreateExtractValue(cas, 1, "cas");
+    }
+
+    // Read-modify-write, returns the old value:
+    auto isFloat = type_->isFloatingPointTy();
+
+    auto rmwOp = op == "atomic-xchg" ? llvm::AtomicRMWInst::Xchg
+                 : op == "atomic-add"
+                     ? (isFloat ? llvm::AtomicRMWInst::FAdd
+                                : llvm::AtomicRMWInst::Add)
+                     : (isFloat ? llvm::AtomicRMWInst::FSub
+                                : llvm::AtomicRMWInst::Sub);
+
+    if (!isFloat && !type_->isIntegerTy() &&
+        rmwOp != llvm::AtomicRMWInst::Xchg) {
+      DIE << op << " expects a numeric place.\n";
+    }
+
+    // References are exchanged as integers (atomicrmw has no pointers):
+    if (type_->isPointerTy()) {
+      auto intType = builder->getIntNTy(getTypeSize(type_) * 8);
+
+      auto old = builder->CreateAtomicRMW(
+          rmwOp, builder->CreateBitCast(ptr, intType->getPointerTo()),
+          builder->CreatePtrToInt(value, intType), align,
+          getAtomicOrdering(exp, 3));
+
+      return builder->CreateIntToPtr(old, type_);
+    }
+
+    return builder->CreateAtomicRMW(rmwOp, ptr, value, align,
+                                    getAtomicOrdering(exp, 3));
+  }
+
+  /**
+   * Memory order argument at the index (seq-cst if not given).
+   */
+  llvm::AtomicOrdering getAtomicOrdering(const Exp& exp, size_t index) {
+    if (exp.list.size() <= index) {
+      return llvm::AtomicOrdering::SequentiallyConsistent;
+    }
+
+    auto& order = exp.list[index].string;
+
+    if (order == "relaxed") {
+      return llvm::AtomicOrdering::Monotonic;
+    }
+
+    if (order == "acquire") {
+      return llvm::AtomicOrdering::Acquire;
+    }
+
+    if (order == "release") {
+      return llvm::AtomicOrdering::Release;
+    }
+
+    if (order == "acq-rel") {
+      return llvm::AtomicOrdering::AcquireRelease;
+    }
+
+    if (order == "seq-cst") {
+      return llvm::AtomicOrdering::SequentiallyConsistent;
+    }
+
+    DIE << "Unknown memory order \"" << order
+        << "\" (relaxed, acquire, release, acq-rel, seq-cst).\n";
+    return llvm::AtomicOrdering::SequentiallyConsistent;
+  }
+
+  /**
+   * Pointer to a place of atomic operations:
+   *
+   * x -> local or global variable
+   * (prop p x) -> field of the instance
+   * (aref a i) -> element of the array
+   */
+  llvm::Value* getPlacePtr(const Exp& place, Env env) {
+    if (place.type == ExpType::SYMBOL) {
+      auto value = env->lookup(place.string);
+
+      if (llvm::isa<llvm::AllocaInst>(value) ||
+          llvm::isa<llvm::GlobalVariable>(value)) {
+        return value;
+      }
+    }
+
+    if (isTaggedList(place, "prop")) {
+      auto instance = gen(place.list[1], env);
+      auto cls =
+          (llvm::StructType*)(instance->getType()->getPointerElementType());
+      return builder->CreateStructGEP(
+          cls, instance, getFieldIndex(cls, place.list[2].string),
+          place.list[2].string);
+    }
+
+    if (isTaggedList(place, "aref")) {
+      return getArrayElementPtr(gen(place.list[1], env),
+                                gen(place.list[2], env));
+    }
+
+    DIE << "Atomic operations expect a variable, (prop ...), or (aref ...).\n";
+    return nullptr;
+  }
+
+  /**
+   * malloc / free of the memory which is freed explicitly (coroutine
+   * frames, environments of spawned jobs).
+   */
+  llvm::FunctionCallee getMemoryFn(const std::string& fnName) {
+    auto charPtrType = builder->getInt8PtrTy();
+
+    auto fnType =
+        fnName == "malloc"
+            ? llvm::FunctionType::get(charPtrType, builder->getInt64Ty(),
+                                      false)
+            : llvm::FunctionType::get(builder->getVoidTy(), charPtrType,
+                                      false);
+
+    auto callee = module->getOrInsertFunction(fnName, fnType);
+
+    if (auto fn = llvm::dyn_cast<llvm::Function>(callee.getCallee())) {
+      fn->addFnAttr(llvm::Attribute::NoUnwind);
+    }
+
+    return callee;
+  }
+
+  /**
+   * (spawn (<fn> <args>)): the arguments are evaluated, and the call
+   * is outlined into a job, which runs on a worker:
+   *
+   * void __spawn.N(i8* env)
+   *
+   * The environment { job, result, args } is the future of the result.
+   */
+  llvm::Value* compileSpawn(const Exp& callExp, Env env) {
+    if (callExp.type != ExpType::LIST || callExp.list.empty() ||
+        callExp.list[0].type != ExpType::SYMBOL) {
+      DIE << "spawn expects a function call: (spawn (<fn> <args>)).\n";
+    }
+
+    auto fnName = callExp.list[0].string;
+
+    std::vector<llvm::Value*> args{};
+    std::vector<llvm::Type*> argTypes{};
+
+    for (auto i = 1; i < callExp.list.size(); i++) {
+      args.push_back(gen(callExp.list[i], env));
+      argTypes.push_back(args.back()->getType());
+    }
+
+    auto callee = genericFns_.count(fnName) != 0
+                      ? getSpecialization(fnName, argTypes)
+                      : module->getFunction(fnName);
+
+    if (callee == nullptr || callee->arg_size() != args.size()) {
+      DIE << "spawn: unknown function \"" << fnName << "\" or wrong number "
+          << "of arguments.\n";
+    }
+
+    // Environment: { job, result, args }
+    std::vector<llvm::Type*> fieldTypes{builder->getInt8PtrTy(),
+                                        callee->getReturnType()};
+
+    for (auto i = 0; i < args.size(); i++) {
+      args[i] = castValue(args[i], callee->getArg(i)->getType());
+      fieldTypes.push_back(args[i]->getType());
+    }
+
+    auto envType = llvm::StructType::get(*ctx, fieldTypes);
+
+    auto jobEnv = builder->CreateBitCast(
+        builder->CreateCall(getMemoryFn("malloc"),
+                            builder->getInt64(getTypeSize(envType))),
+        envType->getPointerTo(), "spawn.env");
+
+    for (auto i = 0; i < args.size(); i++) {
+      builder->CreateStore(args[i],
+                           builder->CreateStructGEP(envType, jobEnv, i + 2));
+    }
+
+    // Job: calls the function with the args, and stores the result.
+    auto jobFn = createOutlinedFunction(
+        "__spawn", llvm::FunctionType::get(builder->getVoidTy(),
+                                           builder->getInt8PtrTy(), false));
+    {
+      llvm::IRBuilderBase::InsertPointGuard guard(*builder);
+      builder->SetInsertPoint(&jobFn->getEntryBlock());
+
+      auto jobArgs = builder->CreateBitCast(jobFn->getArg(0),
+                                            envType->getPointerTo());
+
+      std::vector<llvm::Value*> callArgs{};
+
+      for (auto i = 0; i < args.size(); i++) {
+        auto argPtr = builder->CreateStructGEP(envType, jobArgs, i + 2);
+        callArgs.push_back(builder->CreateLoad(fieldTypes[i + 2], argPtr));
+      }
+
+      builder->CreateStore(builder->CreateCall(callee, callArgs),
+                           builder->CreateStructGEP(envType, jobArgs, 1));
+      builder->CreateRetVoid();
+    }
+
+    auto job = builder->CreateCall(
+        getSchedulerFn("eva_spawn"),
+        {jobFn, builder->CreateBitCast(jobEnv, builder->getInt8PtrTy())},
+        "job");
+
+    builder->CreateStore(job, builder->CreateStructGEP(envType, jobEnv, 0));
+
+    return builder->CreateBitCast(
+        jobEnv, getFutureType(callee->getReturnType()), "future");
+  }
+
+  /**
+   * (sync <future>): waits for the job (running other jobs meanwhile),
+   * and returns the result. The environment is freed.
+   */
+  llvm::Value* compileSync(const Exp& exp, Env env) {
+    auto future = gen(exp, env);
+
+    if (!isFutureType(future->getType())) {
+      DIE << "Future of (spawn ...) is expected in sync.\n";
+    }
+
+    auto resultType = getFutureResultType(future->getType());
+    auto stateType =
+        llvm::StructType::get(*ctx, {builder->getInt8PtrTy(), resultType});
+
+    auto state = builder->CreateBitCast(future, stateType->getPointerTo());
+
+    auto job = builder->CreateLoad(
+        builder->getInt8PtrTy(), builder->CreateStructGEP(stateType, state, 0),
+        "job");
+    builder->CreateCall(getSchedulerFn("eva_sync"), job);
+
+    auto result = builder->CreateLoad(
+        resultType, builder->CreateStructGEP(stateType, state, 1), "result");
+
+    builder->CreateCall(getMemoryFn("free"),
+                        builder->CreateBitCast(state, builder->getInt8PtrTy()));
+
+    return result;
+  }
+
+  /**
+   * (parallel-for (<var> <start> <end>) <body>)
+   *
+   * The body is outlined into a function over a subrange of the
+   * iterations, which the scheduler splits among the workers:
+   *
+   * void __parallel_for.N(i8* env, i64 from, i64 to)
+   *
+   * Local variables are captured by value (arrays and instances are
+   * references), so iterations share only the memory they point to.
+   * Assigning a captured variable would only update the copy, and is
+   * an error: use an array element, a field, or a global.
+   */
+  llvm::Value* compileParallelFor(const Exp& exp, Env env) {
+    auto& header = exp.list[1];
+    auto indexName = header.list[0].string;
+
+    auto start = gen(header.list[1], env);
+    auto end = gen(header.list[2], env);
+    auto indexType = getCommonNumericType(start->getType(), end->getType());
+
+    if (!indexType->isIntegerTy()) {
+      DIE << "parallel-for range must be integer.\n";
+    }
+
+    auto i64Type = builder->getInt64Ty();
+    start = builder->CreateSExtOrTrunc(castNumeric(start, indexType), i64Type);
+    end = builder->CreateSExtOrTrunc(castNumeric(end, indexType), i64Type);
+
+    // Captured variables (the caller waits, the environment is on stack):
+    auto captures = collectCaptures(exp.list[2], env, {indexName});
+    auto envType = getCapturesType(captures);
+    setAllocaInsertPoint();
+    auto bodyEnv = varsBuilder->CreateAlloca(envType, nullptr, "pfor.env");
+
+    storeCaptures(captures, envType, bodyEnv);
+
+    auto bodyFn = createOutlinedFunction(
+        "__parallel_for",
+        llvm::FunctionType::get(builder->getVoidTy(),
+                                {builder->getInt8PtrTy(), i64Type, i64Type},
+                                false));
+    {
+      llvm::IRBuilderBase::InsertPointGuard guard(*builder);
+
+      auto outerFn = fn;
+      auto outerCoroutine = coroutine_;
+      auto outerLoopRanges = loopRanges_;
+      auto outerCapturedVars = capturedVars_;
+
+      fn = bodyFn;
+      coroutine_ = Coroutine{};
+      loopRanges_.clear();
+
+      auto entryBlock = &bodyFn->getEntryBlock();
+      builder->SetInsertPoint(entryBlock);
+
+      auto innerEnv = loadCaptures(
+          captures, envType,
+          builder->CreateBitCast(bodyFn->getArg(0), envType->getPointerTo()));
+
+      for (auto& capture : captures) {
+        capturedVars_.insert(innerEnv->lookup(capture.first));
+      }
+
+      auto indexVar = allocVar(indexName, indexType, innerEnv);
+
+      auto headerBlock = createBB("pfor.header", bodyFn);
+      auto bodyBlock = createBB("pfor.body", bodyFn);
+      auto exitBlock = createBB("pfor.exit", bodyFn);
+
+      builder->CreateBr(headerBlock);
+
+      builder->SetInsertPoint(headerBlock);
+      auto iteration = builder->CreatePHI(i64Type, 2, "iteration");
+      iteration->addIncoming(bodyFn->getArg(1), entryBlock);
+      builder->CreateCondBr(
+          builder->CreateICmpSLT(iteration, bodyFn->getArg(2)), bodyBlock,
+          exitBlock);
+
+      builder->SetInsertPoint(bodyBlock);
+      builder->CreateStore(builder->CreateTrunc(iteration, indexType),
+                           indexVar);
+      gen(exp.list[2], innerEnv);
+
+      iteration->addIncoming(
+          builder->CreateAdd(iteration, builder->getInt64(1)),
+          builder->GetInsertBlock());
+      builder->CreateBr(headerBlock);
+
+      builder->SetInsertPoint(exitBlock);
+      builder->CreateRetVoid();
+
+      fn = outerFn;
+      coroutine_ = outerCoroutine;
+      loopRanges_ = outerLoopRanges;
+      capturedVars_ = outerCapturedVars;
+    }
+
+    builder->CreateCall(
+        getSchedulerFn("eva_parallel_for"),
+        {start, end, bodyFn,
+         builder->CreateBitCast(bodyEnv, builder->getInt8PtrTy())});
+
+    return builder->getInt32(0);
+  }
+
+  /**
+   * Local variables used in the expression, which are captured by
+   * outlined functions. Globals and functions are referenced directly.
+   */
+  std::map<std::string, llvm::AllocaInst*> collectCaptures(
+      const Exp& exp, Env env, const std::set<std::string>& bound) {
+    std::map<std::string, llvm::AllocaInst*> captures{};
+    collectCaptures(exp, env, bound, captures);
+    return captures;
+  }
+
+  void collectCaptures(const Exp& exp, Env env,
+                       const std::set<std::string>& bound,
+                       std::map<std::string, llvm::AllocaInst*>& captures) {
+    if (exp.type == ExpType::SYMBOL) {
+      if (bound.count(exp.string) == 0 && env->has(exp.string)) {
+        if (auto local = llvm::dyn_cast<llvm::AllocaInst>(
+                env->lookup(exp.string))) {
+          captures[exp.string] = local;
+        }
+      }
+      return;
+    }
+
+    if (exp.type == ExpType::LIST) {
+      for (auto& e : exp.list) {
+        collectCaptures(e, env, bound, captures);
+      }
+    }
+  }
+
+  /**
+   * Dies on assignments to the variables captured (copied) by the
+   * parallel-for body being compiled, and to the imported variables.
+   */
+  void checkAssignable(const std::string& name, llvm::Value* binding) {
+    auto globalVar = llvm::dyn_cast<llvm::GlobalVariable>(binding);
+
+    if (globalVar != nullptr && globalVar->isDeclaration()) {
+      DIE << "Cannot assign \"" << name << "\": imported variables are "
+             "assigned in their modules only.\n";
+    }
+
+    if (capturedVars_.count(binding) != 0) {
+      DIE << "Cannot assign \"" << name
+          << "\" in parallel-for: captured by value (use an array "
+             "element, a field, or a global).\n";
+    }
+  }
+
+  /**
+   * Environment of the captured variables: struct of their types.
+   */
+  llvm::StructType* getCapturesType(
+      const std::map<std::string, llvm::AllocaInst*>& captures) {
+    std::vector<llvm::Type*> types{};
+
+    for (auto& capture : captures) {
+      types.push_back(capture.second->getAllocatedType());
+    }
+
+    return llvm::StructType::get(*ctx, types);
+  }
+
+  /**
+   * Copies the captured variables to the environment.
+   */
+  void storeCaptures(const std::map<std::string, llvm::AllocaInst*>& captures,
+                     llvm::StructType* envType, llvm::Value* capturedEnv) {
+    auto i = 0;
+
+    for (auto& capture : captures) {
+      auto value = builder->CreateLoad(capture.second->getAllocatedType(),
+                                       capture.second, capture.first);
+      builder->CreateStore(
+          value, builder->CreateStructGEP(envType, capturedEnv, i++));
+    }
+  }
+
+  /**
+   * Copies the captured variables to the locals of the outlined
+   * function (the current one), and returns their environment.
+   */
+  Env loadCaptures(const std::map<std::string, llvm::AllocaInst*>& captures,
+                   llvm::StructType* envType, llvm::Value* capturedEnv) {
+    auto innerEnv = std::make_shared<Environment>(
+        std::map<std::string, llvm::Value*>{}, GlobalEnv);
+
+    auto i = 0;
+
+    for (auto& capture : captures) {
+      auto type_ = capture.second->getAllocatedType();
+      auto value = builder->CreateLoad(
+          type_, builder->CreateStructGEP(envType, capturedEnv, i++));
+      builder->CreateStore(value, allocVar(capture.first, type_, innerEnv));
+    }
+
+    return innerEnv;
+  }
+
+  /**
+   * Creates an internal function for the outlined code, with
+   * the entry block: __spawn.1, __parallel_for.2, ...
+   */
+  llvm::Function* createOutlinedFunction(const std::string& name,
+                                         llvm::FunctionType* fnType) {
+    auto outlined = llvm::Function::Create(
+        fnType, llvm::Function::InternalLinkage,
+        name + "." + std::to_string(++outlinedCount_), *module);
+
+    outlined->addFnAttr(llvm::Attribute::NoUnwind);
+    createBB("entry", outlined);
+
+    return outlined;
+  }
+
+  /**
+   * Future of a spawned job: %EvaFuture.i32*
+   */
+  llvm::Type* getFutureType(llvm::Type* resultType) {
+    auto futureName = "EvaFuture." + mangleType(resultType);
+    auto futureType = llvm::StructType::getTypeByName(*ctx, futureName);
+
+    if (futureType == nullptr) {
+      futureType = llvm::StructType::create(*ctx, futureName);
+      futureResultTypes_[futureType] = resultType;
+    }
+
+    return futureType->getPointerTo();
+  }
+
+  /**
+   * Whether the type is a future.
+   */
+  bool isFutureType(llvm::Type* type_) {
+    return type_->isPointerTy() &&
+           type_->getPointerElementType()->isStructTy() &&
+           futureResultTypes_.count(llvm::cast<llvm::StructType>(
+               type_->getPointerElementType())) != 0;
+  }
+
+  /**
+   * Result type of the future.
+   */
+  llvm::Type* getFutureResultType(llvm::Type* futureType) {
+    return futureResultTypes_.at(
+        llvm::cast<llvm::StructType>(futureType->getPointerElementType()));
+  }
+
+  /**
+   * Scheduler runtime function (see runtime/EvaScheduler.cpp).
+   */
+  llvm::FunctionCallee getSchedulerFn(const std::string& fnName) {
+    auto charPtrType = builder->getInt8PtrTy();
+    auto voidType = builder->getVoidTy();
+
+    llvm::FunctionType* fnType = nullptr;
+
+    if (fnName == "eva_spawn") {
+      auto jobFnType = llvm::FunctionType::get(voidType, charPtrType, false);
+      fnType = llvm::FunctionType::get(
+          charPtrType, {jobFnType->getPointerTo(), charPtrType}, false);
+    } else if (fnName == "eva_parallel_for") {
+      auto i64Type = builder->getInt64Ty();
+      auto bodyFnType = llvm::FunctionType::get(
+          voidType, {charPtrType, i64Type, i64Type}, false);
+      fnType = llvm::FunctionType::get(
+          voidType, {i64Type, i64Type, bodyFnType->getPointerTo(), charPtrType},
+          false);
+    } else {
+      fnType = llvm::FunctionType::get(voidType, charPtrType, false);
+    }
+
+    auto callee = module->getOrInsertFunction(fnName, fnType);
+
+    if (auto fn = llvm::dyn_cast<llvm::Function>(callee.getCallee())) {
+      fn->addFnAttr(llvm::Attribute::NoUnwind);
+    }
+
+    return callee;
+  }
+
+  /**
+   * Returns size of a type in bytes.
+   */
+  size_t getTypeSize(llvm::Type* type_) {
+    return module->getDataLayout().getTypeAllocSize(type_);
+  }
+
+  /**
+   * Inherits parent class fields.
+   */
+  void inheritClass(llvm::StructType* cls, llvm::StructType* parent) {
+    auto& parentInfo = classMap_[parent->getName().data()];
+    auto& classInfo = classMap_[cls->getName().data()];
+
+    classInfo.fieldsMap = parentInfo.fieldsMap;
+    classInfo.methodsMap = parentInfo.methodsMap;
+    classInfo.fieldNames = parentInfo.fieldNames;
+    classInfo.methodNames = parentInfo.methodNames;
+  }
+
+  /**
+   * Extracts fields and methods from a class expression.
+   */
+  void buildClassInfo(llvm::StructType* cls, const Exp& clsExp, Env env) {
+    auto className = clsExp.list[1].string;
+    auto& classInfo = classMap_[className];
+
+    auto& body = clsExp.list[3];
+
+    for (auto i = 1; i < body.list.size(); i++) {
+      auto& exp = body.list[i];
+
+      // Fields: (var x 0), (var (x number) 0)
+      if (isVar(exp)) {
+        auto fieldName = extractVarName(exp.list[1]);
+
+        if (classInfo.fieldsMap.count(fieldName) != 0) {
+          DIE << "Field " << className << "." << fieldName
+              << " is already declared\n";
+        }
+
+        classInfo.fieldNames.push_back(fieldName);
+        classInfo.fieldsMap[fieldName] = extractVarType(exp.list[1]);
+      }
+
+      // Methods: <Class>_<method>, overrides keep the parent slot.
+      else if (isDef(exp)) {
+        auto methodName = exp.list[1].string;
+        auto fnName = className + "_" + methodName;
+
+        if (classInfo.methodsMap.count(methodName) == 0) {
+          classInfo.methodNames.push_back(methodName);
+        }
+
+        classInfo.methodsMap[methodName] =
+            createFunctionProto(fnName, extractFunctionType(exp), env);
+      }
+    }
+
+    buildClassBody(cls);
+  }
+
+  /**
+   * Builds class body from class info.
+   */
+  void buildClassBody(llvm::StructType* cls) {
+    std::string className{cls->getName().data()};
+    auto& classInfo = classMap_[className];
+
+    auto vTableTy = llvm::StructType::create(*ctx, className + "_vTable");
+
+    // Fields, the vtable is the first one:
+    std::vector<llvm::Type*> clsFields{vTableTy->getPointerTo()};
+
+    for (auto& fieldName : classInfo.fieldNames) {
+      clsFields.push_back(classInfo.fieldsMap[fieldName]);
+    }
+
+    cls->setBody(clsFields, /* packed */ false);
+
+    // Methods:
+    std::vector<llvm::Type*> vTableMethods;
+
+    for (auto& methodName : classInfo.methodNames) {
+      vTableMethods.push_back(classInfo.methodsMap[methodName]->getType());
+    }
+
+    vTableTy->setBody(vTableMethods);
+
+    buildVTable(cls);
+  }
+
+  /**
+   * Creates a vtable per class.
+   *
+   * vTable stores method references to support
+   * inheritance and methods overloading.
+   */
+  void buildVTable(llvm::StructType* cls) {
+    std::string className{cls->getName().data()};
+    auto& classInfo = classMap_[className];
+
+    auto vTableTy = (llvm::StructType*)cls->getElementType(VTABLE_INDEX)
+                        ->getPointerElementType();
+
+    std::vector<llvm::Constant*> vTableMethods;
+
+    for (auto& methodName : classInfo.methodNames) {
+      vTableMethods.push_back(classInfo.methodsMap[methodName]);
+    }
+
+    auto vTable =
+        createGlobalVar(className + "_vTable",
+                        llvm::ConstantStruct::get(vTableTy, vTableMethods));
+
+    // Vtables are never written, the loads of known classes fold:
+    vTable->setConstant(true);
+  }
+
+  /**
+   * Declares the exports of a module from its interface: functions
+   * and methods are external, untyped functions are specialized in
+   * this module, and classes have the same layouts and vtables.
+   */
+  llvm::Value* compileImport(const std::string& moduleName) {
+    // Each module is declared once (imports are re-exported):
+    if (imported_.insert(moduleName).second) {
+      auto interface = parser->parse(
+          "(begin " + ModuleInterface::read(findInterface(moduleName)) + ")");
+
+      for (auto i = 1; i < interface.list.size(); i++) {
+        declareImport(interface.list[i]);
+      }
+    }
+
+    return builder->getInt32(0);
+  }
+
+  /**
+   * Declares an exported function, class, or a re-exported import.
+   */
+  void declareImport(const Exp& exp) {
+    if (isTaggedList(exp, "import")) {
+      compileImport(exp.list[1].string);
+    }
+
+    else if (isDef(exp) && isGeneric(exp)) {
+      auto fnName = exp.list[1].string;
+      genericFns_.erase(fnName);
+      genericFns_.emplace(fnName, GenericFunction{exp, GlobalEnv});
+    }
+
+    else if (isDef(exp)) {
+      createFunctionProto(exp.list[1].string, extractFunctionType(exp),
+                          GlobalEnv);
+    }
+
+    else if (isTaggedList(exp, "interface")) {
+      declareInterface(exp);
+    }
+
+    // Variables are external, and read-only in the importers (the
+    // module assumes only it assigns them, e.g. the array lengths):
+    else if (isTaggedList(exp, "var")) {
+      auto varName = extractVarName(exp.list[1]);
+      auto varTy = extractVarType(exp.list[1]);
+
+      module->getOrInsertGlobal(varName, varTy);
+      GlobalEnv->define(varName, module->getNamedGlobal(varName));
+    }
+
+    else if (isTaggedList(exp, "class")) {
+      declareClass(stripInterfaces(exp));
+    }
+  }
+
+  /**
+   * Declares an imported class: the layout, and the vtable
+   * of the external methods.
+   */
+  void declareClass(const Exp& clsExp) {
+    auto className = clsExp.list[1].string;
+    auto parent = clsExp.list[2].string == "null"
+                      ? nullptr
+                      : getClassByName(clsExp.list[2].string);
+
+    cls = llvm::StructType::create(*ctx, className);
+    classMap_[className] = ClassInfo{cls, parent, {}, {}};
+
+    if (parent != nullptr) {
+      inheritClass(cls, parent);
+    }
+
+    // Builds the class body and the vtable as well:
+    buildClassInfo(cls, clsExp, GlobalEnv);
+
+    cls = nullptr;
+  }
+
+  /**
+   * Exports a top-level variable as a declaration, the untyped
+   * functions of the module (specialized in the importers) may
+   * use it:
+   *
+   * (var seed 42) -> (var (seed number))
+   *
+   * Variables of the types without a name (e.g. functions) are
+   * not exported.
+   */
+  void exportGlobalVar(const std::string& name, llvm::Type* type_) {
+    if (!hasTypeExp(type_)) {
+      return;
+    }
+
+    std::string varTag = "var";
+    std::string varName = name;
+
+    exports_.push_back(Exp(std::vector<Exp>{
+        Exp(varTag), Exp(std::vector<Exp>{Exp(varName), getTypeExp(type_)})}));
+  }
+
+  /**
+   * Vtables (<Class>_vTable) are emitted in each module which
+   * declares the class, and merged by the linker: virtual calls
+   * on known classes are devirtualized in the importers as well.
+   */
+  void shareVTables() {
+    for (auto& entry : classMap_) {
+      if (auto vTable = module->getNamedGlobal(entry.first + "_vTable")) {
+        vTable->setLinkage(llvm::GlobalValue::LinkOnceODRLinkage);
+      }
+    }
+  }
+
+  /**
+   * Declares the interfaces, and records the interfaces of classes
+   * (the classes are compiled with the parent class only):
+   *
+   * (class Transformer (Base Callable) <body>)
+   *
+   * (class Transformer Base <body>)
+   *
+   * Imports are declared first, for the imported interfaces.
+   */
+  Exp declareInterfaces(const Exp& program) {
+    auto result = program;
+
+    for (auto& exp : result.list) {
+      if (isTaggedList(exp, "import")) {
+        compileImport(exp.list[1].string);
+      } else if (isTaggedList(exp, "interface")) {
+        declareInterface(exp);
+      } else if (isTaggedList(exp, "class")) {
+        exp = stripInterfaces(exp);
+      }
+    }
+
+    return result;
+  }
+
+  /**
+   * Declares the interface value type, and the itable type: a method
+   * pointer per interface method, `self` is i8*.
+   *
+   * (interface Callable (begin (def __call__ (self (x number)) -> number)))
+   *
+   * %Callable = type { i8*, %Callable_iTable* }
+   * %Callable_iTable = type { i32 (i8*, i32)* }
+   */
+  void declareInterface(const Exp& interfaceExp) {
+    auto name = interfaceExp.list[1].string;
+
+    if (interfaceMap_.count(name) != 0 || getClassByName(name) != nullptr) {
+      DIE << "Type " << name << " is already declared\n";
+    }
+
+    auto type = llvm::StructType::create(*ctx, name);
+    auto iTable = llvm::StructType::create(*ctx, name + "_iTable");
+
+    // Methods may take and return the interface:
+    interfaceMap_[name] = InterfaceInfo{type, iTable, {}};
+
+    type->setBody({builder->getInt8PtrTy(), iTable->getPointerTo()});
+
+    std::vector<llvm::Type*> slots{};
+    auto& body = interfaceExp.list[2];
+
+    for (auto i = 1; i < body.list.size(); i++) {
+      auto& methodExp = body.list[i];
+
+      if (!isDef(methodExp)) {
+        DIE << "Interface " << name << " can only declare methods\n";
+      }
+
+      interfaceMap_[name].methods.push_back(methodExp.list[1].string);
+      slots.push_back(getInterfaceMethodType(methodExp)->getPointerTo());
+    }
+
+    iTable->setBody(slots);
+  }
+
+  /**
+   * Method type of an interface: `self` is the instance of any class.
+   */
+  llvm::FunctionType* getInterfaceMethodType(const Exp& methodExp) {
+    auto returnType = hasReturnType(methodExp)
+                          ? getTypeFromExp(methodExp.list[4])
+                          : builder->getInt32Ty();
+
+    std::vector<llvm::Type*> paramTypes{};
+
+    for (auto& param : methodExp.list[2].list) {
+      paramTypes.push_back(extractVarName(param) == "self"
+                               ? builder->getInt8PtrTy()
+                               : extractVarType(param));
+    }
+
+    return llvm::FunctionType::get(returnType, paramTypes, /* varargs */ false);
+  }
+
+  /**
+   * Moves the interfaces out of the parent slot of the class. The
+   * class implements the interfaces of the parent (first, in the
+   * same order, so the itable slots are the same in subclasses).
+   */
+  Exp stripInterfaces(const Exp& clsExp) {
+    auto className = clsExp.list[1].string;
+    auto& supers = clsExp.list[2];
+
+    std::string parent = "null";
+    std::vector<std::string> interfaces{};
+
+    auto names = supers.type == ExpType::LIST ? supers.list
+                                              : std::vector<Exp>{supers};
+
+    for (auto& super : names) {
+      if (interfaceMap_.count(super.string) != 0) {
+        interfaces.push_back(super.string);
+      } else if (super.string != "null") {
+        if (parent != "null") {
+          DIE << "Class " << className << " has more than one parent\n";
+        }
+        parent = super.string;
+      }
+    }
+
+    auto inherited = classInterfaces_.find(parent);
+    auto all = inherited != classInterfaces_.end()
+                   ? inherited->second
+                   : std::vector<std::string>{};
+
+    for (auto& name : interfaces) {
+      if (std::find(all.begin(), all.end(), name) == all.end()) {
+        all.push_back(name);
+      }
+    }
+
+    if (!all.empty()) {
+      classInterfaces_[className] = all;
+    }
+
+    auto result = clsExp;
+    result.list[2] = Exp(parent);
+    return result;
+  }
+
+  /**
+   * Itables of the classes: the vtable of a class implementing
+   * interfaces is prefixed with its itables, in the order of the
+   * interfaces of the class:
+   *
+   * @Transformer_vTable = { i8* <itables>, %Transformer_vTable <methods> }
+   *
+   * Objects keep pointing to the methods, the itables are at the
+   * word before. Conversions to an interface load the itable at
+   * the constant slot of the static class (see toInterface).
+   */
+  void buildInterfaceTables() {
+    for (auto& entry : classInterfaces_) {
+      auto className = entry.first;
+      auto vTable = module->getNamedGlobal(className + "_vTable");
+
+      // The conversions (toInterface) load the itables before the
+      // vtable, so each class must have its (prefixed) vtable:
+      if (vTable == nullptr || !vTable->hasInitializer()) {
+        DIE << "Class \"" << className << "\" implements interfaces, "
+            << "but has no vtable.\n";
+      }
+
+      std::vector<llvm::Constant*> iTables{};
+
+      for (auto& interfaceName : entry.second) {
+        iTables.push_back(llvm::ConstantExpr::getBitCast(
+            buildITable(className, interfaceName), builder->getInt8PtrTy()));
+      }
+
+      auto iTablesType =
+          llvm::ArrayType::get(builder->getInt8PtrTy(), iTables.size());
+
+      auto iTablesVar = new llvm::GlobalVariable(
+          *module, iTablesType, /* isConstant */ true,
+          llvm::GlobalValue::PrivateLinkage,
+          llvm::ConstantArray::get(iTablesType, iTables),
+          className + "_iTables");
+
+      auto prefixedType = llvm::StructType::get(
+          *ctx, {builder->getInt8PtrTy(), vTable->getValueType()});
+
+      // Vtables are never written, the loads of known classes fold:
+      auto prefixed = new llvm::GlobalVariable(
+          *module, prefixedType, /* isConstant */ true, vTable->getLinkage(),
+          llvm::ConstantStruct::get(
+              prefixedType,
+              {llvm::ConstantExpr::getBitCast(iTablesVar,
+                                              builder->getInt8PtrTy()),
+               vTable->getInitializer()}));
+
+      prefixed->takeName(vTable);
+
+      vTable->replaceAllUsesWith(llvm::ConstantExpr::getInBoundsGetElementPtr(
+          prefixedType, prefixed,
+          llvm::ArrayRef<llvm::Constant*>{builder->getInt32(0),
+                                          builder->getInt32(1)}));
+      vTable->eraseFromParent();
+    }
+  }
+
+  /**
+   * Itable of the class for the interface: the class methods
+   * (own or inherited) by the interface selectors.
+   */
+  llvm::GlobalVariable* buildITable(const std::string& className,
+                                    const std::string& interfaceName) {
+    auto& info = interfaceMap_[interfaceName];
+    auto& methods = classMap_[className].methodsMap;
+
+    std::vector<llvm::Constant*> slots{};
+
+    for (auto i = 0; i < info.methods.size(); i++) {
+      auto& methodName = info.methods[i];
+      auto method = methods.find(methodName);
+
+      if (method == methods.end()) {
+        DIE << "Class " << className << " does not implement "
+            << interfaceName << "." << methodName << "\n";
+      }
+
+      auto slotType = (llvm::PointerType*)info.iTable->getElementType(i);
+      auto slotFnType = (llvm::FunctionType*)slotType->getPointerElementType();
+      auto fnType = method->second->getFunctionType();
+
+      auto matches = fnType->getReturnType() == slotFnType->getReturnType() &&
+                     fnType->getNumParams() == slotFnType->getNumParams();
+
+      for (auto p = 1; matches && p < fnType->getNumParams(); p++) {
+        matches = fnType->getParamType(p) == slotFnType->getParamType(p);
+      }
+
+      if (!matches) {
+        DIE << "Method " << className << "." << methodName
+            << " does not match " << interfaceName << "." << methodName
+            << "\n";
+      }
+
+      slots.push_back(llvm::ConstantExpr::getBitCast(method->second, slotType));
+    }
+
+    return new llvm::GlobalVariable(
+        *module, info.iTable, /* isConstant */ true,
+        llvm::GlobalValue::PrivateLinkage,
+        llvm::ConstantStruct::get(info.iTable, slots),
+        className + "_" + interfaceName + "_iTable");
+  }
+
+  /**
+   * Interface of the interface value type (nullptr for other types).
+   */
+  InterfaceInfo* getInterfaceInfo(llvm::Type* type_) {
+    auto structType = llvm::dyn_cast_or_null<llvm::StructType>(type_);
+
+    if (structType == nullptr || !structType->hasName()) {
+      return nullptr;
+    }
+
+    auto it = interfaceMap_.find(structType->getName().str());
+    return it != interfaceMap_.end() && it->second.type == structType
+               ? &it->second
+               : nullptr;
+  }
+
+  /**
+   * Converts a class instance to the interface value: the itable
+   * slot is known from the static class, the itable is of the
+   * dynamic class (the itables are before its vtable).
+   *
+   * %vTable = load i8**, i8*** <instance>
+   * %iTables = load i8*, i8** (%vTable - 1)
+   * %iTable = load i8*, i8** (%iTables + <slot>)
+   */
+  llvm::Value* toInterface(llvm::Value* instance,
+                           llvm::StructType* interfaceType) {
+    if (instance->getType() == interfaceType) {
+      return instance;
+    }
+
+    auto interfaceName = interfaceType->getName().str();
+    auto& info = interfaceMap_[interfaceName];
+
+    auto clsType = instance->getType()->isPointerTy()
+                       ? llvm::dyn_cast<llvm::StructType>(
+                             instance->getType()->getPointerElementType())
+                       : nullptr;
+
+    auto className = clsType != nullptr && clsType->hasName()
+                         ? clsType->getName().str()
+                         : "";
+
+    auto interfaces = classInterfaces_.find(className);
+    auto slot = interfaces != classInterfaces_.end()
+                    ? std::find(interfaces->second.begin(),
+                                interfaces->second.end(), interfaceName)
+                    : std::vector<std::string>::iterator{};
+
+    if (interfaces == classInterfaces_.end() ||
+        slot == interfaces->second.end()) {
+      DIE << "Class " << (className.empty() ? "<unknown>" : className)
+          << " does not implement " << interfaceName << "\n";
+    }
+
+    auto bytePtrTy = builder->getInt8PtrTy();
+
+    // The vtable is the first field (VTABLE_INDEX):
+    auto vTable = builder->CreateLoad(
+        bytePtrTy->getPointerTo(),
+        builder->CreateBitCast(instance,
+                               bytePtrTy->getPointerTo()->getPointerTo()),
+        "vt");
+
+    auto iTables = builder->CreateLoad(
+        bytePtrTy, builder->CreateInBoundsGEP(bytePtrTy, vTable,
+                                              builder->getInt64(-1)),
+        "itables");
+
+    auto iTable = builder->CreateLoad(
+        bytePtrTy,
+        builder->CreateInBoundsGEP(
+            bytePtrTy,
+            builder->CreateBitCast(iTables, bytePtrTy->getPointerTo()),
+            builder->getInt64(slot - interfaces->second.begin())),
+        "itable");
+
+    // The itables are constant:
+    iTables->setMetadata(llvm::LLVMContext::MD_invariant_load,
+                         llvm::MDNode::get(*ctx, {}));
+    iTable->setMetadata(llvm::LLVMContext::MD_invariant_load,
+                        llvm::MDNode::get(*ctx, {}));
+
+    llvm::Value* value = llvm::UndefValue::get(info.type);
+
+    value = builder->CreateInsertValue(
+        value, builder->CreateBitCast(instance, bytePtrTy),
+        INTERFACE_INSTANCE_INDEX);
+
+    return builder->CreateInsertValue(
+        value, builder->CreateBitCast(iTable, info.iTable->getPointerTo()),
+        INTERFACE_ITABLE_INDEX, interfaceName);
+  }
+
+  /**
+   * Whether a method call is on an interface value (a variable):
+   *
+   * ((method c __call__) c 2)
+   */
+  bool isInterfaceCall(const Exp& exp, Env env) {
+    auto& methodExp = exp.list[0];
+
+    return !interfaceMap_.empty() && isTaggedList(methodExp, "method") &&
+           getInterfaceInfo(getVariableType(methodExp.list[1], env)) !=
+               nullptr;
+  }
+
+  /**
+   * Static type of a variable (nullptr if it's not a variable).
+   */
+  llvm::Type* getVariableType(const Exp& exp, Env env) {
+    if (exp.type != ExpType::SYMBOL || !env->has(exp.string)) {
+      return nullptr;
+    }
+
+    auto value = env->lookup(exp.string);
+
+    if (auto local = llvm::dyn_cast<llvm::AllocaInst>(value)) {
+      return local->getAllocatedType();
+    }
+
+    if (auto global = llvm::dyn_cast<llvm::GlobalVariable>(value)) {
+      return global->getValueType();
+    }
+
+    return value->getType();
+  }
+
+  /**
+   * Calls the method through the itable of the interface value,
+   * the selector is the index of the method in the interface (one
+   * load, as a virtual call). The instance is passed as `self`.
+   *
+   * ((method c __call__) c 2)
+   */
+  llvm::Value* callInterfaceMethod(const Exp& exp, Env env) {
+    auto& methodExp = exp.list[0];
+    auto methodName = methodExp.list[2].string;
+
+    auto value = gen(methodExp.list[1], env);
+    auto& info = *getInterfaceInfo(value->getType());
+
+    auto selector = std::find(info.methods.begin(), info.methods.end(),
+                              methodName) -
+                    info.methods.begin();
+
+    if (selector == info.methods.size()) {
+      DIE << "Interface " << info.type->getName().str() << " has no method "
+          << methodName << "\n";
+    }
+
+    auto slotType = (llvm::PointerType*)info.iTable->getElementType(selector);
+    auto fnType = (llvm::FunctionType*)slotType->getPointerElementType();
+
+    if (exp.list.size() - 1 != fnType->getNumParams()) {
+      DIE << "Method " << methodName << " expects " << fnType->getNumParams()
+          << " arguments\n";
+    }
+
+    auto iTable =
+        builder->CreateExtractValue(value, INTERFACE_ITABLE_INDEX, "itable");
+
+    auto method = builder->CreateLoad(
+        slotType, builder->CreateStructGEP(info.iTable, iTable, selector),
+        methodName);
+
+    method->setMetadata(llvm::LLVMContext::MD_invariant_load,
+                        llvm::MDNode::get(*ctx, {}));
+
+    std::vector<llvm::Value*> args{};
+
+    for (auto i = 1; i < exp.list.size(); i++) {
+      auto arg = gen(exp.list[i], env);
+
+      // self: the instance of the interface value:
+      if (i == 1) {
+        arg = getInterfaceInfo(arg->getType()) != nullptr
+                  ? builder->CreateExtractValue(arg, INTERFACE_INSTANCE_INDEX)
+                  : builder->CreateBitCast(arg, builder->getInt8PtrTy());
+      } else {
+        arg = castValue(arg, fnType->getParamType(i - 1));
+      }
+
+      args.push_back(arg);
+    }
+
+    return builder->CreateCall(fnType, method, args);
+  }
+
+  /**
+   * Interface file of a module, in the import paths.
+   */
+  std::string findInterface(const std::string& moduleName) {
+    for (auto& dir : importPaths_) {
+      auto fileName = dir + "/" + moduleName + ".evi";
+
+      if (llvm::sys::fs::exists(fileName)) {
+        return fileName;
+      }
+    }
+
+    DIE << "Module \"" << moduleName << "\" is not compiled (no "
+        << moduleName << ".evi)\n";
+    return "";
+  }
+
+  /**
+   * Tagged lists.
+   */
+  bool isTaggedList(const Exp& exp, const std::string& tag) {
+    return exp.type == ExpType::LIST && exp.list[0].type == ExpType::SYMBOL &&
+           exp.list[0].string == tag;
+  }
+
+  /**
+   * (var ...)
+   */
+  bool isVar(const Exp& exp) { return isTaggedList(exp, "var"); }
+
+  /**
+   * (def ...)
+   */
+  bool isDef(const Exp& exp) { return isTaggedList(exp, "def"); }
+
+  /**
+   * (new ...)
+   */
+  bool isNew(const Exp& exp) { return isTaggedList(exp, "new"); }
+
+  /**
+   * (prop ...)
+   */
+  bool isProp(const Exp& exp) { return isTaggedList(exp, "prop"); }
+
+  /**
+   * (super ...)
+   */
+  bool isSuper(const Exp& exp) { return isTaggedList(exp, "super"); }
+
+  /**
+   * Returns a type by name.
+   */
+  llvm::StructType* getClassByName(const std::string& name) {
+    return llvm::StructType::getTypeByName(*ctx, name);
+  }
+
+  /**
+   * Extracts var or parameter name considering type.
+   *
+   * x -> x
+   * (x number) -> x
+   */
+  std::string extractVarName(const Exp& exp) {
+    return exp.type == ExpType::LIST ? exp.list[0].string : exp.string;
+  }
+
+  /**
+   * Extracts var or parameter type with i32 as default.
+   *
+   * x -> i32
+   * (x number) -> number
+   */
+  llvm::Type* extractVarType(const Exp& exp) {
+    return exp.type == ExpType::LIST ? getTypeFromExp(exp.list[1])
+                                     : builder->getInt32Ty();
+  }
+
+  /**
+   * Returns LLVM type from type expression.
+   *
+   * number -> i32
+   * (array number) -> %Array.i32*
+   * (vec f32 8) -> <8 x float>
+   * (task number) -> %EvaTask.i32*
+   * (future number) -> %EvaFuture.i32*
+   */
+  llvm::Type* getTypeFromExp(const Exp& typeExp) {
+    if (typeExp.type != ExpType::LIST) {
+      return getTypeFromString(typeExp.string);
+    }
+
+    if (isTaggedList(typeExp, "array")) {
+      return getArrayType(getTypeFromExp(typeExp.list[1]))->getPointerTo();
+    }
+
+    // SIMD vectors: (vec f32 8) -> <8 x float>
+    if (isTaggedList(typeExp, "vec")) {
+      return llvm::FixedVectorType::get(getTypeFromExp(typeExp.list[1]),
+                                        getLanesCount(typeExp.list[2]));
+    }
+
+    // Tasks of async functions: (task number) -> %EvaTask.i32*
+    if (isTaggedList(typeExp, "task")) {
+      return getTaskType(getTypeFromExp(typeExp.list[1]));
+    }
+
+    // Futures of spawned calls: (future number) -> %EvaFuture.i32*
+    if (isTaggedList(typeExp, "future")) {
+      return getFutureType(getTypeFromExp(typeExp.list[1]));
+    }
+
+    DIE << "Unknown type expression.\n";
+    return nullptr;
+  }
+
+  /**
+   * Returns LLVM type from string representation.
+   */
+  llvm::Type* getTypeFromString(const std::string& type_) {
+    // number -> i32
+    if (type_ == "number") {
+      return builder->getInt32Ty();
+    }
+
+    // string -> %EvaString*
+    if (type_ == "string") {
+      return getStringType()->getPointerTo();
+    }
+
+    // boolean -> i1
+    if (type_ == "boolean") {
+      return builder->getInt1Ty();
+    }
+
+    // Sized integers:
+    if (type_ == "i32") {
+      return builder->getInt32Ty();
+    }
+
+    if (type_ == "i64") {
+      return builder->getInt64Ty();
+    }
+
+    // Floating point:
+    if (type_ == "f32") {
+      return builder->getFloatTy();
+    }
+
+    if (type_ == "f64") {
+      return builder->getDoubleTy();
+    }
+
+    // Interfaces, passed by value:
+    if (interfaceMap_.count(type_) != 0) {
+      return interfaceMap_[type_].type;
+    }
+
+    // Classes:
+    return classMap_[type_].cls->getPointerTo();
+  }
+
+  /**
+   * Common type of two numeric operands: i32 -> i64 -> f32 -> f64.
+   * Scalars mixed with vectors are splatted to the vector type.
+   */
+  llvm::Type* getCommonNumericType(llvm::Type* type1, llvm::Type* type2) {
+    if (type1 == type2 || type1->isVectorTy()) {
+      return type1;
+    }
+
+    if (type2->isVectorTy()) {
+      return type2;
+    }
+
+    if (type1->isFloatingPointTy() || type2->isFloatingPointTy()) {
+      return type1->isDoubleTy() || type2->isDoubleTy()
+                 ? builder->getDoubleTy()
+                 : builder->getFloatTy();
+    }
+
+    return type1->getIntegerBitWidth() > type2->getIntegerBitWidth() ? type1
+                                                                      : type2;
+  }
+
+  /**
+   * Converts a numeric value to the given numeric type.
+   * Integers are signed (sext, sitofp, fptosi).
+   */
+  llvm::Value* castNumeric(llvm::Value* value, llvm::Type* type_) {
+    auto valueType = value->getType();
+
+    if (valueType == type_ ||
+        !(valueType->isIntOrIntVectorTy() || valueType->isFPOrFPVectorTy()) ||
+        !(type_->isIntOrIntVectorTy() || type_->isFPOrFPVectorTy())) {
+      return value;
+    }
+
+    // Scalar to vector: splat.
+    if (!valueType->isVectorTy() && type_->isVectorTy()) {
+      auto vecType = (llvm::FixedVectorType*)type_;
+      return builder->CreateVectorSplat(
+          vecType->getNumElements(),
+          castNumeric(value, vecType->getElementType()), "splat");
+    }
+
+    if (valueType->isIntOrIntVectorTy() && type_->isIntOrIntVectorTy()) {
+      return builder->CreateSExtOrTrunc(value, type_);
+    }
+
+    if (valueType->isIntOrIntVectorTy()) {
+      return builder->CreateSIToFP(value, type_);
+    }
+
+    if (type_->isIntOrIntVectorTy()) {
+      return builder->CreateFPToSI(value, type_);
+    }
+
+    return builder->CreateFPCast(value, type_);
+  }
+
+  /**
+   * Converts a value to the type of a variable, parameter, field or
+   * result: numbers are converted (castNumeric), instances of a
+   * subclass are used as the parent class, and instances are
+   * converted to the interface values (toInterface).
+   */
+  llvm::Value* castValue(llvm::Value* value, llvm::Type* type_) {
+    auto valueType = value->getType();
+
+    if (valueType == type_) {
+      return value;
+    }
+
+    if (getInterfaceInfo(type_) != nullptr) {
+      return toInterface(value, (llvm::StructType*)type_);
+    }
+
+    if (isSubclassInstance(valueType, type_)) {
+      return builder->CreateBitCast(value, type_);
+    }
+
+    if (!isNumericType(valueType) || !isNumericType(type_)) {
+      DIE << "Cannot convert " << mangleType(valueType) << " to "
+          << mangleType(type_) << "\n";
+    }
+
+    return castNumeric(value, type_);
+  }
+
+  /**
+   * Converts the call arguments to the parameter types.
+   */
+  void castArgs(std::vector<llvm::Value*>& args, llvm::FunctionType* fnType) {
+    for (auto i = 0; i < args.size(); i++) {
+      args[i] = castValue(args[i], fnType->getParamType(i));
+    }
+  }
+
+  /**
+   * Whether the type is an instance of the class, or of its subclass.
+   */
+  bool isSubclassInstance(llvm::Type* type_, llvm::Type* clsType) {
+    if (!type_->isPointerTy() || !clsType->isPointerTy()) {
+      return false;
+    }
+
+    auto cls = llvm::dyn_cast<llvm::StructType>(type_->getPointerElementType());
+    auto parent = clsType->getPointerElementType();
+
+    while (cls != nullptr && cls != parent && cls->hasName() &&
+           classMap_.count(cls->getName().str()) != 0) {
+      cls = classMap_[cls->getName().str()].parent;
+    }
+
+    return cls != nullptr && cls == parent;
+  }
+
+  /**
+   * Whether the type is an integer or floating point number (or vector).
+   */
+  bool isNumericType(llvm::Type* type_) {
+    return type_->isIntOrIntVectorTy() || type_->isFPOrFPVectorTy();
+  }
+
+  /**
+   * Condition of `if` and `while`: numbers and pointers are
+   * compared to zero (booleans are as is).
+   */
+  llvm::Value* toBoolean(llvm::Value* value) {
+    if (value->getType()->isIntegerTy(1)) {
+      return value;
+    }
+
+    if (value->getType()->isFloatingPointTy()) {
+      return builder->CreateFCmpUNE(
+          value, llvm::ConstantFP::get(value->getType(), 0.0), "tobool");
+    }
+
+    if (value->getType()->isIntegerTy() || value->getType()->isPointerTy()) {
+      return builder->CreateIsNotNull(value, "tobool");
+    }
+
+    DIE << "Condition should be a boolean, a number, or an instance.\n";
+    return nullptr;
+  }
+
+  /**
+   * Compiles the call arguments (from the `first` expression) to the
+   * parameter types (from the `firstParam` one).
+   */
+  std::vector<llvm::Value*> genArgs(const Exp& exp, size_t first,
+                                    llvm::FunctionType* fnType, Env env,
+                                    size_t firstParam = 0) {
+    auto argsCount = exp.list.size() - first;
+
+    if (argsCount != fnType->getNumParams() - firstParam) {
+      auto name = isNew(exp) ? exp.list[1].string + ".constructor"
+                  : exp.list[0].type == ExpType::SYMBOL
+                      ? exp.list[0].string
+                      : exp.list[0].list[2].string;
+
+      DIE << "\"" << name << "\" expects "
+          << fnType->getNumParams() - firstParam << " arguments, given "
+          << argsCount << "\n";
+    }
+
+    std::vector<llvm::Value*> args{};
+
+    for (auto i = 0; i < argsCount; i++) {
+      args.push_back(castValue(gen(exp.list[first + i], env),
+                               fnType->getParamType(firstParam + i)));
+    }
+
+    return args;
+  }
+
+  /**
+   * Promotes both operands to their common numeric type.
+   */
+  void promoteOperands(llvm::Value*& op1, llvm::Value*& op2) {
+    auto type1 = op1->getType();
+    auto type2 = op2->getType();
+
+    // Booleans and pointers are compared as is:
+    if (type1 == type2 || type1->isIntegerTy(1) || type2->isIntegerTy(1) ||
+        type1->isPointerTy() || type2->isPointerTy()) {
+      return;
+    }
+
+    auto commonType = getCommonNumericType(type1, type2);
+
+    op1 = castNumeric(op1, commonType);
+    op2 = castNumeric(op2, commonType);
+  }
+
+  /**
+   * Whether function has return type defined.
+   */
+  bool hasReturnType(const Exp& fnExp) {
+    return fnExp.list[3].type == ExpType::SYMBOL &&
+           fnExp.list[3].string == "->";
+  }
+
+  /**
+   * Exp function to LLVM function params.
+   *
+   * (def square ((number x)) -> number ...)
+   *
+   * llvm::FunctionType::get(returnType, paramTypes, false);
+   */
+  llvm::FunctionType* extractFunctionType(const Exp& fnExp) {
+    auto params = fnExp.list[2];
+
+    // Return type:
+    auto returnType = hasReturnType(fnExp)
+                          ? getTypeFromExp(fnExp.list[4])
+                          : builder->getInt32Ty();
+
+    // Parameter types:
+    std::vector<llvm::Type*> paramTypes{};
+
+    for (auto& param : params.list) {
+      auto paramName = extractVarName(param);
+      auto paramTy = extractVarType(param);
+
+      // The `self` name is special, meaning instance of a class:
+      paramTypes.push_back(
+          paramName == "self" ? (llvm::Type*)cls->getPointerTo() : paramTy);
+    }
+
+    return llvm::FunctionType::get(returnType, paramTypes, /* varargs */ false);
+  }
+
+  /**
+   * Compiles a function.
+   *
+   * Untyped: (def square (x) (* x x)) - i32 by default
+   *
+   * Typed: (def square ((x number)) -> number (* x x))
+   */
+  llvm::Value* compileFunction(const Exp& fnExp, std::string fnName, Env env) {
+    auto params = fnExp.list[2];
+    auto body = hasReturnType(fnExp) ? fnExp.list[5] : fnExp.list[3];
+
+    // Methods are prefixed with the class name: Point_calc
+    if (cls != nullptr) {
+      fnName = std::string(cls->getName().data()) + "_" + fnName;
+    }
+
+    // The state of the outer function is restored after the body:
+    llvm::IRBuilderBase::InsertPointGuard guard(*builder);
+
+    auto outerFn = fn;
+    auto outerCoroutine = coroutine_;
+    auto outerLoopRanges = loopRanges_;
+
+    fn = createFunction(fnName, extractFunctionType(fnExp), env);
+    coroutine_ = Coroutine{};
+
+    // Applied after the attribute inference:
+    if (fnAnnotations_.count(fnExp.list[1].annotationsId) != 0) {
+      functionAnnotations_[fn] = fnExp.list[1].annotationsId;
+    }
+    loopRanges_.clear();
+
+    // The prologue is located at the def (see finalizeDebugInfo):
+    builder->SetCurrentDebugLocation(llvm::DebugLoc());
+
+    // Parameters are allocated on the stack:
+    auto fnEnv = std::make_shared<Environment>(
+        std::map<std::string, llvm::Value*>{}, env);
+
+    auto idx = 0;
+
+    for (auto& arg : fn->args()) {
+      auto argName = extractVarName(params.list[idx++]);
+
+      arg.setName(argName);
+
+      auto argBinding = allocVar(argName, arg.getType(), fnEnv);
+      builder->CreateStore(&arg, argBinding);
+    }
+
+    auto result = gen(body, fnEnv);
+    builder->CreateRet(castValue(result, fn->getReturnType()));
+
+    auto compiledFn = fn;
+
+    fn = outerFn;
+    coroutine_ = outerCoroutine;
+    loopRanges_ = outerLoopRanges;
+
+    return compiledFn;
+  }
+
+  /**
+   * Whether a function is untyped: has at least one param without a type.
+   * Methods are always typed by the class (`self`).
+   */
+  bool isGeneric(const Exp& fnExp) {
+    if (cls != nullptr) {
+      return false;
+    }
+
+    for (auto& param : fnExp.list[2].list) {
+      if (param.type != ExpType::LIST) {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  /**
+   * Returns the specialization of an untyped function for the given
+   * argument types, compiling it on first use:
+   *
+   * (def square (x) (* x x))
+   *
+   * (square 2) -> square$i32
+   * (check p) -> check$Point*
+   */
+  llvm::Function* getSpecialization(const std::string& fnName,
+                                    const std::vector<llvm::Type*>& argTypes) {
+    auto specName = mangleName(fnName, argTypes);
+
+    // Each specialization is emitted once:
+    if (auto specFn = module->getFunction(specName)) {
+      return specFn;
+    }
+
+    auto& generic = genericFns_.at(fnName);
+
+    if (generic.fnExp.list[2].list.size() != argTypes.size()) {
+      DIE << "Function \"" << fnName << "\" expects "
+          << generic.fnExp.list[2].list.size() << " arguments, given "
+          << argTypes.size() << "\n";
+    }
+
+    auto returnType = inferReturnType(fnName, argTypes);
+
+    // Self-calls in the body are by the generic name, so the tail
+    // recursion is converted before the specialization is renamed:
+    auto specExp = eliminateTailRecursion(
+        specializeFunction(generic.fnExp, argTypes, returnType));
+    specExp.list[1].string = specName;
+
+    auto specFn =
+        (llvm::Function*)compileFunction(specExp, specName, generic.env);
+
+    // Imported untyped functions are specialized in each module
+    // which calls them (merged by the linker):
+    if (separateCompilation_) {
+      specFn->setLinkage(llvm::GlobalValue::LinkOnceODRLinkage);
+    }
+
+    return specFn;
+  }
+
+  /**
+   * Builds typed function expression from the untyped one (of the
+   * same name, renamed by getSpecialization):
+   *
+   * (def square (x) (* x x))
+   *
+   * (def square ((x number)) -> number (* x x))
+   */
+  Exp specializeFunction(const Exp& fnExp,
+                         const std::vector<llvm::Type*>& argTypes,
+                         llvm::Type* returnType) {
+    auto& params = fnExp.list[2].list;
+
+    std::vector<Exp> typedParams{};
+
+    for (auto i = 0; i < params.size(); i++) {
+      auto paramName = extractVarName(params[i]);
+      auto typeExp = params[i].type == ExpType::LIST
+                         ? params[i].list[1]
+                         : getTypeExp(argTypes[i]);
+      typedParams.push_back(Exp(std::vector<Exp>{Exp(paramName), typeExp}));
+    }
+
+    std::string defTag = "def";
+    std::string arrow = "->";
+    auto returnTypeExp =
+        hasReturnType(fnExp) ? fnExp.list[4] : getTypeExp(returnType);
+
+    return Exp(std::vector<Exp>{
+        Exp(defTag),
+        fnExp.list[1],
+        Exp(typedParams),
+        Exp(arrow),
+        returnTypeExp,
+        hasReturnType(fnExp) ? fnExp.list[5] : fnExp.list[3],
+    });
+  }
+
+  /**
+   * Mangles specialization name: square$i32, check$Point*
+   */
+  std::string mangleName(const std::string& fnName,
+                         const std::vector<llvm::Type*>& argTypes) {
+    auto specName = fnName;
+
+    for (auto argType : argTypes) {
+      specName += "$" + mangleType(argType);
+    }
+
+    return specName;
+  }
+
+  /**
+   * Type as a name part: i32, Point*
+   */
+  std::string mangleType(llvm::Type* type_) {
+    std::string typeStr;
+    llvm::raw_string_ostream typeStream(typeStr);
+    type_->print(typeStream, /* IsForDebug */ false, /* NoDetails */ true);
+    typeStream.flush();
+
+    // %Point* -> Point*
+    typeStr.erase(std::remove(typeStr.begin(), typeStr.end(), '%'),
+                  typeStr.end());
+
+    return typeStr;
+  }
+
+  /**
+   * Returns type expression as used in annotations
+   * (inverse of getTypeFromExp).
+   */
+  Exp getTypeExp(llvm::Type* type_) {
+    // Arrays: (array <type>)
+    if (isArrayType(type_)) {
+      std::string arrayTag = "array";
+      return Exp(std::vector<Exp>{Exp(arrayTag),
+                                  getTypeExp(getArrayElementType(type_))});
+    }
+
+    // Vectors: (vec <type> <lanes>)
+    if (auto vecType = llvm::dyn_cast<llvm::FixedVectorType>(type_)) {
+      std::string vecTag = "vec";
+      return Exp(std::vector<Exp>{Exp(vecTag),
+                                  getTypeExp(vecType->getElementType()),
+                                  Exp((int64_t)vecType->getNumElements())});
+    }
+
+    // Tasks: (task <type>)
+    if (isTaskType(type_)) {
+      std::string taskTag = "task";
+      return Exp(std::vector<Exp>{Exp(taskTag),
+                                  getTypeExp(getTaskResultType(type_))});
+    }
+
+    // Futures: (future <type>)
+    if (isFutureType(type_)) {
+      std::string futureTag = "future";
+      return Exp(std::vector<Exp>{Exp(futureTag),
+                                  getTypeExp(getFutureResultType(type_))});
+    }
+
+    auto typeName = getTypeName(type_);
+    return Exp(typeName);
+  }
+
+  /**
+   * Returns type name as used in annotations (inverse of getTypeFromString).
+   */
+  std::string getTypeName(llvm::Type* type_) {
+    if (type_->isIntegerTy(1)) {
+      return "boolean";
+    }
+
+    if (type_->isIntegerTy(32)) {
+      return "number";
+    }
+
+    if (type_->isIntegerTy(64)) {
+      return "i64";
+    }
+
+    if (type_->isFloatTy()) {
+      return "f32";
+    }
+
+    if (type_->isDoubleTy()) {
+      return "f64";
+    }
+
+    if (isStringType(type_)) {
+      return "string";
+    }
+
+    // Classes:
+    if (type_->isPointerTy() &&
+        type_->getPointerElementType()->isStructTy()) {
+      return type_->getPointerElementType()->getStructName().str();
+    }
+
+    // Interfaces:
+    if (getInterfaceInfo(type_) != nullptr) {
+      return type_->getStructName().str();
+    }
+
+    DIE << "Unsupported type in untyped function specialization.\n";
+    return "";
+  }
+
+  /**
+   * Whether the type has a type expression (see getTypeExp).
+   */
+  bool hasTypeExp(llvm::Type* type_) {
+    if (isArrayType(type_)) {
+      return hasTypeExp(getArrayElementType(type_));
+    }
+
+    if (auto vecType = llvm::dyn_cast<llvm::FixedVectorType>(type_)) {
+      return hasTypeExp(vecType->getElementType());
+    }
+
+    if (isTaskType(type_)) {
+      return hasTypeExp(getTaskResultType(type_));
+    }
+
+    if (isFutureType(type_)) {
+      return hasTypeExp(getFutureResultType(type_));
+    }
+
+    return type_->isIntegerTy(1) || type_->isIntegerTy(32) ||
+           type_->isIntegerTy(64) || type_->isFloatTy() ||
+           type_->isDoubleTy() || isStringType(type_) ||
+           (type_->isPointerTy() &&
+            type_->getPointerElementType()->isStructTy()) ||
+           getInterfaceInfo(type_) != nullptr;
+  }
+
+  /**
+   * Infers return type of an untyped function for the argument types.
+   * Recursive calls which are being inferred are skipped.
+   */
+  llvm::Type* inferReturnType(const std::string& fnName,
+                              const std::vector<llvm::Type*>& argTypes) {
+    auto specName = mangleName(fnName, argTypes);
+
+    if (auto specFn = module->getFunction(specName)) {
+      return specFn->getReturnType();
+    }
+
+    auto& fnExp = genericFns_.at(fnName).fnExp;
+
+    if (hasReturnType(fnExp)) {
+      return getTypeFromExp(fnExp.list[4]);
+    }
+
+    if (inferring_.count(specName) != 0) {
+      return nullptr;
+    }
+
+    inferring_.insert(specName);
+
+    TypeEnv typeEnv{};
+    auto& params = fnExp.list[2].list;
+
+    for (auto i = 0; i < params.size(); i++) {
+      typeEnv[extractVarName(params[i])] = params[i].type == ExpType::LIST
+                                               ? extractVarType(params[i])
+                                               : argTypes[i];
+    }
+
+    auto returnType = inferType(fnExp.list[3], typeEnv);
+
+    inferring_.erase(specName);
+
+    // Unknown (e.g. only recursive paths) defaults to i32:
+    return returnType != nullptr ? returnType : builder->getInt32Ty();
+  }
+
+  /**
+   * Infers static type of an expression. Returns nullptr if unknown.
+   */
+  llvm::Type* inferType(const Exp& exp, TypeEnv& typeEnv) {
+    switch (exp.type) {
+      case ExpType::NUMBER:
+        return exp.number > INT32_MAX || exp.number < INT32_MIN
+                   ? builder->getInt64Ty()
+                   : builder->getInt32Ty();
+
+      case ExpType::FLOAT:
+        return builder->getDoubleTy();
+
+      case ExpType::STRING:
+        return getStringType()->getPointerTo();
+
+      case ExpType::SYMBOL: {
+        if (exp.string == "true" || exp.string == "false") {
+          return builder->getInt1Ty();
+        }
+
+        if (typeEnv.count(exp.string) != 0) {
+          return typeEnv[exp.string];
+        }
+
+        if (auto global = module->getNamedGlobal(exp.string)) {
+          return global->getValueType();
+        }
+
+        return builder->getInt32Ty();
+      }
+
+      case ExpType::LIST:
+        break;
+    }
+
+    auto tag = exp.list[0];
+
+    // Method calls: ((method obj name) ...)
+    if (tag.type == ExpType::LIST) {
+      if (!isTaggedList(tag, "method")) {
+        return nullptr;
+      }
+
+      auto instanceType = isSuper(tag.list[1])
+                              ? getTypeFromString(tag.list[1].list[1].string)
+                              : inferType(tag.list[1], typeEnv);
+
+      // Interface calls:
+      if (auto info = getInterfaceInfo(instanceType)) {
+        auto selector = std::find(info->methods.begin(), info->methods.end(),
+                                  tag.list[2].string) -
+                        info->methods.begin();
+
+        return selector < info->methods.size()
+                   ? ((llvm::FunctionType*)info->iTable
+                          ->getElementType(selector)
+                          ->getPointerElementType())
+                         ->getReturnType()
+                   : nullptr;
+      }
+
+      if (instanceType == nullptr || !instanceType->isPointerTy()) {
+        return nullptr;
+      }
+
+      auto clsName =
+          instanceType->getPointerElementType()->getStructName().str();
+      auto& methods = classMap_[clsName].methodsMap;
+      auto method = methods.find(tag.list[2].string);
+
+      return method != methods.end() ? method->second->getReturnType()
+                                     : nullptr;
+    }
+
+    auto op = tag.string;
+
+    if (op == "+" || op == "-" || op == "*" || op == "/") {
+      auto type1 = inferType(exp.list[1], typeEnv);
+      auto type2 = inferType(exp.list[2], typeEnv);
+      return type1 != nullptr && type2 != nullptr
+                 ? getCommonNumericType(type1, type2)
+                 : type1;
+    }
+
+    if (op == ">" || op == "<" || op == "==" || op == "!=" || op == ">=" ||
+        op == "<=") {
+      // Vectors are compared per lane:
+      auto type1 = inferType(exp.list[1], typeEnv);
+      if (auto vecType = llvm::dyn_cast_or_null<llvm::FixedVectorType>(type1)) {
+        return llvm::FixedVectorType::get(builder->getInt1Ty(),
+                                          vecType->getNumElements());
+      }
+      return builder->getInt1Ty();
+    }
+
+    // Numeric branches have the common type (as in the codegen of if):
+    if (op == "if") {
+      auto thenType = inferType(exp.list[2], typeEnv);
+      auto elseType =
+          exp.list.size() > 3 ? inferType(exp.list[3], typeEnv) : nullptr;
+
+      if (thenType == nullptr || elseType == nullptr) {
+        return thenType != nullptr ? thenType : elseType;
+      }
+
+      return isNumericType(thenType) && isNumericType(elseType)
+                 ? getCommonNumericType(thenType, elseType)
+                 : thenType;
+    }
+
+    if (op == "while" || op == "for" || op == "printf" || op == "def" ||
+        op == "class" || op == "interface" || op == "async" ||
+        op == "parallel-for" || op == "fence") {
+      return builder->getInt32Ty();
+    }
+
+    if (op == "atomic-cas") {
+      return builder->getInt1Ty();
+    }
+
+    if (op == "atomic-load" || op == "atomic-add" || op == "atomic-sub" ||
+        op == "atomic-xchg") {
+      return inferType(exp.list[1], typeEnv);
+    }
+
+    if (op == "atomic-store") {
+      return inferType(exp.list[2], typeEnv);
+    }
+
+    if (op == "spawn") {
+      auto resultType = inferType(exp.list[1], typeEnv);
+      return resultType != nullptr ? getFutureType(resultType) : nullptr;
+    }
+
+    if (op == "sync") {
+      auto futureType = inferType(exp.list[1], typeEnv);
+      return futureType != nullptr && isFutureType(futureType)
+                 ? getFutureResultType(futureType)
+                 : nullptr;
+    }
+
+    if (op == "await" || op == "async-run") {
+      auto taskType = inferType(exp.list[1], typeEnv);
+      return taskType != nullptr && isTaskType(taskType)
+                 ? getTaskResultType(taskType)
+                 : builder->getInt32Ty();
+    }
+
+    if (op == "var") {
+      auto varType = exp.list[1].type == ExpType::LIST
+                         ? extractVarType(exp.list[1])
+                         : inferType(exp.list[2], typeEnv);
+      typeEnv[extractVarName(exp.list[1])] = varType;
+      return varType;
+    }
+
+    if (op == "set") {
+      return inferType(exp.list[2], typeEnv);
+    }
+
+    if (op == "begin") {
+      llvm::Type* blockType = builder->getInt32Ty();
+      for (auto i = 1; i < exp.list.size(); i++) {
+        blockType = inferType(exp.list[i], typeEnv);
+      }
+      return blockType;
+    }
+
+    if (op == "new") {
+      return getTypeFromString(exp.list[1].string);
+    }
+
+    if (op == "array") {
+      return getArrayType(getTypeFromExp(exp.list[1]))->getPointerTo();
+    }
+
+    if (op == "alen" || op == "str-len" || op == "str-hash") {
+      return builder->getInt64Ty();
+    }
+
+    if (op == "str-concat") {
+      return getStringType()->getPointerTo();
+    }
+
+    if (op == "str-cmp") {
+      return builder->getInt32Ty();
+    }
+
+    if (op == "str-eq") {
+      return builder->getInt1Ty();
+    }
+
+    if (op == "aref") {
+      auto arrayType = inferType(exp.list[1], typeEnv);
+      return arrayType != nullptr && isArrayType(arrayType)
+                 ? getArrayElementType(arrayType)
+                 : nullptr;
+    }
+
+    if (op == "aset") {
+      return inferType(exp.list[3], typeEnv);
+    }
+
+    if (op == "splat") {
+      return getTypeFromExp(exp.list[1]);
+    }
+
+    if (op == "vload") {
+      auto arrayType = inferType(exp.list[1], typeEnv);
+      return arrayType != nullptr && isArrayType(arrayType)
+                 ? llvm::FixedVectorType::get(getArrayElementType(arrayType),
+                                              getLanesCount(exp.list[3]))
+                 : nullptr;
+    }
+
+    if (op == "vstore" || op == "set-lane" || op == "shuffle") {
+      return inferType(exp.list[op == "vstore" ? 3 : 1], typeEnv);
+    }
+
+    if (op == "lane" || op == "reduce-add" || op == "reduce-mul" ||
+        op == "reduce-min" || op == "reduce-max") {
+      auto vecType = inferType(exp.list[1], typeEnv);
+      return vecType != nullptr && vecType->isVectorTy()
+                 ? ((llvm::VectorType*)vecType)->getElementType()
+                 : nullptr;
+    }
+
+    if (op == "prop") {
+      auto instanceType = inferType(exp.list[1], typeEnv);
+
+      if (instanceType == nullptr || !instanceType->isPointerTy()) {
+        return nullptr;
+      }
+
+      auto clsName =
+          instanceType->getPointerElementType()->getStructName().str();
+      auto& fields = classMap_[clsName].fieldsMap;
+      auto field = fields.find(exp.list[2].string);
+
+      return field != fields.end() ? field->second : nullptr;
+    }
+
+    // Untyped function calls:
+    if (genericFns_.count(op) != 0) {
+      std::vector<llvm::Type*> argTypes{};
+
+      for (auto i = 1; i < exp.list.size(); i++) {
+        auto argType = inferType(exp.list[i], typeEnv);
+        if (argType == nullptr) {
+          return nullptr;
+        }
+        argTypes.push_back(argType);
+      }
+
+      return inferReturnType(op, argTypes);
+    }
+
+    // Typed function calls:
+    if (auto callee = module->getFunction(op)) {
+      return callee->getReturnType();
+    }
+
+    return nullptr;
+  }
+
+  /**
+   * Converts direct self-recursion in tail positions to a loop.
+   * Tail positions are the last expression of `begin`, and both
+   * branches of `if`:
+   *
+   * (def sum (n acc) (if (== n 0) acc (sum (- n 1) (+ acc n))))
+   *
+   * (def sum (n acc)
+   *   (begin
+   *     (var (__tail_result number) 0)
+   *     (var (__tail_continue boolean) true)
+   *     (while __tail_continue
+   *       (begin
+   *         (set __tail_continue false)
+   *         (if (== n 0)
+   *           (begin (set __tail_result acc) 0)
+   *           (begin
+   *             (var (__tail_arg0 number) (- n 1))
+   *             (var (__tail_arg1 number) (+ acc n))
+   *             (set n __tail_arg0)
+   *             (set acc __tail_arg1)
+   *             (set __tail_continue true)
+   *             0))))
+   *     __tail_result))
+   *
+   * Only functions returning numbers or booleans are converted, other
+   * tail calls are guaranteed by `musttail` (see markTailCalls).
+   * Untyped functions are converted per specialization, with the
+   * param types of the specialization (see getSpecialization).
+   */
+  Exp eliminateTailRecursion(const Exp& fnExp) {
+    auto fnName = fnExp.list[1].string;
+    auto& body = hasReturnType(fnExp) ? fnExp.list[5] : fnExp.list[3];
+
+    // Untyped return is i32:
+    std::string returnTypeName = "number";
+
+    if (hasReturnType(fnExp)) {
+      returnTypeName = fnExp.list[4].type == ExpType::SYMBOL
+                           ? fnExp.list[4].string
+                           : "";
+    }
+
+    auto resultInit = getZeroLiteral(returnTypeName);
+
+    if (resultInit.type == ExpType::SYMBOL && resultInit.string.empty()) {
+      return fnExp;
+    }
+
+    if (!hasSelfTailCall(body, fnExp)) {
+      return fnExp;
+    }
+
+    auto loopBody = list({sym("begin"),
+                          list({sym("set"), sym("__tail_continue"),
+                                sym("false")}),
+                          tailPosition(body, fnExp)});
+
+    auto newBody = list({
+        sym("begin"),
+        list({sym("var"),
+              list({sym("__tail_result"), sym(returnTypeName)}),
+              resultInit}),
+        list({sym("var"), list({sym("__tail_continue"), sym("boolean")}),
+              sym("true")}),
+        list({sym("while"), sym("__tail_continue"), loopBody}),
+        sym("__tail_result"),
+    });
+
+    auto newFnExp = fnExp;
+    newFnExp.list[hasReturnType(fnExp) ? 5 : 3] = newBody;
+
+    return newFnExp;
+  }
+
+  /**
+   * Whether there is a direct self-call in a tail position.
+   */
+  bool hasSelfTailCall(const Exp& exp, const Exp& fnExp) {
+    if (isSelfCall(exp, fnExp)) {
+      return true;
+    }
+
+    if (isTaggedList(exp, "if") && exp.list.size() == 4) {
+      return hasSelfTailCall(exp.list[2], fnExp) ||
+             hasSelfTailCall(exp.list[3], fnExp);
+    }
+
+    if (isTaggedList(exp, "begin") && exp.list.size() > 1) {
+      return hasSelfTailCall(exp.list[exp.list.size() - 1], fnExp);
+    }
+
+    return false;
+  }
+
+  /**
+   * Rewrites tail positions: self-calls rebind the params and continue
+   * the loop, other values are stored as the result.
+   */
+  Exp tailPosition(const Exp& exp, const Exp& fnExp) {
+    if (isTaggedList(exp, "if") && exp.list.size() == 4) {
+      return list({exp.list[0], exp.list[1], tailPosition(exp.list[2], fnExp),
+                   tailPosition(exp.list[3], fnExp)});
+    }
+
+    if (isTaggedList(exp, "begin") && exp.list.size() > 1) {
+      auto block = exp;
+      block.list.back() = tailPosition(exp.list.back(), fnExp);
+      return block;
+    }
+
+    if (isSelfCall(exp, fnExp)) {
+      auto& params = fnExp.list[2].list;
+      std::vector<Exp> rebind{sym("begin")};
+
+      // Args are evaluated before any param is updated:
+      for (auto i = 0; i < params.size(); i++) {
+        auto paramType = params[i].type == ExpType::LIST ? params[i].list[1]
+                                                         : sym("number");
+        rebind.push_back(
+            list({sym("var"),
+                  list({sym("__tail_arg" + std::to_string(i)), paramType}),
+                  exp.list[i + 1]}));
+      }
+
+      for (auto i = 0; i < params.size(); i++) {
+        rebind.push_back(list({sym("set"), sym(extractVarName(params[i])),
+                               sym("__tail_arg" + std::to_string(i))}));
+      }
+
+      rebind.push_back(list({sym("set"), sym("__tail_continue"), sym("true")}));
+      rebind.push_back(Exp((int64_t)0));
+
+      return list(rebind);
+    }
+
+    return list({sym("begin"), list({sym("set"), sym("__tail_result"), exp}),
+                 Exp((int64_t)0)});
+  }
+
+  /**
+   * (<fnName> <args>) with all params passed.
+   */
+  bool isSelfCall(const Exp& exp, const Exp& fnExp) {
+    return isTaggedList(exp, fnExp.list[1].string) &&
+           exp.list.size() == fnExp.list[2].list.size() + 1;
+  }
+
+  /**
+   * Zero literal of a numeric or boolean type name, or empty symbol.
+   */
+  Exp getZeroLiteral(const std::string& typeName) {
+    if (typeName == "number" || typeName == "i32" || typeName == "i64") {
+      return Exp((int64_t)0);
+    }
+
+    if (typeName == "f32" || typeName == "f64") {
+      return Exp(0.0);
+    }
+
+    if (typeName == "boolean") {
+      return sym("false");
+    }
+
+    return sym("");
+  }
+
+  /**
+   * AST builders: symbol and list.
+   */
+  Exp sym(std::string name) { return Exp(name); }
+
+  Exp list(std::vector<Exp> items) { return Exp(items); }
+
+  /**
+   * Marks calls in tail positions (a call followed by `ret` of its
+   * result): `musttail` if the prototypes match, `tail` otherwise.
+   *
+   * Calls in branches which return through a phi are moved to return
+   * directly from the branch first.
+   */
+  void markTailCalls() {
+    for (auto& function : *module) {
+      if (function.isDeclaration()) {
+        continue;
+      }
+
+      duplicateReturns(function);
+
+      for (auto& block : function) {
+        auto ret = llvm::dyn_cast<llvm::ReturnInst>(block.getTerminator());
+
+        if (ret == nullptr || ret->getReturnValue() == nullptr ||
+            ret == &block.front()) {
+          continue;
+        }
+
+        auto call = llvm::dyn_cast<llvm::CallInst>(ret->getPrevNode());
+
+        if (call == nullptr || ret->getReturnValue() != call ||
+            call->getCalledFunction() == nullptr ||
+            call->getCalledFunction()->isDeclaration()) {
+          continue;
+        }
+
+        auto callee = call->getCalledFunction();
+
+        auto prototypesMatch =
+            callee->getFunctionType() == function.getFunctionType() &&
+            callee->getCallingConv() == function.getCallingConv() &&
+            !callee->isVarArg();
+
+        call->setTailCallKind(prototypesMatch ? llvm::CallInst::TCK_MustTail
+                                              : llvm::CallInst::TCK_Tail);
+      }
+    }
+  }
+
+  /**
+   * ret (phi [call, branch], ...) -> ret call in the branch.
+   */
+  void duplicateReturns(llvm::Function& function) {
+    std::vector<llvm::ReturnInst*> rets{};
+
+    for (auto& block : function) {
+      if (auto ret = llvm::dyn_cast<llvm::ReturnInst>(block.getTerminator())) {
+        rets.push_back(ret);
+      }
+    }
+
+    for (auto ret : rets) {
+      auto phi = llvm::dyn_cast_or_null<llvm::PHINode>(ret->getReturnValue());
+
+      // Only a block with just `phi; ret phi`:
+      if (phi == nullptr || phi->getParent() != ret->getParent() ||
+          &phi->getParent()->front() != phi || phi->getNextNode() != ret ||
+          !phi->hasOneUse()) {
+        continue;
+      }
+
+      for (auto i = (int)phi->getNumIncomingValues() - 1; i >= 0; i--) {
+        auto call = llvm::dyn_cast<llvm::CallInst>(phi->getIncomingValue(i));
+        auto pred = phi->getIncomingBlock(i);
+        auto br = llvm::dyn_cast<llvm::BranchInst>(pred->getTerminator());
+
+        if (call == nullptr || br == nullptr || br->isConditional() ||
+            call->getParent() != pred || call->getNextNode() != br) {
+          continue;
+        }
+
+        llvm::ReturnInst::Create(*ctx, call, br);
+        br->eraseFromParent();
+        phi->removeIncomingValue(i, /* DeletePHIIfEmpty */ false);
+      }
+
+      // All branches return directly:
+      if (phi->getNumIncomingValues() == 0) {
+        auto block = phi->getParent();
+        ret->eraseFromParent();
+        phi->eraseFromParent();
+        block->eraseFromParent();
+      }
+    }
+  }
+
+  /**
+   * Profiler hooks: each function gets an id, and calls
+   * eva_prof_enter(id) on entry, and eva_prof_exit(id) before
+   * returns (before the guaranteed tail calls, since the caller's
+   * frame is gone by then). Main registers the function names:
+   *
+   * eva_prof_init([N x i8*] names, N)
+   *
+   * Runs after the attributes inference: functions which don't
+   * access memory now only access the profiler state.
+   */
+  void instrumentFunctions() {
+    auto enterFn = getProfilerFn("eva_prof_enter");
+    auto exitFn = getProfilerFn("eva_prof_exit");
+
+    std::vector<llvm::Constant*> names{};
+    llvm::Function* mainFn = nullptr;
+
+    for (auto& function : *module) {
+      // Coroutines are not instrumented: their `ret` is in each resume
+      // clone (after the split), recording the exits without entries.
+      if (function.isDeclaration() ||
+          function.hasFnAttribute("coroutine.presplit")) {
+        continue;
+      }
+
+      auto fnId = builder->getInt32(names.size());
+      names.push_back(internString(getDisplayName(function)));
+
+      if (function.doesNotAccessMemory()) {
+        function.removeFnAttr(llvm::Attribute::ReadNone);
+        function.addFnAttr(llvm::Attribute::InaccessibleMemOnly);
+      }
+      function.removeFnAttr(llvm::Attribute::ReadOnly);
+
+      builder->SetInsertPoint(&*function.getEntryBlock().getFirstInsertionPt());
+      builder->CreateCall(enterFn, fnId);
+
+      for (auto& block : function) {
+        if (!llvm::isa<llvm::ReturnInst>(block.getTerminator())) {
+          continue;
+        }
+
+        auto mustTailCall = block.getTerminatingMustTailCall();
+        builder->SetInsertPoint(mustTailCall != nullptr
+                                    ? (llvm::Instruction*)mustTailCall
+                                    : block.getTerminator());
+        builder->CreateCall(exitFn, fnId);
+      }
+
+      if (function.getName() == "main") {
+        mainFn = &function;
+      }
+    }
+
+    if (mainFn == nullptr) {
+      return;
+    }
+
+    auto namesType = llvm::ArrayType::get(
+        builder->getInt8Ty()->getPointerTo(), names.size());
+
+    auto namesTable = new llvm::GlobalVariable(
+        *module, namesType, /* isConstant */ true,
+        llvm::GlobalVariable::PrivateLinkage,
+        llvm::ConstantArray::get(namesType, names), "eva.prof.names");
+
+    // Before the entry hook of main:
+    builder->SetInsertPoint(&*mainFn->getEntryBlock().getFirstInsertionPt());
+    builder->CreateCall(
+        getProfilerFn("eva_prof_init"),
+        {builder->CreateConstInBoundsGEP2_32(namesType, namesTable, 0, 0),
+         builder->getInt32(names.size())});
+  }
+
+  /**
+   * Profiler runtime function. Hooks only touch the profiler state.
+   */
+  llvm::FunctionCallee getProfilerFn(const std::string& fnName) {
+    auto fnType =
+        fnName == "eva_prof_init"
+            ? llvm::FunctionType::get(
+                  builder->getVoidTy(),
+                  {builder->getInt8Ty()->getPointerTo()->getPointerTo(),
+                   builder->getInt32Ty()},
+                  false)
+            : llvm::FunctionType::get(builder->getVoidTy(),
+                                      builder->getInt32Ty(), false);
+
+    auto callee = module->getOrInsertFunction(fnName, fnType);
+
+    if (auto fn = llvm::dyn_cast<llvm::Function>(callee.getCallee())) {
+      fn->addFnAttr(llvm::Attribute::NoUnwind);
+
+      if (fnName != "eva_prof_init") {
+        fn->addFnAttr(llvm::Attribute::InaccessibleMemOnly);
+      }
+    }
+
+    return callee;
+  }
+
+  /**
+   * Function name as written in the source: methods
+   * <Class>_<method> are Class.method.
+   */
+  std::string getDisplayName(llvm::Function& function) {
+    auto fnName = function.getName().str();
+    std::string clsName{};
+
+    for (auto& cls : classMap_) {
+      if (fnName.rfind(cls.first + "_", 0) == 0 &&
+          cls.first.size() > clsName.size()) {
+        clsName = cls.first;
+      }
+    }
+
+    return clsName.empty()
+               ? fnName
+               : clsName + "." + fnName.substr(clsName.size() + 1);
+  }
+
+  /**
+   * Infers function attributes over the module, and applies
+   * the source annotations:
+   *
+   * - nounwind: Eva has no exceptions
+   * - readnone / readonly: only own stack is written (and read)
+   * - willreturn: no loops, and only calls functions which return
+   * - noalias on allocations, nonnull/dereferenceable on `self`
+   * - ^inline -> alwaysinline, ^noinline -> noinline
+   * - ^pure -> checked to have no side effects
+   */
+  void inferFunctionAttributes() {
+    std::map<llvm::Function*, MemoryEffect> effects{};
+    std::set<llvm::Function*> willReturn{};
+
+    // Fresh allocations:
+    if (auto gcMalloc = module->getFunction("GC_malloc")) {
+      gcMalloc->addRetAttr(llvm::Attribute::NoAlias);
+      gcMalloc->addFnAttr(llvm::Attribute::NoUnwind);
+    }
+
+    // Optimistic start, until the fixed point:
+    for (auto& function : *module) {
+      if (!function.isDeclaration()) {
+        effects[&function] = MemoryEffect::NONE;
+      }
+    }
+
+    for (auto changed = true; changed;) {
+      changed = false;
+
+      for (auto& entry : effects) {
+        auto effect = getMemoryEffect(*entry.first, effects);
+        if (effect != entry.second) {
+          entry.second = effect;
+          changed = true;
+        }
+      }
+    }
+
+    // Pessimistic start: recursive functions are never proven.
+    for (auto changed = true; changed;) {
+      changed = false;
+
+      for (auto& entry : effects) {
+        if (willReturn.count(entry.first) == 0 &&
+            isWillReturn(*entry.first, willReturn)) {
+          willReturn.insert(entry.first);
+          changed = true;
+        }
+      }
+    }
+
+    for (auto& entry : effects) {
+      auto function = entry.first;
+      auto effect = entry.second;
+
+      function->addFnAttr(llvm::Attribute::NoUnwind);
+
+      if (effect == MemoryEffect::NONE) {
+        function->addFnAttr(llvm::Attribute::ReadNone);
+      } else if (effect == MemoryEffect::READ) {
+        function->addFnAttr(llvm::Attribute::ReadOnly);
+      }
+
+      if (willReturn.count(function) != 0) {
+        function->addFnAttr(llvm::Attribute::WillReturn);
+      }
+
+      // Instance is always allocated:
+      for (auto& arg : function->args()) {
+        if (arg.getName() == "self" && arg.getType()->isPointerTy()) {
+          arg.addAttr(llvm::Attribute::NonNull);
+          arg.addAttr(llvm::Attribute::getWithDereferenceableBytes(
+              *ctx, getTypeSize(arg.getType()->getPointerElementType())));
+        }
+      }
+
+      applyAnnotations(*function, effect);
+    }
+  }
+
+  /**
+   * Applies source annotations to the function (specializations
+   * of untyped functions get annotations of the function).
+   */
+  void applyAnnotations(llvm::Function& function, MemoryEffect effect) {
+    auto fnName = function.getName().str();
+    auto it = functionAnnotations_.find(&function);
+
+    if (it == functionAnnotations_.end()) {
+      return;
+    }
+
+    auto& annotations = fnAnnotations_.at(it->second);
+
+    if (annotations.count("inline") != 0) {
+      function.addFnAttr(llvm::Attribute::AlwaysInline);
+    }
+
+    if (annotations.count("noinline") != 0) {
+      function.addFnAttr(llvm::Attribute::NoInline);
+    }
+
+    if (annotations.count("pure") != 0 && effect == MemoryEffect::WRITE) {
+      DIE << "Function \"" << fnName
+          << "\" is annotated ^pure, but has side effects.\n";
+    }
+  }
+
+  /**
+   * Memory effect of a function given the current effects of others.
+   * Own stack variables (allocas) are not counted.
+   */
+  MemoryEffect getMemoryEffect(
+      llvm::Function& function,
+      const std::map<llvm::Function*, MemoryEffect>& effects) {
+    auto effect = MemoryEffect::NONE;
+
+    for (auto& block : function) {
+      for (auto& instr : block) {
+        auto instrEffect = MemoryEffect::NONE;
+
+        if (auto load = llvm::dyn_cast<llvm::LoadInst>(&instr)) {
+          instrEffect = isLocalMemory(load->getPointerOperand())
+                            ? MemoryEffect::NONE
+                            : MemoryEffect::READ;
+        } else if (auto store = llvm::dyn_cast<llvm::StoreInst>(&instr)) {
+          instrEffect = isLocalMemory(store->getPointerOperand())
+                            ? MemoryEffect::NONE
+                            : MemoryEffect::WRITE;
+        } else if (auto call = llvm::dyn_cast<llvm::CallBase>(&instr)) {
+          auto callee = call->getCalledFunction();
+          auto calleeEffect =
+              callee != nullptr ? effects.find(callee) : effects.end();
+
+          if (calleeEffect != effects.end()) {
+            instrEffect = calleeEffect->second;
+          } else if (call->doesNotAccessMemory()) {
+            instrEffect = MemoryEffect::NONE;
+          } else if (call->onlyReadsMemory()) {
+            instrEffect = MemoryEffect::READ;
+          } else {
+            instrEffect = MemoryEffect::WRITE;
+          }
+        } else if (instr.mayWriteToMemory()) {
+          instrEffect = MemoryEffect::WRITE;
+        } else if (instr.mayReadFromMemory()) {
+          instrEffect = MemoryEffect::READ;
+        }
+
+        effect = std::max(effect, instrEffect);
+      }
+    }
+
+    return effect;
+  }
+
+  /**
+   * Whether a pointer is a stack variable of the function.
+   */
+  bool isLocalMemory(llvm::Value* ptr) {
+    return llvm::isa<llvm::AllocaInst>(ptr->stripPointerCasts());
+  }
+
+  /**
+   * Whether a function has no loops, and only calls
+   * functions known to return.
+   */
+  bool isWillReturn(llvm::Function& function,
+                    const std::set<llvm::Function*>& willReturn) {
+    for (auto& block : function) {
+      for (auto& instr : block) {
+        auto call = llvm::dyn_cast<llvm::CallBase>(&instr);
+
+        if (call == nullptr) {
+          continue;
+        }
+
+        auto callee = call->getCalledFunction();
+
+        if (callee == nullptr ||
+            (willReturn.count(callee) == 0 &&
+             !callee->hasFnAttribute(llvm::Attribute::WillReturn))) {
+          return false;
+        }
+      }
+    }
+
+    return !hasCycle(function);
+  }
+
+  /**
+   * Whether the function CFG has a cycle (a loop).
+   */
+  bool hasCycle(llvm::Function& function) {
+    std::set<llvm::BasicBlock*> visited{};
+    std::set<llvm::BasicBlock*> onStack{};
+
+    std::function<bool(llvm::BasicBlock*)> visit =
+        [&](llvm::BasicBlock* block) {
+          visited.insert(block);
+          onStack.insert(block);
+
+          for (auto succ : llvm::successors(block)) {
+            if (onStack.count(succ) != 0 ||
+                (visited.count(succ) == 0 && visit(succ))) {
+              return true;
+            }
+          }
+
+          onStack.erase(block);
+          return false;
+        };
+
+    return visit(&function.getEntryBlock());
+  }
+
+  /**
+   * Allocas go to the entry block: at its end, or before its branch
+   * if the code after it is already in other blocks (loops).
+   */
+  void setAllocaInsertPoint() {
+    auto entryBlock = &fn->getEntryBlock();
+
+    if (auto terminator = entryBlock->getTerminator()) {
+      varsBuilder->SetInsertPoint(terminator);
+    } else {
+      varsBuilder->SetInsertPoint(entryBlock);
+    }
+  }
+
+  /**
+   * Allocates a local variable on the stack. Result is the alloca instruction.
+   */
+  llvm::Value* allocVar(const std::string& name, llvm::Type* type_, Env env) {
+    setAllocaInsertPoint();
+
+    auto varAlloc = varsBuilder->CreateAlloca(type_, 0, name.c_str());
+
+    if (debugInfo_) {
+      declareVar(varAlloc, name, type_);
+    }
+
+    // Add to the environment:
+    env->define(name, varAlloc);
+
+    return varAlloc;
+  }
+
+  /**
+   * Creates a global variable.
+   */
+  llvm::GlobalVariable* createGlobalVar(const std::string& name,
+                                        llvm::Constant* init) {
+    module->getOrInsertGlobal(name, init->getType());
+
+    auto variable = module->getNamedGlobal(name);
+
+    variable->setConstant(false);
+    variable->setInitializer(init);
+
+    return variable;
+  }
+
+  /**
+   * Define external functions (from libc++)
+   *
+   * The runtime functions are declared on the first use.
+   */
+  void setupExternFunctions() {
+    // Instances (and arrays) are garbage collected:
+    // i8* GC_malloc(i64)
+    getArrayAllocFn();
+  }
+
+  /**
+   * Creates a function.
+   */
+  llvm::Function* createFunction(const std::string& fnName,
+                                 llvm::FunctionType* fnType, Env env) {
+    // Function prototype might already be defined:
+    auto fn = module->getFunction(fnName);
+
+    if (fn == nullptr) {
+      fn = createFunctionProto(fnName, fnType, env);
+    } else if (!fn->empty()) {
+      DIE << "Function \"" << fnName << "\" is already defined.\n";
+    }
+
+    createFunctionBlock(fn);
+
+    return fn;
+  }
+
+  /**
+   * Creates function prototype (defines the function, but not the body)
+   */
+  llvm::Function* createFunctionProto(const std::string& fnName,
+                                      llvm::FunctionType* fnType, Env env) {
+    auto fn = llvm::Function::Create(fnType, llvm::Function::ExternalLinkage,
+                                     fnName, *module);
+
+    // Arrays are always non-null and aligned:
+    for (auto& arg : fn->args()) {
+      if (isArrayType(arg.getType())) {
+        arg.addAttr(llvm::Attribute::NonNull);
+        arg.addAttr(llvm::Attribute::getWithAlignment(
+            *ctx, llvm::Align(ARRAY_ALIGNMENT)));
+      }
+    }
+
+    // Host CPU features:
+    if (!hostCPU_.empty()) {
+      fn->addFnAttr("target-cpu", hostCPU_);
+      fn->addFnAttr("target-features", hostCPUFeatures_);
+    }
+
+    // Lets the backend and vectorizer use the fast-math semantics:
+    if (fastMath_) {
+      fn->addFnAttr("unsafe-fp-math", "true");
+      fn->addFnAttr("no-nans-fp-math", "true");
+      fn->addFnAttr("no-infs-fp-math", "true");
+      fn->addFnAttr("no-signed-zeros-fp-math", "true");
+    }
+
+    verifyFunction(*fn);
+
+    // Install in the environment:
+    env->define(fnName, fn);
+
+    return fn;
+  }
+
+  /**
+   * Creates function block.
+   */
+  void createFunctionBlock(llvm::Function* fn) {
+    auto entry = createBB("entry", fn);
+    builder->SetInsertPoint(entry);
+  }
+
+  /**
+   * Creates a basic block. If the `fn` is passed, the block is
+   * automatically appended to the parent function. Otherwise,
+   * the block should later be appended manually via
+   * fn->getBasicBlockList().push_back(block);
+   */
+  llvm::BasicBlock* createBB(std::string name, llvm::Function* fn = nullptr) {
+    return llvm::BasicBlock::Create(*ctx, name, fn);
+  }
+
+  /**
+   * Saves IR to file.
+   */
+  void saveModuleToFile(const std::string& fileName) {
+    std::error_code errorCode;
+    llvm::raw_fd_ostream outLL(fileName, errorCode);
+    module->print(outLL, nullptr);
+  }
+
+  /**
+   * Emits the module as a native object file.
+   */
+  void emitObjectFile(const std::string& fileName) {
+    std::error_code errorCode;
+    llvm::raw_fd_ostream out(fileName, errorCode, llvm::sys::fs::OF_None);
+
+    if (errorCode) {
+      DIE << "Cannot write " << fileName << ": " << errorCode.message();
+    }
+
+    emitObject(out);
+  }
+
+  /**
+   * Emits the module as a native object to the stream.
+   */
+  void emitObject(llvm::raw_pwrite_stream& out) {
+    auto targetMachine = createModuleTarget();
+
+    llvm::legacy::PassManager passManager;
+
+    if (targetMachine->addPassesToEmitFile(passManager, out, nullptr,
+                                           llvm::CGFT_ObjectFile)) {
+      DIE << "Cannot emit an object file for " << module->getTargetTriple();
+    }
+
+    passManager.run(*module);
+  }
+
+  /**
+   * Emits the module as bitcode with the ThinLTO summary (functions,
+   * their references and call edges), which the linker uses to import
+   * functions across modules for the inlining.
+   */
+  void emitBitcodeFile(const std::string& fileName) {
+    createModuleTarget();
+
+    // Position independent code at the link (as the object files):
+    module->setPICLevel(llvm::PICLevel::BigPIC);
+
+    std::error_code errorCode;
+    llvm::raw_fd_ostream out(fileName, errorCode, llvm::sys::fs::OF_None);
+
+    if (errorCode) {
+      DIE << "Cannot write " << fileName << ": " << errorCode.message();
+    }
+
+    llvm::ProfileSummaryInfo profileSummary(*module);
+    auto index =
+        llvm::buildModuleSummaryIndex(*module, nullptr, &profileSummary);
+
+    llvm::WriteBitcodeToFile(*module, out,
+                             /* ShouldPreserveUseListOrder */ false, &index);
+  }
+
+  /**
+   * Target machine of the emitted file, the module gets its triple
+   * and data layout.
+   */
+  std::unique_ptr<llvm::TargetMachine> createModuleTarget() {
+    auto targetMachine = createTargetMachine();
+
+    if (targetMachine == nullptr) {
+      DIE << "No target for " << module->getTargetTriple();
+    }
+
+    module->setTargetTriple(targetMachine->getTargetTriple().str());
+    module->setDataLayout(targetMachine->createDataLayout());
+
+    return targetMachine;
+  }
+
+  /**
+   * Initialize the module.
+   */
+  void moduleInit() {
+    // Open a new context and module.
+    ctx = std::make_unique<llvm::LLVMContext>();
+    module = std::make_unique<llvm::Module>("EvaLLVM", *ctx);
+
+    // Create a new builder for the module.
+    builder = std::make_unique<llvm::IRBuilder<>>(*ctx);
+
+    // Vars builder:
+    varsBuilder = std::make_unique<llvm::IRBuilder<>>(*ctx);
+  }
+
+  /**
+   * Sets up The Global Environment.
+   */
+  void setupGlobalEnvironment() {
+    // Globals are defined by the program (VERSION, top-level vars):
+    GlobalEnv = std::make_shared<Environment>(
+        std::map<std::string, llvm::Value*>{}, nullptr);
+  }
+
+  /**
+   * Sets source locations of the parsed expressions, walking the tokens
+   * in the same order as the parser: a list is located at its `(`.
+   * Columns on the first line are shifted by the wrapping prefix.
+   */
+  void attachLocations(Exp& exp, syntax::Tokenizer& tokenizer,
+                       int firstLineShift) {
+    auto token = tokenizer.getNextToken();
+
+    exp.line = token->startLine;
+    exp.column = std::max(
+        1, token->startColumn + 1 -
+               (token->startLine == 1 ? firstLineShift : 0));
+
+    if (exp.type == ExpType::LIST) {
+      for (auto& e : exp.list) {
+        attachLocations(e, tokenizer, firstLineShift);
+      }
+
+      // Closing `)`:
+      tokenizer.getNextToken();
+    }
+  }
+
+  /**
+   * Creates the compile unit, and collects def locations.
+   */
+  void createCompileUnit(const Exp& program) {
+    dibuilder_ = std::make_unique<llvm::DIBuilder>(*module);
+
+    auto slash = sourceFile_.find_last_of('/');
+    diFile_ = dibuilder_->createFile(
+        slash == std::string::npos ? sourceFile_
+                                   : sourceFile_.substr(slash + 1),
+        slash == std::string::npos ? "." : sourceFile_.substr(0, slash));
+
+    compileUnit_ = dibuilder_->createCompileUnit(
+        llvm::dwarf::DW_LANG_C, diFile_, "eva-llvm",
+        /* isOptimized */ optLevel_ > 0, /* flags */ "",
+        /* runtimeVersion */ 0);
+
+    module->addModuleFlag(llvm::Module::Warning, "Debug Info Version",
+                          llvm::DEBUG_METADATA_VERSION);
+    module->addModuleFlag(llvm::Module::Warning, "Dwarf Version", 4);
+
+    collectFunctionLines(program, "");
+  }
+
+  /**
+   * Lines of defs by function name (methods as <Class>_<method>).
+   */
+  void collectFunctionLines(const Exp& exp, const std::string& clsName) {
+    if (exp.type != ExpType::LIST || exp.list.empty()) {
+      return;
+    }
+
+    auto innerClsName = clsName;
+
+    if (isTaggedList(exp, "def")) {
+      auto fnName = exp.list[1].string;
+      functionLines_[clsName.empty() ? fnName : clsName + "_" + fnName] =
+          exp.line;
+      innerClsName = "";
+    }
+
+    if (isTaggedList(exp, "class")) {
+      innerClsName = exp.list[1].string;
+    }
+
+    for (auto& e : exp.list) {
+      collectFunctionLines(e, innerClsName);
+    }
+  }
+
+  /**
+   * Debug location of the expression in the current function.
+   */
+  llvm::DebugLoc getDebugLoc(const Exp& exp) {
+    if (!debugInfo_ || exp.line == 0 || fn == nullptr) {
+      return llvm::DebugLoc();
+    }
+
+    return llvm::DILocation::get(*ctx, exp.line, exp.column,
+                                 getSubprogram(fn));
+  }
+
+  /**
+   * Subprogram of the function (created on first use). Specializations
+   * of untyped functions are located at the generic def.
+   */
+  llvm::DISubprogram* getSubprogram(llvm::Function* function) {
+    if (auto subprogram = function->getSubprogram()) {
+      return subprogram;
+    }
+
+    auto fnName = function->getName().str();
+    auto it = functionLines_.find(fnName.substr(0, fnName.find('$')));
+    auto line = it != functionLines_.end() ? it->second : 1;
+
+    std::vector<llvm::Metadata*> types{
+        getDebugType(function->getReturnType())};
+
+    for (auto& arg : function->args()) {
+      types.push_back(getDebugType(arg.getType()));
+    }
+
+    auto subprogram = dibuilder_->createFunction(
+        diFile_, getDisplayName(*function), fnName, diFile_, line,
+        dibuilder_->createSubroutineType(
+            dibuilder_->getOrCreateTypeArray(types)),
+        /* scopeLine */ line, llvm::DINode::FlagPrototyped,
+        llvm::DISubprogram::SPFlagDefinition |
+            (optLevel_ > 0 ? llvm::DISubprogram::SPFlagOptimized
+                           : llvm::DISubprogram::SPFlagZero));
+
+    function->setSubprogram(subprogram);
+
+    return subprogram;
+  }
+
+  /**
+   * Debug type of the value type.
+   */
+  llvm::DIType* getDebugType(llvm::Type* type_) {
+    if (type_->isVoidTy()) {
+      return nullptr;
+    }
+
+    if (type_->isIntegerTy(1)) {
+      return dibuilder_->createBasicType("boolean", 8,
+                                         llvm::dwarf::DW_ATE_boolean);
+    }
+
+    if (type_->isIntegerTy()) {
+      return dibuilder_->createBasicType(getTypeName(type_),
+                                         type_->getIntegerBitWidth(),
+                                         llvm::dwarf::DW_ATE_signed);
+    }
+
+    if (type_->isFloatTy() || type_->isDoubleTy()) {
+      return dibuilder_->createBasicType(getTypeName(type_),
+                                         getTypeSize(type_) * 8,
+                                         llvm::dwarf::DW_ATE_float);
+    }
+
+    // Instances, strings, arrays (opaque structs):
+    if (type_->isPointerTy() &&
+        type_->getPointerElementType()->isStructTy()) {
+      auto structType = (llvm::StructType*)type_->getPointerElementType();
+      auto structName =
+          structType->hasName() ? structType->getName().str() : "";
+
+      return dibuilder_->createPointerType(
+          dibuilder_->createStructType(
+              compileUnit_, structName, diFile_, 0,
+              structType->isSized() ? getTypeSize(structType) * 8 : 0,
+              /* alignInBits */ 0, llvm::DINode::FlagZero,
+              /* derivedFrom */ nullptr,
+              dibuilder_->getOrCreateArray({})),
+          getTypeSize(type_) * 8);
+    }
+
+    // Vectors and others, by size:
+    return dibuilder_->createBasicType(
+        "v" + std::to_string(getTypeSize(type_) * 8), getTypeSize(type_) * 8,
+        llvm::dwarf::DW_ATE_unsigned);
+  }
+
+  /**
+   * Describes a local variable (or parameter) of the current function.
+   */
+  void declareVar(llvm::AllocaInst* varAlloc, const std::string& name,
+                  llvm::Type* type_) {
+    auto subprogram = getSubprogram(fn);
+    auto loc = builder->getCurrentDebugLocation();
+    auto line = loc && loc->getScope()->getSubprogram() == subprogram
+                    ? loc.getLine()
+                    : subprogram->getLine();
+
+    auto var = dibuilder_->createAutoVariable(subprogram, name, diFile_, line,
+                                              getDebugType(type_));
+
+    dibuilder_->insertDeclare(
+        varAlloc, var, dibuilder_->createExpression(),
+        llvm::DILocation::get(*ctx, line, 0, subprogram),
+        varAlloc->getParent());
+  }
+
+  /**
+   * Completes debug info: every function gets a subprogram, and
+   * instructions emitted outside of a function body (prologues)
+   * are located at the def.
+   */
+  void finalizeDebugInfo() {
+    for (auto& function : *module) {
+      if (function.isDeclaration()) {
+        continue;
+      }
+
+      auto subprogram = getSubprogram(&function);
+      auto defLoc =
+          llvm::DILocation::get(*ctx, subprogram->getLine(), 0, subprogram);
+
+      for (auto& block : function) {
+        for (auto& instr : block) {
+          auto& loc = instr.getDebugLoc();
+
+          if (loc ? loc->getScope()->getSubprogram() != subprogram
+                  : llvm::isa<llvm::CallBase>(instr)) {
+            instr.setDebugLoc(defLoc);
+          }
+        }
+      }
+    }
+
+    dibuilder_->finalize();
+  }
+
+  /**
+   * Starts timing of a compiler phase (if collecting stats).
+   */
+  void startPhase(const std::string& name) {
+    if (stats_ != nullptr) {
+      stats_->startPhase(name);
+    }
+  }
+
+  void endPhase() {
+    if (stats_ != nullptr) {
+      stats_->endPhase();
+    }
+  }
+
+  /**
+   * Number of tokens of the parsed source: atoms, and the parentheses.
+   */
+  size_t countTokens(const Exp& exp) {
+    if (exp.type != ExpType::LIST) {
+      return 1;
+    }
+
+    // Parentheses:
+    size_t tokensCount = 2;
+
+    for (auto& e : exp.list) {
+      tokensCount += countTokens(e);
+    }
+
+    return tokensCount;
+  }
+
+  /**
+   * Number of AST nodes.
+   */
+  size_t countNodes(const Exp& exp) {
+    size_t nodesCount = 1;
+
+    if (exp.type == ExpType::LIST) {
+      for (auto& e : exp.list) {
+        nodesCount += countNodes(e);
+      }
+    }
+
+    return nodesCount;
+  }
+
+  /**
+   * Counts AST nodes, and functions, classes, basic blocks, and
+   * instructions of the generated (not optimized) module.
+   */
+  void countModule(const Exp& ast) {
+    size_t functionsCount = 0, blocksCount = 0, instructionsCount = 0;
+
+    for (auto& function : *module) {
+      if (function.isDeclaration()) {
+        continue;
+      }
+
+      functionsCount++;
+      blocksCount += function.size();
+      instructionsCount += function.getInstructionCount();
+    }
+
+    stats_->count("tokens", countTokens(ast));
+    stats_->count("ast_nodes", countNodes(ast));
+    stats_->count("functions", functionsCount);
+    stats_->count("classes", classMap_.size());
+    stats_->count("basic_blocks", blocksCount);
+    stats_->count("instructions", instructionsCount);
+  }
+
+  /**
+   * Runs the optimization pipeline at the optimization level.
+   *
+   * PGO: the instrumentation (or profile annotation) is part of
+   * the pipeline, it runs after the early simplification, so that
+   * the instrumented and optimized CFGs match.
+   */
+  void optimize() {
+    // The profile matches the CFG instrumented at the same level, and
+    // -O0 instruments before the early simplification:
+    if (optLevel_ == 0 && (profileGenerate_ || !profileUse_.empty())) {
+      DIE << "--profile-generate and --profile-use need -O1 or above "
+             "(the same level for both).\n";
+    }
+
+    // Coroutines are lowered by the pipeline (at -O0 as well):
+    if (optLevel_ == 0 && !hasCoroutines_) {
+      return;
+    }
+
+    llvm::Optional<llvm::PGOOptions> pgoOptions;
+
+    if (profileGenerate_) {
+      pgoOptions = llvm::PGOOptions("", "", "", llvm::PGOOptions::IRInstr);
+    } else if (!profileUse_.empty()) {
+      pgoOptions =
+          llvm::PGOOptions(profileUse_, "", "", llvm::PGOOptions::IRUse);
+    }
+
+    auto targetMachine = createTargetMachine();
+
+    llvm::LoopAnalysisManager lam;
+    llvm::FunctionAnalysisManager fam;
+    llvm::CGSCCAnalysisManager cgam;
+    llvm::ModuleAnalysisManager mam;
 
-        else {
-          auto loadedMethod = (llvm::LoadInst*)gen(exp.list[0], env);
+    llvm::PassBuilder passBuilder(targetMachine.get(),
+                                  llvm::PipelineTuningOptions(), pgoOptions);
 
-          auto fnTy = (llvm::FunctionType*)(loadedMethod->getPointerOperand()
-                                                ->getType()
-                                                ->getContainedType(0)
-                                                ->getContainedType(0));
+    passBuilder.registerModuleAnalyses(mam);
+    passBuilder.registerCGSCCAnalyses(cgam);
+    passBuilder.registerFunctionAnalyses(fam);
+    passBuilder.registerLoopAnalyses(lam);
+    passBuilder.crossRegisterProxies(lam, fam, cgam, mam);
 
-          // Implement here...
-        }
+    static const llvm::OptimizationLevel levels[] = {
+        llvm::OptimizationLevel::O0, llvm::OptimizationLevel::O1,
+        llvm::OptimizationLevel::O2, llvm::OptimizationLevel::O3};
 
-        break;
+    auto level = levels[std::min(optLevel_, 3u)];
+
+    // Nothing is inlined at -O0:
+    if (level != llvm::OptimizationLevel::O0) {
+      linkPrelude();
     }
 
-    // Unreachable:
-    return builder->getInt32(0);
-  }
+    // Separate compilation: the ThinLTO pre-link pipeline, the module
+    // is optimized further at the link, with the imported functions.
+    auto pipeline =
+        level == llvm::OptimizationLevel::O0
+            ? passBuilder.buildO0DefaultPipeline(level, separateCompilation_)
+        : separateCompilation_
+            ? passBuilder.buildThinLTOPreLinkDefaultPipeline(level)
+            : passBuilder.buildPerModuleDefaultPipeline(level);
 
-  /**
-   * Returns field index.
-   */
-  size_t getFieldIndex(llvm::StructType* cls, const std::string& fieldName) {
-    auto fields = &classMap_[cls->getName().data()].fieldsMap;
-    auto it = fields->find(fieldName);
-    return std::distance(fields->begin(), it) + RESERVED_FIELDS_COUNT;
+    pipeline.run(*module, mam);
   }
 
   /**
-   * Returns method index.
+   * Links the runtime functions which the module references (and
+   * the functions they call) from the prelude.
+   *
+   * The linked functions are available_externally: the optimizer
+   * inlines them, and drops the bodies afterwards, the calls go to
+   * the linked runtime. Functions using the runtime state (internal
+   * globals, e.g. the output buffer) stay declarations: the state
+   * must not be copied to the module. Runtime globals are declared.
    */
-  size_t getMethodIndex(llvm::StructType* cls, const std::string& methodName) {
-    // Implement here...
+  void linkPrelude() {
+    if (preludeFile_.empty()) {
+      return;
+    }
+
+    std::set<std::string> defined{};
+
+    for (auto& global : module->global_values()) {
+      if (!global.isDeclaration()) {
+        defined.insert(global.getName().str());
+      }
+    }
+
+    // Only the bodies of the linked functions are read:
+    auto prelude =
+        llvm::getLazyBitcodeModule(getPreludeBuffer(preludeFile_), *ctx);
+
+    if (!prelude) {
+      DIE << "Cannot load the prelude " << preludeFile_ << ": "
+          << llvm::toString(prelude.takeError()) << "\n";
+    }
+
+    if (llvm::Linker::linkModules(*module, std::move(*prelude),
+                                  llvm::Linker::LinkOnlyNeeded)) {
+      DIE << "Cannot link the prelude " << preludeFile_ << "\n";
+    }
+
+    for (auto& global : module->globals()) {
+      if (global.isDeclaration() || !global.hasExternalLinkage() ||
+          defined.count(global.getName().str()) != 0) {
+        continue;
+      }
+
+      global.setInitializer(nullptr);
+      global.setComdat(nullptr);
+    }
+
+    for (auto& fn : module->functions()) {
+      if (fn.isDeclaration() || !fn.hasExternalLinkage() ||
+          defined.count(fn.getName().str()) != 0) {
+        continue;
+      }
+
+      std::set<const llvm::Function*> visited{};
+
+      if (usesRuntimeState(fn, visited)) {
+        fn.deleteBody();
+      } else {
+        fn.setLinkage(llvm::GlobalValue::AvailableExternallyLinkage);
+      }
+    }
   }
 
   /**
-   * Creates an instance of a class.
+   * Whether the function (or the internal functions it calls) uses
+   * internal mutable globals.
    */
-  llvm::Value* createInstance(const Exp& exp, Env env,
-                              const std::string& name) {
-    // Implement here...
+  static bool usesRuntimeState(const llvm::Function& fn,
+                               std::set<const llvm::Function*>& visited) {
+    if (!visited.insert(&fn).second) {
+      return false;
+    }
+
+    for (auto& inst : llvm::instructions(fn)) {
+      for (auto& op : inst.operands()) {
+        if (usesRuntimeState(op.get(), visited)) {
+          return true;
+        }
+      }
+    }
+
+    return false;
   }
 
-  /**
-   * Allocates an object of a given class on the heap.
-   */
-  llvm::Value* mallocInstance(llvm::StructType* cls, const std::string& name) {
-    // Implement here...
+  static bool usesRuntimeState(const llvm::Value* value,
+                               std::set<const llvm::Function*>& visited) {
+    if (auto global = llvm::dyn_cast<llvm::GlobalVariable>(value)) {
+      return global->hasLocalLinkage() && !global->isConstant();
+    }
+
+    if (auto callee = llvm::dyn_cast<llvm::Function>(value)) {
+      return callee->hasLocalLinkage() && usesRuntimeState(*callee, visited);
+    }
+
+    // Constant expressions, e.g. a GEP of a global:
+    if (auto constant = llvm::dyn_cast<llvm::ConstantExpr>(value)) {
+      for (auto& op : constant->operands()) {
+        if (usesRuntimeState(op.get(), visited)) {
+          return true;
+        }
+      }
+    }
+
+    return false;
   }
 
   /**
-   * Returns size of a type in bytes.
+   * Prelude bitcode, read once per process (shared by the compiler
+   * instances of all threads, each loads it to its own context).
    */
-  size_t getTypeSize(llvm::Type* type_) {
-    return module->getDataLayout().getTypeAllocSize(type_);
+  static llvm::MemoryBufferRef getPreludeBuffer(const std::string& file) {
+    static std::mutex mutex;
+    static std::map<std::string, std::unique_ptr<llvm::MemoryBuffer>> buffers;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto& buffer = buffers[file];
+
+    if (buffer == nullptr) {
+      auto loaded = llvm::MemoryBuffer::getFile(file);
+
+      if (!loaded) {
+        DIE << "Cannot read the prelude " << file << ": "
+            << loaded.getError().message() << "\n";
+      }
+
+      buffer = std::move(*loaded);
+    }
+
+    return buffer->getMemBufferRef();
   }
 
   /**
-   * Inherits parent class fields.
+   * Target machine for the optimization pipeline (target specific
+   * costs for inlining and vectorization) and the object files
+   * (position independent). Null if the target is not available.
    */
-  void inheritClass(llvm::StructType* cls, llvm::StructType* parent) {
-    // Implement here...
+  std::unique_ptr<llvm::TargetMachine> createTargetMachine() {
+    initializeNativeTarget();
+
+    auto triple = module->getTargetTriple().empty()
+                      ? llvm::sys::getDefaultTargetTriple()
+                      : module->getTargetTriple();
+
+    std::string error;
+    auto target = llvm::TargetRegistry::lookupTarget(triple, error);
+
+    if (target == nullptr) {
+      return nullptr;
+    }
+
+    return std::unique_ptr<llvm::TargetMachine>(target->createTargetMachine(
+        triple, hostCPU_.empty() ? "generic" : hostCPU_, hostCPUFeatures_,
+        llvm::TargetOptions(), llvm::Reloc::PIC_));
   }
 
   /**
-   * Extracts fields and methods from a class expression.
+   * Sets up target triple.
    */
-  void buildClassInfo(llvm::StructType* cls, const Exp& clsExp, Env env) {
-    // Implement here...
+  void setupTargetTriple() {
+    module->setTargetTriple(llvm::sys::getDefaultTargetTriple());
   }
 
   /**
-   * Builds class body from class info.
+   * Parser.
    */
-  void buildClassBody(llvm::StructType* cls) {
-    // Implement here...
-  }
+  std::unique_ptr<EvaParser> parser;
 
   /**
-   * Creates a vtable per class.
-   *
-   * vTable stores method references to support
-   * inheritance and methods overloading.
+   * Global Environment (symbol table).
    */
-  void buildVTable(llvm::StructType* cls) {
-    // Implement here...
-  }
+  std::shared_ptr<Environment> GlobalEnv;
 
   /**
-   * Tagged lists.
+   * Currently compiling class.
    */
-  bool isTaggedList(const Exp& exp, const std::string& tag) {
-    return exp.type == ExpType::LIST && exp.list[0].type == ExpType::SYMBOL &&
-           exp.list[0].string == tag;
-  }
+  llvm::StructType* cls = nullptr;
 
   /**
-   * (var ...)
+   * Class info.
    */
-  bool isVar(const Exp& exp) { return isTaggedList(exp, "var"); }
+  std::map<std::string, ClassInfo> classMap_;
 
   /**
-   * (def ...)
+   * Interfaces, and the interfaces of classes (inherited first).
    */
-  bool isDef(const Exp& exp) { return isTaggedList(exp, "def"); }
+  std::map<std::string, InterfaceInfo> interfaceMap_;
+  std::map<std::string, std::vector<std::string>> classInterfaces_;
 
   /**
-   * (new ...)
+   * Untyped functions, specialized on calls.
    */
-  bool isNew(const Exp& exp) { return isTaggedList(exp, "new"); }
+  std::map<std::string, GenericFunction> genericFns_;
 
   /**
-   * (prop ...)
+   * Specializations which return types are being inferred.
    */
-  bool isProp(const Exp& exp) { return isTaggedList(exp, "prop"); }
+  std::set<std::string> inferring_;
 
   /**
-   * (super ...)
+   * Function annotations.
    */
-  bool isSuper(const Exp& exp) { return isTaggedList(exp, "super"); }
+  Annotations fnAnnotations_;
 
   /**
-   * Returns a type by name.
+   * Annotations of the compiled functions (ids in fnAnnotations_).
    */
-  llvm::StructType* getClassByName(const std::string& name) {
-    return llvm::StructType::getTypeByName(*ctx, name);
-  }
+  std::map<llvm::Function*, int> functionAnnotations_;
 
   /**
-   * Extracts var or parameter name considering type.
-   *
-   * x -> x
-   * (x number) -> x
+   * Fast-math mode for floating point operations.
    */
-  std::string extractVarName(const Exp& exp) {
-    return exp.type == ExpType::LIST ? exp.list[0].string : exp.string;
-  }
+  bool fastMath_ = false;
 
   /**
-   * Extracts var or parameter type with i32 as default.
-   *
-   * x -> i32
-   * (x number) -> number
+   * Host CPU name and features (empty if not compiling for the host).
    */
-  llvm::Type* extractVarType(const Exp& exp) {
-    return exp.type == ExpType::LIST ? getTypeFromString(exp.list[1].string)
-                                     : builder->getInt32Ty();
-  }
+  std::string hostCPU_;
+  std::string hostCPUFeatures_;
 
   /**
-   * Returns LLVM type from string representation.
+   * Optimization level of the emitted module.
    */
-  llvm::Type* getTypeFromString(const std::string& type_) {
-    // number -> i32
-    if (type_ == "number") {
-      return builder->getInt32Ty();
-    }
-
-    // string -> i8* (aka char*)
-    if (type_ == "string") {
-      return builder->getInt8Ty()->getPointerTo();
-    }
-
-    // Classes:
-    return classMap_[type_].cls->getPointerTo();
-  }
+  unsigned optLevel_ = 0;
 
   /**
-   * Whether function has return type defined.
+   * PGO: instrument for profiling, or use the profile file.
    */
-  bool hasReturnType(const Exp& fnExp) {
-    return fnExp.list[3].type == ExpType::SYMBOL &&
-           fnExp.list[3].string == "->";
-  }
+  bool profileGenerate_ = false;
+  std::string profileUse_;
 
   /**
-   * Exp function to LLVM function params.
-   *
-   * (def square ((number x)) -> number ...)
-   *
-   * llvm::FunctionType::get(returnType, paramTypes, false);
+   * Profiler hooks in all functions.
    */
-  llvm::FunctionType* extractFunctionType(const Exp& fnExp) {
-    auto params = fnExp.list[2];
-
-    // Return type:
-    auto returnType = hasReturnType(fnExp)
-                          ? getTypeFromString(fnExp.list[4].string)
-                          : builder->getInt32Ty();
-
-    // Parameter types:
-    std::vector<llvm::Type*> paramTypes{};
-
-    for (auto& param : params.list) {
-      auto paramName = extractVarName(param);
-      auto paramTy = extractVarType(param);
-
-      // The `self` name is special, meaning instance of a class:
-      paramTypes.push_back(
-          paramName == "self" ? (llvm::Type*)cls->getPointerTo() : paramTy);
-    }
-
-    return llvm::FunctionType::get(returnType, paramTypes, /* varargs */ false);
-  }
+  bool instrumentFunctions_ = false;
 
   /**
-   * Compiles a function.
-   *
-   * Untyped: (def square (x) (* x x)) - i32 by default
-   *
-   * Typed: (def square ((x number)) -> number (* x x))
+   * Allocation profile: site ids by (class, function), and the sites.
    */
-  llvm::Value* compileFunction(const Exp& fnExp, std::string fnName, Env env) {
-    // Implement here...
-  }
+  bool allocProfile_ = false;
+  std::map<std::pair<std::string, std::string>, size_t> allocSites_;
+  std::vector<llvm::Constant*> allocSitesTable_;
 
   /**
-   * Allocates a local variable on the stack. Result is the alloca instruction.
+   * Debug info: source file, compile unit, lines of defs.
    */
-  llvm::Value* allocVar(const std::string& name, llvm::Type* type_, Env env) {
-    varsBuilder->SetInsertPoint(&fn->getEntryBlock());
-
-    auto varAlloc = varsBuilder->CreateAlloca(type_, 0, name.c_str());
-
-    // Add to the environment:
-    env->define(name, varAlloc);
-
-    return varAlloc;
-  }
+  bool debugInfo_ = false;
+  std::string sourceFile_;
+  std::unique_ptr<llvm::DIBuilder> dibuilder_;
+  llvm::DICompileUnit* compileUnit_ = nullptr;
+  llvm::DIFile* diFile_ = nullptr;
+  std::map<std::string, int> functionLines_;
 
   /**
-   * Creates a global variable.
+   * Compiler statistics (if requested).
    */
-  llvm::GlobalVariable* createGlobalVar(const std::string& name,
-                                        llvm::Constant* init) {
-    // Implement here...
-  }
+  CompileStats* stats_ = nullptr;
 
   /**
-   * Define external functions (from libc++)
+   * Lengths of arrays allocated with constant length, and of the
+   * variables only ever holding them. Entries of the erased values
+   * are dropped by the value maps.
    */
-  void setupExternFunctions() {
-    // Implement here...
-  }
+  llvm::ValueMap<llvm::Value*, uint64_t> staticArrayLengths_;
+  llvm::ValueMap<llvm::Value*, uint64_t> staticArrayVars_;
 
   /**
-   * Creates a function.
+   * Copies of the captured variables in the parallel-for body being
+   * compiled (see checkAssignable).
    */
-  llvm::Function* createFunction(const std::string& fnName,
-                                 llvm::FunctionType* fnType, Env env) {
-    // Implement here...
-  }
+  std::set<llvm::Value*> capturedVars_;
 
   /**
-   * Creates function prototype (defines the function, but not the body)
+   * Variables assigned anywhere in the program (see collectAssignedVars).
    */
-  llvm::Function* createFunctionProto(const std::string& fnName,
-                                      llvm::FunctionType* fnType, Env env) {
-    auto fn = llvm::Function::Create(fnType, llvm::Function::ExternalLinkage,
-                                     fnName, *module);
-    verifyFunction(*fn);
-
-    // Install in the environment:
-    env->define(fnName, fn);
-
-    return fn;
-  }
+  std::set<std::string> assignedVars_;
 
   /**
-   * Creates function block.
+   * Interned C strings (literal bytes, printf formats).
    */
-  void createFunctionBlock(llvm::Function* fn) {
-    // Implement here...
-  }
+  std::map<std::string, llvm::GlobalVariable*> stringPool_;
 
   /**
-   * Creates a basic block. If the `fn` is passed, the block is
-   * automatically appended to the parent function. Otherwise,
-   * the block should later be appended manually via
-   * fn->getBasicBlockList().push_back(block);
+   * Interned string literals.
    */
-  llvm::BasicBlock* createBB(std::string name, llvm::Function* fn = nullptr) {
-    return llvm::BasicBlock::Create(*ctx, name, fn);
-  }
+  std::map<std::string, llvm::GlobalVariable*> stringLiterals_;
 
   /**
-   * Saves IR to file.
+   * Ranges of the enclosing counted loops.
    */
-  void saveModuleToFile(const std::string& fileName) {
-    std::error_code errorCode;
-    llvm::raw_fd_ostream outLL(fileName, errorCode);
-    module->print(outLL, nullptr);
-  }
+  std::vector<LoopRange> loopRanges_;
 
   /**
-   * Initialize the module.
+   * Currently compiling coroutine (async function).
    */
-  void moduleInit() {
-    // Open a new context and module.
-    ctx = std::make_unique<llvm::LLVMContext>();
-    module = std::make_unique<llvm::Module>("EvaLLVM", *ctx);
-
-    // Create a new builder for the module.
-    builder = std::make_unique<llvm::IRBuilder<>>(*ctx);
-
-    // Vars builder:
-    varsBuilder = std::make_unique<llvm::IRBuilder<>>(*ctx);
-  }
+  Coroutine coroutine_;
 
   /**
-   * Sets up The Global Environment.
+   * Result types of task types.
    */
-  void setupGlobalEnvironment() {
-    // Implement here...
-  }
+  std::map<llvm::StructType*, llvm::Type*> taskResultTypes_;
 
   /**
-   * Sets up target triple.
+   * Whether the module has coroutines (to be lowered).
    */
-  void setupTargetTriple() {
-    // llvm::sys::getDefaultTargetTriple()
-    // Implement here...
-  }
+  bool hasCoroutines_ = false;
 
   /**
-   * Parser.
+   * Result types of future types.
    */
-  std::unique_ptr<EvaParser> parser;
+  std::map<llvm::StructType*, llvm::Type*> futureResultTypes_;
 
   /**
-   * Global Environment (symbol table).
+   * Number of outlined functions (used for unique names).
    */
-  std::shared_ptr<Environment> GlobalEnv;
+  size_t outlinedCount_ = 0;
 
   /**
-   * Currently compiling class.
+   * Separate compilation: the module name (empty for the main module),
+   * the interface search paths, declared imports, and the exports.
    */
-  llvm::StructType* cls = nullptr;
+  bool separateCompilation_ = false;
+  std::string moduleName_;
+  std::vector<std::string> importPaths_{"."};
+  std::set<std::string> imported_;
+  std::vector<Exp> exports_;
 
   /**
-   * Class info.
+   * Runtime bitcode linked for the inlining (empty if none).
    */
-  std::map<std::string, ClassInfo> classMap_;
+  std::string preludeFile_;
 
   /**
    * Currently compiling function.
@@ -0,0 +1,584 @@
+/**
+ * Programming Language with LLVM
+ *
+ * Course info:
+ * http://dmitrysoshnikov.com/courses/programming-language-with-llvm/
+ *
+ * (C) 2023-present Dmitry Soshnikov <dmitry.soshnikov@gmail.com>
+ */
+
+/**
+ * Compile server: a daemon which compiles (and runs) programs sent
+ * over a Unix domain socket, and the matching client.
+ *
+ *   eva-llvm --serve /tmp/eva.sock -j 4 -O2
+ *   eva-llvm --connect /tmp/eva.sock --emit run -e '(printf "%d\n" 42)'
+ *
+ * Workers are processes (forked before any threads are started), which
+ * accept connections concurrently. Each one has a warm compiler
+ * instance, and serves a request in a forked child: the child gets a
+ * copy of the warm compiler, so requests don't pay for the process
+ * start, the target initialization, and the compiler setup, and the
+ * worker's compiler stays unused. The server restarts dead workers.
+ *
+ * Protocol (a request per connection):
+ *
+ *   request:  <command> <length>\n<source>
+ *   response: <ok|error> <exit code> <length>\n<payload>
+ *
+ * Commands:
+ *
+ *   ir     - payload is the LLVM IR
+ *   object - payload is the native object file
+ *   run    - payload is the program output, with the exit code
+ *
+ * Crashes (and asserts) of the compiler only kill the child, and are
+ * returned as errors, as are the compile errors. Programs run in a
+ * process forked from the child (the code is compiled by the child's
+ * JIT first). Both compiling and running are limited to
+ * REQUEST_TIMEOUT_SECONDS each, and requests to MAX_REQUEST_SIZE.
+ *
+ * Since workers and their children are single-threaded, fork doesn't
+ * copy locks held by other threads.
+ */
+
+#ifndef EvaServer_h
+#define EvaServer_h
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "./EvaJIT.h"
+#include "./EvaLLVM.h"
+#include "./Logger.h"
+#include "./runtime/EvaRuntime.h"
+
+/**
+ * Max source length of a request.
+ */
+static const size_t MAX_REQUEST_SIZE = 64 * 1024 * 1024;
+
+/**
+ * Time limit of compiling, and of running a program.
+ */
+static const unsigned REQUEST_TIMEOUT_SECONDS = 10;
+
+/**
+ * Response of the compile server.
+ */
+struct CompileResponse {
+  bool ok;
+  int exitCode;
+  std::string payload;
+};
+
+/**
+ * Socket I/O of the protocol.
+ */
+class EvaSocket {
+ public:
+  /**
+   * Writes all bytes (false if the peer is gone).
+   */
+  static bool writeAll(int fd, const std::string& data) {
+    size_t written = 0;
+
+    while (written < data.size()) {
+      auto n = write(fd, data.data() + written, data.size() - written);
+
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+
+      if (n <= 0) {
+        return false;
+      }
+
+      written += n;
+    }
+
+    return true;
+  }
+
+  /**
+   * Reads the header line: "<fields> <length>\n" (false on EOF).
+   */
+  static bool readHeader(int fd, std::vector<std::string>& fields) {
+    std::string line{};
+    char c;
+
+    while (true) {
+      auto n = read(fd, &c, 1);
+
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+
+      if (n <= 0 || line.size() > 256) {
+        return false;
+      }
+
+      if (c == '\n') {
+        break;
+      }
+
+      line += c;
+    }
+
+    std::istringstream header(line);
+    std::string field;
+
+    fields.clear();
+
+    while (header >> field) {
+      fields.push_back(field);
+    }
+
+    return !fields.empty();
+  }
+
+  /**
+   * Reads the body of the given length (false on a short read, or if
+   * it's longer than the limit).
+   */
+  static bool readBody(int fd, size_t length, std::string& body,
+                       size_t maxLength = MAX_REQUEST_SIZE) {
+    if (length > maxLength) {
+      return false;
+    }
+
+    body.resize(length);
+    size_t done = 0;
+
+    while (done < length) {
+      auto n = read(fd, &body[done], length - done);
+
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+
+      if (n <= 0) {
+        return false;
+      }
+
+      done += n;
+    }
+
+    return true;
+  }
+
+  /**
+   * Reads until EOF.
+   */
+  static std::string readAll(int fd) {
+    std::string data{};
+    char buffer[64 * 1024];
+
+    while (true) {
+      auto n = read(fd, buffer, sizeof(buffer));
+
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+
+      if (n <= 0) {
+        return data;
+      }
+
+      data.append(buffer, n);
+    }
+  }
+
+  /**
+   * Parses a length field (false if it's not a number).
+   */
+  static bool parseLength(const std::string& field, size_t& length) {
+    char* end = nullptr;
+    length = std::strtoull(field.c_str(), &end, 10);
+    return !field.empty() && *end == '\0';
+  }
+};
+
+class EvaServer {
+ public:
+  /**
+   * Sets the compiler options of a new compiler instance.
+   */
+  using Configure = std::function<void(EvaLLVM&)>;
+
+  EvaServer(const std::string& socketPath, unsigned jobs, Configure configure)
+      : socketPath_(socketPath),
+        jobs_(std::max(jobs, 1u)),
+        configure_(configure) {}
+
+  /**
+   * Listens on the socket, and serves requests until killed.
+   */
+  int serve() {
+    if (socketPath_.size() >= sizeof(sockaddr_un::sun_path)) {
+      DIE << "Socket path is too long: " << socketPath_ << "\n";
+    }
+
+    listenFd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    std::strcpy(address.sun_path, socketPath_.c_str());
+
+    // A socket file of a previous server:
+    unlink(socketPath_.c_str());
+
+    if (listenFd_ < 0 ||
+        bind(listenFd_, (sockaddr*)&address, sizeof(address)) < 0 ||
+        listen(listenFd_, SOMAXCONN) < 0) {
+      DIE << "Cannot listen on " << socketPath_ << ": " << strerror(errno)
+          << "\n";
+    }
+
+    // Clients which disconnect early are not fatal:
+    std::signal(SIGPIPE, SIG_IGN);
+
+    EvaLLVM::initializeNativeTarget();
+
+    std::set<pid_t> workers;
+
+    for (auto i = 0; i < jobs_; i++) {
+      workers.insert(startWorker());
+    }
+
+    // Restarts the workers which died:
+    while (true) {
+      int status = 0;
+      auto pid = wait(&status);
+
+      if (pid < 0) {
+        if (errno != EINTR) {
+          std::perror("eva: wait");
+          return 1;
+        }
+        continue;
+      }
+
+      if (workers.erase(pid) != 0) {
+        std::fprintf(stderr, "eva: worker %d died (%s), restarting\n", pid,
+                     describeStatus(status).c_str());
+        workers.insert(startWorker());
+      }
+    }
+  }
+
+ private:
+  /**
+   * Forks a worker process (which exits with the server).
+   */
+  pid_t startWorker() {
+    auto serverPid = getpid();
+    auto pid = fork();
+
+    if (pid < 0) {
+      DIE << "fork: " << strerror(errno) << "\n";
+    }
+
+    if (pid == 0) {
+      prctl(PR_SET_PDEATHSIG, SIGKILL);
+
+      if (getppid() != serverPid) {
+        _exit(0);
+      }
+
+      runWorker();
+    }
+
+    return pid;
+  }
+
+  /**
+   * Worker: accepts a connection, and serves it in a child process
+   * with the (copy of the) warm compiler.
+   */
+  [[noreturn]] void runWorker() {
+    throwsErrors() = true;
+
+    auto vm = createCompiler();
+
+    while (true) {
+      auto client = accept4(listenFd_, nullptr, nullptr, SOCK_CLOEXEC);
+
+      if (client < 0) {
+        if (errno != EINTR) {
+          std::perror("eva: accept");
+        }
+        continue;
+      }
+
+      serveClient(client, *vm);
+      close(client);
+    }
+  }
+
+  /**
+   * Compiler instance with the server options.
+   */
+  std::unique_ptr<EvaLLVM> createCompiler() {
+    auto vm = std::make_unique<EvaLLVM>();
+    configure_(*vm);
+    return vm;
+  }
+
+  /**
+   * Serves the client in a child process. If the child doesn't
+   * respond (crashed, or timed out), the error is sent instead.
+   */
+  void serveClient(int client, EvaLLVM& vm) {
+    auto pid = fork();
+
+    if (pid == 0) {
+      alarm(REQUEST_TIMEOUT_SECONDS);
+      respond(client, vm);
+      _exit(0);
+    }
+
+    if (pid < 0) {
+      sendResponse(client, CompileResponse{false, 1,
+                                           std::string("fork: ") +
+                                               strerror(errno) + "\n"});
+      return;
+    }
+
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      sendResponse(client, CompileResponse{false, 1,
+                                           "Compiler " +
+                                               describeStatus(status) + "\n"});
+    }
+  }
+
+  /**
+   * Termination reason of a child process.
+   */
+  static std::string describeStatus(int status) {
+    if (WIFSIGNALED(status)) {
+      if (WTERMSIG(status) == SIGALRM) {
+        return "timed out (" + std::to_string(REQUEST_TIMEOUT_SECONDS) +
+               " s)";
+      }
+      return std::string("crashed: ") + strsignal(WTERMSIG(status));
+    }
+
+    return "exited with " + std::to_string(WEXITSTATUS(status));
+  }
+
+  /**
+   * Reads the request, and sends the response (in the child).
+   */
+  void respond(int client, EvaLLVM& vm) {
+    std::vector<std::string> header;
+    std::string source;
+    size_t length = 0;
+
+    if (!EvaSocket::readHeader(client, header) || header.size() != 2 ||
+        !EvaSocket::parseLength(header[1], length) ||
+        !EvaSocket::readBody(client, length, source)) {
+      sendResponse(client, CompileResponse{false, 1, "Malformed request\n"});
+      return;
+    }
+
+    sendResponse(client, handle(header[0], source, vm));
+  }
+
+  /**
+   * Compiles (or runs) the source. Errors of the compiler (and the
+   * parser) are returned as the error responses.
+   */
+  CompileResponse handle(const std::string& command,
+                         const std::string& source, EvaLLVM& vm) {
+    try {
+      if (command == "ir") {
+        return CompileResponse{true, 0, vm.compileToIR(source)};
+      }
+
+      if (command == "object") {
+        return CompileResponse{true, 0, vm.compileToObjectCode(source)};
+      }
+
+      if (command == "run") {
+        return run(source, vm);
+      }
+
+      return CompileResponse{false, 1, "Unknown command: " + command + "\n"};
+    } catch (const std::exception& error) {
+      return CompileResponse{false, 1, error.what()};
+    } catch (const std::runtime_error* error) {
+      // The tokenizer throws pointers:
+      std::string message = error->what();
+      delete error;
+      return CompileResponse{false, 1, message};
+    } catch (...) {
+      return CompileResponse{false, 1, "Unknown compiler error\n"};
+    }
+  }
+
+  /**
+   * Compiles the program with the JIT, and runs main in a forked
+   * process, collecting its output.
+   */
+  CompileResponse run(const std::string& source, EvaLLVM& vm) {
+    vm.compileProgram(source);
+    auto compiled = vm.takeModule();
+
+    EvaJIT jit;
+
+    auto main = (int (*)())jit.addModule(std::move(compiled.first),
+                                         std::move(compiled.second), "main");
+
+    // The program has its own time limit:
+    alarm(0);
+
+    int output[2];
+
+    if (pipe2(output, O_CLOEXEC) < 0) {
+      DIE << "pipe: " << strerror(errno) << "\n";
+    }
+
+    auto pid = fork();
+
+    if (pid == 0) {
+      alarm(REQUEST_TIMEOUT_SECONDS);
+
+      dup2(output[1], STDOUT_FILENO);
+      dup2(output[1], STDERR_FILENO);
+
+      // The socket, the listening socket, etc:
+      closefrom(STDERR_FILENO + 1);
+
+      auto exitCode = main();
+      eva_flush();
+      std::fflush(stdout);
+      _exit(exitCode);
+    }
+
+    close(output[1]);
+
+    if (pid < 0) {
+      close(output[0]);
+      DIE << "fork: " << strerror(errno) << "\n";
+    }
+
+    auto payload = EvaSocket::readAll(output[0]);
+    close(output[0]);
+
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+
+    auto exitCode = WIFEXITED(status) ? WEXITSTATUS(status)
+                                      : 128 + WTERMSIG(status);
+
+    if (WIFSIGNALED(status) && WTERMSIG(status) == SIGALRM) {
+      payload += "Timed out (" + std::to_string(REQUEST_TIMEOUT_SECONDS) +
+                 " s)\n";
+    }
+
+    return CompileResponse{true, exitCode, payload};
+  }
+
+  /**
+   * Writes the response (the client may be gone already).
+   */
+  void sendResponse(int client, const CompileResponse& response) {
+    auto header = std::string(response.ok ? "ok" : "error") + " " +
+                  std::to_string(response.exitCode) + " " +
+                  std::to_string(response.payload.size()) + "\n";
+
+    EvaSocket::writeAll(client, header) &&
+        EvaSocket::writeAll(client, response.payload);
+  }
+
+  /**
+   * Path of the socket.
+   */
+  std::string socketPath_;
+
+  /**
+   * Number of workers (and warm compilers).
+   */
+  unsigned jobs_;
+
+  /**
+   * Compiler options.
+   */
+  Configure configure_;
+
+  /**
+   * Listening socket.
+   */
+  int listenFd_ = -1;
+};
+
+/**
+ * Thin client of the compile server.
+ */
+class EvaClient {
+ public:
+  /**
+   * Sends the request, returns the response.
+   */
+  static CompileResponse request(const std::string& socketPath,
+                                 const std::string& command,
+                                 const std::string& source) {
+    auto fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, socketPath.c_str(),
+                 sizeof(address.sun_path) - 1);
+
+    if (fd < 0 || connect(fd, (sockaddr*)&address, sizeof(address)) < 0) {
+      DIE << "Cannot connect to " << socketPath << ": " << strerror(errno)
+          << "\n";
+    }
+
+    std::vector<std::string> header;
+    std::string payload;
+    size_t length = 0;
+    int exitCode = 0;
+
+    auto ok = EvaSocket::writeAll(fd, command + " " +
+                                          std::to_string(source.size()) +
+                                          "\n" + source) &&
+              EvaSocket::readHeader(fd, header) && header.size() == 3 &&
+              EvaSocket::parseLength(header[2], length) &&
+              EvaSocket::readBody(fd, length, payload, SIZE_MAX);
+
+    close(fd);
+
+    if (!ok) {
+      DIE << "Malformed response from " << socketPath << "\n";
+    }
+
+    exitCode = std::atoi(header[1].c_str());
+
+    return CompileResponse{header[0] == "ok", exitCode, payload};
+  }
+};
+
+#endif
@@ -16,13 +16,48 @@
 
 #include <iostream>
 #include <sstream>
+#include <stdexcept>
 
-class ErrorLogMessage : public std::basic_ostringstream<char> {
+/**
+ * Error of a thread which handles errors (e.g. the compile server),
+ * thrown instead of exiting.
+ */
+class CompileError : public std::runtime_error {
+ public:
+  using std::runtime_error::runtime_error;
+};
+
+/**
+ * Whether errors of the current thread are thrown as CompileError.
+ */
+inline bool& throwsErrors() {
+  static thread_local bool enabled = false;
+  return enabled;
+}
+
+/**
+ * Reports the error when the message is complete (the end of the
+ * DIE << ... statement).
+ */
+class ErrorLogMessage {
  public:
-  ~ErrorLogMessage() {
-    std::cerr << "Fatal error: " << str().c_str();
+  template <typename T>
+  ErrorLogMessage& operator<<(const T& value) {
+    message_ << value;
+    return *this;
+  }
+
+  ~ErrorLogMessage() noexcept(false) {
+    if (throwsErrors()) {
+      throw CompileError(message_.str());
+    }
+
+    std::cerr << "Fatal error: " << message_.str().c_str();
     exit(EXIT_FAILURE);
   }
+
+ private:
+  std::ostringstream message_;
 };
 
 #define DIE ErrorLogMessage()
@@ -0,0 +1,335 @@
+/**
+ * Programming Language with LLVM
+ *
+ * Course info:
+ * http://dmitrysoshnikov.com/courses/programming-language-with-llvm/
+ *
+ * (C) 2023-present Dmitry Soshnikov <dmitry.soshnikov@gmail.com>
+ */
+
+/**
+ * Incremental build of a program of modules:
+ *
+ *   eva-llvm --build app/main.eva -O2 -j 4
+ *
+ * (import "geometry") in a module refers to app/geometry.eva (imports
+ * are relative to the directory of the main module). Each module is
+ * compiled to ThinLTO bitcode (geometry.bc) and its interface
+ * (geometry.evi), next to the source. The compiler options of the
+ * bitcode are in geometry.options.
+ *
+ * A module is recompiled when its source is newer than the bitcode,
+ * or an interface of its imports is, or it was built with other
+ * options (e.g. -O, -g, --profile-use). Interfaces are rewritten only
+ * when they change, so editing a function body recompiles just the
+ * edited module. Modules of the same depth are compiled in parallel.
+ *
+ * The bitcode files are returned in the link order (imports first),
+ * and linked with ThinLTO: cross-module inlining, and devirtualization
+ * of the methods of known classes, happen at the link.
+ */
+
+#ifndef ModuleBuilder_h
+#define ModuleBuilder_h
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "llvm/Support/FileSystem.h"
+
+#include "./EvaLLVM.h"
+#include "./Logger.h"
+#include "./ModuleInterface.h"
+#include "./parser/EvaParser.h"
+
+/**
+ * Module of a program: the import name, files, and the imports.
+ */
+struct ModuleUnit {
+  std::string name;
+  std::string sourceFile;
+  std::string bitcodeFile;
+  std::string interfaceFile;
+  std::string optionsFile;
+  std::vector<size_t> imports;
+  size_t depth;
+  bool isMain;
+};
+
+class ModuleBuilder {
+ public:
+  /**
+   * Sets the compiler options of a module (by its source file).
+   */
+  using Configure = std::function<void(EvaLLVM&, const std::string&)>;
+
+  ModuleBuilder(unsigned jobs, Configure configure)
+      : jobs_(std::max(jobs, 1u)), configure_(configure) {}
+
+  /**
+   * Builds the program of the main module, returns the bitcode
+   * files in the link order.
+   */
+  std::vector<std::string> build(const std::string& mainFile) {
+    auto slash = mainFile.rfind('/');
+    rootDir_ = slash == std::string::npos ? "." : mainFile.substr(0, slash);
+
+    auto mainName = mainFile.substr(slash + 1);
+    mainName = mainName.substr(0, mainName.rfind('.'));
+
+    std::vector<std::string> path{};
+    addModule(mainName, mainFile, /* isMain */ true, path);
+
+    // Compiles by depth: the imports are compiled (and their interfaces
+    // are updated) before the importers are checked:
+    size_t maxDepth = 0;
+
+    for (auto& unit : units_) {
+      maxDepth = std::max(maxDepth, unit.depth);
+    }
+
+    for (size_t depth = 0; depth <= maxDepth; depth++) {
+      std::vector<size_t> stale{};
+
+      for (auto i = 0; i < units_.size(); i++) {
+        if (units_[i].depth == depth && isStale(units_[i])) {
+          stale.push_back(i);
+        }
+      }
+
+      compileModules(stale);
+    }
+
+    std::vector<std::string> bitcodeFiles{};
+
+    for (auto& unit : units_) {
+      bitcodeFiles.push_back(unit.bitcodeFile);
+    }
+
+    return bitcodeFiles;
+  }
+
+ private:
+  /**
+   * Adds a module after its imports (the link order), and returns
+   * its index. The path of the importing modules detects cycles.
+   */
+  size_t addModule(const std::string& name, const std::string& sourceFile,
+                   bool isMain, std::vector<std::string>& path) {
+    auto it = indices_.find(name);
+
+    if (it != indices_.end()) {
+      return it->second;
+    }
+
+    if (std::find(path.begin(), path.end(), name) != path.end()) {
+      std::string cycle{};
+
+      for (auto& module : path) {
+        cycle += module + " -> ";
+      }
+
+      DIE << "Import cycle: " << cycle << name << "\n";
+    }
+
+    path.push_back(name);
+
+    std::vector<size_t> imports{};
+    size_t depth = 0;
+
+    for (auto& import : getImports(sourceFile)) {
+      auto importFile = rootDir_ + "/" + import + ".eva";
+
+      if (!llvm::sys::fs::exists(importFile)) {
+        DIE << "Module \"" << import << "\" imported by \"" << name
+            << "\" is not found: " << importFile << "\n";
+      }
+
+      auto index = addModule(import, importFile, /* isMain */ false, path);
+      imports.push_back(index);
+      depth = std::max(depth, units_[index].depth + 1);
+    }
+
+    path.pop_back();
+
+    auto base = sourceFile.substr(0, sourceFile.rfind('.'));
+
+    units_.push_back(ModuleUnit{name, sourceFile, base + ".bc", base + ".evi",
+                                base + ".options", imports, depth, isMain});
+
+    indices_[name] = units_.size() - 1;
+    return units_.size() - 1;
+  }
+
+  /**
+   * Imports of a module: (import "<name>") at the top level.
+   */
+  std::vector<std::string> getImports(const std::string& sourceFile) {
+    auto program = parser_.parse("(begin " + readFile(sourceFile) + ")");
+
+    std::vector<std::string> imports{};
+
+    for (auto i = 1; i < program.list.size(); i++) {
+      auto& exp = program.list[i];
+
+      if (exp.type == ExpType::LIST && exp.list.size() == 2 &&
+          exp.list[0].type == ExpType::SYMBOL &&
+          exp.list[0].string == "import") {
+        imports.push_back(exp.list[1].string);
+      }
+    }
+
+    return imports;
+  }
+
+  /**
+   * Whether the module is recompiled: the bitcode is missing, or
+   * older than the source or the interfaces of the imports, or it
+   * was compiled with other options.
+   */
+  bool isStale(const ModuleUnit& unit) {
+    llvm::sys::TimePoint<> built;
+
+    if (!getModificationTime(unit.bitcodeFile, built) ||
+        !llvm::sys::fs::exists(unit.interfaceFile)) {
+      return true;
+    }
+
+    EvaLLVM vm;
+    configure_(vm, unit.sourceFile);
+
+    if (ModuleInterface::read(unit.optionsFile) != vm.getOptions()) {
+      return true;
+    }
+
+    llvm::sys::TimePoint<> modified;
+
+    if (!getModificationTime(unit.sourceFile, modified) || modified > built) {
+      return true;
+    }
+
+    for (auto import : unit.imports) {
+      if (!getModificationTime(units_[import].interfaceFile, modified) ||
+          modified > built) {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  /**
+   * Compiles the modules in parallel: each thread has its own compiler
+   * instance (and LLVM context).
+   */
+  void compileModules(const std::vector<size_t>& modules) {
+    std::atomic<size_t> next{0};
+
+    auto worker = [&]() {
+      size_t i;
+      while ((i = next.fetch_add(1)) < modules.size()) {
+        auto& unit = units_[modules[i]];
+
+        EvaLLVM vm;
+        configure_(vm, unit.sourceFile);
+
+        if (!unit.isMain) {
+          vm.setModuleName(unit.name);
+        }
+
+        vm.addImportPath(rootDir_);
+        vm.compileModule(readFile(unit.sourceFile), unit.bitcodeFile,
+                         unit.interfaceFile);
+
+        // After the bitcode, an interrupted build is recompiled:
+        writeFile(unit.optionsFile, vm.getOptions());
+      }
+    };
+
+    std::vector<std::thread> threads;
+
+    for (auto i = 1; i < std::min<size_t>(jobs_, modules.size()); i++) {
+      threads.emplace_back(worker);
+    }
+
+    worker();
+
+    for (auto& thread : threads) {
+      thread.join();
+    }
+  }
+
+  /**
+   * Last modification time of a file (false if there is no file).
+   */
+  static bool getModificationTime(const std::string& fileName,
+                                  llvm::sys::TimePoint<>& time) {
+    llvm::sys::fs::file_status status;
+
+    if (llvm::sys::fs::status(fileName, status) ||
+        !llvm::sys::fs::exists(status)) {
+      return false;
+    }
+
+    time = status.getLastModificationTime();
+    return true;
+  }
+
+  static void writeFile(const std::string& fileName,
+                        const std::string& content) {
+    std::ofstream file(fileName);
+
+    if (!file) {
+      DIE << "Cannot write " << fileName << "\n";
+    }
+
+    file << content;
+  }
+
+  static std::string readFile(const std::string& fileName) {
+    std::ifstream file(fileName);
+
+    if (!file) {
+      DIE << "Cannot read " << fileName << "\n";
+    }
+
+    std::stringstream buffer;
+    buffer << file.rdbuf() << "\n";
+    return buffer.str();
+  }
+
+  /**
+   * Threads of the compilation.
+   */
+  unsigned jobs_;
+
+  /**
+   * Compiler options.
+   */
+  Configure configure_;
+
+  /**
+   * Directory of the main module (the root of the imports).
+   */
+  std::string rootDir_;
+
+  /**
+   * Modules in the link order, and their indices by name.
+   */
+  std::vector<ModuleUnit> units_;
+  std::map<std::string, size_t> indices_;
+
+  /**
+   * Parser of the imports.
+   */
+  EvaParser parser_;
+};
+
+#endif
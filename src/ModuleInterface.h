@@ -0,0 +1,238 @@
+/**
+ * Programming Language with LLVM
+ *
+ * Course info:
+ * http://dmitrysoshnikov.com/courses/programming-language-with-llvm/
+ *
+ * (C) 2023-present Dmitry Soshnikov <dmitry.soshnikov@gmail.com>
+ */
+
+/**
+ * Module interface: the exported declarations of a module, used to
+ * compile its importers without the module source.
+ *
+ * geometry.eva:
+ *
+ *   (import "math")
+ *   (def area ((r number)) -> number (* 3 (square r)))
+ *   (def max (a b) (if (> a b) a b))
+ *   (var origin 0)
+ *   (class Point null
+ *     (begin
+ *       (var (x number) 0)
+ *       (def getX (self) -> number (prop self x))))
+ *
+ * geometry.evi (a declaration per line):
+ *
+ *   (import "math")
+ *   (def area ((r number)) -> number)
+ *   (def max (a b) (if (> a b) a b))
+ *   (class Point null (begin (var (x number) 0) (def getX (self) -> number)))
+ *   (var (origin number))
+ *
+ * Typed functions and methods are signatures only. Untyped functions
+ * are specialized per call-site types, so they are exported with the
+ * bodies. Interfaces are exported as is. Imports are re-exported, since
+ * the signatures may use their classes. Top-level variables are
+ * declarations of their compiled types (appended by the compiler,
+ * see EvaLLVM::exportGlobalVar), the untyped functions may use them.
+ */
+
+#ifndef ModuleInterface_h
+#define ModuleInterface_h
+
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "./Logger.h"
+#include "./parser/EvaParser.h"
+
+class ModuleInterface {
+ public:
+  /**
+   * Exported declarations of a program (a `begin` block).
+   */
+  static std::vector<Exp> extract(const Exp& program) {
+    std::vector<Exp> exports{};
+
+    for (auto i = 1; i < program.list.size(); i++) {
+      auto& exp = program.list[i];
+
+      if (isTaggedList(exp, "import")) {
+        exports.push_back(exp);
+      }
+
+      else if (isTaggedList(exp, "def")) {
+        exports.push_back(isGeneric(exp) ? exp : getSignature(exp));
+      }
+
+      else if (isTaggedList(exp, "async")) {
+        exports.push_back(getAsyncSignature(exp.list[1]));
+      }
+
+      else if (isTaggedList(exp, "interface")) {
+        exports.push_back(exp);
+      }
+
+      else if (isTaggedList(exp, "class")) {
+        exports.push_back(getClassDeclaration(exp));
+      }
+    }
+
+    return exports;
+  }
+
+  /**
+   * Writes the interface file, only if it changed: importers are
+   * recompiled when the interface is newer than their output.
+   *
+   * Returns whether the file was written.
+   */
+  static bool write(const std::string& fileName,
+                    const std::vector<Exp>& exports) {
+    std::string content{};
+
+    for (auto& exp : exports) {
+      content += print(exp) + "\n";
+    }
+
+    if (read(fileName) == content) {
+      return false;
+    }
+
+    std::ofstream file(fileName);
+
+    if (!file) {
+      DIE << "Cannot write " << fileName << "\n";
+    }
+
+    file << content;
+    return true;
+  }
+
+  /**
+   * Reads the interface file (empty if there is none).
+   */
+  static std::string read(const std::string& fileName) {
+    std::ifstream file(fileName);
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    return buffer.str();
+  }
+
+  /**
+   * Prints an expression in the source syntax.
+   */
+  static std::string print(const Exp& exp) {
+    switch (exp.type) {
+      case ExpType::NUMBER:
+        return std::to_string(exp.number);
+
+      case ExpType::FLOAT: {
+        // Fixed notation keeps the dot (the tokenizer has no exponents):
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(17) << exp.floatNumber;
+        return out.str();
+      }
+
+      case ExpType::STRING:
+        return "\"" + exp.string + "\"";
+
+      case ExpType::SYMBOL:
+        return exp.string;
+
+      case ExpType::LIST: {
+        std::string result = "(";
+
+        for (auto i = 0; i < exp.list.size(); i++) {
+          result += (i > 0 ? " " : "") + print(exp.list[i]);
+        }
+
+        return result + ")";
+      }
+    }
+
+    return "";
+  }
+
+ private:
+  static bool isTaggedList(const Exp& exp, const std::string& tag) {
+    return exp.type == ExpType::LIST && !exp.list.empty() &&
+           exp.list[0].type == ExpType::SYMBOL && exp.list[0].string == tag;
+  }
+
+  static bool hasReturnType(const Exp& fnExp) {
+    return fnExp.list[3].type == ExpType::SYMBOL &&
+           fnExp.list[3].string == "->";
+  }
+
+  /**
+   * Untyped function: a parameter without a type.
+   */
+  static bool isGeneric(const Exp& fnExp) {
+    for (auto& param : fnExp.list[2].list) {
+      if (param.type != ExpType::LIST) {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  /**
+   * Function without the body, the return type is explicit:
+   *
+   * (def square ((x number)) -> number (* x x))
+   *
+   * (def square ((x number)) -> number)
+   */
+  static Exp getSignature(const Exp& fnExp) {
+    std::string arrow = "->";
+    std::string returnType = "number";
+
+    return Exp(std::vector<Exp>{
+        fnExp.list[0],
+        fnExp.list[1],
+        fnExp.list[2],
+        Exp(arrow),
+        hasReturnType(fnExp) ? fnExp.list[4] : Exp(returnType),
+    });
+  }
+
+  /**
+   * Async function is exported as the function returning the task:
+   *
+   * (async def fetch ((fd number)) -> number <body>)
+   *
+   * (def fetch ((fd number)) -> (task number))
+   */
+  static Exp getAsyncSignature(const Exp& fnExp) {
+    std::string taskTag = "task";
+
+    auto signature = getSignature(fnExp);
+    signature.list[4] = Exp(std::vector<Exp>{Exp(taskTag), signature.list[4]});
+    return signature;
+  }
+
+  /**
+   * Class with the fields (the layout), and the method signatures
+   * (the vtable).
+   */
+  static Exp getClassDeclaration(const Exp& clsExp) {
+    auto result = clsExp;
+    auto& body = result.list[3].list;
+
+    for (auto i = 1; i < body.size(); i++) {
+      if (isTaggedList(body[i], "def")) {
+        body[i] = getSignature(body[i]);
+      }
+    }
+
+    return result;
+  }
+};
+
+#endif
@@ -7,12 +7,13 @@
  *
  *   syntax-cli --help
  *
- * To regenerate run:
- *
- *   syntax-cli \
- *     --grammar ~/path-to-grammar-file \
- *     --mode <parsing-mode> \
- *     --output ~/ParserClassName.h
+ * Generated from EvaGrammar.bnf, and maintained by hand since: parsers
+ * run in many threads (eva-llvm -j N, the compile server), so the
+ * lexical rules, start conditions, productions and the LR table are
+ * static const and used by reference, and the tokenizer matches at the
+ * cursor in place. The generator's template has the shared mutable
+ * statics, so regenerating (after a grammar change) needs these edits
+ * to be applied again.
  */
 #ifndef __Syntax_LR_Parser_h
 #define __Syntax_LR_Parser_h
@@ -50,14 +51,21 @@
 //   }
 //
 // clang-format off
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
 #include <string>
 #include <vector>
 
+#include "../Logger.h"
+
 /**
  * Expression type.
  */
 enum class ExpType {
   NUMBER,
+  FLOAT,
   STRING,
   SYMBOL,
   LIST,
@@ -69,12 +77,48 @@ enum class ExpType {
 struct Exp {
   ExpType type;
 
-  int number;
+  int64_t number = 0;
+  double floatNumber = 0;
   std::string string;
   std::vector<Exp> list;
 
+  // Source location (1-based, 0 if unknown):
+  int line = 0;
+  int column = 0;
+
+  // Annotations of a def, on its name (see EvaLLVM::stripAnnotations):
+  int annotationsId = 0;
+
   // Numbers:
-  Exp(int number) : type(ExpType::NUMBER), number(number) {}
+  Exp(int64_t number) : type(ExpType::NUMBER), number(number) {}
+
+  // Floating point numbers:
+  Exp(double floatNumber) : type(ExpType::FLOAT), floatNumber(floatNumber) {}
+
+  // Number literals: 42, 3.14
+  static Exp parseNumber(const std::string& str) {
+    char* end = nullptr;
+    errno = 0;
+
+    if (str.find('.') != std::string::npos) {
+      double floatNumber = std::strtod(str.c_str(), &end);
+
+      // Underflow rounds to a denormal (or 0), overflow is an error:
+      if ((errno == ERANGE && floatNumber == HUGE_VAL) || *end != '\0') {
+        DIE << "Number literal is out of range: " << str << "\n";
+      }
+
+      return Exp(floatNumber);
+    }
+
+    int64_t number = std::strtoll(str.c_str(), &end, 10);
+
+    if (errno == ERANGE || *end != '\0') {
+      DIE << "Number literal is out of range: " << str << "\n";
+    }
+
+    return Exp(number);
+  }
 
   // Strings, Symbols:
   Exp(std::string& strVal) {
@@ -228,15 +272,19 @@ class Tokenizer {
       return toToken(TokenType::__EOF);
     }
 
-    auto strSlice = str_.substr(cursor_);
-
-    auto lexRulesForState = lexRulesByStartConditions_.at(getCurrentState());
+    // Rules and tables are immutable (shared by tokenizers in all threads),
+    // and are used by reference:
+    const auto& lexRulesForState =
+        lexRulesByStartConditions_.at(getCurrentState());
 
     for (const auto& ruleIndex : lexRulesForState) {
-      auto rule = lexRules_[ruleIndex];
+      const auto& rule = lexRules_[ruleIndex];
       std::smatch sm;
 
-      if (std::regex_search(strSlice, sm, rule.regex)) {
+      // Matches at the cursor only (`^` is the cursor position):
+      if (std::regex_search(str_.cbegin() + cursor_, str_.cend(), sm,
+                            rule.regex,
+                            std::regex_constants::match_continuous)) {
         yytext = sm[0];
 
         captureLocations_(yytext);
@@ -264,7 +312,7 @@ class Tokenizer {
       return toToken(TokenType::__EOF);
     }
 
-    throwUnexpectedToken(std::string(1, strSlice[0]), currentLine_,
+    throwUnexpectedToken(std::string(1, str_[cursor_]), currentLine_,
                          currentColumn_);
   }
 
@@ -356,14 +404,14 @@ class Tokenizer {
    */
   // clang-format off
   static constexpr size_t LEX_RULES_COUNT = 8;
-  static std::array<LexRule, LEX_RULES_COUNT> lexRules_;
-  static std::map<TokenizerState, std::vector<size_t>> lexRulesByStartConditions_;
+  static const std::array<LexRule, LEX_RULES_COUNT> lexRules_;
+  static const std::map<TokenizerState, std::vector<size_t>> lexRulesByStartConditions_;
   // clang-format on
 
   /**
    * Special EOF token.
    */
-  static std::string __EOF;
+  static const std::string __EOF;
 
   /**
    * Tokenizing string.
@@ -401,7 +449,7 @@ class Tokenizer {
 // ------------------------------------------------------------------
 // Lexical rule handlers.
 
-std::string Tokenizer::__EOF("$");
+const std::string Tokenizer::__EOF("$");
 
 // clang-format off
 inline TokenType _lexRule1(const Tokenizer& tokenizer, const std::string& yytext) {
@@ -441,17 +489,17 @@ return TokenType::SYMBOL;
 // Lexical rules.
 
 // clang-format off
-std::array<LexRule, Tokenizer::LEX_RULES_COUNT> Tokenizer::lexRules_ = {{
+const std::array<LexRule, Tokenizer::LEX_RULES_COUNT> Tokenizer::lexRules_ = {{
   {std::regex(R"(^\()"), &_lexRule1},
   {std::regex(R"(^\))"), &_lexRule2},
   {std::regex(R"(^\/\/.*)"), &_lexRule3},
   {std::regex(R"(^\/\*[\s\S]*?\*\/)"), &_lexRule4},
   {std::regex(R"(^\s+)"), &_lexRule5},
   {std::regex(R"(^"[^\"]*")"), &_lexRule6},
-  {std::regex(R"(^\d+)"), &_lexRule7},
-  {std::regex(R"(^[\w\-+*=!<>/]+)"), &_lexRule8}
+  {std::regex(R"(^\d+(\.\d+)?)"), &_lexRule7},
+  {std::regex(R"(^[\w\-+*=!<>/^]+)"), &_lexRule8}
 }};
-std::map<TokenizerState, std::vector<size_t>> Tokenizer::lexRulesByStartConditions_ =  {{TokenizerState::INITIAL, {0, 1, 2, 3, 4, 5, 6, 7}}};
+const std::map<TokenizerState, std::vector<size_t>> Tokenizer::lexRulesByStartConditions_ =  {{TokenizerState::INITIAL, {0, 1, 2, 3, 4, 5, 6, 7}}};
 // clang-format on
 
 #endif
@@ -573,7 +621,7 @@ class EvaParser {
         throwUnexpectedToken(token);
       }
 
-      auto entry = table_[state].at(column);
+      const auto& entry = table_[state].at(column);
 
       // Shift a token, go to state.
       if (entry.type == TE::Shift) {
@@ -590,7 +638,7 @@ class EvaParser {
       // Reduce by production.
       else if (entry.type == TE::Reduce) {
         auto productionNumber = entry.value;
-        auto production = productions_[productionNumber];
+        const auto& production = productions_[productionNumber];
 
         tokenizer.yytext = shiftedToken->value;
 
@@ -606,7 +654,8 @@ class EvaParser {
         auto previousState = statesStack.back();
 
         auto symbolToReduceWith = production.opcode;
-        auto nextStateEntry = table_[previousState].at(symbolToReduceWith);
+        const auto& nextStateEntry =
+            table_[previousState].at(symbolToReduceWith);
         assert(nextStateEntry.type == TE::Transit);
 
         statesStack.push_back(nextStateEntry.value);
@@ -654,10 +703,10 @@ class EvaParser {
 
   // clang-format off
   static constexpr size_t PRODUCTIONS_COUNT = 9;
-  static std::array<Production, PRODUCTIONS_COUNT> productions_;
+  static const std::array<Production, PRODUCTIONS_COUNT> productions_;
 
   static constexpr size_t ROWS_COUNT = 11;
-  static std::array<Row, ROWS_COUNT> table_;
+  static const std::array<Row, ROWS_COUNT> table_;
   // clang-format on
 };
 
@@ -702,7 +751,7 @@ void _handler4(yyparse& parser) {
 // Semantic action prologue.
 auto _1 = POP_T();
 
-auto __ = Exp(std::stoi(_1)) ;
+auto __ = Exp::parseNumber(_1) ;
 
  // Semantic action epilogue.
 PUSH_VR();
@@ -769,7 +818,7 @@ PUSH_VR();
 // clang-format on
 
 // clang-format off
-std::array<Production, yyparse::PRODUCTIONS_COUNT> yyparse::productions_ = {{{-1, 1, &_handler1},
+const std::array<Production, yyparse::PRODUCTIONS_COUNT> yyparse::productions_ = {{{-1, 1, &_handler1},
 {0, 1, &_handler2},
 {0, 1, &_handler3},
 {1, 1, &_handler4},
@@ -784,7 +833,7 @@ std::array<Production, yyparse::PRODUCTIONS_COUNT> yyparse::productions_ = {{{-1
 // Parsing table.
 
 // clang-format off
-std::array<Row, yyparse::ROWS_COUNT> yyparse::table_ = {
+const std::array<Row, yyparse::ROWS_COUNT> yyparse::table_ = {
     Row {{0, {TE::Transit, 1}}, {1, {TE::Transit, 2}}, {2, {TE::Transit, 3}}, {4, {TE::Shift, 4}}, {5, {TE::Shift, 5}}, {6, {TE::Shift, 6}}, {7, {TE::Shift, 7}}},
     Row {{9, {TE::Accept, 0}}},
     Row {{4, {TE::Reduce, 1}}, {5, {TE::Reduce, 1}}, {6, {TE::Reduce, 1}}, {7, {TE::Reduce, 1}}, {8, {TE::Reduce, 1}}, {9, {TE::Reduce, 1}}},
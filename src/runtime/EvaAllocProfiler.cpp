@@ -0,0 +1,168 @@
+/**
+ * Programming Language with LLVM
+ *
+ * Course info:
+ * http://dmitrysoshnikov.com/courses/programming-language-with-llvm/
+ *
+ * (C) 2023-present Dmitry Soshnikov <dmitry.soshnikov@gmail.com>
+ */
+
+/**
+ * Allocation profiler (eva-llvm --alloc-profile).
+ *
+ * Each module registers its allocation sites (class + allocating
+ * function), and gets the range of the global site ids. Each site has
+ * a per-thread counter, merged at thread exit (and after each job of
+ * the scheduler workers). At program exit the sites are printed to
+ * stderr, sorted by allocated bytes.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "./EvaRuntime.h"
+
+/**
+ * Registered site (names are copied: JIT-compiled modules may be
+ * freed before the report).
+ */
+struct AllocSite {
+  std::string className;
+  std::string callSite;
+  int64_t bytes;
+};
+
+/**
+ * Allocation sites and merged counters (never destroyed, since
+ * threads may exit during the process shutdown).
+ */
+struct AllocProfile {
+  std::mutex mutex;
+  std::vector<AllocSite> sites;
+  std::vector<uint64_t> counts;
+
+  // Registered sites (counts are resized before it's increased):
+  std::atomic<uint32_t> sitesCount{0};
+};
+
+static AllocProfile* allocProfile = nullptr;
+static std::once_flag allocProfileInit;
+
+/**
+ * Per-thread counters.
+ */
+struct ThreadAllocCounts {
+  std::vector<uint64_t> counts;
+
+  ~ThreadAllocCounts() { merge(); }
+
+  /**
+   * Adds the counters to the shared ones, and resets them.
+   */
+  void merge() {
+    if (allocProfile == nullptr) {
+      return;
+    }
+
+    std::lock_guard<std::mutex> lock(allocProfile->mutex);
+
+    for (auto i = 0; i < counts.size(); i++) {
+      allocProfile->counts[i] += counts[i];
+      counts[i] = 0;
+    }
+  }
+};
+
+static thread_local ThreadAllocCounts threadCounts;
+
+/**
+ * Prints the sites, sorted by bytes.
+ */
+static void dumpAllocProfile() {
+  // Threads (including the main) are merged at their exit already.
+  std::lock_guard<std::mutex> lock(allocProfile->mutex);
+
+  auto& counts = allocProfile->counts;
+  auto& sites = allocProfile->sites;
+
+  std::vector<uint32_t> order;
+  for (uint32_t i = 0; i < counts.size(); i++) {
+    if (counts[i] > 0) {
+      order.push_back(i);
+    }
+  }
+
+  std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+    return counts[a] * sites[a].bytes > counts[b] * sites[b].bytes;
+  });
+
+  uint64_t totalCount = 0, totalBytes = 0;
+
+  fprintf(stderr, "\n%12s %16s %10s  %-20s %s\n", "Instances", "Bytes",
+          "Size", "Class", "Allocated in");
+
+  for (auto siteId : order) {
+    auto& site = sites[siteId];
+    auto bytes = counts[siteId] * site.bytes;
+
+    fprintf(stderr, "%12llu %16llu %10lld  %-20s %s\n",
+            (unsigned long long)counts[siteId], (unsigned long long)bytes,
+            (long long)site.bytes, site.className.c_str(),
+            site.callSite.c_str());
+
+    totalCount += counts[siteId];
+    totalBytes += bytes;
+  }
+
+  fprintf(stderr, "%12llu %16llu  total\n", (unsigned long long)totalCount,
+          (unsigned long long)totalBytes);
+}
+
+uint32_t eva_alloc_register(const EvaAllocSite* sites, uint32_t count) {
+  std::call_once(allocProfileInit, []() {
+    allocProfile = new AllocProfile();
+    atexit(dumpAllocProfile);
+  });
+
+  std::lock_guard<std::mutex> lock(allocProfile->mutex);
+
+  uint32_t base = allocProfile->sites.size();
+
+  for (uint32_t i = 0; i < count; i++) {
+    allocProfile->sites.push_back(
+        AllocSite{sites[i].className, sites[i].callSite, sites[i].bytes});
+  }
+
+  allocProfile->counts.resize(allocProfile->sites.size());
+  allocProfile->sitesCount.store(allocProfile->sites.size(),
+                                 std::memory_order_release);
+
+  return base;
+}
+
+void eva_alloc_record(uint32_t siteId) {
+  // Not registered (yet):
+  if (allocProfile == nullptr ||
+      siteId >= allocProfile->sitesCount.load(std::memory_order_acquire)) {
+    return;
+  }
+
+  auto& counts = threadCounts.counts;
+
+  if (counts.size() <= siteId) {
+    counts.resize(siteId + 1);
+  }
+
+  counts[siteId]++;
+}
+
+void eva_alloc_drain() {
+  if (allocProfile != nullptr) {
+    threadCounts.merge();
+  }
+}
@@ -0,0 +1,236 @@
+/**
+ * Programming Language with LLVM
+ *
+ * Course info:
+ * http://dmitrysoshnikov.com/courses/programming-language-with-llvm/
+ *
+ * (C) 2023-present Dmitry Soshnikov <dmitry.soshnikov@gmail.com>
+ */
+
+/**
+ * Event loop of async functions: a single-threaded loop (per thread)
+ * with a ready queue, timers, and epoll-based fd readiness.
+ *
+ * Async functions are LLVM coroutines (switch-resumed lowering): the
+ * frame starts with the resume and destroy function pointers, and
+ * the resume pointer is null at the final suspension point.
+ */
+
+#include <errno.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <map>
+#include <queue>
+#include <vector>
+
+#include "./EvaRuntime.h"
+
+/**
+ * Coroutine frame header.
+ */
+struct CoroutineFrame {
+  void (*resume)(void*);
+  void (*destroy)(void*);
+};
+
+/**
+ * Timer: coroutine resumed at the deadline (FIFO for equal deadlines).
+ */
+struct Timer {
+  int64_t deadline;
+  uint64_t seq;
+  void* handle;
+
+  bool operator>(const Timer& other) const {
+    return deadline != other.deadline ? deadline > other.deadline
+                                      : seq > other.seq;
+  }
+};
+
+/**
+ * Coroutines waiting for an fd to become readable and writable.
+ */
+struct FdWaiters {
+  void* reader = nullptr;
+  void* writer = nullptr;
+};
+
+/**
+ * Loop state of the current thread.
+ */
+struct EventLoop {
+  std::deque<void*> ready;
+  std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers;
+  std::map<int, FdWaiters> fds;
+  uint64_t timersCount = 0;
+  int epollFd = -1;
+
+  ~EventLoop() {
+    if (epollFd >= 0) {
+      close(epollFd);
+    }
+  }
+};
+
+static thread_local EventLoop loop;
+
+/**
+ * Monotonic time in milliseconds.
+ */
+static int64_t nowMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+/**
+ * Whether the coroutine is at the final suspension point.
+ */
+static bool isDone(void* handle) {
+  return ((CoroutineFrame*)handle)->resume == nullptr;
+}
+
+/**
+ * Resumes the coroutine (llvm.coro.resume).
+ */
+static void resume(void* handle) {
+  ((CoroutineFrame*)handle)->resume(handle);
+}
+
+/**
+ * Registers the fd with the events of its waiters (or removes it).
+ */
+static void updateFd(int fd, FdWaiters& waiters, bool isNew) {
+  epoll_event event{};
+  event.data.fd = fd;
+  event.events = (waiters.reader != nullptr ? EPOLLIN : 0) |
+                 (waiters.writer != nullptr ? EPOLLOUT : 0);
+
+  if (event.events == 0) {
+    epoll_ctl(loop.epollFd, EPOLL_CTL_DEL, fd, nullptr);
+    loop.fds.erase(fd);
+    return;
+  }
+
+  if (epoll_ctl(loop.epollFd, isNew ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd,
+                &event) == 0) {
+    return;
+  }
+
+  // Regular files (and other fds not supported by epoll) are always ready:
+  if (errno == EPERM) {
+    if (waiters.reader != nullptr) {
+      loop.ready.push_back(waiters.reader);
+    }
+    if (waiters.writer != nullptr) {
+      loop.ready.push_back(waiters.writer);
+    }
+    loop.fds.erase(fd);
+    return;
+  }
+
+  std::perror("eva: epoll_ctl");
+  std::exit(1);
+}
+
+/**
+ * Waits for fds until the timeout, and moves ready waiters
+ * (and expired timers) to the ready queue.
+ */
+static void poll(int timeoutMs) {
+  epoll_event events[64];
+  int count = 0;
+
+  if (loop.fds.empty()) {
+    if (timeoutMs > 0) {
+      usleep(timeoutMs * 1000);
+    }
+  } else {
+    count = epoll_wait(loop.epollFd, events, 64, timeoutMs);
+
+    if (count < 0 && errno != EINTR) {
+      std::perror("eva: epoll_wait");
+      std::exit(1);
+    }
+  }
+
+  for (auto i = 0; i < count; i++) {
+    auto fd = events[i].data.fd;
+    auto& waiters = loop.fds[fd];
+    auto errors = EPOLLHUP | EPOLLERR;
+
+    if ((events[i].events & (EPOLLIN | errors)) && waiters.reader) {
+      loop.ready.push_back(waiters.reader);
+      waiters.reader = nullptr;
+    }
+
+    if ((events[i].events & (EPOLLOUT | errors)) && waiters.writer) {
+      loop.ready.push_back(waiters.writer);
+      waiters.writer = nullptr;
+    }
+
+    updateFd(fd, waiters, /* isNew */ false);
+  }
+
+  auto now = nowMs();
+
+  while (!loop.timers.empty() && loop.timers.top().deadline <= now) {
+    loop.ready.push_back(loop.timers.top().handle);
+    loop.timers.pop();
+  }
+}
+
+extern "C" {
+
+void eva_loop_schedule(void* handle) { loop.ready.push_back(handle); }
+
+void eva_loop_sleep(void* handle, int32_t ms) {
+  loop.timers.push(Timer{nowMs() + ms, loop.timersCount++, handle});
+}
+
+void eva_loop_wait_fd(void* handle, int32_t fd, int32_t writable) {
+  if (loop.epollFd < 0) {
+    loop.epollFd = epoll_create1(EPOLL_CLOEXEC);
+  }
+
+  auto isNew = loop.fds.count(fd) == 0;
+  auto& waiters = loop.fds[fd];
+
+  (writable ? waiters.writer : waiters.reader) = handle;
+
+  updateFd(fd, waiters, isNew);
+}
+
+void eva_loop_run_until(void* handle) {
+  while (!isDone(handle)) {
+    if (!loop.ready.empty()) {
+      auto next = loop.ready.front();
+      loop.ready.pop_front();
+      resume(next);
+      continue;
+    }
+
+    if (loop.timers.empty() && loop.fds.empty()) {
+      std::fprintf(stderr,
+                   "eva: async-run: the task waits, but nothing can wake "
+                   "it up\n");
+      std::exit(1);
+    }
+
+    auto timeoutMs = -1;
+
+    if (!loop.timers.empty()) {
+      auto left = loop.timers.top().deadline - nowMs();
+      timeoutMs = left > 0 ? (int)left : 0;
+    }
+
+    poll(timeoutMs);
+  }
+}
+}
@@ -0,0 +1,229 @@
+/**
+ * Programming Language with LLVM
+ *
+ * Course info:
+ * http://dmitrysoshnikov.com/courses/programming-language-with-llvm/
+ *
+ * (C) 2023-present Dmitry Soshnikov <dmitry.soshnikov@gmail.com>
+ */
+
+/**
+ * Buffered output: printf calls with literal formats are lowered
+ * to the eva_write_* functions.
+ *
+ * Output is formatted into a per-thread buffer, and written to stdout
+ * in large chunks (or per line, if stdout is a terminal). Buffers are
+ * flushed at thread exit, and before the failed checks trap. The
+ * buffer of the signaled thread is also written on abort, and when the
+ * time limit (SIGALRM, e.g. of the compile server) kills the program.
+ * The signal handlers are installed on the first write, so the hosts
+ * of the runtime (eva-llvm, the compile server) keep their own until
+ * a program prints.
+ */
+
+#include <signal.h>
+#include <unistd.h>
+
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "./EvaRuntime.h"
+
+/**
+ * Size of the per-thread output buffer.
+ */
+static const size_t OUTPUT_BUFFER_SIZE = 64 * 1024;
+
+/**
+ * Whether stdout is a terminal: flushed per line then.
+ */
+static const bool isLineBuffered = isatty(STDOUT_FILENO);
+
+static bool installSignalHandlers();
+
+/**
+ * Per-thread output buffer.
+ */
+struct OutputBuffer {
+  char data[OUTPUT_BUFFER_SIZE];
+  size_t size = 0;
+
+  /**
+   * Constructed on the first write of the thread.
+   */
+  OutputBuffer() {
+    static const bool signalHandlersInstalled = installSignalHandlers();
+    (void)signalHandlersInstalled;
+  }
+
+  ~OutputBuffer() { flush(); }
+
+  void flush() {
+    if (size == 0) {
+      return;
+    }
+
+    // Keeps order with the output of libc stdio:
+    fflush(stdout);
+
+    writeAll();
+  }
+
+  /**
+   * Writes the buffered bytes (only write(2), so it's used from the
+   * signal handlers as well).
+   */
+  void writeAll() {
+    size_t written = 0;
+    while (written < size) {
+      auto n = write(STDOUT_FILENO, data + written, size - written);
+      if (n <= 0) {
+        break;
+      }
+      written += n;
+    }
+
+    size = 0;
+  }
+
+  void append(const char* bytes, size_t length) {
+    if (size + length > OUTPUT_BUFFER_SIZE) {
+      flush();
+
+      // Large chunks are written directly:
+      if (length > OUTPUT_BUFFER_SIZE) {
+        fflush(stdout);
+        write(STDOUT_FILENO, bytes, length);
+        return;
+      }
+    }
+
+    memcpy(data + size, bytes, length);
+    size += length;
+
+    if (isLineBuffered && memchr(bytes, '\n', length) != nullptr) {
+      flush();
+    }
+  }
+};
+
+static thread_local OutputBuffer buffer;
+
+/**
+ * Writes the output of the signaled thread, and re-raises the signal
+ * with the default action (the handler is reset, SA_RESETHAND).
+ */
+static void flushOnSignal(int signal) {
+  buffer.writeAll();
+  raise(signal);
+}
+
+/**
+ * Installs the handlers of SIGABRT and SIGALRM, unless the program
+ * (or the host of the JIT) handles them already.
+ */
+static bool installSignalHandlers() {
+  static const int signals[] = {SIGABRT, SIGALRM};
+
+  for (auto signal : signals) {
+    struct sigaction current;
+
+    if (sigaction(signal, nullptr, &current) != 0 ||
+        current.sa_handler != SIG_DFL) {
+      continue;
+    }
+
+    struct sigaction action = {};
+    action.sa_handler = flushOnSignal;
+    action.sa_flags = SA_RESETHAND;
+    sigemptyset(&action.sa_mask);
+
+    sigaction(signal, &action, nullptr);
+  }
+
+  return true;
+}
+
+/**
+ * Writes decimal digits of the value (in reverse into a scratch buffer).
+ */
+static int32_t writeUnsigned(uint64_t value, bool isNegative) {
+  char digits[21];
+  auto pos = sizeof(digits);
+
+  do {
+    digits[--pos] = '0' + value % 10;
+    value /= 10;
+  } while (value != 0);
+
+  if (isNegative) {
+    digits[--pos] = '-';
+  }
+
+  buffer.append(digits + pos, sizeof(digits) - pos);
+  return sizeof(digits) - pos;
+}
+
+int32_t eva_write_str(const char* data, int64_t length) {
+  buffer.append(data, length);
+  return length;
+}
+
+int32_t eva_write_cstr(const char* s) {
+  // printf("%s", NULL) prints "(null)" with glibc:
+  if (s == nullptr) {
+    s = "(null)";
+  }
+  return eva_write_str(s, strlen(s));
+}
+
+int32_t eva_write_char(int32_t c) {
+  char ch = c;
+  buffer.append(&ch, 1);
+  return 1;
+}
+
+int32_t eva_write_i32(int32_t value) {
+  return writeUnsigned(value < 0 ? -(uint64_t)(int64_t)value : value,
+                       value < 0);
+}
+
+int32_t eva_write_u32(uint32_t value) { return writeUnsigned(value, false); }
+
+int32_t eva_write_i64(int64_t value) {
+  return writeUnsigned(value < 0 ? -(uint64_t)value : value, value < 0);
+}
+
+int32_t eva_write_u64(uint64_t value) { return writeUnsigned(value, false); }
+
+int32_t eva_write_format(const char* format, ...) {
+  char small[256];
+
+  va_list args, argsCopy;
+  va_start(args, format);
+  va_copy(argsCopy, args);
+
+  auto length = vsnprintf(small, sizeof(small), format, args);
+  va_end(args);
+
+  if (length < 0) {
+    va_end(argsCopy);
+    return length;
+  }
+
+  if (length < sizeof(small)) {
+    buffer.append(small, length);
+  } else {
+    auto large = (char*)malloc(length + 1);
+    vsnprintf(large, length + 1, format, argsCopy);
+    buffer.append(large, length);
+    free(large);
+  }
+
+  va_end(argsCopy);
+  return length;
+}
+
+void eva_flush() { buffer.flush(); }
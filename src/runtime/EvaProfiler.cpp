@@ -0,0 +1,300 @@
+/**
+ * Programming Language with LLVM
+ *
+ * Course info:
+ * http://dmitrysoshnikov.com/courses/programming-language-with-llvm/
+ *
+ * (C) 2023-present Dmitry Soshnikov <dmitry.soshnikov@gmail.com>
+ */
+
+/**
+ * Function profiler (eva-llvm --instrument-functions).
+ *
+ * Entry/exit hooks record timestamps into a per-thread ring buffer,
+ * which is drained into the shared profile when full, and at thread
+ * exit. At program exit the report (calls, inclusive and exclusive
+ * time per function) is printed to stderr, and collapsed stacks for
+ * flame graphs are written to eva-profile.folded ($EVA_PROFILE_FILE).
+ */
+
+#include <time.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "./EvaRuntime.h"
+
+/**
+ * Number of events in the per-thread ring buffer.
+ */
+static const size_t PROFILE_EVENTS_SIZE = 16 * 1024;
+
+/**
+ * Monotonic nanoseconds.
+ */
+static uint64_t nowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Timestamp: TSC where available, nanoseconds otherwise.
+ */
+static inline uint64_t timestamp() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return nowNs();
+#endif
+}
+
+/**
+ * Entry or exit of a function.
+ */
+struct ProfileEvent {
+  uint32_t fnId;
+  uint32_t isExit;
+  uint64_t time;
+};
+
+/**
+ * Activation of a function on the shadow stack.
+ */
+struct ProfileFrame {
+  uint32_t fnId;
+  uint32_t node;
+  uint64_t start;
+  uint64_t children;
+};
+
+/**
+ * Per function totals.
+ */
+struct FunctionProfile {
+  uint64_t calls = 0;
+  uint64_t inclusive = 0;
+  uint64_t exclusive = 0;
+};
+
+/**
+ * Call tree node (for collapsed stacks).
+ */
+struct CallTreeNode {
+  uint32_t fnId;
+  uint32_t parent;
+  uint64_t self;
+  std::map<uint32_t, uint32_t> children;
+};
+
+/**
+ * Shared profile, merged from all threads (never destroyed, since
+ * threads may exit during the process shutdown).
+ */
+struct Profile {
+  std::mutex mutex;
+  std::vector<std::string> names;
+  std::vector<FunctionProfile> functions;
+  std::vector<CallTreeNode> callTree{CallTreeNode{0, 0, 0, {}}};
+  uint64_t startTime = 0;
+  uint64_t startNs = 0;
+};
+
+static Profile* profile = nullptr;
+
+/**
+ * Per-thread events, and the shadow stack.
+ */
+struct ThreadProfile {
+  ProfileEvent events[PROFILE_EVENTS_SIZE];
+  size_t eventsCount = 0;
+
+  std::vector<ProfileFrame> stack;
+
+  // Active calls per function (recursion is counted once in inclusive):
+  std::vector<uint32_t> depth;
+
+  ~ThreadProfile() { drain(); }
+
+  /**
+   * Moves the recorded events into the shared profile.
+   */
+  void drain() {
+    if (profile == nullptr) {
+      eventsCount = 0;
+      return;
+    }
+
+    std::lock_guard<std::mutex> lock(profile->mutex);
+    depth.resize(profile->names.size());
+
+    for (auto i = 0; i < eventsCount; i++) {
+      auto& event = events[i];
+
+      // Ids of the functions of other modules:
+      if (event.fnId >= profile->functions.size()) {
+        continue;
+      }
+
+      if (!event.isExit) {
+        auto parent = stack.empty() ? 0 : stack.back().node;
+        stack.push_back(ProfileFrame{event.fnId, getNode(parent, event.fnId),
+                                     event.time, 0});
+        profile->functions[event.fnId].calls++;
+        depth[event.fnId]++;
+        continue;
+      }
+
+      if (stack.empty() || stack.back().fnId != event.fnId) {
+        continue;
+      }
+
+      auto frame = stack.back();
+      stack.pop_back();
+
+      auto elapsed = event.time - frame.start;
+      auto self = elapsed - std::min(elapsed, frame.children);
+
+      auto& fn = profile->functions[frame.fnId];
+      fn.exclusive += self;
+      profile->callTree[frame.node].self += self;
+
+      if (--depth[frame.fnId] == 0) {
+        fn.inclusive += elapsed;
+      }
+
+      if (!stack.empty()) {
+        stack.back().children += elapsed;
+      }
+    }
+
+    eventsCount = 0;
+  }
+
+  /**
+   * Child node of the call tree.
+   */
+  uint32_t getNode(uint32_t parent, uint32_t fnId) {
+    auto& children = profile->callTree[parent].children;
+    auto it = children.find(fnId);
+
+    if (it != children.end()) {
+      return it->second;
+    }
+
+    uint32_t node = profile->callTree.size();
+    profile->callTree[parent].children[fnId] = node;
+    profile->callTree.push_back(CallTreeNode{fnId, parent, 0, {}});
+
+    return node;
+  }
+
+  void record(uint32_t fnId, uint32_t isExit) {
+    // Before main initializes the profile (e.g. the module init
+    // ctors), the events are dropped:
+    if (profile == nullptr) {
+      return;
+    }
+
+    if (eventsCount == PROFILE_EVENTS_SIZE) {
+      drain();
+    }
+    events[eventsCount++] = ProfileEvent{fnId, isExit, timestamp()};
+  }
+};
+
+static thread_local ThreadProfile threadProfile;
+
+/**
+ * Collapsed stack of the call tree node: main;fib;fib
+ */
+static std::string getStack(uint32_t node) {
+  std::string stack = profile->names[profile->callTree[node].fnId];
+
+  for (auto parent = profile->callTree[node].parent; parent != 0;
+       parent = profile->callTree[parent].parent) {
+    stack = profile->names[profile->callTree[parent].fnId] + ";" + stack;
+  }
+
+  return stack;
+}
+
+/**
+ * Prints the report, and writes collapsed stacks.
+ */
+static void dumpProfile() {
+  // Threads (including the main) are drained at their exit already.
+  std::lock_guard<std::mutex> lock(profile->mutex);
+
+  // Timestamps to nanoseconds:
+  auto elapsedNs = nowNs() - profile->startNs;
+  auto elapsedTime = timestamp() - profile->startTime;
+  auto nsPerTick = elapsedTime > 0 ? (double)elapsedNs / elapsedTime : 1.0;
+
+  std::vector<uint32_t> order;
+  for (uint32_t i = 0; i < profile->functions.size(); i++) {
+    if (profile->functions[i].calls > 0) {
+      order.push_back(i);
+    }
+  }
+
+  std::sort(order.begin(), order.end(), [](uint32_t a, uint32_t b) {
+    return profile->functions[a].exclusive > profile->functions[b].exclusive;
+  });
+
+  fprintf(stderr, "\n%12s %16s %16s  %s\n", "Calls", "Inclusive (ms)",
+          "Exclusive (ms)", "Function");
+
+  for (auto fnId : order) {
+    auto& fn = profile->functions[fnId];
+    fprintf(stderr, "%12llu %16.3f %16.3f  %s\n", (unsigned long long)fn.calls,
+            fn.inclusive * nsPerTick / 1e6, fn.exclusive * nsPerTick / 1e6,
+            profile->names[fnId].c_str());
+  }
+
+  // Collapsed stacks (nanoseconds):
+  auto fileName = getenv("EVA_PROFILE_FILE");
+  auto file = fopen(fileName != nullptr ? fileName : "eva-profile.folded", "w");
+
+  if (file == nullptr) {
+    return;
+  }
+
+  for (uint32_t node = 1; node < profile->callTree.size(); node++) {
+    if (profile->callTree[node].self > 0) {
+      fprintf(file, "%s %llu\n", getStack(node).c_str(),
+              (unsigned long long)(profile->callTree[node].self * nsPerTick));
+    }
+  }
+
+  fclose(file);
+}
+
+void eva_prof_init(const char** names, uint32_t count) {
+  profile = new Profile();
+  profile->names.assign(names, names + count);
+  profile->functions.resize(count);
+  profile->startTime = timestamp();
+  profile->startNs = nowNs();
+
+  atexit(dumpProfile);
+}
+
+void eva_prof_enter(uint32_t fnId) { threadProfile.record(fnId, 0); }
+
+void eva_prof_exit(uint32_t fnId) { threadProfile.record(fnId, 1); }
+
+void eva_prof_drain() {
+  if (profile != nullptr) {
+    threadProfile.drain();
+  }
+}
@@ -0,0 +1,145 @@
+/**
+ * Programming Language with LLVM
+ *
+ * Course info:
+ * http://dmitrysoshnikov.com/courses/programming-language-with-llvm/
+ *
+ * (C) 2023-present Dmitry Soshnikov <dmitry.soshnikov@gmail.com>
+ */
+
+/**
+ * Eva runtime: functions called from the generated code.
+ *
+ * The runtime is linked with the compiled program (see compile-run.sh),
+ * and into eva-llvm itself for the JIT.
+ */
+
+#ifndef EvaRuntime_h
+#define EvaRuntime_h
+
+#include <cstdint>
+
+/**
+ * Inline storage size: strings shorter than it (up to 15 chars, the
+ * '\0' included in the storage) are stored inline.
+ */
+#define EVA_STRING_INLINE_SIZE 16
+
+/**
+ * Native string: length + pointer to the bytes ('\0'-terminated).
+ * Small strings point to own inline storage.
+ *
+ * %EvaString = type { i64, i8*, [16 x i8] }
+ */
+struct EvaString {
+  int64_t length;
+  const char* data;
+  char inlineData[EVA_STRING_INLINE_SIZE];
+};
+
+/**
+ * Allocation site: class, allocating function, instance size.
+ *
+ * { i8*, i8*, i64 }
+ */
+struct EvaAllocSite {
+  const char* className;
+  const char* callSite;
+  int64_t bytes;
+};
+
+extern "C" {
+
+/**
+ * Creates a string from the bytes.
+ */
+EvaString* eva_string_new(const char* data, int64_t length);
+
+/**
+ * (str-concat a b)
+ */
+EvaString* eva_string_concat(const EvaString* a, const EvaString* b);
+
+/**
+ * (str-cmp a b): negative, zero, or positive.
+ */
+int32_t eva_string_compare(const EvaString* a, const EvaString* b);
+
+/**
+ * (str-eq a b): 1 if equal, 0 otherwise.
+ */
+int32_t eva_string_equals(const EvaString* a, const EvaString* b);
+
+/**
+ * (str-hash s)
+ */
+uint64_t eva_string_hash(const EvaString* s);
+
+/**
+ * Buffered output (printf lowering): each function writes into a per-thread
+ * buffer and returns the number of written chars, as printf does.
+ */
+int32_t eva_write_str(const char* data, int64_t length);
+int32_t eva_write_cstr(const char* s);
+int32_t eva_write_char(int32_t c);
+int32_t eva_write_i32(int32_t value);
+int32_t eva_write_u32(uint32_t value);
+int32_t eva_write_i64(int64_t value);
+int32_t eva_write_u64(uint64_t value);
+
+/**
+ * Generic printf formatting into the buffer.
+ */
+int32_t eva_write_format(const char* format, ...);
+
+/**
+ * Writes the buffered output of the current thread.
+ */
+void eva_flush();
+
+/**
+ * Function profiler: function names by id, entry and exit hooks.
+ */
+void eva_prof_init(const char** names, uint32_t count);
+void eva_prof_enter(uint32_t fnId);
+void eva_prof_exit(uint32_t fnId);
+
+/**
+ * Moves the profiler events of the current thread to the profile.
+ */
+void eva_prof_drain();
+
+/**
+ * Allocation profiler: registers the allocation sites of a module
+ * (returns the id of the first one), and a hook per allocation.
+ */
+uint32_t eva_alloc_register(const EvaAllocSite* sites, uint32_t count);
+void eva_alloc_record(uint32_t siteId);
+
+/**
+ * Merges the allocation counters of the current thread.
+ */
+void eva_alloc_drain();
+
+/**
+ * Event loop of async functions (coroutine handles): ready queue,
+ * timers, fd readiness (writable: 0 - read, 1 - write), and running
+ * the loop until the task completes.
+ */
+void eva_loop_schedule(void* handle);
+void eva_loop_sleep(void* handle, int32_t ms);
+void eva_loop_wait_fd(void* handle, int32_t fd, int32_t writable);
+void eva_loop_run_until(void* handle);
+
+/**
+ * Work-stealing scheduler: (spawn ...) runs the outlined call as a job,
+ * (sync ...) waits for the job, and (parallel-for ...) runs the outlined
+ * body over subranges of [start, end).
+ */
+void* eva_spawn(void (*fn)(void*), void* env);
+void eva_sync(void* job);
+void eva_parallel_for(int64_t start, int64_t end,
+                      void (*body)(void*, int64_t, int64_t), void* env);
+}
+
+#endif
@@ -0,0 +1,458 @@
+/**
+ * Programming Language with LLVM
+ *
+ * Course info:
+ * http://dmitrysoshnikov.com/courses/programming-language-with-llvm/
+ *
+ * (C) 2023-present Dmitry Soshnikov <dmitry.soshnikov@gmail.com>
+ */
+
+/**
+ * Work-stealing scheduler of (spawn ...), (sync ...), and (parallel-for ...).
+ *
+ * Each worker owns a Chase-Lev deque: the owner pushes and pops jobs at
+ * the bottom, idle workers steal from the top. The thread which starts
+ * the scheduler is worker 0, and EVA_NUM_THREADS (default: number of
+ * cores) is the total number of workers. Threads which are not workers
+ * submit jobs to a shared queue.
+ *
+ * Waiting (sync, end of parallel-for) runs other jobs meanwhile.
+ *
+ * Workers flush their output buffer, and merge their profiler events
+ * and allocation counters after each job (they don't exit, so it
+ * wouldn't be done at the thread exit).
+ */
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "./EvaRuntime.h"
+
+/**
+ * Job: the outlined function and its environment.
+ *
+ * Detached jobs (subranges of parallel-for) are deleted after they run,
+ * the others (spawn) are marked done, and deleted by sync.
+ */
+struct Job {
+  void (*fn)(void*);
+  void* env;
+  bool detached;
+  std::atomic<bool> done{false};
+};
+
+/**
+ * Chase-Lev deque ("Correct and Efficient Work-Stealing for Weak Memory
+ * Models", Le et al., 2013). The buffer grows, old buffers are kept until
+ * the deque is destroyed, since thieves may still read them.
+ */
+class WorkDeque {
+ public:
+  WorkDeque() : buffer_(new Buffer(64)) {}
+
+  ~WorkDeque() {
+    delete buffer_.load();
+    for (auto buffer : retired_) {
+      delete buffer;
+    }
+  }
+
+  /**
+   * Owner: pushes a job to the bottom.
+   */
+  void push(Job* job) {
+    auto bottom = bottom_.load(std::memory_order_relaxed);
+    auto top = top_.load(std::memory_order_acquire);
+    auto buffer = buffer_.load(std::memory_order_relaxed);
+
+    if (bottom - top > buffer->capacity - 1) {
+      buffer = grow(buffer, top, bottom);
+    }
+
+    buffer->put(bottom, job);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom_.store(bottom + 1, std::memory_order_relaxed);
+  }
+
+  /**
+   * Owner: pops the most recent job (nullptr if empty).
+   */
+  Job* pop() {
+    auto bottom = bottom_.load(std::memory_order_relaxed) - 1;
+    auto buffer = buffer_.load(std::memory_order_relaxed);
+    bottom_.store(bottom, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    auto top = top_.load(std::memory_order_relaxed);
+
+    if (top > bottom) {
+      bottom_.store(bottom + 1, std::memory_order_relaxed);
+      return nullptr;
+    }
+
+    auto job = buffer->get(bottom);
+
+    // Last job: race with the thieves.
+    if (top == bottom) {
+      if (!top_.compare_exchange_strong(top, top + 1,
+                                        std::memory_order_seq_cst,
+                                        std::memory_order_relaxed)) {
+        job = nullptr;
+      }
+      bottom_.store(bottom + 1, std::memory_order_relaxed);
+    }
+
+    return job;
+  }
+
+  /**
+   * Thief: steals the oldest job (nullptr if empty or lost the race).
+   */
+  Job* steal() {
+    auto top = top_.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    auto bottom = bottom_.load(std::memory_order_acquire);
+
+    if (top >= bottom) {
+      return nullptr;
+    }
+
+    auto job = buffer_.load(std::memory_order_acquire)->get(top);
+
+    if (!top_.compare_exchange_strong(top, top + 1,
+                                      std::memory_order_seq_cst,
+                                      std::memory_order_relaxed)) {
+      return nullptr;
+    }
+
+    return job;
+  }
+
+ private:
+  /**
+   * Circular buffer (capacity is a power of two).
+   */
+  struct Buffer {
+    int64_t capacity;
+    std::atomic<Job*>* jobs;
+
+    Buffer(int64_t capacity)
+        : capacity(capacity), jobs(new std::atomic<Job*>[capacity]) {}
+
+    ~Buffer() { delete[] jobs; }
+
+    Job* get(int64_t i) {
+      return jobs[i & (capacity - 1)].load(std::memory_order_relaxed);
+    }
+
+    void put(int64_t i, Job* job) {
+      jobs[i & (capacity - 1)].store(job, std::memory_order_relaxed);
+    }
+  };
+
+  Buffer* grow(Buffer* buffer, int64_t top, int64_t bottom) {
+    auto grown = new Buffer(buffer->capacity * 2);
+
+    for (auto i = top; i < bottom; i++) {
+      grown->put(i, buffer->get(i));
+    }
+
+    retired_.push_back(buffer);
+    buffer_.store(grown, std::memory_order_release);
+
+    return grown;
+  }
+
+  std::atomic<int64_t> top_{0};
+  std::atomic<int64_t> bottom_{0};
+  std::atomic<Buffer*> buffer_;
+  std::vector<Buffer*> retired_;
+};
+
+/**
+ * Workers, their deques, and the queue of jobs from other threads.
+ * Never destroyed: workers run until the process exits.
+ */
+struct Scheduler {
+  std::vector<WorkDeque*> deques;
+
+  std::mutex submittedMutex;
+  std::deque<Job*> submitted;
+  std::atomic<size_t> submittedCount{0};
+
+  std::mutex sleepMutex;
+  std::condition_variable wakeup;
+  std::atomic<int> sleeping{0};
+};
+
+static Scheduler* scheduler = nullptr;
+static std::once_flag schedulerInit;
+
+/**
+ * Worker id of the current thread (-1 if not a worker).
+ */
+static thread_local int workerId = -1;
+
+/**
+ * Random victims (xorshift).
+ */
+static thread_local uint32_t randomState = 0x9e3779b9;
+
+static uint32_t nextRandom() {
+  randomState ^= randomState << 13;
+  randomState ^= randomState >> 17;
+  randomState ^= randomState << 5;
+  return randomState;
+}
+
+/**
+ * Own jobs first (most recent), then submitted, then stolen ones.
+ */
+static Job* findJob() {
+  auto& deques = scheduler->deques;
+
+  if (workerId >= 0) {
+    if (auto job = deques[workerId]->pop()) {
+      return job;
+    }
+  }
+
+  if (scheduler->submittedCount.load(std::memory_order_acquire) > 0) {
+    std::lock_guard<std::mutex> lock(scheduler->submittedMutex);
+
+    if (!scheduler->submitted.empty()) {
+      auto job = scheduler->submitted.front();
+      scheduler->submitted.pop_front();
+      scheduler->submittedCount.fetch_sub(1, std::memory_order_relaxed);
+      return job;
+    }
+  }
+
+  auto count = deques.size();
+  auto start = nextRandom() % count;
+
+  for (auto i = 0; i < count; i++) {
+    auto victim = (start + i) % count;
+
+    if (victim != workerId) {
+      if (auto job = deques[victim]->steal()) {
+        return job;
+      }
+    }
+  }
+
+  return nullptr;
+}
+
+/**
+ * Moves the per-thread state of other threads to the shared one
+ * (worker 0 is the main thread, which does it at the exit).
+ */
+static void drainThread() {
+  if (workerId != 0) {
+    eva_flush();
+    eva_prof_drain();
+    eva_alloc_drain();
+  }
+}
+
+/**
+ * Runs the job (the job of sync is marked done).
+ */
+static void execute(Job* job) {
+  auto detached = job->detached;
+
+  job->fn(job->env);
+
+  drainThread();
+
+  if (detached) {
+    delete job;
+  } else {
+    job->done.store(true, std::memory_order_release);
+  }
+}
+
+/**
+ * Pushes the job to the own deque (or submits it from other threads),
+ * and wakes up a sleeping worker.
+ */
+static void submit(Job* job) {
+  if (workerId >= 0) {
+    scheduler->deques[workerId]->push(job);
+  } else {
+    std::lock_guard<std::mutex> lock(scheduler->submittedMutex);
+    scheduler->submitted.push_back(job);
+    scheduler->submittedCount.fetch_add(1, std::memory_order_release);
+  }
+
+  if (scheduler->sleeping.load(std::memory_order_seq_cst) > 0) {
+    scheduler->wakeup.notify_one();
+  }
+}
+
+/**
+ * Worker loop: runs jobs, spins a while when there are none, and
+ * then sleeps until a job is submitted (or a timeout, in case the
+ * notification is missed).
+ */
+static void runWorker(int id) {
+  workerId = id;
+  randomState += id * 0x6d2b79f5;
+
+  auto idle = 0;
+
+  while (true) {
+    if (auto job = findJob()) {
+      execute(job);
+      idle = 0;
+      continue;
+    }
+
+    if (++idle < 64) {
+      std::this_thread::yield();
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(scheduler->sleepMutex);
+    scheduler->sleeping.fetch_add(1, std::memory_order_seq_cst);
+    scheduler->wakeup.wait_for(lock, std::chrono::milliseconds(1));
+    scheduler->sleeping.fetch_sub(1, std::memory_order_seq_cst);
+  }
+}
+
+/**
+ * Number of workers: EVA_NUM_THREADS, or the number of cores.
+ */
+static int getWorkersCount() {
+  if (auto value = std::getenv("EVA_NUM_THREADS")) {
+    auto count = std::atoi(value);
+    if (count > 0) {
+      return count;
+    }
+  }
+
+  auto cores = std::thread::hardware_concurrency();
+  return cores > 0 ? cores : 1;
+}
+
+/**
+ * Starts the workers on the first use.
+ */
+static void startScheduler() {
+  std::call_once(schedulerInit, []() {
+    auto count = getWorkersCount();
+
+    scheduler = new Scheduler();
+
+    for (auto i = 0; i < count; i++) {
+      scheduler->deques.push_back(new WorkDeque());
+    }
+
+    // The current thread is worker 0:
+    workerId = 0;
+
+    for (auto i = 1; i < count; i++) {
+      std::thread(runWorker, i).detach();
+    }
+  });
+}
+
+/**
+ * Runs jobs until the condition holds.
+ */
+template <typename Condition>
+static void helpUntil(Condition condition) {
+  while (!condition()) {
+    if (auto job = findJob()) {
+      execute(job);
+    } else {
+      std::this_thread::yield();
+    }
+  }
+}
+
+/**
+ * Subrange of a parallel-for: the upper halves are split off as jobs
+ * (to be stolen) until the range is at most `grain` iterations.
+ */
+struct RangeJob {
+  void (*body)(void*, int64_t, int64_t);
+  void* env;
+  int64_t from;
+  int64_t to;
+  int64_t grain;
+  std::atomic<int64_t>* remaining;
+};
+
+static void runRange(void* env) {
+  auto range = (RangeJob*)env;
+  auto from = range->from;
+  auto to = range->to;
+
+  while (to - from > range->grain) {
+    auto middle = from + (to - from) / 2;
+    auto upper = new RangeJob(*range);
+    upper->from = middle;
+    upper->to = to;
+    submit(new Job{runRange, upper, /* detached */ true});
+    to = middle;
+  }
+
+  range->body(range->env, from, to);
+
+  drainThread();
+
+  range->remaining->fetch_sub(to - from, std::memory_order_acq_rel);
+
+  delete range;
+}
+
+extern "C" {
+
+void* eva_spawn(void (*fn)(void*), void* env) {
+  startScheduler();
+
+  auto job = new Job{fn, env, /* detached */ false};
+  submit(job);
+
+  return job;
+}
+
+void eva_sync(void* handle) {
+  auto job = (Job*)handle;
+
+  helpUntil([job]() { return job->done.load(std::memory_order_acquire); });
+
+  delete job;
+}
+
+void eva_parallel_for(int64_t start, int64_t end,
+                      void (*body)(void*, int64_t, int64_t), void* env) {
+  if (end <= start) {
+    return;
+  }
+
+  startScheduler();
+
+  // Output before the loop goes first:
+  eva_flush();
+
+  // ~8 subranges per worker, for the load balance:
+  auto grain = (end - start) / (8 * (int64_t)scheduler->deques.size());
+  std::atomic<int64_t> remaining{end - start};
+
+  runRange(new RangeJob{body, env, start, end, grain > 0 ? grain : 1,
+                        &remaining});
+
+  helpUntil([&remaining]() {
+    return remaining.load(std::memory_order_acquire) == 0;
+  });
+}
+}
@@ -0,0 +1,140 @@
+/**
+ * Programming Language with LLVM
+ *
+ * Course info:
+ * http://dmitrysoshnikov.com/courses/programming-language-with-llvm/
+ *
+ * (C) 2023-present Dmitry Soshnikov <dmitry.soshnikov@gmail.com>
+ */
+
+/**
+ * Native strings: all operations use lengths, never scan for '\0'.
+ */
+
+#include <cstdlib>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "./EvaRuntime.h"
+
+/**
+ * Strings are allocated with GC_malloc when the program is linked
+ * with the GC, and with malloc otherwise.
+ */
+extern "C" void* GC_malloc(size_t size) __attribute__((weak));
+
+static void* allocate(size_t size) {
+  return GC_malloc != nullptr ? GC_malloc(size) : malloc(size);
+}
+
+/**
+ * Index of the first mismatching byte, or `length` if equal.
+ * Compares 16 bytes at a time.
+ */
+static int64_t mismatch(const char* a, const char* b, int64_t length) {
+  int64_t i = 0;
+
+#ifdef __SSE2__
+  for (; i + 16 <= length; i += 16) {
+    auto va = _mm_loadu_si128((const __m128i*)(a + i));
+    auto vb = _mm_loadu_si128((const __m128i*)(b + i));
+    auto mask = _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+
+    if (mask != 0xFFFF) {
+      return i + __builtin_ctz(~mask);
+    }
+  }
+#endif
+
+  for (; i < length; i++) {
+    if (a[i] != b[i]) {
+      return i;
+    }
+  }
+
+  return length;
+}
+
+EvaString* eva_string_new(const char* data, int64_t length) {
+  auto isSmall = length < EVA_STRING_INLINE_SIZE;
+  auto size = sizeof(EvaString) + (isSmall ? 0 : length + 1);
+
+  auto s = (EvaString*)allocate(size);
+  auto bytes = isSmall ? s->inlineData : (char*)(s + 1);
+
+  memcpy(bytes, data, length);
+  bytes[length] = '\0';
+
+  s->length = length;
+  s->data = bytes;
+
+  return s;
+}
+
+EvaString* eva_string_concat(const EvaString* a, const EvaString* b) {
+  auto length = a->length + b->length;
+  auto isSmall = length < EVA_STRING_INLINE_SIZE;
+  auto size = sizeof(EvaString) + (isSmall ? 0 : length + 1);
+
+  auto s = (EvaString*)allocate(size);
+  auto bytes = isSmall ? s->inlineData : (char*)(s + 1);
+
+  memcpy(bytes, a->data, a->length);
+  memcpy(bytes + a->length, b->data, b->length);
+  bytes[length] = '\0';
+
+  s->length = length;
+  s->data = bytes;
+
+  return s;
+}
+
+int32_t eva_string_compare(const EvaString* a, const EvaString* b) {
+  auto length = a->length < b->length ? a->length : b->length;
+  auto i = mismatch(a->data, b->data, length);
+
+  if (i < length) {
+    return (unsigned char)a->data[i] < (unsigned char)b->data[i] ? -1 : 1;
+  }
+
+  return a->length < b->length ? -1 : a->length > b->length ? 1 : 0;
+}
+
+int32_t eva_string_equals(const EvaString* a, const EvaString* b) {
+  if (a->length != b->length) {
+    return 0;
+  }
+
+  // Interned literals:
+  if (a->data == b->data) {
+    return 1;
+  }
+
+  return mismatch(a->data, b->data, a->length) == a->length;
+}
+
+uint64_t eva_string_hash(const EvaString* s) {
+  uint64_t hash = 0x9E3779B97F4A7C15ull ^ (uint64_t)s->length;
+  int64_t i = 0;
+
+  // 8 bytes at a time:
+  for (; i + 8 <= s->length; i += 8) {
+    uint64_t word;
+    memcpy(&word, s->data + i, 8);
+    hash = (hash ^ word) * 0xFF51AFD7ED558CCDull;
+    hash ^= hash >> 32;
+  }
+
+  for (; i < s->length; i++) {
+    hash = (hash ^ (unsigned char)s->data[i]) * 0x100000001B3ull;
+  }
+
+  hash ^= hash >> 33;
+  hash *= 0xC4CEB9FE1A85EC53ull;
+  hash ^= hash >> 33;
+
+  return hash;
+}